@@ -0,0 +1,1431 @@
+/*
+ * bench-qpack -- microbenchmarks for the QPACK encoder and decoder
+ *
+ * Replays QIF files and reports time per header, throughput, and number
+ * of allocations for Huffman encoding and decoding, integer codec, and
+ * full encoding and decoding at several dynamic table sizes and numbers
+ * of risked streams.  Output is human-readable; use -o to also write
+ * results as JSON for tracking regressions across releases.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef WIN32
+#include "getopt.h"
+#else
+#include <unistd.h>
+#endif
+#include <sys/types.h>
+
+#include "lsqpack.h"
+#include "lsxpack_header.h"
+#include "lsqpack-test.h"
+
+#ifndef BENCH_QIF_DIR
+#define BENCH_QIF_DIR "test/qifs"
+#endif
+
+#ifndef BENCH_WRAP_MALLOC
+#define BENCH_WRAP_MALLOC 0
+#endif
+
+#ifndef BENCH_THREADS
+#define BENCH_THREADS 0
+#endif
+
+#if BENCH_THREADS
+#include <pthread.h>
+#endif
+
+#ifndef BENCH_MT
+#define BENCH_MT 0
+#endif
+
+#if BENCH_MT
+#include "lsqpack-mt.h"
+#endif
+
+
+/* Allocation counting relies on the linker wrapping malloc(3) and friends.
+ * See bench/CMakeLists.txt.
+ */
+static unsigned long s_n_allocs;
+
+#if BENCH_WRAP_MALLOC
+void *__real_malloc (size_t);
+void *__real_calloc (size_t, size_t);
+void *__real_realloc (void *, size_t);
+
+void *
+__wrap_malloc (size_t size)
+{
+    __atomic_fetch_add(&s_n_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+
+void *
+__wrap_calloc (size_t nmemb, size_t size)
+{
+    __atomic_fetch_add(&s_n_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+
+void *
+__wrap_realloc (void *ptr, size_t size)
+{
+    __atomic_fetch_add(&s_n_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+#endif
+
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+#ifdef WIN32
+    (void) timespec_get(&ts, TIME_UTC);
+#else
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+
+/* Header lists read from a QIF file */
+struct qif
+{
+    const char             *name;
+    char                   *text;
+    struct lsxpack_header  *xhdrs;
+    unsigned               *list_ends;  /* Index of one past last header */
+    unsigned                n_xhdrs;
+    unsigned                n_lists;
+    size_t                  n_bytes;    /* Sum of name and value lengths */
+};
+
+
+static int
+qif_load (struct qif *qif, const char *dir, const char *name)
+{
+    char path[0x400];
+    FILE *in;
+    long size;
+    char *line, *next, *tab;
+    unsigned n_alloced_xhdrs, n_alloced_lists, n_in_list;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    in = fopen(path, "rb");
+    if (!in)
+    {
+        fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (0 != fseek(in, 0, SEEK_END) || (size = ftell(in)) < 0
+                                            || 0 != fseek(in, 0, SEEK_SET))
+    {
+        fprintf(stderr, "cannot get size of %s\n", path);
+        fclose(in);
+        return -1;
+    }
+    memset(qif, 0, sizeof(*qif));
+    qif->name = name;
+    qif->text = malloc((size_t) size + 1);
+    if (!qif->text || (size_t) size != fread(qif->text, 1, size, in))
+    {
+        fprintf(stderr, "cannot read %s\n", path);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+    qif->text[size] = '\0';
+
+    n_alloced_xhdrs = 0;
+    n_alloced_lists = 0;
+    n_in_list = 0;
+    for (line = qif->text; *line; line = next)
+    {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        else
+            next = line + strlen(line);
+        if (next - line > 1 && next[-2] == '\r')
+            next[-2] = '\0';
+
+        if (*line == '\0')
+        {
+            if (n_in_list == 0)
+                continue;
+            if (qif->n_lists >= n_alloced_lists)
+            {
+                n_alloced_lists = n_alloced_lists ? n_alloced_lists * 2 : 64;
+                qif->list_ends = realloc(qif->list_ends,
+                            n_alloced_lists * sizeof(qif->list_ends[0]));
+                if (!qif->list_ends)
+                    return -1;
+            }
+            qif->list_ends[ qif->n_lists++ ] = qif->n_xhdrs;
+            n_in_list = 0;
+            continue;
+        }
+        if (*line == '#')
+            continue;
+        tab = strchr(line, '\t');
+        if (!tab)
+        {
+            fprintf(stderr, "%s: no TAB in line\n", path);
+            return -1;
+        }
+        if (qif->n_xhdrs >= n_alloced_xhdrs)
+        {
+            n_alloced_xhdrs = n_alloced_xhdrs ? n_alloced_xhdrs * 2 : 256;
+            qif->xhdrs = realloc(qif->xhdrs,
+                                n_alloced_xhdrs * sizeof(qif->xhdrs[0]));
+            if (!qif->xhdrs)
+                return -1;
+        }
+        lsxpack_header_set_ptr(&qif->xhdrs[ qif->n_xhdrs++ ], line,
+                                tab - line, tab + 1, strlen(tab + 1));
+        qif->n_bytes += strlen(line) - 1;
+        ++n_in_list;
+    }
+    if (n_in_list)
+    {
+        qif->list_ends = realloc(qif->list_ends,
+                            (qif->n_lists + 1) * sizeof(qif->list_ends[0]));
+        if (!qif->list_ends)
+            return -1;
+        qif->list_ends[ qif->n_lists++ ] = qif->n_xhdrs;
+    }
+
+    return 0;
+}
+
+
+static void
+qif_cleanup (struct qif *qif)
+{
+    free(qif->text);
+    free(qif->xhdrs);
+    free(qif->list_ends);
+}
+
+
+struct decode_thread;
+struct helper_hblock;
+
+/* Each benchmark runs over the whole QIF file in one iteration; threaded
+ * benchmarks do it `passes' times in one iteration.
+ */
+struct bench
+{
+    char            name[0x80];
+    int           (*run)(struct bench *);
+    struct qif     *qif;
+    unsigned        table_size;
+    unsigned        risked_streams;
+    unsigned        n_threads;
+    unsigned        passes;
+    struct decode_thread
+                   *threads;
+#if BENCH_MT
+    struct lsqpack_mt
+                   *mt;
+    struct bench_hblock
+                   *helper_conns;
+    struct helper_hblock
+                   *helper_hblocks;
+#endif
+    /* Prepared input used by some benchmarks */
+    unsigned char  *in_buf;
+    size_t          in_sz;
+    size_t         *offs;       /* Used by Huffman decoder benchmark */
+    unsigned        n_offs;
+    /* Output buffer */
+    unsigned char  *out_buf;
+    size_t          out_sz;
+    /* Results */
+    unsigned        iterations;
+    uint64_t        elapsed_ns;
+    unsigned long   n_allocs;
+};
+
+
+static int
+run_huff_encode (struct bench *bench)
+{
+    const struct qif *const qif = bench->qif;
+    const struct lsxpack_header *xhdr;
+    unsigned char *dst, *const end = bench->out_buf + bench->out_sz;
+    int r;
+
+    dst = bench->out_buf;
+    for (xhdr = qif->xhdrs; xhdr < qif->xhdrs + qif->n_xhdrs; ++xhdr)
+    {
+        r = lsqpack_enc_enc_str(7, dst, end - dst,
+            (const unsigned char *) lsxpack_header_get_name(xhdr),
+            xhdr->name_len);
+        if (r < 0)
+            return -1;
+        dst += r;
+        r = lsqpack_enc_enc_str(7, dst, end - dst,
+            (const unsigned char *) lsxpack_header_get_value(xhdr),
+            xhdr->val_len);
+        if (r < 0)
+            return -1;
+        dst += r;
+    }
+    return 0;
+}
+
+
+/* Huffman-encode all strings that benefit from it; record string offsets */
+static int
+prep_huff_decode (struct bench *bench)
+{
+    const struct qif *const qif = bench->qif;
+    const struct lsxpack_header *xhdr;
+    const char *str;
+    unsigned char *dst;
+    unsigned i, len;
+    int r;
+
+    bench->in_sz = qif->n_bytes + qif->n_xhdrs * 2 * 4;
+    bench->in_buf = malloc(bench->in_sz);
+    bench->offs = malloc((qif->n_xhdrs * 2 + 1) * sizeof(bench->offs[0]));
+    if (!bench->in_buf || !bench->offs)
+        return -1;
+    dst = bench->in_buf;
+    bench->n_offs = 0;
+    for (xhdr = qif->xhdrs; xhdr < qif->xhdrs + qif->n_xhdrs; ++xhdr)
+        for (i = 0; i < 2; ++i)
+        {
+            str = i ? lsxpack_header_get_value(xhdr)
+                    : lsxpack_header_get_name(xhdr);
+            len = i ? xhdr->val_len : xhdr->name_len;
+            r = lsqpack_enc_enc_str(7, dst,
+                        bench->in_buf + bench->in_sz - dst,
+                        (const unsigned char *) str, len);
+            if (r < 0)
+                return -1;
+            if (*dst & 0x80)
+            {
+                /* Strings are stored back to back; record where each ends */
+                bench->offs[ bench->n_offs++ ] = dst + r - bench->in_buf;
+                dst += r;
+            }
+        }
+    return 0;
+}
+
+
+static int
+run_huff_decode (struct bench *bench)
+{
+    struct lsqpack_dec_int_state int_state;
+    struct lsqpack_huff_decode_state state;
+    struct huff_decode_retval rv;
+    const unsigned char *src, *end;
+    uint64_t len;
+    unsigned i;
+
+    src = bench->in_buf;
+    for (i = 0; i < bench->n_offs; ++i)
+    {
+        end = bench->in_buf + bench->offs[i];
+        int_state.resume = 0;
+        if (0 != lsqpack_dec_int(&src, end, 7, &len, &int_state))
+            return -1;
+        assert(src + len == end);
+        state.resume = 0;
+        rv = lsqpack_huff_decode_full(src, (int) len, bench->out_buf,
+                                            (int) bench->out_sz, &state, 1);
+        if (rv.status != HUFF_DEC_OK)
+            return -1;
+        src = end;
+    }
+    return 0;
+}
+
+
+static int
+run_int_codec (struct bench *bench)
+{
+    const struct qif *const qif = bench->qif;
+    const struct lsxpack_header *xhdr;
+    struct lsqpack_dec_int_state state;
+    const unsigned char *src;
+    unsigned char *dst, *const end = bench->out_buf + bench->out_sz;
+    uint64_t value, sum;
+
+    /* Encode and decode lengths using various prefixes, as well as a value
+     * that requires several continuation bytes.
+     */
+    dst = bench->out_buf;
+    for (xhdr = qif->xhdrs; xhdr < qif->xhdrs + qif->n_xhdrs; ++xhdr)
+    {
+        *dst = 0;
+        dst = lsqpack_enc_int(dst, end, xhdr->name_len, 3);
+        *dst = 0;
+        dst = lsqpack_enc_int(dst, end, xhdr->val_len, 7);
+        *dst = 0;
+        dst = lsqpack_enc_int(dst, end,
+                        (uint64_t) xhdr->name_len * xhdr->val_len << 20, 5);
+    }
+
+    sum = 0;
+    src = bench->out_buf;
+    for (xhdr = qif->xhdrs; xhdr < qif->xhdrs + qif->n_xhdrs; ++xhdr)
+    {
+        state.resume = 0;
+        if (0 != lsqpack_dec_int(&src, dst, 3, &value, &state))
+            return -1;
+        sum += value;
+        state.resume = 0;
+        if (0 != lsqpack_dec_int(&src, dst, 7, &value, &state))
+            return -1;
+        sum += value;
+        state.resume = 0;
+        if (0 != lsqpack_dec_int(&src, dst, 5, &value, &state))
+            return -1;
+        sum += value;
+    }
+    return sum == 0;    /* Keep the compiler from eliding decoding */
+}
+
+
+/* Integers used by the int_encode and int_decode benchmarks: the same as
+ * those used by int_codec.
+ */
+#define N_BENCH_INTS 3
+
+static const unsigned bench_int_prefix_bits[N_BENCH_INTS] = { 3, 7, 5, };
+
+static uint64_t
+bench_int_value (const struct lsxpack_header *xhdr, unsigned i)
+{
+    switch (i)
+    {
+    case 0:
+        return xhdr->name_len;
+    case 1:
+        return xhdr->val_len;
+    default:
+        return (uint64_t) xhdr->name_len * xhdr->val_len << 20;
+    }
+}
+
+
+/* Encode integers back to back; record where each ends.  The input is
+ * padded so that the decoder can always take the fast path.
+ */
+static int
+prep_int (struct bench *bench)
+{
+    const struct qif *const qif = bench->qif;
+    const struct lsxpack_header *xhdr;
+    unsigned char *dst;
+    unsigned i;
+
+    bench->in_sz = qif->n_xhdrs * N_BENCH_INTS * LSQPACK_UINT64_ENC_SZ
+                                                        + LSQPACK_UINT64_ENC_SZ;
+    bench->in_buf = calloc(1, bench->in_sz);
+    bench->offs = malloc(qif->n_xhdrs * N_BENCH_INTS * sizeof(bench->offs[0]));
+    if (!bench->in_buf || !bench->offs)
+        return -1;
+    dst = bench->in_buf;
+    bench->n_offs = 0;
+    for (xhdr = qif->xhdrs; xhdr < qif->xhdrs + qif->n_xhdrs; ++xhdr)
+        for (i = 0; i < N_BENCH_INTS; ++i)
+        {
+            dst = lsqpack_enc_int(dst, bench->in_buf + bench->in_sz,
+                            bench_int_value(xhdr, i), bench_int_prefix_bits[i]);
+            bench->offs[ bench->n_offs++ ] = dst - bench->in_buf;
+        }
+    return 0;
+}
+
+
+/* Encode with plenty of room in the output buffer (`tail' is false) or with
+ * the buffer ending right after each integer.
+ */
+static int
+encode_ints (struct bench *bench, int tail)
+{
+    const struct qif *const qif = bench->qif;
+    const struct lsxpack_header *xhdr;
+    unsigned char *dst, *end;
+    unsigned i, n;
+
+    dst = bench->out_buf;
+    end = bench->out_buf + bench->out_sz;
+    n = 0;
+    for (xhdr = qif->xhdrs; xhdr < qif->xhdrs + qif->n_xhdrs; ++xhdr)
+        for (i = 0; i < N_BENCH_INTS; ++i, ++n)
+        {
+            if (tail)
+                end = bench->out_buf + bench->offs[n];
+            *dst = 0;
+            dst = lsqpack_enc_int(dst, end, bench_int_value(xhdr, i),
+                                                    bench_int_prefix_bits[i]);
+        }
+    return (size_t) (dst - bench->out_buf) != bench->offs[n - 1];
+}
+
+
+static int
+run_int_encode (struct bench *bench)
+{
+    return encode_ints(bench, 0);
+}
+
+
+static int
+run_int_encode_tail (struct bench *bench)
+{
+    return encode_ints(bench, 1);
+}
+
+
+static int
+decode_ints (struct bench *bench, int tail)
+{
+    struct lsqpack_dec_int_state state;
+    const unsigned char *src, *end;
+    uint64_t value, sum;
+    unsigned n;
+
+    src = bench->in_buf;
+    end = bench->in_buf + bench->in_sz;
+    sum = 0;
+    for (n = 0; n < bench->n_offs; ++n)
+    {
+        if (tail)
+            end = bench->in_buf + bench->offs[n];
+        state.resume = 0;
+        if (0 != lsqpack_dec_int(&src, end, bench_int_prefix_bits[
+                                        n % N_BENCH_INTS], &value, &state))
+            return -1;
+        sum += value;
+    }
+    return sum == 0;    /* Keep the compiler from eliding decoding */
+}
+
+
+static int
+run_int_decode (struct bench *bench)
+{
+    return decode_ints(bench, 0);
+}
+
+
+static int
+run_int_decode_tail (struct bench *bench)
+{
+    return decode_ints(bench, 1);
+}
+
+static int
+enc_ack (struct lsqpack_enc *enc, uint64_t stream_id,
+            const unsigned char *pref_buf, unsigned *acked_ins_count)
+{
+    unsigned char cmd[LSQPACK_LONGEST_HEADER_ACK + LSQPACK_LONGEST_ICI];
+    unsigned char *p;
+
+    p = cmd;
+    if (pref_buf[0] != 0)
+    {
+        *p = 0x80;
+        p = lsqpack_enc_int(p, cmd + sizeof(cmd), stream_id, 7);
+    }
+    if (enc->qpe_ins_count > *acked_ins_count)
+    {
+        *p = 0x00;
+        p = lsqpack_enc_int(p, cmd + sizeof(cmd),
+                                enc->qpe_ins_count - *acked_ins_count, 6);
+        *acked_ins_count = enc->qpe_ins_count;
+    }
+    if (p > cmd)
+        return lsqpack_enc_decoder_in(enc, cmd, p - cmd);
+    else
+        return 0;
+}
+
+
+/* Encode all header lists, acknowledging each header block immediately.
+ * If `record' is set, the encoder stream and the header blocks are saved
+ * in `in_buf' for the decoder benchmark, each prefixed by a 32-bit length.
+ */
+static int
+encode_qif (struct bench *bench, int record)
+{
+    const struct qif *const qif = bench->qif;
+    struct lsqpack_enc enc;
+    enum lsqpack_enc_status st;
+    unsigned char tsu_buf[LSQPACK_LONGEST_SDTC], pref_buf[0x20];
+    unsigned char *enc_buf, *hea_buf, *rec;
+    size_t tsu_sz, enc_sz, hea_sz, enc_off, hea_off;
+    ssize_t pref_sz;
+    uint32_t len;
+    unsigned list, i, acked_ins_count;
+    uint64_t stream_id;
+    int r = -1;
+
+    enc_buf = bench->out_buf;
+    hea_buf = bench->out_buf + bench->out_sz / 2;
+    rec = bench->in_buf;
+    tsu_sz = sizeof(tsu_buf);
+    if (0 != lsqpack_enc_init(&enc, NULL, bench->table_size,
+                bench->table_size, bench->risked_streams, 0, tsu_buf, &tsu_sz))
+        return -1;
+    acked_ins_count = 0;
+
+    for (list = 0, i = 0; list < qif->n_lists; ++list)
+    {
+        stream_id = list * 4;
+        if (0 != lsqpack_enc_start_header(&enc, stream_id, 0))
+            goto end;
+        enc_off = 0;
+        hea_off = 0;
+        for ( ; i < qif->list_ends[list]; ++i)
+        {
+            enc_sz = bench->out_sz / 2 - enc_off;
+            hea_sz = bench->out_sz / 2 - hea_off;
+            st = lsqpack_enc_encode(&enc, enc_buf + enc_off, &enc_sz,
+                    hea_buf + hea_off, &hea_sz, &qif->xhdrs[i], 0);
+            if (st != LQES_OK)
+                goto end;
+            enc_off += enc_sz;
+            hea_off += hea_sz;
+        }
+        pref_sz = lsqpack_enc_end_header(&enc, pref_buf, sizeof(pref_buf),
+                                                                    NULL);
+        if (pref_sz <= 0)
+            goto end;
+        if (record)
+        {
+            if ((size_t) (bench->in_buf + bench->in_sz - rec)
+                                < 8 + enc_off + (size_t) pref_sz + hea_off)
+                goto end;
+            len = (uint32_t) enc_off;
+            memcpy(rec, &len, sizeof(len));
+            memcpy(rec + 4, enc_buf, enc_off);
+            rec += 4 + enc_off;
+            len = (uint32_t) (pref_sz + hea_off);
+            memcpy(rec, &len, sizeof(len));
+            memcpy(rec + 4, pref_buf, pref_sz);
+            memcpy(rec + 4 + pref_sz, hea_buf, hea_off);
+            rec += 4 + pref_sz + hea_off;
+        }
+        if (0 != enc_ack(&enc, stream_id, pref_buf, &acked_ins_count))
+            goto end;
+    }
+    if (record)
+        bench->in_sz = rec - bench->in_buf;
+    r = 0;
+
+  end:
+    lsqpack_enc_cleanup(&enc);
+    return r;
+}
+
+
+static int
+run_encode (struct bench *bench)
+{
+    return encode_qif(bench, 0);
+}
+
+
+/* Same output as encoding with zero-capacity dynamic table */
+static int
+run_encode_stateless (struct bench *bench)
+{
+    const struct qif *const qif = bench->qif;
+    unsigned list, first;
+    size_t sz;
+
+    for (list = 0, first = 0; list < qif->n_lists; ++list)
+    {
+        sz = bench->out_sz;
+        if (0 != lsqpack_enc_encode_stateless(bench->out_buf, &sz,
+                    &qif->xhdrs[first], qif->list_ends[list] - first, 0))
+            return -1;
+        first = qif->list_ends[list];
+    }
+    return 0;
+}
+
+
+static int
+prep_decode (struct bench *bench)
+{
+    const struct qif *const qif = bench->qif;
+
+    /* Worst case: every header is a literal in both streams */
+    bench->in_sz = 2 * (qif->n_bytes + qif->n_xhdrs * 16)
+                                                    + qif->n_lists * 0x30;
+    bench->in_buf = malloc(bench->in_sz);
+    if (!bench->in_buf)
+        return -1;
+    return encode_qif(bench, 1);
+}
+
+
+struct bench_hblock
+{
+    struct lsxpack_header   xhdr;
+    char                   *buf;
+    size_t                  buf_sz;
+    unsigned                n_headers;
+};
+
+
+static void
+bench_unblocked (void *hblock_ctx)
+{
+    assert(0);  /* Encoder stream is always fed before the header block */
+}
+
+
+static struct lsxpack_header *
+bench_prepare_decode (void *hblock_ctx, struct lsxpack_header *xhdr,
+                                                                size_t space)
+{
+    struct bench_hblock *const hblock = hblock_ctx;
+
+    if (xhdr || space > hblock->buf_sz)
+        return NULL;
+    lsxpack_header_prepare_decode(&hblock->xhdr, hblock->buf, 0,
+                                                            hblock->buf_sz);
+    return &hblock->xhdr;
+}
+
+
+static int
+bench_process_header (void *hblock_ctx, struct lsxpack_header *xhdr)
+{
+    struct bench_hblock *const hblock = hblock_ctx;
+
+    ++hblock->n_headers;
+    return 0;
+}
+
+
+static const struct lsqpack_dec_hset_if bench_hset_if = {
+    .dhi_unblocked      = bench_unblocked,
+    .dhi_prepare_decode = bench_prepare_decode,
+    .dhi_process_header = bench_process_header,
+};
+
+
+/* Header lists are passed to bench_hset_if callbacks or, if `hlist' is
+ * not NULL, are written to it.
+ */
+static int
+decode_qif (struct bench *bench, struct lsqpack_dec_hlist *hlist)
+{
+    const struct qif *const qif = bench->qif;
+    struct lsqpack_dec dec;
+    struct bench_hblock hblock;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *p, *end, *buf;
+    unsigned char dec_buf[LSQPACK_LONGEST_HEADER_ACK];
+    size_t dec_buf_sz;
+    uint32_t len;
+    uint64_t stream_id;
+    unsigned list;
+    int r = -1;
+
+    lsqpack_dec_init(&dec, NULL, bench->table_size, bench->risked_streams,
+                                                            &bench_hset_if, 0);
+    hblock.buf = (char *) bench->out_buf;
+    hblock.buf_sz = bench->out_sz;
+    p = bench->in_buf;
+    end = bench->in_buf + bench->in_sz;
+    for (list = 0; p < end; ++list)
+    {
+        stream_id = list * 4;
+        memcpy(&len, p, sizeof(len));
+        if (len && 0 != lsqpack_dec_enc_in(&dec, p + 4, len))
+            goto end;
+        p += 4 + len;
+        memcpy(&len, p, sizeof(len));
+        hblock.n_headers = 0;
+        buf = p + 4;
+        dec_buf_sz = sizeof(dec_buf);
+        if (hlist)
+        {
+            rhs = lsqpack_dec_header_in_hlist(&dec, &hblock, stream_id, len,
+                                    &buf, len, dec_buf, &dec_buf_sz, hlist);
+            hblock.n_headers = hlist->dhl_n_xhdrs;
+        }
+        else
+            rhs = lsqpack_dec_header_in(&dec, &hblock, stream_id, len, &buf,
+                                                    len, dec_buf, &dec_buf_sz);
+        if (rhs != LQRHS_DONE || hblock.n_headers
+                != qif->list_ends[list] - (list ? qif->list_ends[list - 1] : 0))
+            goto end;
+        p += 4 + len;
+    }
+    r = 0;
+
+  end:
+    lsqpack_dec_cleanup(&dec);
+    return r;
+}
+
+
+static int
+run_decode (struct bench *bench)
+{
+    return decode_qif(bench, NULL);
+}
+
+
+static int
+run_decode_hlist (struct bench *bench)
+{
+    struct lsqpack_dec_hlist hlist;
+    int r;
+
+    memset(&hlist, 0, sizeof(hlist));
+    r = decode_qif(bench, &hlist);
+    lsqpack_dec_hlist_cleanup(&hlist);
+    return r;
+}
+
+
+#if BENCH_THREADS
+/* Connections are sharded across threads.  Each thread decodes the QIF
+ * file using its own decoder and output buffer: decoders share no state,
+ * so no locking is needed.
+ */
+#define THREAD_PASSES 8
+
+struct decode_thread
+{
+    struct bench    bench;
+    pthread_t       thread;
+    int             status;
+};
+
+
+static void *
+decode_thread (void *arg)
+{
+    struct decode_thread *const dt = arg;
+    unsigned n;
+
+    dt->status = 0;
+    for (n = 0; n < THREAD_PASSES && dt->status == 0; ++n)
+        dt->status = run_decode(&dt->bench);
+    return NULL;
+}
+
+
+static int
+prep_decode_threads (struct bench *bench)
+{
+    struct decode_thread *dt;
+
+    if (0 != prep_decode(bench))
+        return -1;
+    bench->passes = bench->n_threads * THREAD_PASSES;
+    bench->threads = calloc(bench->n_threads, sizeof(bench->threads[0]));
+    if (!bench->threads)
+        return -1;
+    for (dt = bench->threads; dt < bench->threads + bench->n_threads; ++dt)
+    {
+        dt->bench = *bench;
+        dt->bench.out_buf = malloc(bench->out_sz);
+        if (!dt->bench.out_buf)
+            return -1;
+    }
+    return 0;
+}
+
+
+static int
+run_decode_threads (struct bench *bench)
+{
+    struct decode_thread *dt;
+    unsigned n_started;
+    int r = 0;
+
+    for (n_started = 0; n_started < bench->n_threads; ++n_started)
+        if (0 != pthread_create(&bench->threads[n_started].thread, NULL,
+                                    decode_thread, &bench->threads[n_started]))
+        {
+            r = -1;
+            break;
+        }
+    for (dt = bench->threads; dt < bench->threads + n_started; ++dt)
+    {
+        pthread_join(dt->thread, NULL);
+        r |= dt->status;
+    }
+    return r;
+}
+
+
+static void
+cleanup_decode_threads (struct bench *bench)
+{
+    struct decode_thread *dt;
+
+    if (bench->threads)
+    {
+        for (dt = bench->threads; dt < bench->threads + bench->n_threads; ++dt)
+            free(dt->bench.out_buf);
+        free(bench->threads);
+    }
+}
+#endif
+
+
+#if BENCH_MT
+/* Same work as decode_mt, done using lsqpack-mt: the main thread submits
+ * input of all connections, interleaving them, and collects results.
+ * Header blocks of a connection are decoded one at a time, so they share
+ * the connection's output buffer.
+ */
+struct helper_hblock
+{
+    struct bench_hblock    *conn;
+    unsigned                n_headers;
+};
+
+
+static struct lsxpack_header *
+helper_prepare_decode (void *hblock_ctx, struct lsxpack_header *xhdr,
+                                                                size_t space)
+{
+    struct helper_hblock *const hblock = hblock_ctx;
+
+    return bench_prepare_decode(hblock->conn, xhdr, space);
+}
+
+
+static int
+helper_process_header (void *hblock_ctx, struct lsxpack_header *xhdr)
+{
+    struct helper_hblock *const hblock = hblock_ctx;
+
+    ++hblock->n_headers;
+    return 0;
+}
+
+
+static const struct lsqpack_dec_hset_if helper_hset_if = {
+    .dhi_unblocked      = bench_unblocked,
+    .dhi_prepare_decode = helper_prepare_decode,
+    .dhi_process_header = helper_process_header,
+};
+
+
+static int
+prep_decode_helper (struct bench *bench)
+{
+    struct lsqpack_mt_settings settings;
+    unsigned n;
+
+    if (0 != prep_decode(bench))
+        return -1;
+    bench->passes = bench->n_threads * THREAD_PASSES;
+    bench->helper_conns = calloc(bench->passes,
+                                            sizeof(bench->helper_conns[0]));
+    bench->helper_hblocks = calloc(bench->passes * bench->qif->n_lists,
+                                            sizeof(bench->helper_hblocks[0]));
+    if (!bench->helper_conns || !bench->helper_hblocks)
+        return -1;
+    for (n = 0; n < bench->passes; ++n)
+    {
+        bench->helper_conns[n].buf_sz = 0x10000;
+        bench->helper_conns[n].buf = malloc(0x10000);
+        if (!bench->helper_conns[n].buf)
+            return -1;
+    }
+    memset(&settings, 0, sizeof(settings));
+    settings.lms_n_threads = bench->n_threads;
+    settings.lms_dyn_table_size = bench->table_size;
+    settings.lms_max_risked_streams = bench->risked_streams;
+    settings.lms_hset_if = &helper_hset_if;
+    bench->mt = lsqpack_mt_new(&settings);
+    return bench->mt ? 0 : -1;
+}
+
+
+static int
+run_decode_helper (struct bench *bench)
+{
+    const struct qif *const qif = bench->qif;
+    struct lsqpack_mt_conn **conns;
+    struct lsqpack_mt_result *result;
+    struct helper_hblock *hblock;
+    const unsigned char *p, *q, *end;
+    uint32_t len;
+    unsigned list, n, n_closed;
+    int r = -1;
+
+    conns = calloc(bench->passes, sizeof(conns[0]));
+    if (!conns)
+        return -1;
+    for (n = 0; n < bench->passes; ++n)
+    {
+        conns[n] = lsqpack_mt_conn_new(bench->mt, NULL);
+        if (!conns[n])
+            goto end;
+    }
+
+    p = bench->in_buf;
+    end = bench->in_buf + bench->in_sz;
+    for (list = 0; p < end; ++list)
+    {
+        for (n = 0; n < bench->passes; ++n)
+        {
+            hblock = &bench->helper_hblocks[ n * qif->n_lists + list ];
+            hblock->conn = &bench->helper_conns[n];
+            hblock->n_headers = 0;
+            q = p;
+            memcpy(&len, q, sizeof(len));
+            if (len && 0 != lsqpack_mt_enc_in(conns[n], q + 4, len))
+                goto end;
+            q += 4 + len;
+            memcpy(&len, q, sizeof(len));
+            if (0 != lsqpack_mt_header_in(conns[n], hblock, list * 4, q + 4,
+                                                                        len))
+                goto end;
+            q += 4 + len;
+        }
+        p = q;
+    }
+
+    r = 0;
+  end:
+    for (n = 0; n < bench->passes && conns[n]; ++n)
+        lsqpack_mt_conn_destroy(conns[n]);
+    for (n_closed = 0; n_closed < n; )
+    {
+        result = lsqpack_mt_get_result(bench->mt, 1);
+        if (result->lmr_type == LSQPACK_MT_CONN_CLOSED)
+            ++n_closed;
+        else if (result->lmr_type == LSQPACK_MT_HEADER_BLOCK)
+        {
+            hblock = result->lmr_hblock_ctx;
+            list = (unsigned) (result->lmr_stream_id / 4);
+            if (result->lmr_status != LQRHS_DONE || hblock->n_headers
+                != qif->list_ends[list] - (list ? qif->list_ends[list - 1] : 0))
+                r = -1;
+        }
+        else if (result->lmr_status != LQRHS_DONE)
+            r = -1;
+        lsqpack_mt_result_free(result);
+    }
+    free(conns);
+    return r;
+}
+
+
+static void
+cleanup_decode_helper (struct bench *bench)
+{
+    unsigned n;
+
+    if (bench->mt)
+        lsqpack_mt_destroy(bench->mt);
+    if (bench->helper_conns)
+        for (n = 0; n < bench->passes; ++n)
+            free(bench->helper_conns[n].buf);
+    free(bench->helper_conns);
+    free(bench->helper_hblocks);
+}
+#endif
+
+
+static int
+run_bench (struct bench *bench, uint64_t min_time_ns)
+{
+    uint64_t start, elapsed;
+    unsigned long allocs;
+    unsigned n, i;
+
+    /* Warm up and check that the benchmark works */
+    if (0 != bench->run(bench))
+        return -1;
+
+    n = 1;
+    while (1)
+    {
+        allocs = s_n_allocs;
+        start = now_ns();
+        for (i = 0; i < n; ++i)
+            if (0 != bench->run(bench))
+                return -1;
+        elapsed = now_ns() - start;
+        if (elapsed >= min_time_ns || n >= 1000000)
+            break;
+        /* Aim a little past min_time, as google-benchmark does */
+        if (elapsed < min_time_ns / 10)
+            n *= 10;
+        else
+            n = (unsigned) ((double) n * min_time_ns * 1.4 / elapsed) + 1;
+    }
+    bench->iterations = n;
+    bench->elapsed_ns = elapsed;
+    bench->n_allocs = s_n_allocs - allocs;
+    return 0;
+}
+
+
+static double
+ns_per_header (const struct bench *bench)
+{
+    return (double) bench->elapsed_ns / bench->iterations
+                                    / bench->passes / bench->qif->n_xhdrs;
+}
+
+
+static double
+bytes_per_second (const struct bench *bench)
+{
+    return (double) bench->qif->n_bytes * bench->passes * bench->iterations
+                                                    * 1e9 / bench->elapsed_ns;
+}
+
+
+static double
+allocs_per_iteration (const struct bench *bench)
+{
+    return (double) bench->n_allocs / bench->iterations;
+}
+
+
+static void
+print_console_header (void)
+{
+    printf("%-44s %12s %12s %12s %10s\n", "Benchmark", "ns/header",
+                                    "MB/s", "allocs/iter", "iterations");
+    printf("%.*s\n", 94, "----------------------------------------"
+        "----------------------------------------------------------------");
+}
+
+
+static void
+print_console (const struct bench *bench)
+{
+    printf("%-44s %12.1f %12.2f %12.1f %10u\n", bench->name,
+        ns_per_header(bench), bytes_per_second(bench) / 1e6,
+        allocs_per_iteration(bench), bench->iterations);
+    fflush(stdout);
+}
+
+
+/* Format follows that of google-benchmark's JSON reporter, with library-
+ * specific counters added to each benchmark.
+ */
+static void
+print_json (FILE *out, const struct bench *benches, unsigned n_benches,
+                                                            unsigned min_time_ms)
+{
+    const struct bench *bench;
+    char date[0x40];
+    time_t now;
+
+    now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    fprintf(out,
+        "{\n"
+        "  \"context\": {\n"
+        "    \"date\": \"%s\",\n"
+        "    \"library\": \"ls-qpack\",\n"
+        "    \"library_version\": \"%u.%u.%u\",\n"
+        "    \"min_time_ms\": %u,\n"
+        "    \"allocs_counted\": %s\n"
+        "  },\n"
+        "  \"benchmarks\": [\n", date, LSQPACK_MAJOR_VERSION,
+        LSQPACK_MINOR_VERSION, LSQPACK_PATCH_VERSION, min_time_ms,
+        BENCH_WRAP_MALLOC ? "true" : "false");
+    for (bench = benches; bench < benches + n_benches; ++bench)
+        fprintf(out,
+            "    {\n"
+            "      \"name\": \"%s\",\n"
+            "      \"iterations\": %u,\n"
+            "      \"real_time\": %.1f,\n"
+            "      \"time_unit\": \"ns\",\n"
+            "      \"headers_per_iteration\": %u,\n"
+            "      \"ns_per_header\": %.3f,\n"
+            "      \"bytes_per_second\": %.0f,\n"
+            "      \"allocs_per_iteration\": %.2f\n"
+            "    }%s\n", bench->name, bench->iterations,
+            (double) bench->elapsed_ns / bench->iterations,
+            bench->qif->n_xhdrs * bench->passes, ns_per_header(bench),
+            bytes_per_second(bench), allocs_per_iteration(bench),
+            bench + 1 < benches + n_benches ? "," : "");
+    fprintf(out, "  ]\n}\n");
+}
+
+
+static void
+alloc_out_buf (struct bench *bench)
+{
+    const struct qif *const qif = bench->qif;
+    size_t out_sz;
+
+    /* Headers are at most 64 KB each; output is bounded by twice the input
+     * to leave room for encoder overhead.
+     */
+    out_sz = 2 * (qif->n_bytes + qif->n_xhdrs * 16);
+    if (out_sz < 2 * 0x10000)
+        out_sz = 2 * 0x10000;
+    bench->out_sz = out_sz;
+    bench->out_buf = malloc(out_sz);
+    if (!bench->out_buf)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+static void
+usage (const char *name)
+{
+    fprintf(stderr,
+"Usage: %s [options]\n"
+"\n"
+"Options:\n"
+"   -q DIR      Directory with QIF files.  Defaults to " BENCH_QIF_DIR ".\n"
+"   -f FILTER   Only run benchmarks whose names contain FILTER.\n"
+"   -m MS       Minimum time to run each benchmark, in milliseconds.\n"
+"                 Defaults to 200.\n"
+"   -o FILE     Write results to FILE in JSON format.\n"
+"   -t N        Also run decoding in 1, 2, 4, and so on up to N threads to\n"
+"                 measure scaling.  Each thread decodes its own connections.\n"
+"                 If built with LSQPACK_MT, the same is done using the\n"
+"                 lsqpack-mt helper, which the main thread feeds.\n"
+"   -h          Print this help screen and exit.\n"
+    , name);
+}
+
+
+int
+main (int argc, char **argv)
+{
+    static const char *const qif_names[] = {
+        "fb-req.qif", "fb-resp.qif", "netbsd.qif", "long-codes.qif",
+    };
+    static const unsigned table_sizes[] = { 0, 256, 4096, 65536, };
+    static const unsigned risked_streams[] = { 0, 100, };
+    struct qif qifs[sizeof(qif_names) / sizeof(qif_names[0])];
+    struct bench *benches, *bench;
+    const char *qif_dir = BENCH_QIF_DIR, *filter = NULL, *out_name = NULL;
+    unsigned min_time_ms = 200, max_threads = 0, n_benches, n_done, q, t, s,
+                                                                        k;
+    FILE *out;
+    int opt;
+    static const struct {
+        const char  *name;
+        int        (*run)(struct bench *);
+        int        (*prep)(struct bench *);
+        int          per_table;
+    } kinds[] = {
+        { "huff_encode",    run_huff_encode,    NULL,               0, },
+        { "huff_decode",    run_huff_decode,    prep_huff_decode,   0, },
+        { "int_codec",      run_int_codec,      NULL,               0, },
+        { "int_encode",     run_int_encode,     prep_int,           0, },
+        { "int_encode_tail",run_int_encode_tail,prep_int,           0, },
+        { "int_decode",     run_int_decode,     prep_int,           0, },
+        { "int_decode_tail",run_int_decode_tail,prep_int,           0, },
+        { "encode",         run_encode,         NULL,               1, },
+        { "encode_stateless",run_encode_stateless,NULL,             0, },
+        { "decode",         run_decode,         prep_decode,        1, },
+        { "decode_hlist",   run_decode_hlist,   prep_decode,        1, },
+    };
+#define N_KINDS (sizeof(kinds) / sizeof(kinds[0]))
+#define N_QIFS (sizeof(qif_names) / sizeof(qif_names[0]))
+#define N_TABLE_SIZES (sizeof(table_sizes) / sizeof(table_sizes[0]))
+#define N_RISKED (sizeof(risked_streams) / sizeof(risked_streams[0]))
+
+    while (-1 != (opt = getopt(argc, argv, "f:m:o:q:t:h")))
+    {
+        switch (opt)
+        {
+        case 'f':
+            filter = optarg;
+            break;
+        case 'm':
+            min_time_ms = atoi(optarg);
+            break;
+        case 'o':
+            out_name = optarg;
+            break;
+        case 'q':
+            qif_dir = optarg;
+            break;
+        case 't':
+#if BENCH_THREADS
+            max_threads = atoi(optarg);
+            break;
+#else
+            fprintf(stderr, "threaded benchmarks are not supported\n");
+            exit(EXIT_FAILURE);
+#endif
+        case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (q = 0; q < N_QIFS; ++q)
+        if (0 != qif_load(&qifs[q], qif_dir, qif_names[q]))
+            exit(EXIT_FAILURE);
+
+    /* Thread counts double up to max_threads: there are fewer than 32 for
+     * each QIF file and each threaded benchmark.
+     */
+    benches = calloc(N_QIFS * N_KINDS * N_TABLE_SIZES * N_RISKED
+                            + (max_threads ? N_QIFS * 64 : 0), sizeof(benches[0]));
+    if (!benches)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    n_benches = 0;
+    for (k = 0; k < N_KINDS; ++k)
+        for (q = 0; q < N_QIFS; ++q)
+            for (t = 0; t < (kinds[k].per_table ? N_TABLE_SIZES : 1); ++t)
+                for (s = 0; s < (kinds[k].per_table ? N_RISKED : 1); ++s)
+                {
+                    bench = &benches[n_benches];
+                    if (kinds[k].per_table)
+                        snprintf(bench->name, sizeof(bench->name),
+                            "%s/%s/t%u/s%u", kinds[k].name, qif_names[q],
+                            table_sizes[t], risked_streams[s]);
+                    else
+                        snprintf(bench->name, sizeof(bench->name), "%s/%s",
+                            kinds[k].name, qif_names[q]);
+                    if (filter && !strstr(bench->name, filter))
+                        continue;
+                    bench->run = kinds[k].run;
+                    bench->qif = &qifs[q];
+                    bench->table_size = table_sizes[t];
+                    bench->risked_streams = risked_streams[s];
+                    bench->passes = 1;
+                    alloc_out_buf(bench);
+                    if (kinds[k].prep && 0 != kinds[k].prep(bench))
+                    {
+                        fprintf(stderr, "%s: cannot prepare benchmark\n",
+                                                                bench->name);
+                        exit(EXIT_FAILURE);
+                    }
+                    ++n_benches;
+                }
+
+#if BENCH_THREADS
+    for (q = 0; q < N_QIFS; ++q)
+        for (t = 1; t && t <= max_threads; t = t == max_threads ? 0
+                            : t * 2 > max_threads ? max_threads : t * 2)
+        {
+            bench = &benches[n_benches];
+            snprintf(bench->name, sizeof(bench->name),
+                "decode_mt/%s/t4096/s100/threads:%u", qif_names[q], t);
+            if (filter && !strstr(bench->name, filter))
+                continue;
+            bench->run = run_decode_threads;
+            bench->qif = &qifs[q];
+            bench->table_size = 4096;
+            bench->risked_streams = 100;
+            bench->n_threads = t;
+            alloc_out_buf(bench);
+            if (0 != prep_decode_threads(bench))
+            {
+                fprintf(stderr, "%s: cannot prepare benchmark\n", bench->name);
+                exit(EXIT_FAILURE);
+            }
+            ++n_benches;
+        }
+#endif
+
+#if BENCH_MT
+    for (q = 0; q < N_QIFS; ++q)
+        for (t = 1; t && t <= max_threads; t = t == max_threads ? 0
+                            : t * 2 > max_threads ? max_threads : t * 2)
+        {
+            bench = &benches[n_benches];
+            snprintf(bench->name, sizeof(bench->name),
+                "decode_helper/%s/t4096/s100/threads:%u", qif_names[q], t);
+            if (filter && !strstr(bench->name, filter))
+                continue;
+            bench->run = run_decode_helper;
+            bench->qif = &qifs[q];
+            bench->table_size = 4096;
+            bench->risked_streams = 100;
+            bench->n_threads = t;
+            alloc_out_buf(bench);
+            if (0 != prep_decode_helper(bench))
+            {
+                fprintf(stderr, "%s: cannot prepare benchmark\n", bench->name);
+                exit(EXIT_FAILURE);
+            }
+            ++n_benches;
+        }
+#endif
+
+    print_console_header();
+    for (n_done = 0; n_done < n_benches; ++n_done)
+    {
+        bench = &benches[n_done];
+        if (0 != run_bench(bench, (uint64_t) min_time_ms * 1000000))
+        {
+            fprintf(stderr, "%s: benchmark failed\n", bench->name);
+            exit(EXIT_FAILURE);
+        }
+        print_console(bench);
+    }
+
+    if (out_name)
+    {
+        out = fopen(out_name, "w");
+        if (!out)
+        {
+            fprintf(stderr, "cannot open %s: %s\n", out_name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        print_json(out, benches, n_benches, min_time_ms);
+        if (0 != fclose(out))
+        {
+            perror("fclose");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (bench = benches; bench < benches + n_benches; ++bench)
+    {
+        free(bench->in_buf);
+        free(bench->offs);
+        free(bench->out_buf);
+#if BENCH_THREADS
+        cleanup_decode_threads(bench);
+#endif
+#if BENCH_MT
+        cleanup_decode_helper(bench);
+#endif
+    }
+    free(benches);
+    for (q = 0; q < N_QIFS; ++q)
+        qif_cleanup(&qifs[q]);
+
+    exit(EXIT_SUCCESS);
+}
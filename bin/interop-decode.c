@@ -41,7 +41,6 @@
 
 #include "lsqpack.h"
 #include "lsxpack_header.h"
-#include "xxhash.h"
 #ifndef DEBUG
 #include "lsqpack-test.h"
 #endif
@@ -192,6 +191,8 @@ usage (const char *name)
 "   -t NUMBER   Dynamic table size.  Defaults to %u.\n"
 "   -m NUMBER   Maximum read size.  Defaults to %zu.\n"
 "   -H [0|1]    Use HTTP/1.x mode and test each header (defaults to `off').\n"
+"   -R [0|1]    Allocate dynamic table entries from ring arena (defaults\n"
+"                 to `off').\n"
 "   -v          Verbose: print headers and table state to stderr.\n"
 "   -S          Don't swap encoder stream and header blocks.\n"
 "   -Q          Don't check static table when LSXPACK_QPACK_IDX is not set.\n"
@@ -276,8 +277,7 @@ process_header (void *hblock_ctx, struct lsxpack_header *xhdr)
 {
     struct buf *const buf = hblock_ctx;
     const char *p;
-    const uint32_t seed = 39378473;
-    uint32_t hash, name_hash;
+    uint32_t hash;
     int nw;
 
     if (s_dec_opts & LSQPACK_DEC_OPT_HTTP1X)
@@ -294,7 +294,8 @@ process_header (void *hblock_ctx, struct lsxpack_header *xhdr)
     if (s_dec_opts & LSQPACK_DEC_OPT_HASH_NAME)
     {
         assert(xhdr->flags & LSXPACK_NAME_HASH);
-        hash = XXH32(lsxpack_header_get_name(xhdr), xhdr->name_len, seed);
+        hash = lsqpack_hash(lsxpack_header_get_name(xhdr), xhdr->name_len,
+                                                            LSQPACK_HASH_SEED);
         assert(hash == xhdr->name_hash);
     }
 
@@ -303,14 +304,10 @@ process_header (void *hblock_ctx, struct lsxpack_header *xhdr)
 
     if (xhdr->flags & LSXPACK_NAME_HASH)
     {
-        name_hash = XXH32(lsxpack_header_get_name(xhdr), xhdr->name_len, seed);
+        hash = lsqpack_hash(lsxpack_header_get_name(xhdr), xhdr->name_len,
+                                                            LSQPACK_HASH_SEED);
         assert(hash == xhdr->name_hash);
     }
-#ifndef NDEBUG
-    else if (!(xhdr->flags & LSXPACK_QPACK_IDX))
-        /* Calculate for upcoming "not in static table check" */
-        name_hash = XXH32(lsxpack_header_get_name(xhdr), xhdr->name_len, seed);
-#endif
 
     if (s_dec_opts & LSQPACK_DEC_OPT_HASH_NAMEVAL)
     {
@@ -323,8 +320,10 @@ process_header (void *hblock_ctx, struct lsxpack_header *xhdr)
 
     if (xhdr->flags & LSXPACK_NAMEVAL_HASH)
     {
-        hash = XXH32(lsxpack_header_get_name(xhdr), xhdr->name_len, seed);
-        hash = XXH32(lsxpack_header_get_value(xhdr), xhdr->val_len, hash);
+        hash = lsqpack_hash(lsxpack_header_get_name(xhdr), xhdr->name_len,
+                                                            LSQPACK_HASH_SEED);
+        hash = lsqpack_hash(lsxpack_header_get_value(xhdr), xhdr->val_len,
+                                                                        hash);
         assert(hash == xhdr->nameval_hash);
     }
 
@@ -344,7 +343,7 @@ process_header (void *hblock_ctx, struct lsxpack_header *xhdr)
          * testing our decoder, we assume that the encoder always uses
          * the static table when it can.
          */
-        int idx = lsqpack_find_in_static_headers(name_hash,
+        int idx = lsqpack_find_in_static_headers(
                             lsxpack_header_get_name(xhdr), xhdr->name_len);
         assert(idx < 0);
     }
@@ -412,7 +411,7 @@ main (int argc, char **argv)
     char command[0x100];
     char line_buf[0x100];
 
-    while (-1 != (opt = getopt(argc, argv, "i:o:r:s:t:m:hvH:SQ")))
+    while (-1 != (opt = getopt(argc, argv, "i:o:r:s:t:m:hvH:R:SQ")))
     {
         switch (opt)
         {
@@ -478,6 +477,12 @@ main (int argc, char **argv)
             else
                 s_dec_opts &= ~LSQPACK_DEC_OPT_HTTP1X;
             break;
+        case 'R':
+            if (atoi(optarg))
+                s_dec_opts |= LSQPACK_DEC_OPT_RING_ARENA;
+            else
+                s_dec_opts &= ~LSQPACK_DEC_OPT_RING_ARENA;
+            break;
         case 'Q':
             s_check_unset_qpack_idx = 0;
             break;
@@ -65,9 +65,12 @@ usage (const char *name)
 "                 immediately.  Default value is 0.\n"
 "   -n          Process annotations.\n"
 "   -S          Server mode.\n"
+"   -C          Use cost model to decide what to insert.\n"
 "   -D          Do not emit \"Duplicate\" instructions.\n"
 "   -A          Aggressive indexing.\n"
 "   -M          Turn off memory guard.\n"
+"   -R          Allocate dynamic table entries from ring arena.\n"
+"   -K          Split cookies into crumbs.\n"
 "   -f          Fast: use maximum output buffers.\n"
 "   -v          Verbose: print various messages to stderr.\n"
 "\n"
@@ -265,13 +268,16 @@ main (int argc, char **argv)
     struct lsxpack_header xhdr;
     unsigned char enc_buf[0x1000], hea_buf[0x1000], pref_buf[0x20];
 
-    while (-1 != (opt = getopt(argc, argv, "ADMSa:i:no:s:t:hvf")))
+    while (-1 != (opt = getopt(argc, argv, "ACDKMRSa:i:no:s:t:hvf")))
     {
         switch (opt)
         {
         case 'S':
             enc_opts |= LSQPACK_ENC_OPT_SERVER;
             break;
+        case 'C':
+            enc_opts |= LSQPACK_ENC_OPT_COST_MODEL;
+            break;
         case 'D':
             enc_opts |= LSQPACK_ENC_OPT_NO_DUP;
             break;
@@ -281,6 +287,12 @@ main (int argc, char **argv)
         case 'M':
             enc_opts |= LSQPACK_ENC_OPT_NO_MEM_GUARD;
             break;
+        case 'R':
+            enc_opts |= LSQPACK_ENC_OPT_RING_ARENA;
+            break;
+        case 'K':
+            enc_opts |= LSQPACK_ENC_OPT_CRUMBLE_COOKIES;
+            break;
         case 'n':
             ++process_annotations;
             break;
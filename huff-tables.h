@@ -136244,4 +136244,48 @@ static const struct hdec { uint8_t lens; uint8_t out[3]; } hdecs[] =
 /* 65534 */ {0,{0,0,0,}},
 /* 65535 */ {0,{0,0,0,}},
 };
+
+/* Codes longer than 16 bits are not covered by hdecs[].  The code is
+ * canonical: codes of the same length are consecutive and longer codes
+ * compare greater when left-aligned.  `limit' is the left-aligned 32-bit
+ * value one past the last code of length `bits'.
+ */
+static const struct hdec_long
+{
+    uint32_t limit;
+    uint32_t first;     /* First code of this length */
+    uint8_t  bits;
+    uint8_t  offset;    /* Index of first symbol in hdec_long_syms[] */
+} hdec_longs[] =
+{
+    { 0xFFFE6000, 0x0007FFF0, 19,   0, },
+    { 0xFFFEE000, 0x000FFFE6, 20,   3, },
+    { 0xFFFF4800, 0x001FFFDC, 21,  11, },
+    { 0xFFFFB000, 0x003FFFD2, 22,  24, },
+    { 0xFFFFEA00, 0x007FFFD8, 23,  50, },
+    { 0xFFFFF600, 0x00FFFFEA, 24,  79, },
+    { 0xFFFFF800, 0x01FFFFEC, 25,  91, },
+    { 0xFFFFFBC0, 0x03FFFFE0, 26,  95, },
+    { 0xFFFFFE20, 0x07FFFFDE, 27, 110, },
+    { 0xFFFFFFF0, 0x0FFFFFE2, 28, 129, },
+    { 0xFFFFFFFF, 0x3FFFFFFC, 30, 158, },
+};
+
+static const uint16_t hdec_long_syms[] =
+{
+     92, 195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153,
+    161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230,
+    129, 132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169,
+    170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228,
+    232, 233,   1, 135, 137, 138, 139, 140, 141, 143, 147, 149,
+    150, 151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180,
+    182, 183, 188, 191, 197, 231, 239,   9, 142, 144, 145, 148,
+    159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192,
+    193, 200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242,
+    243, 255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244,
+    245, 246, 247, 248, 250, 251, 252, 253, 254,   2,   3,   4,
+      5,   6,   7,   8,  11,  12,  14,  15,  16,  17,  18,  19,
+     20,  21,  23,  24,  25,  26,  27,  28,  29,  30,  31, 127,
+    220, 249,  10,  13,  22, 256,
+};
 #endif
@@ -0,0 +1,869 @@
+/*
+ * lsqpack-mt.c -- Multi-threaded decoding helper for the QPACK library.
+ *
+ * Connections are sharded across worker threads.  Three lock-free
+ * multiple-producer, single-consumer queues move work around: input of
+ * each connection, connections with pending input of each worker, and
+ * results.  Mutexes and condition variables are only used to put idle
+ * threads to sleep.
+ */
+/*
+MIT License
+
+Copyright (c) 2018 - 2020 LiteSpeed Technologies Inc
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+
+#include "lsqpack.h"
+#include "lsqpack-mt.h"
+
+
+/* Intrusive MPSC queue after Dmitry Vyukov.  Pushing is wait-free.  Popping
+ * may fail while a push is in progress: use mt_queue_empty() to tell this
+ * case from an empty queue.
+ */
+struct mt_node
+{
+    _Atomic(struct mt_node *)   next;
+};
+
+
+struct mt_queue
+{
+    _Atomic(struct mt_node *)   head;   /* Producers push here */
+    struct mt_node             *tail;   /* Consumer pops from here */
+    struct mt_node              stub;
+};
+
+
+static void
+mt_queue_init (struct mt_queue *q)
+{
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+}
+
+
+static void
+mt_queue_push (struct mt_queue *q, struct mt_node *node)
+{
+    struct mt_node *prev;
+
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    prev = atomic_exchange(&q->head, node);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+
+/* Only called by the consumer */
+static struct mt_node *
+mt_queue_pop (struct mt_queue *q)
+{
+    struct mt_node *tail, *next;
+
+    tail = q->tail;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &q->stub)
+    {
+        if (!next)
+            return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next)
+    {
+        q->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load(&q->head))
+        return NULL;    /* Push in progress */
+    mt_queue_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next)
+    {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+
+/* Only called by the consumer.  A push in progress makes the queue
+ * non-empty.
+ */
+static int
+mt_queue_empty (struct mt_queue *q)
+{
+    return q->tail == &q->stub && atomic_load(&q->head) == &q->stub;
+}
+
+
+/* Lets the consumer of a queue sleep until something is pushed onto it.
+ * The producer pushes first and then calls mt_waiter_wake(); the consumer
+ * sets `waiting' before checking the queue.  As both use sequentially
+ * consistent operations, either the consumer sees the new node or the
+ * producer sees `waiting' set.
+ */
+struct mt_waiter
+{
+    pthread_mutex_t             mutex;
+    pthread_cond_t              cond;
+    atomic_int                  waiting;
+};
+
+
+static int
+mt_waiter_init (struct mt_waiter *waiter)
+{
+    atomic_init(&waiter->waiting, 0);
+    if (0 != pthread_mutex_init(&waiter->mutex, NULL))
+        return -1;
+    if (0 != pthread_cond_init(&waiter->cond, NULL))
+    {
+        pthread_mutex_destroy(&waiter->mutex);
+        return -1;
+    }
+    return 0;
+}
+
+
+static void
+mt_waiter_cleanup (struct mt_waiter *waiter)
+{
+    pthread_cond_destroy(&waiter->cond);
+    pthread_mutex_destroy(&waiter->mutex);
+}
+
+
+static void
+mt_waiter_wake (struct mt_waiter *waiter)
+{
+    if (atomic_load(&waiter->waiting))
+    {
+        pthread_mutex_lock(&waiter->mutex);
+        pthread_cond_signal(&waiter->cond);
+        pthread_mutex_unlock(&waiter->mutex);
+    }
+}
+
+
+/* Wait until the queue is no longer empty or `stop' is set */
+static void
+mt_waiter_wait (struct mt_waiter *waiter, struct mt_queue *q,
+                                                        const atomic_int *stop)
+{
+    pthread_mutex_lock(&waiter->mutex);
+    atomic_store(&waiter->waiting, 1);
+    while (mt_queue_empty(q) && !(stop && atomic_load(stop)))
+        pthread_cond_wait(&waiter->cond, &waiter->mutex);
+    atomic_store(&waiter->waiting, 0);
+    pthread_mutex_unlock(&waiter->mutex);
+}
+
+
+/* Read contexts of header blocks are allocated from an arena that belongs
+ * to the worker thread: they are all of the same size and are allocated
+ * and freed by the thread that owns the decoder.
+ */
+#define MT_ARENA_SLAB_OBJS 32
+#define MT_ARENA_ALIGN 16
+
+struct mt_arena_slab
+{
+    struct mt_arena_slab       *next;
+};
+
+
+struct mt_arena_obj
+{
+    struct mt_arena_obj        *next;
+};
+
+
+struct mt_arena
+{
+    struct mt_arena_slab       *slabs;
+    struct mt_arena_obj        *free;
+    size_t                      obj_size;
+};
+
+
+/* Offset of the first object in a slab */
+#define MT_ARENA_SLAB_HEAD \
+    ((sizeof(struct mt_arena_slab) + MT_ARENA_ALIGN - 1) \
+                                                    & ~(MT_ARENA_ALIGN - 1))
+
+static void *
+mt_arena_alloc (void *ctx, size_t size)
+{
+    struct mt_arena *const arena = ctx;
+    struct mt_arena_slab *slab;
+    struct mt_arena_obj *obj;
+    unsigned n;
+
+    if (!arena->free)
+    {
+        if (!arena->obj_size)
+            arena->obj_size = (size + MT_ARENA_ALIGN - 1)
+                                                    & ~(MT_ARENA_ALIGN - 1);
+        assert(size <= arena->obj_size);
+        slab = malloc(MT_ARENA_SLAB_HEAD
+                                    + arena->obj_size * MT_ARENA_SLAB_OBJS);
+        if (!slab)
+            return NULL;
+        slab->next = arena->slabs;
+        arena->slabs = slab;
+        for (n = 0; n < MT_ARENA_SLAB_OBJS; ++n)
+        {
+            obj = (void *) ((char *) slab + MT_ARENA_SLAB_HEAD
+                                                    + n * arena->obj_size);
+            obj->next = arena->free;
+            arena->free = obj;
+        }
+    }
+
+    assert(size <= arena->obj_size);
+    obj = arena->free;
+    arena->free = obj->next;
+    return obj;
+}
+
+
+static void
+mt_arena_free (void *ctx, void *ptr)
+{
+    struct mt_arena *const arena = ctx;
+    struct mt_arena_obj *const obj = ptr;
+
+    obj->next = arena->free;
+    arena->free = obj;
+}
+
+
+static void
+mt_arena_cleanup (struct mt_arena *arena)
+{
+    struct mt_arena_slab *slab;
+
+    while ((slab = arena->slabs))
+    {
+        arena->slabs = slab->next;
+        free(slab);
+    }
+}
+
+
+static const struct lsqpack_dec_alloc_if mt_arena_if =
+{
+    .dai_alloc      = mt_arena_alloc,
+    .dai_realloc    = NULL,
+    .dai_free       = mt_arena_free,
+};
+
+
+struct mt_worker
+{
+    struct lsqpack_mt          *mw_mt;
+    /* Connections with pending input */
+    struct mt_queue             mw_runq;
+    struct mt_waiter            mw_waiter;
+    atomic_int                  mw_stop;
+    struct mt_arena             mw_arena;
+    pthread_t                   mw_thread;
+};
+
+
+struct lsqpack_mt
+{
+    struct lsqpack_mt_settings  lm_settings;
+    struct mt_queue             lm_results;
+    struct mt_waiter            lm_waiter;
+    atomic_uint                 lm_next_worker;
+    unsigned                    lm_n_workers;
+    struct mt_worker          **lm_workers;
+};
+
+
+/* A job is a unit of input.  Header blocks become results once they are
+ * done, so that the data does not have to be copied again.
+ */
+struct mt_job
+{
+    struct mt_node              mj_node;
+    enum {
+        MJ_ENC_IN,
+        MJ_HEADER_IN,
+        MJ_DESTROY,
+        MJ_RESULT,
+    }                           mj_type;
+    struct lsqpack_mt_conn     *mj_conn;
+    /* Blocked and unblocked header blocks are kept on connection lists */
+    TAILQ_ENTRY(mt_job)         mj_next;
+    const unsigned char        *mj_pos;
+    size_t                      mj_size;
+    struct lsqpack_mt_result    mj_result;
+    unsigned char               mj_buf[0];
+};
+
+TAILQ_HEAD(mt_jobs, mt_job);
+
+
+struct lsqpack_mt_conn
+{
+    struct mt_node              lmc_node;
+    /* Input submitted by the application */
+    struct mt_queue             lmc_input;
+    /* Set while the connection is on the worker's run queue or is being
+     * processed by it.
+     */
+    atomic_int                  lmc_scheduled;
+    /* Held by the application until lsqpack_mt_conn_destroy() returns and
+     * by the worker until it has processed the destroy job: either may be
+     * the last to let go.
+     */
+    atomic_int                  lmc_refcnt;
+    struct mt_worker           *lmc_worker;
+    void                       *lmc_conn_ctx;
+    /* The rest is only used by the worker */
+    struct mt_jobs              lmc_blocked;
+    struct mt_jobs              lmc_unblocked;
+    int                         lmc_failed;
+    /* Allocated up front, so that destroying the connection cannot fail */
+    struct mt_job              *lmc_destroy_job;
+    struct lsqpack_dec          lmc_dec;
+};
+
+
+#define JOB_FROM_NODE(node_) ((struct mt_job *) \
+                        ((char *) (node_) - offsetof(struct mt_job, mj_node)))
+
+
+static struct mt_job *
+mt_job_new (struct lsqpack_mt_conn *conn, size_t size)
+{
+    struct mt_job *job;
+
+    job = malloc(sizeof(*job) + size);
+    if (!job)
+        return NULL;
+    job->mj_conn = conn;
+    job->mj_pos = job->mj_buf;
+    job->mj_size = size;
+    memset(&job->mj_result, 0, sizeof(job->mj_result));
+    job->mj_result.lmr_conn_ctx = conn->lmc_conn_ctx;
+    return job;
+}
+
+
+static void
+mt_submit (struct lsqpack_mt_conn *conn, struct mt_job *job)
+{
+    struct mt_worker *const worker = conn->lmc_worker;
+
+    mt_queue_push(&conn->lmc_input, &job->mj_node);
+    if (0 == atomic_exchange(&conn->lmc_scheduled, 1))
+    {
+        mt_queue_push(&worker->mw_runq, &conn->lmc_node);
+        mt_waiter_wake(&worker->mw_waiter);
+    }
+}
+
+
+static void
+mt_conn_unref (struct lsqpack_mt_conn *conn)
+{
+    if (1 == atomic_fetch_sub(&conn->lmc_refcnt, 1))
+        free(conn);
+}
+
+
+static void
+mt_emit (struct lsqpack_mt *mt, struct mt_job *job)
+{
+    job->mj_type = MJ_RESULT;
+    mt_queue_push(&mt->lm_results, &job->mj_node);
+    mt_waiter_wake(&mt->lm_waiter);
+}
+
+
+static void
+mt_emit_header_block (struct lsqpack_mt *mt, struct mt_job *job,
+                                        enum lsqpack_read_header_status rhs)
+{
+    if (rhs != LQRHS_DONE)
+    {
+        rhs = LQRHS_ERROR;
+        job->mj_result.lmr_dec_buf_sz = 0;
+    }
+    job->mj_result.lmr_type = LSQPACK_MT_HEADER_BLOCK;
+    job->mj_result.lmr_status = rhs;
+    mt_emit(mt, job);
+}
+
+
+static void
+mt_unblocked (void *hblock_ctx)
+{
+    struct mt_job *const job = hblock_ctx;
+    struct lsqpack_mt_conn *const conn = job->mj_conn;
+
+    TAILQ_REMOVE(&conn->lmc_blocked, job, mj_next);
+    TAILQ_INSERT_TAIL(&conn->lmc_unblocked, job, mj_next);
+}
+
+
+static struct lsxpack_header *
+mt_prepare_decode (void *hblock_ctx, struct lsxpack_header *xhdr,
+                                                                size_t space)
+{
+    struct mt_job *const job = hblock_ctx;
+    const struct lsqpack_mt *const mt = job->mj_conn->lmc_worker->mw_mt;
+
+    return mt->lm_settings.lms_hset_if->dhi_prepare_decode(
+                            job->mj_result.lmr_hblock_ctx, xhdr, space);
+}
+
+
+static int
+mt_process_header (void *hblock_ctx, struct lsxpack_header *xhdr)
+{
+    struct mt_job *const job = hblock_ctx;
+    const struct lsqpack_mt *const mt = job->mj_conn->lmc_worker->mw_mt;
+
+    return mt->lm_settings.lms_hset_if->dhi_process_header(
+                                        job->mj_result.lmr_hblock_ctx, xhdr);
+}
+
+
+static const struct lsqpack_dec_hset_if mt_hset_if =
+{
+    .dhi_unblocked      = mt_unblocked,
+    .dhi_prepare_decode = mt_prepare_decode,
+    .dhi_process_header = mt_process_header,
+};
+
+
+static void
+mt_header_in (struct lsqpack_mt *mt, struct lsqpack_mt_conn *conn,
+                                                        struct mt_job *job)
+{
+    enum lsqpack_read_header_status rhs;
+
+    if (conn->lmc_failed)
+    {
+        mt_emit_header_block(mt, job, LQRHS_ERROR);
+        return;
+    }
+
+    job->mj_result.lmr_dec_buf_sz = sizeof(job->mj_result.lmr_dec_buf);
+    rhs = lsqpack_dec_header_in(&conn->lmc_dec, job,
+                job->mj_result.lmr_stream_id, job->mj_size, &job->mj_pos,
+                job->mj_size, job->mj_result.lmr_dec_buf,
+                &job->mj_result.lmr_dec_buf_sz);
+    if (rhs == LQRHS_BLOCKED)
+        TAILQ_INSERT_TAIL(&conn->lmc_blocked, job, mj_next);
+    else
+        mt_emit_header_block(mt, job, rhs);
+}
+
+
+static void
+mt_enc_in (struct lsqpack_mt *mt, struct lsqpack_mt_conn *conn,
+                                                        struct mt_job *job)
+{
+    enum lsqpack_read_header_status rhs;
+    struct mt_job *hblock;
+
+    if (conn->lmc_failed)
+    {
+        free(job);
+        return;
+    }
+
+    if (0 != lsqpack_dec_enc_in(&conn->lmc_dec, job->mj_buf, job->mj_size))
+    {
+        conn->lmc_failed = 1;
+        job->mj_result.lmr_type = LSQPACK_MT_ENC_STREAM;
+        job->mj_result.lmr_status = LQRHS_ERROR;
+        mt_emit(mt, job);
+        return;
+    }
+    free(job);
+
+    /* Rest of the header block is read right away */
+    while ((hblock = TAILQ_FIRST(&conn->lmc_unblocked)))
+    {
+        TAILQ_REMOVE(&conn->lmc_unblocked, hblock, mj_next);
+        hblock->mj_result.lmr_dec_buf_sz
+                                    = sizeof(hblock->mj_result.lmr_dec_buf);
+        rhs = lsqpack_dec_header_read(&conn->lmc_dec, hblock, &hblock->mj_pos,
+                    hblock->mj_buf + hblock->mj_size - hblock->mj_pos,
+                    hblock->mj_result.lmr_dec_buf,
+                    &hblock->mj_result.lmr_dec_buf_sz);
+        assert(rhs != LQRHS_BLOCKED);
+        mt_emit_header_block(mt, hblock, rhs);
+    }
+}
+
+
+static void
+mt_conn_close (struct lsqpack_mt *mt, struct lsqpack_mt_conn *conn,
+                                                        struct mt_job *job)
+{
+    struct mt_job *hblock;
+
+    while ((hblock = TAILQ_FIRST(&conn->lmc_blocked)))
+    {
+        TAILQ_REMOVE(&conn->lmc_blocked, hblock, mj_next);
+        hblock->mj_result.lmr_type = LSQPACK_MT_HEADER_BLOCK;
+        hblock->mj_result.lmr_status = LQRHS_BLOCKED;
+        hblock->mj_result.lmr_dec_buf_sz = 0;
+        mt_emit(mt, hblock);
+    }
+    assert(TAILQ_EMPTY(&conn->lmc_unblocked));
+    /* Read contexts go back to this thread's arena */
+    lsqpack_dec_cleanup(&conn->lmc_dec);
+    mt_conn_unref(conn);
+    job->mj_result.lmr_type = LSQPACK_MT_CONN_CLOSED;
+    mt_emit(mt, job);
+}
+
+
+/* Process all pending input of the connection.  Returns -1 if the
+ * connection has been destroyed.
+ */
+static int
+mt_conn_process (struct mt_worker *worker, struct lsqpack_mt_conn *conn)
+{
+    struct lsqpack_mt *const mt = worker->mw_mt;
+    struct mt_node *node;
+    struct mt_job *job;
+    ssize_t ici_sz;
+    int enc_in = 0;
+
+    while ((node = mt_queue_pop(&conn->lmc_input)))
+    {
+        job = JOB_FROM_NODE(node);
+        switch (job->mj_type)
+        {
+        case MJ_ENC_IN:
+            mt_enc_in(mt, conn, job);
+            enc_in = 1;
+            break;
+        case MJ_HEADER_IN:
+            mt_header_in(mt, conn, job);
+            break;
+        case MJ_DESTROY:
+            mt_conn_close(mt, conn, job);
+            return -1;
+        default:
+            assert(0);
+        }
+    }
+
+    /* One Insert Count Increment for the whole batch */
+    if (enc_in && !conn->lmc_failed)
+    {
+        job = mt_job_new(conn, 0);
+        if (job)
+        {
+            ici_sz = lsqpack_dec_write_ici(&conn->lmc_dec,
+                job->mj_result.lmr_dec_buf, sizeof(job->mj_result.lmr_dec_buf));
+            if (ici_sz > 0)
+            {
+                job->mj_result.lmr_type = LSQPACK_MT_ENC_STREAM;
+                job->mj_result.lmr_status = LQRHS_DONE;
+                job->mj_result.lmr_dec_buf_sz = (size_t) ici_sz;
+                mt_emit(mt, job);
+            }
+            else
+                free(job);
+        }
+    }
+    return 0;
+}
+
+
+static void *
+mt_worker_thread (void *arg)
+{
+    struct mt_worker *const worker = arg;
+    struct lsqpack_mt_conn *conn;
+    struct mt_node *node;
+
+    while (1)
+    {
+        node = mt_queue_pop(&worker->mw_runq);
+        if (!node)
+        {
+            if (!mt_queue_empty(&worker->mw_runq))
+                continue;
+            if (atomic_load(&worker->mw_stop))
+                break;
+            mt_waiter_wait(&worker->mw_waiter, &worker->mw_runq,
+                                                        &worker->mw_stop);
+            continue;
+        }
+        conn = (struct lsqpack_mt_conn *) ((char *) node
+                                - offsetof(struct lsqpack_mt_conn, lmc_node));
+        if (0 != mt_conn_process(worker, conn))
+            continue;
+        /* Input submitted after the queue was drained did not reschedule
+         * the connection, as it was still marked as scheduled.
+         */
+        atomic_store(&conn->lmc_scheduled, 0);
+        if (!mt_queue_empty(&conn->lmc_input)
+                        && 0 == atomic_exchange(&conn->lmc_scheduled, 1))
+            mt_queue_push(&worker->mw_runq, &conn->lmc_node);
+    }
+
+    return NULL;
+}
+
+
+static void
+mt_stop_workers (struct lsqpack_mt *mt, unsigned n_started)
+{
+    struct mt_worker *worker;
+    unsigned n;
+
+    for (n = 0; n < n_started; ++n)
+    {
+        worker = mt->lm_workers[n];
+        pthread_mutex_lock(&worker->mw_waiter.mutex);
+        atomic_store(&worker->mw_stop, 1);
+        pthread_cond_signal(&worker->mw_waiter.cond);
+        pthread_mutex_unlock(&worker->mw_waiter.mutex);
+    }
+    for (n = 0; n < n_started; ++n)
+        pthread_join(mt->lm_workers[n]->mw_thread, NULL);
+}
+
+
+static void
+mt_free_workers (struct lsqpack_mt *mt)
+{
+    struct mt_worker *worker;
+    unsigned n;
+
+    for (n = 0; n < mt->lm_n_workers; ++n)
+        if ((worker = mt->lm_workers[n]))
+        {
+            mt_arena_cleanup(&worker->mw_arena);
+            mt_waiter_cleanup(&worker->mw_waiter);
+            free(worker);
+        }
+    free(mt->lm_workers);
+}
+
+
+struct lsqpack_mt *
+lsqpack_mt_new (const struct lsqpack_mt_settings *settings)
+{
+    struct lsqpack_mt *mt;
+    struct mt_worker *worker;
+    unsigned n;
+
+    if (settings->lms_n_threads == 0 || !settings->lms_hset_if)
+        return NULL;
+
+    mt = calloc(1, sizeof(*mt));
+    if (!mt)
+        return NULL;
+    mt->lm_settings = *settings;
+    mt_queue_init(&mt->lm_results);
+    atomic_init(&mt->lm_next_worker, 0);
+    if (0 != mt_waiter_init(&mt->lm_waiter))
+    {
+        free(mt);
+        return NULL;
+    }
+
+    /* Workers are allocated separately so that their queues do not share
+     * cache lines.
+     */
+    mt->lm_workers = calloc(settings->lms_n_threads,
+                                                sizeof(mt->lm_workers[0]));
+    if (!mt->lm_workers)
+        goto err;
+    for (n = 0; n < settings->lms_n_threads; ++n)
+    {
+        worker = calloc(1, sizeof(*worker));
+        if (!worker)
+            goto err;
+        if (0 != mt_waiter_init(&worker->mw_waiter))
+        {
+            free(worker);
+            goto err;
+        }
+        worker->mw_mt = mt;
+        mt_queue_init(&worker->mw_runq);
+        atomic_init(&worker->mw_stop, 0);
+        mt->lm_workers[n] = worker;
+        ++mt->lm_n_workers;
+    }
+
+    for (n = 0; n < mt->lm_n_workers; ++n)
+        if (0 != pthread_create(&mt->lm_workers[n]->mw_thread, NULL,
+                                        mt_worker_thread, mt->lm_workers[n]))
+        {
+            mt_stop_workers(mt, n);
+            goto err;
+        }
+
+    return mt;
+
+  err:
+    if (mt->lm_workers)
+        mt_free_workers(mt);
+    mt_waiter_cleanup(&mt->lm_waiter);
+    free(mt);
+    return NULL;
+}
+
+
+void
+lsqpack_mt_destroy (struct lsqpack_mt *mt)
+{
+    struct lsqpack_mt_result *result;
+
+    mt_stop_workers(mt, mt->lm_n_workers);
+    mt_free_workers(mt);
+    while ((result = lsqpack_mt_get_result(mt, 0)))
+        lsqpack_mt_result_free(result);
+    mt_waiter_cleanup(&mt->lm_waiter);
+    free(mt);
+}
+
+
+struct lsqpack_mt_conn *
+lsqpack_mt_conn_new (struct lsqpack_mt *mt, void *conn_ctx)
+{
+    struct lsqpack_mt_conn *conn;
+    struct mt_worker *worker;
+
+    conn = malloc(sizeof(*conn));
+    if (!conn)
+        return NULL;
+    conn->lmc_conn_ctx = conn_ctx;
+    conn->lmc_destroy_job = mt_job_new(conn, 0);
+    if (!conn->lmc_destroy_job)
+    {
+        free(conn);
+        return NULL;
+    }
+    conn->lmc_destroy_job->mj_type = MJ_DESTROY;
+
+    worker = mt->lm_workers[ atomic_fetch_add_explicit(&mt->lm_next_worker,
+                            1, memory_order_relaxed) % mt->lm_n_workers ];
+    mt_queue_init(&conn->lmc_input);
+    atomic_init(&conn->lmc_scheduled, 0);
+    atomic_init(&conn->lmc_refcnt, 2);
+    conn->lmc_worker = worker;
+    TAILQ_INIT(&conn->lmc_blocked);
+    TAILQ_INIT(&conn->lmc_unblocked);
+    conn->lmc_failed = 0;
+    lsqpack_dec_init(&conn->lmc_dec, NULL, mt->lm_settings.lms_dyn_table_size,
+                    mt->lm_settings.lms_max_risked_streams, &mt_hset_if,
+                    mt->lm_settings.lms_dec_opts);
+    lsqpack_dec_set_hbrc_alloc_if(&conn->lmc_dec, &mt_arena_if,
+                                                        &worker->mw_arena);
+    return conn;
+}
+
+
+void
+lsqpack_mt_conn_destroy (struct lsqpack_mt_conn *conn)
+{
+    /* The worker may close the connection as soon as the job is queued,
+     * while mt_submit() still uses it.
+     */
+    mt_submit(conn, conn->lmc_destroy_job);
+    mt_conn_unref(conn);
+}
+
+
+int
+lsqpack_mt_enc_in (struct lsqpack_mt_conn *conn, const unsigned char *buf,
+                                                                size_t size)
+{
+    struct mt_job *job;
+
+    job = mt_job_new(conn, size);
+    if (!job)
+        return -1;
+    job->mj_type = MJ_ENC_IN;
+    memcpy(job->mj_buf, buf, size);
+    mt_submit(conn, job);
+    return 0;
+}
+
+
+int
+lsqpack_mt_header_in (struct lsqpack_mt_conn *conn, void *hblock_ctx,
+                uint64_t stream_id, const unsigned char *buf, size_t size)
+{
+    struct mt_job *job;
+
+    job = mt_job_new(conn, size);
+    if (!job)
+        return -1;
+    job->mj_type = MJ_HEADER_IN;
+    job->mj_result.lmr_hblock_ctx = hblock_ctx;
+    job->mj_result.lmr_stream_id = stream_id;
+    memcpy(job->mj_buf, buf, size);
+    mt_submit(conn, job);
+    return 0;
+}
+
+
+struct lsqpack_mt_result *
+lsqpack_mt_get_result (struct lsqpack_mt *mt, int wait)
+{
+    struct mt_node *node;
+
+    while (!(node = mt_queue_pop(&mt->lm_results)))
+    {
+        if (!wait && mt_queue_empty(&mt->lm_results))
+            return NULL;
+        if (wait)
+            mt_waiter_wait(&mt->lm_waiter, &mt->lm_results, NULL);
+    }
+
+    return &JOB_FROM_NODE(node)->mj_result;
+}
+
+
+void
+lsqpack_mt_result_free (struct lsqpack_mt_result *result)
+{
+    free((char *) result - offsetof(struct mt_job, mj_result));
+}
@@ -0,0 +1,168 @@
+/*
+ * lsqpack-mt.h - Multi-threaded decoding helper for the QPACK library
+ *
+ * The library itself creates no threads and takes no locks: a decoder is
+ * used by one connection and is never shared.  This optional helper shards
+ * connections across a pool of worker threads.  Each connection is
+ * assigned to one worker, which does all of its decoding, so decoders still
+ * need no locking.
+ *
+ * Input is submitted using lsqpack_mt_enc_in() and lsqpack_mt_header_in().
+ * It is batched per connection: a worker processes all input pending for a
+ * connection at once and writes a single Insert Count Increment for it.
+ * Decoded header blocks, including those that were blocked and have been
+ * unblocked by encoder stream input, are handed back through a lock-free
+ * queue; use lsqpack_mt_get_result() to collect them.
+ *
+ * Build with `cmake -DLSQPACK_MT=ON'.
+ */
+
+/*
+MIT License
+
+Copyright (c) 2018 - 2020 LiteSpeed Technologies Inc
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef LSQPACK_MT_H
+#define LSQPACK_MT_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lsqpack.h"
+
+struct lsqpack_mt;
+struct lsqpack_mt_conn;
+
+struct lsqpack_mt_settings
+{
+    /** Number of worker threads */
+    unsigned                    lms_n_threads;
+    /** These are passed to @ref lsqpack_dec_init() for each connection */
+    unsigned                    lms_dyn_table_size;
+    unsigned                    lms_max_risked_streams;
+    enum lsqpack_dec_opts       lms_dec_opts;
+    /**
+     * dhi_prepare_decode() and dhi_process_header() are called in worker
+     * threads with `hblock_ctx' passed to @ref lsqpack_mt_header_in().
+     * Calls for header blocks of the same connection are never concurrent.
+     * dhi_unblocked() is not used: unblocked header blocks are decoded by
+     * the worker.
+     */
+    const struct lsqpack_dec_hset_if
+                               *lms_hset_if;
+};
+
+enum lsqpack_mt_result_type
+{
+    /** Header block is done: see `lmr_status' */
+    LSQPACK_MT_HEADER_BLOCK,
+    /**
+     * Encoder stream input has been processed.  Either `lmr_dec_buf'
+     * contains Insert Count Increment, or `lmr_status' is LQRHS_ERROR,
+     * in which case all further input to the connection is rejected.
+     */
+    LSQPACK_MT_ENC_STREAM,
+    /** This is the last result for a destroyed connection */
+    LSQPACK_MT_CONN_CLOSED,
+};
+
+struct lsqpack_mt_result
+{
+    enum lsqpack_mt_result_type lmr_type;
+    /**
+     * LQRHS_DONE or LQRHS_ERROR.  LQRHS_BLOCKED means that the header
+     * block was still blocked when the connection was destroyed.
+     */
+    enum lsqpack_read_header_status
+                                lmr_status;
+    /** Passed to @ref lsqpack_mt_conn_new() */
+    void                       *lmr_conn_ctx;
+    /** Passed to @ref lsqpack_mt_header_in(); NULL if not a header block */
+    void                       *lmr_hblock_ctx;
+    uint64_t                    lmr_stream_id;
+    /** Bytes to write to the decoder stream */
+    size_t                      lmr_dec_buf_sz;
+    unsigned char               lmr_dec_buf[LSQPACK_LONGEST_HEADER_ACK];
+};
+
+/**
+ * Start worker threads.  Returns NULL on failure.
+ */
+struct lsqpack_mt *
+lsqpack_mt_new (const struct lsqpack_mt_settings *);
+
+/**
+ * Stop worker threads and free remaining results.  All connections must
+ * have been destroyed.
+ */
+void
+lsqpack_mt_destroy (struct lsqpack_mt *);
+
+/**
+ * Create a connection and assign it to a worker.  Returns NULL on failure.
+ */
+struct lsqpack_mt_conn *
+lsqpack_mt_conn_new (struct lsqpack_mt *, void *conn_ctx);
+
+/**
+ * Destroy connection once its pending input has been processed.  Header
+ * blocks that are still blocked are returned with LQRHS_BLOCKED status,
+ * followed by LSQPACK_MT_CONN_CLOSED result.  The connection may not be
+ * used after this call.
+ */
+void
+lsqpack_mt_conn_destroy (struct lsqpack_mt_conn *);
+
+/**
+ * Queue encoder stream data.  The data is copied.  Returns 0 on success
+ * and -1 on failure.
+ */
+int
+lsqpack_mt_enc_in (struct lsqpack_mt_conn *, const unsigned char *,
+                                                                size_t);
+
+/**
+ * Queue whole header block.  The data is copied.  Returns 0 on success
+ * and -1 on failure.
+ */
+int
+lsqpack_mt_header_in (struct lsqpack_mt_conn *, void *hblock_ctx,
+                uint64_t stream_id, const unsigned char *, size_t);
+
+/**
+ * Get next result.  If `wait' is set, block until a result is available;
+ * otherwise, return NULL if there is none.  Only one thread may collect
+ * results.  Results of each connection are returned in the order in which
+ * they were produced.
+ */
+struct lsqpack_mt_result *
+lsqpack_mt_get_result (struct lsqpack_mt *, int wait);
+
+void
+lsqpack_mt_result_free (struct lsqpack_mt_result *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -32,21 +32,49 @@ SOFTWARE.
 #include <assert.h>
 #include <errno.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
 #include <sys/types.h>
 #include <inttypes.h>
+#ifndef _MSC_VER
+#include <sys/uio.h>
+#else
+/* For lsqpack_enc_writev(): same layout as the POSIX structure */
+struct iovec
+{
+    void       *iov_base;
+    size_t      iov_len;
+};
+#endif
 
 #include "lsqpack.h"
 #include "lsxpack_header.h"
 
+/* Name and name/value hashes are XXH32 by default.  Setting LSQPACK_CRC32C
+ * to 1 switches them to CRC32C, which is computed using SSE4.2 or ARMv8 CRC
+ * instructions when the compiler targets them.  Static table hashes below
+ * are generated for each choice by tools/gen-enums.pl.
+ */
+#ifndef LSQPACK_CRC32C
+#define LSQPACK_CRC32C 0
+#endif
+
+#if LSQPACK_CRC32C
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#else
 #ifdef XXH_HEADER_NAME
 #include XXH_HEADER_NAME
 #else
 #include <xxhash.h>
 #endif
+#endif
 
 #include "huff-tables.h"
 
@@ -188,6 +216,9 @@ static const struct static_table_entry static_table[] =
 /* Initial guess at number of header fields per list: */
 #define GUESS_N_HEADER_FIELDS 12
 
+/* Cost model does not look further ahead than this many history lengths: */
+#define COST_MAX_HORIZON 4
+
 #define MAX_QUIC_STREAM_ID ((1ull << 62) - 1)
 
 #ifdef LSQPACK_ENC_LOGGER_HEADER
@@ -244,10 +275,190 @@ struct lsqpack_enc_table_entry
 #define N_BUCKETS(n_bits) (1U << (n_bits))
 #define BUCKNO(n_bits, hash) ((hash) & (N_BUCKETS(n_bits) - 1))
 
+
+/* Counters are cheap enough to be always on; setting LSQPACK_STATS to 0
+ * removes them.
+ */
+#ifndef LSQPACK_STATS
+#define LSQPACK_STATS 1
+#endif
+
+#if LSQPACK_STATS
+#define STATS_ADD(stats_, field_, n_) ((stats_).field_ += (n_))
+#define STATS_PEAK(stats_, field_, val_) do {                           \
+    if ((val_) > (stats_).field_)                                       \
+        (stats_).field_ = (val_);                                       \
+} while (0)
+#else
+#define STATS_ADD(stats_, field_, n_) do { } while (0)
+#define STATS_PEAK(stats_, field_, val_) do { } while (0)
+#endif
+
+
+/* Static tracepoints.  If LSQPACK_USDT is set to 1, USDT probes of provider
+ * `lsqpack' are placed using <sys/sdt.h>; they are nops until a tracer such
+ * as bpftrace attaches to them.  Otherwise, they compile to nothing.  The
+ * probes are listed in README.md.
+ */
+#ifndef LSQPACK_USDT
+#define LSQPACK_USDT 0
+#endif
+
+#if LSQPACK_USDT
+#include <sys/sdt.h>
+#define TRACE1(probe_, a_) DTRACE_PROBE1(lsqpack, probe_, a_)
+#define TRACE2(probe_, a_, b_) DTRACE_PROBE2(lsqpack, probe_, a_, b_)
+#define TRACE3(probe_, a_, b_, c_) DTRACE_PROBE3(lsqpack, probe_, a_, b_, c_)
+#define TRACE4(probe_, a_, b_, c_, d_) \
+                            DTRACE_PROBE4(lsqpack, probe_, a_, b_, c_, d_)
+#else
+#define TRACE1(probe_, a_) do { } while (0)
+#define TRACE2(probe_, a_, b_) do { } while (0)
+#define TRACE3(probe_, a_, b_, c_) do { } while (0)
+#define TRACE4(probe_, a_, b_, c_, d_) do { } while (0)
+#endif
+
+
+/* Ring arena.  Dynamic table entries are evicted oldest first, so they can
+ * be allocated from a ring buffer.  When the ring is full -- or the arena
+ * has no buffer at all -- allocation falls back to malloc(3).
+ *
+ * Each chunk is preceded by a header.  Chunk size is a multiple of eight to
+ * keep entries aligned.
+ */
+struct arena_chunk
+{
+    unsigned    ac_size;    /* Including this header */
+    unsigned    ac_free;
+};
+
+#define RING_ARENA_CHUNK_SIZE(size) \
+                    ((sizeof(struct arena_chunk) + (size) + 7) & ~(size_t) 7)
+
+
+static int
+ring_arena_owns (const struct lsqpack_ring_arena *arena, const void *ptr)
+{
+    return (uintptr_t) ptr >= (uintptr_t) arena->ra_buf
+        && (uintptr_t) ptr < (uintptr_t) arena->ra_buf + arena->ra_size;
+}
+
+
+static void *
+ring_arena_alloc (void *ctx, size_t size)
+{
+    struct lsqpack_ring_arena *const arena = ctx;
+    struct arena_chunk *chunk;
+    size_t total;
+
+    total = RING_ARENA_CHUNK_SIZE(size);
+    if (arena->ra_nchunks == 0)
+    {
+        arena->ra_head = 0;
+        arena->ra_tail = 0;
+        arena->ra_wrap = 0;
+    }
+
+    if (arena->ra_wrap == 0)
+    {
+        if (arena->ra_size - arena->ra_head < total)
+        {
+            if (arena->ra_tail >= total)
+            {
+                arena->ra_wrap = arena->ra_head;
+                arena->ra_head = 0;
+            }
+            else
+                return malloc(size);
+        }
+    }
+    else if (arena->ra_tail - arena->ra_head < total)
+        return malloc(size);
+
+    chunk = (struct arena_chunk *) (arena->ra_buf + arena->ra_head);
+    chunk->ac_size = (unsigned) total;
+    chunk->ac_free = 0;
+    arena->ra_head += total;
+    ++arena->ra_nchunks;
+    return chunk + 1;
+}
+
+
+static void
+ring_arena_free (void *ctx, void *ptr)
+{
+    struct lsqpack_ring_arena *const arena = ctx;
+    struct arena_chunk *chunk;
+
+    if (!ring_arena_owns(arena, ptr))
+    {
+        free(ptr);
+        return;
+    }
+
+    chunk = (struct arena_chunk *) ptr - 1;
+    chunk->ac_free = 1;
+
+    /* Chunks freed out of order are reclaimed once they reach the tail */
+    while (arena->ra_nchunks > 0)
+    {
+        chunk = (struct arena_chunk *) (arena->ra_buf + arena->ra_tail);
+        if (!chunk->ac_free)
+            break;
+        arena->ra_tail += chunk->ac_size;
+        --arena->ra_nchunks;
+        if (arena->ra_wrap && arena->ra_tail == arena->ra_wrap)
+        {
+            arena->ra_tail = 0;
+            arena->ra_wrap = 0;
+        }
+    }
+}
+
+
+/* Resize the chunk in place if it is the most recent one; otherwise, move
+ * it.
+ */
+static void *
+ring_arena_realloc (void *ctx, void *ptr, size_t size)
+{
+    struct lsqpack_ring_arena *const arena = ctx;
+    struct arena_chunk *chunk;
+    size_t off, total, limit;
+    void *new_ptr;
+
+    if (!ring_arena_owns(arena, ptr))
+        return realloc(ptr, size);
+
+    chunk = (struct arena_chunk *) ptr - 1;
+    total = RING_ARENA_CHUNK_SIZE(size);
+    off = (unsigned char *) chunk - arena->ra_buf;
+    if (off + chunk->ac_size == arena->ra_head)
+    {
+        limit = arena->ra_wrap ? arena->ra_tail : arena->ra_size;
+        if (off + total <= limit)
+        {
+            chunk->ac_size = (unsigned) total;
+            arena->ra_head = off + total;
+            return ptr;
+        }
+    }
+    else if (total <= chunk->ac_size)
+        return ptr;
+
+    new_ptr = ring_arena_alloc(ctx, size);
+    if (!new_ptr)
+        return NULL;
+    memcpy(new_ptr, ptr, MIN(size, chunk->ac_size - sizeof(*chunk)));
+    ring_arena_free(ctx, ptr);
+    return new_ptr;
+}
+
 struct lsqpack_header_info
 {
     TAILQ_ENTRY(lsqpack_header_info)    qhi_next_all;
     TAILQ_ENTRY(lsqpack_header_info)    qhi_next_risked;
+    TAILQ_ENTRY(lsqpack_header_info)    qhi_next_id;
     struct lsqpack_header_info         *qhi_same_stream_id; /* Circular list */
     uint64_t                            qhi_stream_id;
     unsigned                            qhi_seqno;
@@ -261,11 +472,11 @@ struct lsqpack_header_info
 
 /* Header info structures are kept in a list of arrays, which is faster than
  * searching through a linked list whose elements may be all over the place
- * in memory.  This is important because we need to look up header infos by
- * stream ID and also calculate the minimum absolute ID.  If not sequential
- * search, we would need to implement a hybrid of min-heap and a hash (or
- * search tree) and that seems to be an overkill for something that is not
- * likely to have more than a few hundred elements at the most.
+ * in memory.  This is important because we need to calculate the minimum
+ * absolute ID.  Lookups by stream ID -- performed when Header Ack and
+ * Stream Cancellation instructions are processed -- go through a separate
+ * hash, as a peer that is slow to acknowledge can leave us with thousands
+ * of outstanding header blocks.
  */
 struct lsqpack_header_info_arr
 {
@@ -295,8 +506,51 @@ find_free_slot (uint64_t slots)
 #endif
 }
 
+TAILQ_HEAD(lsqpack_hinfo_head, lsqpack_header_info);
+
+/* The two least significant bits of a QUIC stream ID encode stream type;
+ * the rest is a sequence number, which spreads well across buckets.
+ */
+#define HINFO_BUCKNO(n_bits, stream_id) \
+                ((unsigned) ((stream_id) >> 2) & (N_BUCKETS(n_bits) - 1))
+#define HINFO_MIN_NBITS 4
+
+static int
+enc_grow_hinfo_buckets (struct lsqpack_enc *enc)
+{
+    struct lsqpack_hinfo_head *new_buckets;
+    struct lsqpack_header_info *hinfo;
+    unsigned n, nbits;
+
+    if (enc->qpe_hinfo_buckets)
+        nbits = enc->qpe_hinfo_nbits + 1;
+    else
+        nbits = HINFO_MIN_NBITS;
+
+    new_buckets = malloc(sizeof(new_buckets[0]) * N_BUCKETS(nbits));
+    if (!new_buckets)
+        return -1;
+
+    for (n = 0; n < N_BUCKETS(nbits); ++n)
+        TAILQ_INIT(&new_buckets[n]);
+
+    /* Rehashing in allocation order keeps header infos that share a stream
+     * ID in the same relative order in their new bucket.
+     */
+    TAILQ_FOREACH(hinfo, &enc->qpe_all_hinfos, qhi_next_all)
+        TAILQ_INSERT_TAIL(&new_buckets[
+                        HINFO_BUCKNO(nbits, hinfo->qhi_stream_id)],
+                                                        hinfo, qhi_next_id);
+
+    free(enc->qpe_hinfo_buckets);
+    enc->qpe_hinfo_buckets = new_buckets;
+    enc->qpe_hinfo_nbits   = nbits;
+    return 0;
+}
+
+
 static struct lsqpack_header_info *
-enc_alloc_hinfo (struct lsqpack_enc *enc)
+enc_alloc_hinfo (struct lsqpack_enc *enc, uint64_t stream_id)
 {
     struct lsqpack_header_info_arr *hiarr;
     struct lsqpack_header_info *hinfo;
@@ -320,12 +574,26 @@ enc_alloc_hinfo (struct lsqpack_enc *enc)
         ++enc->qpe_hinfo_arrs_count;
     }
 
+    if (!enc->qpe_hinfo_buckets)
+    {
+        if (0 != enc_grow_hinfo_buckets(enc))
+            return NULL;
+    }
+    else if (enc->qpe_hinfo_nelem >= N_BUCKETS(enc->qpe_hinfo_nbits) * 2)
+        /* Failure to grow is not fatal: the chains just get longer */
+        (void) enc_grow_hinfo_buckets(enc);
+
     slot = find_free_slot(hiarr->hia_slots);
     hiarr->hia_slots |= 1ULL << slot;
     hinfo = &hiarr->hia_hinfos[ slot ];
     memset(hinfo, 0, sizeof(*hinfo));
     hinfo->qhi_same_stream_id = hinfo;
+    hinfo->qhi_stream_id = stream_id;
     TAILQ_INSERT_TAIL(&enc->qpe_all_hinfos, hinfo, qhi_next_all);
+    TAILQ_INSERT_TAIL(&enc->qpe_hinfo_buckets[
+                    HINFO_BUCKNO(enc->qpe_hinfo_nbits, stream_id)],
+                                                        hinfo, qhi_next_id);
+    ++enc->qpe_hinfo_nelem;
     return hinfo;
 }
 
@@ -341,12 +609,34 @@ enc_free_hinfo (struct lsqpack_enc *enc, struct lsqpack_header_info *hinfo)
             slot = hinfo - hiarr->hia_hinfos;
             hiarr->hia_slots &= ~(1ULL << slot);
             TAILQ_REMOVE(&enc->qpe_all_hinfos, &hiarr->hia_hinfos[slot], qhi_next_all);
+            TAILQ_REMOVE(&enc->qpe_hinfo_buckets[
+                    HINFO_BUCKNO(enc->qpe_hinfo_nbits, hinfo->qhi_stream_id)],
+                                                        hinfo, qhi_next_id);
+            --enc->qpe_hinfo_nelem;
             return;
         }
 
     assert(0);
 }
 
+
+/* Returns the oldest header info with this stream ID */
+static struct lsqpack_header_info *
+enc_find_hinfo (const struct lsqpack_enc *enc, uint64_t stream_id)
+{
+    struct lsqpack_header_info *hinfo;
+
+    if (!enc->qpe_hinfo_buckets)
+        return NULL;
+
+    TAILQ_FOREACH(hinfo, &enc->qpe_hinfo_buckets[
+                    HINFO_BUCKNO(enc->qpe_hinfo_nbits, stream_id)], qhi_next_id)
+        if (hinfo->qhi_stream_id == stream_id)
+            return hinfo;
+
+    return NULL;
+}
+
 static int
 enc_use_dynamic_table (const struct lsqpack_enc *enc)
 {
@@ -359,16 +649,85 @@ enc_use_dynamic_table (const struct lsqpack_enc *enc)
 enum he { HE_NAME, HE_NAMEVAL, N_HES };
 
 
+/* History elements form a ring.  To make membership tests constant-time,
+ * the valid elements are also chained into per-hash-type buckets, linked
+ * by index.
+ */
 struct lsqpack_hist_el {
     unsigned    he_hashes[N_HES];
+    unsigned    he_next[N_HES];
 };
 
+#define HIST_NIL (~0u)
+
+/* Buckets are allocated in a single array: all name buckets followed by
+ * all name/value buckets.
+ */
+static unsigned *
+qenc_hist_alloc_buckets (unsigned nels, unsigned *nbits_p)
+{
+    unsigned *buckets;
+    unsigned nbits;
+
+    for (nbits = 2; N_BUCKETS(nbits) < nels; ++nbits)
+        ;
+    buckets = malloc(sizeof(buckets[0]) * N_HES * N_BUCKETS(nbits));
+    if (buckets)
+    {
+        memset(buckets, 0xFF, sizeof(buckets[0]) * N_HES * N_BUCKETS(nbits));
+        *nbits_p = nbits;
+    }
+    return buckets;
+}
+
+
+static unsigned *
+qenc_hist_bucket (const struct lsqpack_enc *enc, enum he he, unsigned hash)
+{
+    return &enc->qpe_hist_buckets[ he * N_BUCKETS(enc->qpe_hist_nbits)
+                                        + BUCKNO(enc->qpe_hist_nbits, hash) ];
+}
+
+
+static void
+qenc_hist_link (struct lsqpack_enc *enc, unsigned idx)
+{
+    struct lsqpack_hist_el *const el = &enc->qpe_hist_els[ idx ];
+    unsigned *head;
+    enum he he;
+
+    for (he = 0; he < N_HES; ++he)
+    {
+        head = qenc_hist_bucket(enc, he, el->he_hashes[he]);
+        el->he_next[he] = *head;
+        *head = idx;
+    }
+}
+
+
+static void
+qenc_hist_unlink (struct lsqpack_enc *enc, unsigned idx)
+{
+    struct lsqpack_hist_el *const el = &enc->qpe_hist_els[ idx ];
+    unsigned *p;
+    enum he he;
+
+    for (he = 0; he < N_HES; ++he)
+    {
+        for (p = qenc_hist_bucket(enc, he, el->he_hashes[he]); *p != idx;
+                                    p = &enc->qpe_hist_els[ *p ].he_next[he])
+            assert(*p != HIST_NIL);
+        *p = el->he_next[he];
+    }
+}
+
 
 static void
 qenc_hist_update_size (struct lsqpack_enc *enc, unsigned new_size)
 {
     struct lsqpack_hist_el *els;
-    unsigned first, count, i, j;
+    unsigned *buckets;
+    unsigned first, count, i, j, nbits;
 
     if (new_size == enc->qpe_hist_nels)
         return;
@@ -378,12 +737,20 @@ qenc_hist_update_size (struct lsqpack_enc *enc, unsigned new_size)
         enc->qpe_hist_nels = 0;
         enc->qpe_hist_idx = 0;
         enc->qpe_hist_wrapped = 0;
+        memset(enc->qpe_hist_buckets, 0xFF, sizeof(enc->qpe_hist_buckets[0])
+                                    * N_HES * N_BUCKETS(enc->qpe_hist_nbits));
         return;
     }
 
-    els = malloc(sizeof(els[0]) * (new_size + 1));
+    els = malloc(sizeof(els[0]) * new_size);
     if (!els)
         return;
+    buckets = qenc_hist_alloc_buckets(new_size, &nbits);
+    if (!buckets)
+    {
+        free(els);
+        return;
+    }
 
     E_DEBUG("history size change from %u to %u", enc->qpe_hist_nels, new_size);
 
@@ -404,6 +771,12 @@ qenc_hist_update_size (struct lsqpack_enc *enc, unsigned new_size)
     enc->qpe_hist_wrapped = enc->qpe_hist_idx == 0;
     free(enc->qpe_hist_els);
     enc->qpe_hist_els = els;
+    free(enc->qpe_hist_buckets);
+    enc->qpe_hist_buckets = buckets;
+    enc->qpe_hist_nbits = nbits;
+    count = enc->qpe_hist_wrapped ? new_size : enc->qpe_hist_idx;
+    for (i = 0; i < count; ++i)
+        qenc_hist_link(enc, i);
 }
 
 
@@ -413,9 +786,12 @@ qenc_hist_add (struct lsqpack_enc *enc, unsigned name_hash,
 {
     if (enc->qpe_hist_nels)
     {
+        if (enc->qpe_hist_wrapped)
+            qenc_hist_unlink(enc, enc->qpe_hist_idx);
         enc->qpe_hist_els[ enc->qpe_hist_idx ].he_hashes[HE_NAME] = name_hash;
         enc->qpe_hist_els[ enc->qpe_hist_idx ].he_hashes[HE_NAMEVAL]
                                                                 = nameval_hash;
+        qenc_hist_link(enc, enc->qpe_hist_idx);
         enc->qpe_hist_idx = (enc->qpe_hist_idx + 1) % enc->qpe_hist_nels;
         enc->qpe_hist_wrapped |= enc->qpe_hist_idx == 0;
     }
@@ -425,25 +801,41 @@ qenc_hist_add (struct lsqpack_enc *enc, unsigned name_hash,
 static int
 qenc_hist_seen (struct lsqpack_enc *enc, enum he he, unsigned hash)
 {
-    const struct lsqpack_hist_el *el;
-    unsigned last_idx;
+    unsigned idx;
 
     if (enc->qpe_hist_els)
     {
-        if (enc->qpe_hist_wrapped)
-            last_idx = enc->qpe_hist_nels;
-        else
-            last_idx = enc->qpe_hist_idx;
-        enc->qpe_hist_els[ last_idx ].he_hashes[he] = hash;
-        for (el = enc->qpe_hist_els; el->he_hashes[he] != hash; ++el)
-            ;
-        return el < &enc->qpe_hist_els[ last_idx ];
+        for (idx = *qenc_hist_bucket(enc, he, hash); idx != HIST_NIL;
+                                idx = enc->qpe_hist_els[ idx ].he_next[he])
+            if (enc->qpe_hist_els[ idx ].he_hashes[he] == hash)
+            {
+                STATS_ADD(enc->qpe_stats, n_hist_hits, 1);
+                return 1;
+            }
+        STATS_ADD(enc->qpe_stats, n_hist_misses, 1);
+        return 0;
     }
     else
         return 1;
 }
 
 
+/* Return number of times the hash occurs in history */
+static unsigned
+qenc_hist_count (struct lsqpack_enc *enc, enum he he, unsigned hash)
+{
+    unsigned idx, count;
+
+    count = 0;
+    for (idx = *qenc_hist_bucket(enc, he, hash); idx != HIST_NIL;
+                                idx = enc->qpe_hist_els[ idx ].he_next[he])
+        count += enc->qpe_hist_els[ idx ].he_hashes[he] == hash;
+    STATS_ADD(enc->qpe_stats, n_hist_hits, count > 0);
+    STATS_ADD(enc->qpe_stats, n_hist_misses, count == 0);
+    return count;
+}
+
+
 unsigned char *
 lsqpack_enc_int (unsigned char *, unsigned char *const, uint64_t, unsigned);
 
@@ -510,22 +902,36 @@ lsqpack_enc_init (struct lsqpack_enc *enc, void *logger_ctx,
             dyn_table_size / DYNAMIC_ENTRY_OVERHEAD / 3,
             GUESS_N_HEADER_FIELDS
         );
-        enc->qpe_hist_els = malloc(sizeof(enc->qpe_hist_els[0]) * (enc->qpe_hist_nels + 1));
+        enc->qpe_hist_els = malloc(sizeof(enc->qpe_hist_els[0]) * enc->qpe_hist_nels);
         if (!enc->qpe_hist_els)
             return -1;
+        enc->qpe_hist_buckets = qenc_hist_alloc_buckets(enc->qpe_hist_nels,
+                                                        &enc->qpe_hist_nbits);
+        if (!enc->qpe_hist_buckets)
+        {
+            free(enc->qpe_hist_els);
+            return -1;
+        }
     }
     else
     {
         enc->qpe_hist_nels = 0;
         enc->qpe_hist_els = NULL;
+        enc->qpe_hist_buckets = NULL;
     }
 
     if (max_table_size / DYNAMIC_ENTRY_OVERHEAD)
     {
         nbits = 2;
+        /* Make sure qenc_grow_tables() is never called */
+        if (enc_opts & LSQPACK_ENC_OPT_RING_ARENA)
+            while (N_BUCKETS(nbits) / 2
+                                <= max_table_size / DYNAMIC_ENTRY_OVERHEAD)
+                ++nbits;
         buckets = malloc(sizeof(buckets[0]) * N_BUCKETS(nbits));
         if (!buckets)
         {
+            free(enc->qpe_hist_buckets);
             free(enc->qpe_hist_els);
             return -1;
         }
@@ -542,6 +948,28 @@ lsqpack_enc_init (struct lsqpack_enc *enc, void *logger_ctx,
         buckets = NULL;
     }
 
+    /* An entry takes up more room in the arena than the 32 bytes of
+     * overhead it is charged.  Double the size, as a new entry is allocated
+     * before old entries are evicted and the ring wastes some space when
+     * it wraps.
+     */
+    if ((enc_opts & LSQPACK_ENC_OPT_RING_ARENA) && buckets)
+    {
+        enc->qpe_arena.ra_size = 2 * ((size_t) max_table_size
+                    + max_table_size / DYNAMIC_ENTRY_OVERHEAD
+                        * (RING_ARENA_CHUNK_SIZE(
+                                sizeof(struct lsqpack_enc_table_entry))
+                                                - DYNAMIC_ENTRY_OVERHEAD));
+        enc->qpe_arena.ra_buf = malloc(enc->qpe_arena.ra_size);
+        if (!enc->qpe_arena.ra_buf)
+        {
+            free(buckets);
+            free(enc->qpe_hist_buckets);
+            free(enc->qpe_hist_els);
+            return -1;
+        }
+    }
+
     enc->qpe_max_entries  = max_table_size / DYNAMIC_ENTRY_OVERHEAD;
     enc->qpe_real_max_capacity = max_table_size;
     enc->qpe_cur_max_capacity = dyn_table_size;
@@ -553,6 +981,16 @@ lsqpack_enc_init (struct lsqpack_enc *enc, void *logger_ctx,
         enc->qpe_flags   |= LSQPACK_ENC_USE_DUP;
     if (enc_opts & LSQPACK_ENC_OPT_NO_MEM_GUARD)
         enc->qpe_flags   |= LSQPACK_ENC_NO_MEM_GUARD;
+    if (enc_opts & LSQPACK_ENC_OPT_COST_MODEL)
+        enc->qpe_flags   |= LSQPACK_ENC_COST_MODEL;
+    if (enc_opts & LSQPACK_ENC_OPT_SERVER)
+        enc->qpe_flags   |= LSQPACK_ENC_SERVER;
+    if (enc_opts & LSQPACK_ENC_OPT_ENC_QUEUE)
+        enc->qpe_flags   |= LSQPACK_ENC_QUEUE;
+    if (enc_opts & LSQPACK_ENC_OPT_HBLOCK_CACHE)
+        enc->qpe_flags   |= LSQPACK_ENC_HBLOCK_CACHE;
+    if (enc_opts & LSQPACK_ENC_OPT_CRUMBLE_COOKIES)
+        enc->qpe_flags   |= LSQPACK_ENC_CRUMBLE_COOKIES;
     E_DEBUG("initialized.  opts: 0x%X; max capacity: %u; max risked "
         "streams: %u.", enc_opts, enc->qpe_cur_max_capacity,
         enc->qpe_max_risked_streams);
@@ -566,12 +1004,14 @@ lsqpack_enc_cleanup (struct lsqpack_enc *enc)
 {
     struct lsqpack_enc_table_entry *entry, *next;
     struct lsqpack_header_info_arr *hiarr, *next_hiarr;
+    unsigned i;
 
     for (entry = STAILQ_FIRST(&enc->qpe_all_entries); entry; entry = next)
     {
         next = STAILQ_NEXT(entry, ete_next_all);
-        free(entry);
+        ring_arena_free(&enc->qpe_arena, entry);
     }
+    free(enc->qpe_arena.ra_buf);
 
     for (hiarr = STAILQ_FIRST(&enc->qpe_hinfo_arrs); hiarr; hiarr = next_hiarr)
     {
@@ -579,58 +1019,186 @@ lsqpack_enc_cleanup (struct lsqpack_enc *enc)
         free(hiarr);
     }
 
+    free(enc->qpe_hinfo_buckets);
     free(enc->qpe_buckets);
+    free(enc->qpe_hist_buckets);
     free(enc->qpe_hist_els);
+    free(enc->qpe_queue.eq_buf);
+    if (enc->qpe_hblock_cache)
+    {
+        for (i = 0; i < N_BUCKETS(LSQPACK_ENC_HBLOCK_CACHE_BITS); ++i)
+            free(enc->qpe_hblock_cache[i].eh_buf);
+        free(enc->qpe_hblock_cache);
+    }
     E_DEBUG("cleaned up");
 }
 
 
-#define LSQPACK_XXH_SEED 39378473
-#define XXH_NAME_WIDTH 9
-#define XXH_NAME_SHIFT 0
-#define XXH_NAMEVAL_WIDTH 9
-#define XXH_NAMEVAL_SHIFT 0
+#if LSQPACK_CRC32C
+/* Seed is used as initial CRC value; there is no final XOR. */
+static uint32_t
+qpack_crc32c (const void *buf, size_t len, uint32_t crc)
+{
+    const unsigned char *p = buf;
+    const unsigned char *const end = p + len;
+#if defined(__SSE4_2__) || defined(__ARM_FEATURE_CRC32)
+    uint64_t word;
+
+    for ( ; end - p >= 8; p += 8)
+    {
+        memcpy(&word, p, sizeof(word));
+#if defined(__SSE4_2__) && defined(__x86_64__)
+        crc = (uint32_t) _mm_crc32_u64(crc, word);
+#elif defined(__SSE4_2__)
+        crc = _mm_crc32_u32(crc, (uint32_t) word);
+        crc = _mm_crc32_u32(crc, (uint32_t) (word >> 32));
+#else
+        crc = __crc32cd(crc, word);
+#endif
+    }
+    for ( ; p < end; ++p)
+#if defined(__SSE4_2__)
+        crc = _mm_crc32_u8(crc, *p);
+#else
+        crc = __crc32cb(crc, *p);
+#endif
+#else
+    unsigned i;
+
+    for ( ; p < end; ++p)
+    {
+        crc ^= *p;
+        for (i = 0; i < 8; ++i)
+            crc = (crc >> 1) ^ (0x82F63B78u & -(crc & 1));
+    }
+#endif
+    return crc;
+}
+#define QPACK_HASH(buf_, len_, seed_) qpack_crc32c(buf_, len_, seed_)
+#else
+#define QPACK_HASH(buf_, len_, seed_) XXH32(buf_, len_, seed_)
+#endif
+
 
-static const unsigned char name2id_plus_one[ 1 << XXH_NAME_WIDTH ] =
+uint32_t
+lsqpack_hash (const void *buf, size_t len, uint32_t seed)
 {
-    [347]  =  1,   [397]  =  2,   [64]   =  3,   [144]  =  4,   [25]   =  5,
-    [216]  =  6,   [361]  =  7,   [442]  =  8,   [190]  =  9,   [404]  =  10,
-    [181]  =  11,  [210]  =  12,  [38]   =  13,  [51]   =  14,  [318]  =  15,
-    [484]  =  16,  [81]   =  23,  [83]   =  25,  [248]  =  30,  [169]  =  32,
-    [456]  =  33,  [479]  =  34,  [59]   =  36,  [498]  =  37,  [401]  =  43,
-    [453]  =  45,  [266]  =  56,  [88]   =  57,  [317]  =  60,  [74]   =  62,
-    [189]  =  63,  [211]  =  73,  [334]  =  74,  [365]  =  77,  [382]  =  80,
-    [377]  =  81,  [257]  =  82,  [56]   =  84,  [321]  =  85,  [79]   =  86,
-    [384]  =  87,  [357]  =  88,  [438]  =  89,  [84]   =  90,  [264]  =  91,
-    [146]  =  92,  [225]  =  93,  [490]  =  94,  [305]  =  95,  [362]  =  96,
-    [486]  =  97,  [497]  =  98,
+    return QPACK_HASH(buf, len, seed);
+}
+
+/* Generated by tools/gen-static-phash.pl */
+#define STATIC_NAME_BITS 7
+#define STATIC_NAMEVAL_BITS 7
+#define STATIC_NAME_HASH(str_, len_) ((len_) ? \
+    ((unsigned) (len_) * 7 \
+        + (unsigned char) (str_)[0] * 5 \
+        + (unsigned char) (str_)[(len_) - 1] * 15 \
+        + (unsigned char) (str_)[((len_) * 7) >> 3] * 2) : 0)
+#define STATIC_VAL_HASH(str_, len_) ((len_) ? \
+    ((unsigned) (len_) * 1 \
+        + (unsigned char) (str_)[0] * 1 \
+        + (unsigned char) (str_)[(len_) - 1] * 4 \
+        + (unsigned char) (str_)[((len_) * 3) >> 3] * 7) : 0)
+
+static const struct static_name_slot
+{
+    unsigned char   id_plus_one;
+    unsigned char   disp;
+} static_name_slots[ 1 << STATIC_NAME_BITS ] =
+{
+    [7] = { 73, 2, }, [8] = { 23, 2, }, [9] = { 94, 2, },
+    [13] = { 62, 0, }, [14] = { 45, 1, }, [16] = { 85, 4, },
+    [18] = { 56, 3, }, [22] = { 92, 0, }, [24] = { 63, 1, },
+    [29] = { 11, 22, }, [34] = { 13, 24, }, [35] = { 91, 25, },
+    [41] = { 84, 0, }, [45] = { 2, 0, }, [46] = { 34, 3, },
+    [47] = { 3, 1, }, [51] = { 32, 2, }, [53] = { 80, 0, },
+    [54] = { 77, 10, }, [55] = { 96, 29, }, [56] = { 4, 6, },
+    [60] = { 81, 4, }, [66] = { 15, 28, }, [67] = { 30, 0, },
+    [68] = { 43, 4, }, [69] = { 7, 9, }, [70] = { 10, 20, },
+    [71] = { 33, 1, }, [74] = { 88, 13, }, [75] = { 9, 18, },
+    [77] = { 97, 31, }, [78] = { 6, 8, }, [81] = { 5, 2, },
+    [83] = { 12, 23, }, [84] = { 74, 0, }, [86] = { 87, 18, },
+    [90] = { 98, 1, }, [99] = { 89, 17, }, [102] = { 36, 1, },
+    [103] = { 1, 1, }, [105] = { 57, 0, }, [108] = { 8, 11, },
+    [115] = { 60, 0, }, [116] = { 82, 2, }, [118] = { 25, 0, },
+    [119] = { 16, 0, }, [121] = { 86, 5, }, [122] = { 90, 21, },
+    [123] = { 93, 27, }, [124] = { 37, 2, }, [125] = { 14, 26, },
+    [127] = { 95, 24, },
+};
+
+static const unsigned char static_nameval_slots[ 1 << STATIC_NAMEVAL_BITS ] =
+{
+    [0] = 57, [1] = 1, [2] = 73, [3] = 33, [4] = 85, [5] = 44,
+    [6] = 4, [7] = 77, [8] = 6, [9] = 7, [10] = 53, [11] = 8,
+    [12] = 61, [13] = 88, [14] = 39, [15] = 38, [16] = 98, [17] = 89,
+    [18] = 9, [19] = 80, [20] = 10, [21] = 90, [22] = 11, [23] = 12,
+    [24] = 13, [25] = 91, [26] = 14, [27] = 93, [28] = 15, [29] = 96,
+    [30] = 30, [31] = 97, [36] = 84, [38] = 74, [39] = 46, [42] = 75,
+    [44] = 58, [49] = 41, [50] = 62, [53] = 2, [56] = 60, [60] = 16,
+    [63] = 19, [65] = 40, [66] = 3, [67] = 5, [68] = 64, [69] = 26,
+    [70] = 59, [71] = 68, [72] = 72, [73] = 35, [74] = 81, [77] = 21,
+    [78] = 67, [79] = 83, [80] = 25, [81] = 47, [82] = 86, [83] = 69,
+    [84] = 29, [85] = 65, [86] = 27, [87] = 28, [88] = 78, [89] = 70,
+    [90] = 23, [91] = 48, [92] = 49, [93] = 66, [94] = 43, [95] = 87,
+    [96] = 51, [97] = 50, [98] = 92, [99] = 54, [100] = 56, [101] = 95,
+    [102] = 34, [103] = 24, [105] = 71, [107] = 31, [108] = 45, [110] = 20,
+    [111] = 55, [113] = 42, [114] = 17, [115] = 37, [116] = 63, [117] = 52,
+    [118] = 22, [120] = 79, [121] = 99, [122] = 36, [123] = 94, [124] = 76,
+    [125] = 18, [126] = 32, [127] = 82,
 };
 
-static const unsigned char nameval2id_plus_one[ 1 << XXH_NAMEVAL_WIDTH ] =
-{
-    [150]  =  1,   [502]  =  2,   [353]  =  3,   [262]  =  4,   [443]  =  5,
-    [164]  =  6,   [463]  =  7,   [84]   =  8,   [205]  =  9,   [228]  =  10,
-    [451]  =  11,  [444]  =  12,  [176]  =  13,  [75]   =  14,  [399]  =  15,
-    [56]   =  16,  [384]  =  17,  [21]   =  18,  [484]  =  19,  [382]  =  20,
-    [439]  =  21,  [329]  =  22,  [360]  =  23,  [67]   =  24,  [105]  =  25,
-    [342]  =  26,  [457]  =  27,  [161]  =  28,  [337]  =  29,  [135]  =  30,
-    [314]  =  31,  [370]  =  32,  [404]  =  33,  [184]  =  34,  [156]  =  35,
-    [139]  =  36,  [339]  =  37,  [508]  =  38,  [267]  =  39,  [375]  =  40,
-    [122]  =  41,  [297]  =  42,  [144]  =  43,  [85]   =  44,  [466]  =  45,
-    [38]   =  46,  [320]  =  47,  [273]  =  48,  [277]  =  49,  [136]  =  50,
-    [454]  =  51,  [477]  =  52,  [91]   =  53,  [227]  =  54,  [301]  =  55,
-    [272]  =  56,  [319]  =  57,  [142]  =  58,  [268]  =  59,  [65]   =  60,
-    [410]  =  61,  [4]    =  62,  [373]  =  63,  [1]    =  64,  [210]  =  65,
-    [224]  =  66,  [423]  =  67,  [222]  =  68,  [386]  =  69,  [12]   =  70,
-    [7]    =  71,  [391]  =  72,  [73]   =  73,  [307]  =  74,  [27]   =  75,
-    [256]  =  76,  [154]  =  77,  [204]  =  78,  [310]  =  79,  [198]  =  80,
-    [162]  =  81,  [334]  =  82,  [438]  =  83,  [69]   =  84,  [188]  =  85,
-    [244]  =  86,  [190]  =  87,  [465]  =  88,  [468]  =  89,  [417]  =  90,
-    [110]  =  91,  [107]  =  92,  [368]  =  93,  [460]  =  94,  [54]   =  95,
-    [492]  =  96,  [402]  =  97,  [196]  =  98,  [383]  =  99,
+#if LSQPACK_CRC32C
+/* Generated by tools/gen-enums.pl crc32c */
+static const uint32_t name_hashes[] =
+{
+    0xD9D96645u, 0x41EA193Au, 0x45C408C9u, 0x4FCE04FEu, 0xDB25E4E6u,
+    0xB1DABEFEu, 0xB4FCBAD4u, 0xA152235Fu, 0xB8E804BAu, 0xE5D1B5CAu,
+    0x718A097Fu, 0x53055A07u, 0xC46BEA4Eu, 0xED7CD631u, 0x3E1DDB5Au,
+    0x4EC05DE5u, 0x4EC05DE5u, 0x4EC05DE5u, 0x4EC05DE5u, 0x4EC05DE5u,
+    0x4EC05DE5u, 0x4EC05DE5u, 0xA536DBFCu, 0xA536DBFCu, 0xE8AE807Fu,
+    0xE8AE807Fu, 0xE8AE807Fu, 0xE8AE807Fu, 0xE8AE807Fu, 0x78B4DFF9u,
+    0x78B4DFF9u, 0x9476EA87u, 0xDC541B51u, 0x4BE76CC0u, 0x4BE76CC0u,
+    0x8B3EBC2Du, 0x75BDBF53u, 0x75BDBF53u, 0x75BDBF53u, 0x75BDBF53u,
+    0x75BDBF53u, 0x75BDBF53u, 0xBEDFB7BDu, 0xBEDFB7BDu, 0x7288E7BCu,
+    0x7288E7BCu, 0x7288E7BCu, 0x7288E7BCu, 0x7288E7BCu, 0x7288E7BCu,
+    0x7288E7BCu, 0x7288E7BCu, 0x7288E7BCu, 0x7288E7BCu, 0x7288E7BCu,
+    0x7F562CE7u, 0x34EAC3B3u, 0x34EAC3B3u, 0x34EAC3B3u, 0xD62D71E5u,
+    0xD62D71E5u, 0xC4641B71u, 0xC2914318u, 0xE8AE807Fu, 0xE8AE807Fu,
+    0xE8AE807Fu, 0xE8AE807Fu, 0xE8AE807Fu, 0xE8AE807Fu, 0xE8AE807Fu,
+    0xE8AE807Fu, 0xE8AE807Fu, 0x57E09F38u, 0xC7881D37u, 0xC7881D37u,
+    0x4BE76CC0u, 0x7D20AB78u, 0x7D20AB78u, 0x7D20AB78u, 0x7D0BB525u,
+    0xB91A5525u, 0x1697FF4Eu, 0x1697FF4Eu, 0xA8A02749u, 0x21E57354u,
+    0x49736D15u, 0x9B558F56u, 0x29295445u, 0x12ACEAA4u, 0x7560E764u,
+    0x0A7B095Eu, 0x3CE03C96u, 0x19B26752u, 0x6C41B74Cu, 0xAE201A10u,
+    0x658CF85Au, 0x9B3110AEu, 0xF148A976u, 0xF148A976u,
 };
 
 
+static const uint32_t nameval_hashes[] =
+{
+    0xD9D96645u, 0x25EE396Au, 0x8B9970B1u, 0x4FCE04FEu, 0xF5A923A7u,
+    0xB1DABEFEu, 0xB4FCBAD4u, 0xA152235Fu, 0xB8E804BAu, 0xE5D1B5CAu,
+    0x718A097Fu, 0x53055A07u, 0xC46BEA4Eu, 0xED7CD631u, 0x3E1DDB5Au,
+    0x3C44AB3Cu, 0xCBE29A65u, 0xD2EF8725u, 0x1ED62CE0u, 0xB16578D2u,
+    0x7E1694F3u, 0xE9786F47u, 0xD8549C57u, 0xE7FF4D5Du, 0xB888105Du,
+    0x41F623DAu, 0x232D26BBu, 0x57DD42D2u, 0x2656B447u, 0xAC842755u,
+    0x5F6530D9u, 0x0DA9BB66u, 0xA9EAE3C5u, 0xA33F4A00u, 0x31C1B259u,
+    0xD4415A57u, 0x7F688A99u, 0xD99A4975u, 0x20AFF684u, 0x57D9D8ECu,
+    0xB4E30B41u, 0xB079536Bu, 0x2A144B86u, 0xAB7AB812u, 0x8D84004Fu,
+    0x98C61B5Du, 0xADF4F456u, 0x7DB80948u, 0x1227306Fu, 0x03BDFEFAu,
+    0x9E7363CAu, 0x93D90A70u, 0x4B4C0F43u, 0xE9D3A95Bu, 0x1F928B69u,
+    0xA9065366u, 0x6A3401F4u, 0x399320D9u, 0x7ABF390Du, 0x373AB2CDu,
+    0x4321E0C5u, 0xC86DD8DFu, 0xB0FF0783u, 0xABD8E3A9u, 0x866CB4C5u,
+    0x6757C432u, 0x058CC153u, 0x9047D5CDu, 0x83172639u, 0x45696620u,
+    0x82F3F13Fu, 0x350647B3u, 0x57E09F38u, 0x78F45DCDu, 0x0D85A4C0u,
+    0x8899674Eu, 0x5AB3C4E0u, 0xBA1F7850u, 0xB17B41FEu, 0x00138B58u,
+    0xF8D716C4u, 0xF263F479u, 0x42ED835Du, 0xFC315690u, 0x21E57354u,
+    0x7D4791D9u, 0xB597A206u, 0x29295445u, 0x12ACEAA4u, 0x7560E764u,
+    0x0A7B095Eu, 0xD03E26C0u, 0x19B26752u, 0x470B353Du, 0xD2782DC7u,
+    0x658CF85Au, 0x9B3110AEu, 0xA2A52E7Eu, 0xF6976C3Fu,
+};
+#else
+/* Generated by tools/gen-enums.pl xxh32 */
 static const uint32_t name_hashes[] =
 {
     0x653A915Bu, 0x3513518Du, 0xBEC8E440u, 0x16020A90u, 0x48F5CC19u,
@@ -679,18 +1247,24 @@ static const uint32_t nameval_hashes[] =
     0xA60BF66Eu, 0x46201E6Bu, 0xB2DE5570u, 0xF19F5DCCu, 0x73B6C636u,
     0xDC83E7ECu, 0xAA333392u, 0x4EDB46C4u, 0xF64F937Fu,
 };
+#endif
 
 
 /* -1 means not found */
 static int
-find_in_static_full (uint32_t nameval_hash, const char *name,
-                        unsigned name_len, const char *val, unsigned val_len)
+find_in_static_full (const char *name, unsigned name_len, const char *val,
+                                                            unsigned val_len)
 {
+    const struct static_name_slot *slot;
     unsigned id;
 
-    id = nameval2id_plus_one[ (nameval_hash >> XXH_NAMEVAL_SHIFT)
-                                    & ((1 << XXH_NAMEVAL_WIDTH) - 1) ];
+    slot = &static_name_slots[ STATIC_NAME_HASH(name, name_len)
+                                        & ((1 << STATIC_NAME_BITS) - 1) ];
+    if (slot->id_plus_one == 0)
+        return -1;
 
+    id = static_nameval_slots[ (STATIC_VAL_HASH(val, val_len) + slot->disp)
+                                        & ((1 << STATIC_NAMEVAL_BITS) - 1) ];
     if (id == 0)
         return -1;
 
@@ -709,13 +1283,12 @@ find_in_static_full (uint32_t nameval_hash, const char *name,
 static
 #endif
 int
-lsqpack_find_in_static_headers (uint32_t name_hash, const char *name,
-                                                            unsigned name_len)
+lsqpack_find_in_static_headers (const char *name, unsigned name_len)
 {
     unsigned id;
 
-    id = name2id_plus_one[ (name_hash >> XXH_NAME_SHIFT)
-                                    & ((1 << XXH_NAME_WIDTH) - 1) ];
+    id = static_name_slots[ STATIC_NAME_HASH(name, name_len)
+                                & ((1 << STATIC_NAME_BITS) - 1) ].id_plus_one;
 
     if (id == 0)
         return -1;
@@ -728,6 +1301,19 @@ lsqpack_find_in_static_headers (uint32_t name_hash, const char *name,
         return -1;
 }
 
+/* When there is enough room in the buffer, up to eight continuation bytes
+ * of an integer are encoded or decoded using a single eight-byte store or
+ * load.  The resumable byte-by-byte code is used at buffer ends.
+ */
+#ifndef LSQPACK_FAST_INT
+#if __GNUC__ && defined(__BYTE_ORDER__) \
+                            && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LSQPACK_FAST_INT 1
+#else
+#define LSQPACK_FAST_INT 0
+#endif
+#endif
+
 
 static unsigned
 lsqpack_val2len (uint64_t value, unsigned prefix_bits)
@@ -748,6 +1334,35 @@ lsqpack_val2len (uint64_t value, unsigned prefix_bits)
 }
 
 
+#if LSQPACK_FAST_INT
+/* Write continuation bytes of `value', which must be smaller than 2^56.
+ * Eight bytes must be available at `dst'.
+ */
+static unsigned char *
+lsqpack_enc_int_cont_fast (unsigned char *dst, uint64_t value)
+{
+    uint64_t x;
+    unsigned len;
+
+    /* Number of 7-bit groups */
+    len = (64 - __builtin_clzll(value | 1) + 6) / 7;
+
+    /* Spread 7-bit groups into bytes: 28 bits per half, 14 bits per
+     * quarter, and 7 bits per byte.
+     */
+    x = ((value & 0x00FFFFFFF0000000ull) << 4)
+                                    | (value & 0x000000000FFFFFFFull);
+    x = ((x & 0x0FFFC0000FFFC000ull) << 2) | (x & 0x00003FFF00003FFFull);
+    x = ((x & 0x3F803F803F803F80ull) << 1) | (x & 0x007F007F007F007Full);
+    /* Set continuation bit in all bytes but the last */
+    x |= 0x8080808080808080ull & ((1ull << (8 * len - 8)) - 1);
+
+    memcpy(dst, &x, sizeof(x));
+    return dst + len;
+}
+#endif
+
+
 unsigned char *
 lsqpack_enc_int (unsigned char *dst, unsigned char *const end, uint64_t value,
                                                         unsigned prefix_bits)
@@ -762,6 +1377,10 @@ lsqpack_enc_int (unsigned char *dst, unsigned char *const end, uint64_t value,
     {
         *dst++ |= (1 << prefix_bits) - 1;
         value -= (1 << prefix_bits) - 1;
+#if LSQPACK_FAST_INT
+        if (value < (1ull << 56) && end - dst >= 8)
+            return lsqpack_enc_int_cont_fast(dst, value);
+#endif
         while (value >= 128)
         {
             if (dst < end)
@@ -801,9 +1420,13 @@ lsqpack_enc_int_nocheck (unsigned char *dst, uint64_t value,
 }
 
 
-int
-lsqpack_enc_enc_str (unsigned prefix_bits, unsigned char *const dst,
-        size_t dst_len, const unsigned char *str, unsigned str_len)
+/* Same as lsqpack_enc_enc_str(), but tallies string bytes saved by Huffman
+ * coding in `huff_saved'.
+ */
+static int
+qenc_enc_str (unsigned *huff_saved, unsigned prefix_bits,
+        unsigned char *const dst, size_t dst_len, const unsigned char *str,
+        unsigned str_len)
 {
     unsigned char *p;
     unsigned enc_size_bytes, len_size;
@@ -815,6 +1438,7 @@ lsqpack_enc_enc_str (unsigned prefix_bits, unsigned char *const dst,
         len_size = lsqpack_val2len(enc_size_bytes, prefix_bits);
         if (len_size + enc_size_bytes <= dst_len)
         {
+            *huff_saved += str_len - enc_size_bytes;
             *dst &= ~((1 << (prefix_bits + 1)) - 1);
             *dst |= 1 << prefix_bits;
             lsqpack_enc_int_nocheck(dst, enc_size_bytes, prefix_bits);
@@ -827,6 +1451,7 @@ lsqpack_enc_enc_str (unsigned prefix_bits, unsigned char *const dst,
     }
     else
     {
+        TRACE2(enc_huff_fallback, str_len, enc_size_bytes);
         len_size = lsqpack_val2len(str_len, prefix_bits);
         if (len_size + str_len <= dst_len)
         {
@@ -841,6 +1466,36 @@ lsqpack_enc_enc_str (unsigned prefix_bits, unsigned char *const dst,
 }
 
 
+int
+lsqpack_enc_enc_str (unsigned prefix_bits, unsigned char *const dst,
+        size_t dst_len, const unsigned char *str, unsigned str_len)
+{
+    unsigned huff_saved;
+
+    return qenc_enc_str(&huff_saved, prefix_bits, dst, dst_len, str, str_len);
+}
+
+
+/* Write string that is already Huffman-encoded, such as a value passed to
+ * the application in LSQPACK_DEC_OPT_LAZY_VALUES mode.
+ */
+static int
+qenc_enc_huff_str (unsigned prefix_bits, unsigned char *const dst,
+                    size_t dst_len, const unsigned char *str, unsigned str_len)
+{
+    unsigned len_size;
+
+    len_size = lsqpack_val2len(str_len, prefix_bits);
+    if (len_size + str_len > dst_len)
+        return -1;
+    *dst &= ~((1 << (prefix_bits + 1)) - 1);
+    *dst |= 1 << prefix_bits;
+    lsqpack_enc_int_nocheck(dst, str_len, prefix_bits);
+    memcpy(dst + len_size, str, str_len);
+    return len_size + str_len;
+}
+
+
 static void
 qenc_drop_oldest_entry (struct lsqpack_enc *enc)
 {
@@ -853,6 +1508,7 @@ qenc_drop_oldest_entry (struct lsqpack_enc *enc)
         entry->ete_id, (int) entry->ete_name_len, ETE_NAME(entry),
         (int) entry->ete_val_len, ETE_VALUE(entry), enc->qpe_nelem - 1,
         enc->qpe_cur_bytes_used - ETE_SIZE(entry));
+    TRACE3(enc_evict, enc, entry->ete_id, ETE_SIZE(entry));
     STAILQ_REMOVE_HEAD(&enc->qpe_all_entries, ete_next_all);
     buckno = BUCKNO(enc->qpe_nbits, entry->ete_nameval_hash);
     assert(entry == STAILQ_FIRST(&enc->qpe_buckets[buckno].by_nameval));
@@ -864,7 +1520,8 @@ qenc_drop_oldest_entry (struct lsqpack_enc *enc)
     enc->qpe_dropped += ETE_SIZE(entry);
     enc->qpe_cur_bytes_used -= ETE_SIZE(entry);
     --enc->qpe_nelem;
-    free(entry);
+    STATS_ADD(enc->qpe_stats, n_evictions, 1);
+    ring_arena_free(&enc->qpe_arena, entry);
 }
 
 
@@ -1000,13 +1657,32 @@ qenc_grow_tables (struct lsqpack_enc *enc)
 }
 
 
-static struct lsqpack_enc_table_entry *
-lsqpack_enc_push_entry (struct lsqpack_enc *enc, uint32_t name_hash,
-                uint32_t nameval_hash, const char *name, unsigned name_len,
-                const char *value, unsigned value_len)
+/* Place new entry at the head of the table and into the hash buckets */
+static void
+qenc_link_entry (struct lsqpack_enc *enc,
+                                        struct lsqpack_enc_table_entry *entry)
 {
-    struct lsqpack_enc_table_entry *entry;
     unsigned buckno;
+
+    STAILQ_INSERT_TAIL(&enc->qpe_all_entries, entry, ete_next_all);
+    buckno = BUCKNO(enc->qpe_nbits, entry->ete_nameval_hash);
+    STAILQ_INSERT_TAIL(&enc->qpe_buckets[buckno].by_nameval, entry,
+                                                        ete_next_nameval);
+    buckno = BUCKNO(enc->qpe_nbits, entry->ete_name_hash);
+    STAILQ_INSERT_TAIL(&enc->qpe_buckets[buckno].by_name, entry,
+                                                        ete_next_name);
+
+    enc->qpe_cur_bytes_used += ETE_SIZE(entry);
+    ++enc->qpe_nelem;
+}
+
+
+static struct lsqpack_enc_table_entry *
+lsqpack_enc_push_entry (struct lsqpack_enc *enc, uint32_t name_hash,
+                uint32_t nameval_hash, const char *name, unsigned name_len,
+                const char *value, unsigned value_len)
+{
+    struct lsqpack_enc_table_entry *entry;
     size_t size;
 
     if (enc->qpe_nelem >= N_BUCKETS(enc->qpe_nbits) / 2 &&
@@ -1014,7 +1690,7 @@ lsqpack_enc_push_entry (struct lsqpack_enc *enc, uint32_t name_hash,
         return NULL;
 
     size = sizeof(*entry) + name_len + value_len;
-    entry = malloc(size);
+    entry = ring_arena_alloc(&enc->qpe_arena, size);
     if (!entry)
         return NULL;
 
@@ -1027,25 +1703,24 @@ lsqpack_enc_push_entry (struct lsqpack_enc *enc, uint32_t name_hash,
     entry->ete_id = 1 + enc->qpe_ins_count++;
     memcpy(ETE_NAME(entry), name, name_len);
     memcpy(ETE_VALUE(entry), value, value_len);
-
-    STAILQ_INSERT_TAIL(&enc->qpe_all_entries, entry, ete_next_all);
-    buckno = BUCKNO(enc->qpe_nbits, nameval_hash);
-    STAILQ_INSERT_TAIL(&enc->qpe_buckets[buckno].by_nameval, entry,
-                                                        ete_next_nameval);
-    buckno = BUCKNO(enc->qpe_nbits, name_hash);
-    STAILQ_INSERT_TAIL(&enc->qpe_buckets[buckno].by_name, entry,
-                                                        ete_next_name);
-
-    enc->qpe_cur_bytes_used += ENTRY_COST(name_len, value_len);
-    ++enc->qpe_nelem;
+    qenc_link_entry(enc, entry);
     E_DEBUG("pushed entry %u (`%.*s': `%.*s'), nelem: %u; capacity: %u",
         entry->ete_id, (int) entry->ete_name_len, ETE_NAME(entry),
         (int) entry->ete_val_len, ETE_VALUE(entry), enc->qpe_nelem,
         enc->qpe_cur_bytes_used);
+    TRACE4(enc_insert, enc, entry->ete_id, name_len, value_len);
     return entry;
 }
 
 
+static int
+qenc_hinfo_at_risk (const struct lsqpack_enc *enc,
+                                    const struct lsqpack_header_info *hinfo)
+{
+    return hinfo->qhi_max_id > enc->qpe_max_acked_id;
+}
+
+
 int
 lsqpack_enc_start_header (struct lsqpack_enc *enc, uint64_t stream_id,
                             unsigned seqno)
@@ -1056,13 +1731,11 @@ lsqpack_enc_start_header (struct lsqpack_enc *enc, uint64_t stream_id,
         return -1;
 
     E_DEBUG("Start header for stream %"PRIu64, stream_id);
+    TRACE3(enc_header_begin, enc, stream_id, seqno);
 
-    enc->qpe_cur_header.hinfo = enc_alloc_hinfo(enc);
+    enc->qpe_cur_header.hinfo = enc_alloc_hinfo(enc, stream_id);
     if (enc->qpe_cur_header.hinfo)
-    {
-        enc->qpe_cur_header.hinfo->qhi_stream_id = stream_id;
-        enc->qpe_cur_header.hinfo->qhi_seqno     = seqno;
-    }
+        enc->qpe_cur_header.hinfo->qhi_seqno = seqno;
     else
         E_INFO("could not allocate hinfo for stream %"PRIu64, stream_id);
     enc->qpe_cur_header.flags = 0;
@@ -1071,11 +1744,15 @@ lsqpack_enc_start_header (struct lsqpack_enc *enc, uint64_t stream_id,
     enc->qpe_cur_header.base_idx = enc->qpe_ins_count;
 
     /* Check if there are other header blocks with the same stream ID that
-     * are at risk.
+     * are at risk.  They are in the same hash bucket as the new header info.
+     * Since the acknowledged ID only grows, a header block that is at risk
+     * now has been at risk since it ended and is on the risked list.
      */
     if (seqno && enc->qpe_cur_header.hinfo)
-        TAILQ_FOREACH(hinfo, &enc->qpe_risked_hinfos, qhi_next_risked)
-            if (hinfo->qhi_stream_id == stream_id)
+        TAILQ_FOREACH(hinfo, &enc->qpe_hinfo_buckets[
+                    HINFO_BUCKNO(enc->qpe_hinfo_nbits, stream_id)], qhi_next_id)
+            if (hinfo->qhi_stream_id == stream_id
+                                        && qenc_hinfo_at_risk(enc, hinfo))
             {
                 enc->qpe_cur_header.other_at_risk = hinfo;
                 break;
@@ -1137,14 +1814,37 @@ lsqpack_enc_cancel_header (struct lsqpack_enc *enc)
 }
 
 
+/* The risked list is ordered by qhi_max_id, so that when the acknowledged
+ * ID advances, only the header blocks that are no longer at risk -- those
+ * at the head of the list -- are looked at.  A new header block usually
+ * references the newest entries, which is why the search starts at the tail.
+ */
+static void
+qenc_insert_risked (struct lsqpack_enc *enc, struct lsqpack_header_info *hinfo)
+{
+    struct lsqpack_header_info *prev;
+
+    for (prev = TAILQ_LAST(&enc->qpe_risked_hinfos, lsqpack_hinfo_head);
+            prev && prev->qhi_max_id > hinfo->qhi_max_id;
+                prev = TAILQ_PREV(prev, lsqpack_hinfo_head, qhi_next_risked))
+        ;
+    if (prev)
+        TAILQ_INSERT_AFTER(&enc->qpe_risked_hinfos, prev, hinfo,
+                                                            qhi_next_risked);
+    else
+        TAILQ_INSERT_HEAD(&enc->qpe_risked_hinfos, hinfo, qhi_next_risked);
+}
+
+
 static void
 qenc_add_to_risked_list (struct lsqpack_enc *enc,
                                             struct lsqpack_header_info *hinfo)
 {
-    TAILQ_INSERT_TAIL(&enc->qpe_risked_hinfos, hinfo, qhi_next_risked);
+    qenc_insert_risked(enc, hinfo);
     if (enc->qpe_cur_header.other_at_risk)
     {
-        hinfo->qhi_same_stream_id = enc->qpe_cur_header.other_at_risk;
+        hinfo->qhi_same_stream_id
+                    = enc->qpe_cur_header.other_at_risk->qhi_same_stream_id;
         enc->qpe_cur_header.other_at_risk->qhi_same_stream_id = hinfo;
     }
     else
@@ -1171,7 +1871,8 @@ qenc_remove_from_risked_list (struct lsqpack_enc *enc,
     else
     {
         for (prev = hinfo->qhi_same_stream_id;
-                                    prev->qhi_same_stream_id != hinfo; ++prev)
+                                    prev->qhi_same_stream_id != hinfo;
+                                        prev = prev->qhi_same_stream_id)
             ;
         prev->qhi_same_stream_id = hinfo->qhi_same_stream_id;
         hinfo->qhi_same_stream_id = hinfo;
@@ -1179,14 +1880,6 @@ qenc_remove_from_risked_list (struct lsqpack_enc *enc,
 }
 
 
-static int
-qenc_hinfo_at_risk (const struct lsqpack_enc *enc,
-                                    const struct lsqpack_header_info *hinfo)
-{
-    return hinfo->qhi_max_id > enc->qpe_max_acked_id;
-}
-
-
 ssize_t
 lsqpack_enc_end_header (struct lsqpack_enc *enc, unsigned char *buf, size_t sz,
         enum lsqpack_enc_header_flags *header_flags)
@@ -1203,6 +1896,10 @@ lsqpack_enc_end_header (struct lsqpack_enc *enc, unsigned char *buf, size_t sz,
     if (!(enc->qpe_flags & LSQPACK_ENC_HEADER))
         return -1;
 
+    if ((enc->qpe_flags & LSQPACK_ENC_COST_MODEL) && enc->qpe_cur_header.hinfo)
+        update_ema(&enc->qpe_ins_bytes_ema,
+                            enc->qpe_cur_header.hinfo->qhi_bytes_inserted);
+
     if (enc->qpe_hist_els)
     {
         qenc_sample_header_count(enc);
@@ -1263,8 +1960,12 @@ lsqpack_enc_end_header (struct lsqpack_enc *enc, unsigned char *buf, size_t sz,
             "risked: %d", hinfo->qhi_stream_id, hinfo->qhi_max_id,
             encoded_largest_ref, qenc_hinfo_at_risk(enc, hinfo));
 
+        TRACE3(enc_header_end, enc, hinfo->qhi_max_id,
+                                            qenc_hinfo_at_risk(enc, hinfo));
         enc->qpe_cur_header.hinfo = NULL;
         enc->qpe_flags &= ~LSQPACK_ENC_HEADER;
+        if (qenc_hinfo_at_risk(enc, hinfo))
+            STATS_ADD(enc->qpe_stats, n_at_risk_hblocks, 1);
         if (header_flags)
         {
             *header_flags = enc->qpe_cur_header.flags;
@@ -1286,6 +1987,7 @@ lsqpack_enc_end_header (struct lsqpack_enc *enc, unsigned char *buf, size_t sz,
         }
         else
             E_DEBUG("ended header; hinfo absent");
+        TRACE3(enc_header_end, enc, 0, 0);
         enc->qpe_flags &= ~LSQPACK_ENC_HEADER;
         if (header_flags)
             *header_flags = enc->qpe_cur_header.flags;
@@ -1505,6 +2207,129 @@ qenc_can_risk (const struct lsqpack_enc *enc)
 }
 
 
+enum ins_kind
+{
+    IK_NAMEREF_STATIC,
+    IK_NAMEREF_DYNAMIC,
+    IK_LIT,
+    IK_LIT_NAME,
+    IK_DUP,
+};
+
+
+/* The cost model used with LSQPACK_ENC_OPT_COST_MODEL.  Inserting a field
+ * costs encoder stream bytes now and pays off each time the entry is
+ * referenced before it is evicted.  The number of future references is
+ * estimated from the field's frequency in history and the eviction horizon:
+ * the number of fields encoded before the table cycles through at the
+ * current insertion rate.
+ *
+ * Encoder stream bytes are weighed more heavily than header block bytes,
+ * as they may block other streams.  Servers weigh them more still: response
+ * headers have more one-off values than request headers.
+ */
+static int
+qenc_insert_pays_off (struct lsqpack_enc *enc, enum ins_kind kind,
+        unsigned name_hash, unsigned nameval_hash, const char *name,
+        unsigned name_len, const char *value, unsigned value_len, int risk)
+{
+    unsigned count, hist_len, name_sz, val_sz, ins_cost, lit_cost, ref_cost,
+             entry_size;
+    float freq, horizon, uses, weight, savings;
+
+    if (!enc->qpe_hist_els)
+        return 1;
+
+    if (kind == IK_LIT_NAME)
+    {
+        /* If the whole field repeats but was not worth inserting, an entry
+         * with just the name, which takes up almost as much room, is not
+         * worth it either.
+         */
+        if (qenc_hist_count(enc, HE_NAMEVAL, nameval_hash))
+            return 0;
+        count = qenc_hist_count(enc, HE_NAME, name_hash);
+    }
+    else
+        count = qenc_hist_count(enc, HE_NAMEVAL, nameval_hash);
+    if (count == 0)
+        return 0;
+
+    name_sz = qenc_enc_str_size((const unsigned char *) name, name_len);
+    val_sz = kind == IK_LIT_NAME ? 1
+            : qenc_enc_str_size((const unsigned char *) value, value_len);
+    ref_cost = 1 + (enc->qpe_nelem >= 15);
+    switch (kind)
+    {
+    case IK_NAMEREF_STATIC:
+    case IK_NAMEREF_DYNAMIC:
+        ins_cost = 2 + val_sz;
+        lit_cost = 2 + val_sz;
+        break;
+    case IK_LIT:
+        ins_cost = 1 + name_sz + val_sz;
+        lit_cost = 1 + name_sz + val_sz;
+        break;
+    case IK_LIT_NAME:
+        /* Only the name is saved: the value is still a literal */
+        ins_cost = 1 + name_sz + val_sz;
+        lit_cost = 1 + name_sz;
+        break;
+    default:
+        assert(kind == IK_DUP);
+        ins_cost = 2;
+        lit_cost = 1 + name_sz + val_sz;
+        break;
+    }
+    if (lit_cost <= ref_cost)
+        return 0;
+
+    entry_size = ENTRY_COST(name_len, kind == IK_LIT_NAME ? 0 : value_len);
+    if (entry_size >= enc->qpe_cur_max_capacity)
+        return 0;
+
+    hist_len = enc->qpe_hist_wrapped ? enc->qpe_hist_nels : enc->qpe_hist_idx;
+    freq = (float) count / (float) (hist_len ? hist_len : 1);
+    if (enc->qpe_ins_bytes_ema > 0)
+        horizon = (float) (enc->qpe_cur_max_capacity - entry_size)
+                / enc->qpe_ins_bytes_ema * enc->qpe_header_count_ema;
+    else
+        horizon = (float) enc->qpe_hist_nels * COST_MAX_HORIZON;
+    if (horizon > (float) enc->qpe_hist_nels * COST_MAX_HORIZON)
+        horizon = (float) enc->qpe_hist_nels * COST_MAX_HORIZON;
+    uses = freq * horizon;
+    /* An entry that cannot be risked is not usable until acknowledged,
+     * which takes about a header list's worth of fields.
+     */
+    if (!risk)
+        uses -= freq * enc->qpe_header_count_ema;
+    else if (kind != IK_DUP)
+        uses += 1;
+
+    weight = enc->qpe_flags & LSQPACK_ENC_SERVER ? 2.0f : 1.5f;
+    savings = uses * (float) (lit_cost - ref_cost);
+    E_DEBUG("cost model: count: %u; uses: %.2f; savings: %.1f; cost: %.1f",
+                                count, uses, savings, weight * ins_cost);
+    return savings > weight * (float) ins_cost;
+}
+
+
+/* Without the cost model, a field is inserted if it was seen before */
+static int
+qenc_should_insert (struct lsqpack_enc *enc, enum ins_kind kind,
+        unsigned name_hash, unsigned nameval_hash, const char *name,
+        unsigned name_len, const char *value, unsigned value_len, int risk)
+{
+    if (enc->qpe_flags & LSQPACK_ENC_COST_MODEL)
+        return qenc_insert_pays_off(enc, kind, name_hash, nameval_hash, name,
+                                            name_len, value, value_len, risk);
+    else if (kind == IK_LIT_NAME)
+        return qenc_hist_seen(enc, HE_NAME, name_hash);
+    else
+        return qenc_hist_seen(enc, HE_NAMEVAL, nameval_hash);
+}
+
+
 /* Returns number of bytes written to enc_buf if an entry was duplicated, 0 if
  * it wasn't.
  */
@@ -1547,7 +2372,10 @@ qenc_dup_draining (struct lsqpack_enc *enc, unsigned char *enc_buf,
                                                         next->ete_val_len))
                 break;
         if (!next
-                && qenc_hist_seen(enc, HE_NAMEVAL, entry->ete_nameval_hash)
+                && qenc_should_insert(enc, IK_DUP, entry->ete_name_hash,
+                        entry->ete_nameval_hash, ETE_NAME(entry),
+                        entry->ete_name_len,
+                        ETE_VALUE(entry), entry->ete_val_len, 0)
                         && qenc_has_or_can_evict_at_least(enc, ETE_SIZE(entry)))
             candidate = entry;
     }
@@ -1570,6 +2398,7 @@ qenc_dup_draining (struct lsqpack_enc *enc, unsigned char *enc_buf,
     if (!entry)
         return 0;
 
+    STATS_ADD(enc->qpe_stats, n_dups, 1);
     return (unsigned) (dst - enc_buf);
 }
 
@@ -1584,21 +2413,134 @@ qenc_dup_draining (struct lsqpack_enc *enc, unsigned char *enc_buf,
 #endif
 
 
-enum lsqpack_enc_status
-lsqpack_enc_encode (struct lsqpack_enc *enc,
+/* Return registered name the header field refers to or NULL.  The index
+ * may have been set by someone else -- for example, by a decoder with its
+ * own registry -- so the name is compared before the cached data is used.
+ * Comparing is still much cheaper than hashing.
+ */
+static const struct lsqpack_enc_name *
+qenc_app_name (const struct lsqpack_enc *enc,
+                                        const struct lsxpack_header *xhdr)
+{
+    const struct lsqpack_enc_name *app_name;
+
+    if (enc->qpe_names && (xhdr->flags & LSXPACK_APP_IDX)
+                            && xhdr->app_index < enc->qpe_names->qen_n_names)
+    {
+        app_name = &enc->qpe_names->qen_names[ xhdr->app_index ];
+        if (app_name->een_name_len == xhdr->name_len
+                && 0 == memcmp(app_name->een_name,
+                        lsxpack_header_get_name(xhdr), xhdr->name_len))
+            return app_name;
+        E_DEBUG("application index %u does not match name `%.*s'",
+            (unsigned) xhdr->app_index, (int) xhdr->name_len,
+            lsxpack_header_get_name(xhdr));
+    }
+    return NULL;
+}
+
+
+/* Look for a full match in the static table and, if there is none,
+ * calculate name and nameval hashes.  Returns static table index or -1.
+ * The hashes are set to zero if a static table match is found.
+ */
+static int
+qenc_hash_and_find_static (const struct lsqpack_enc *enc,
+        const struct lsxpack_header *xhdr, unsigned *name_hash_p,
+        unsigned *nameval_hash_p)
+{
+    const char *const name = lsxpack_header_get_name(xhdr);
+    const char *const value = lsxpack_header_get_value(xhdr);
+    const struct lsqpack_enc_name *app_name;
+    unsigned name_hash, nameval_hash;
+    int static_id;
+
+    if ((xhdr->flags & (LSXPACK_QPACK_IDX|LSXPACK_VAL_MATCHED))
+                                == (LSXPACK_QPACK_IDX|LSXPACK_VAL_MATCHED))
+    {
+        *name_hash_p = 0;
+        *nameval_hash_p = 0;
+        return xhdr->qpack_index;
+    }
+
+    /* Encoded value cannot be matched: see qenc_encode_field() */
+    if (xhdr->flags & LSXPACK_VAL_HUFFMAN)
+    {
+        *name_hash_p = 0;
+        *nameval_hash_p = 0;
+        return -1;
+    }
+
+    if ((app_name = qenc_app_name(enc, xhdr)) != NULL)
+    {
+        name_hash = app_name->een_name_hash;
+        if (app_name->een_value && app_name->een_val_len == xhdr->val_len
+                && 0 == memcmp(app_name->een_value, value, xhdr->val_len))
+        {
+            *name_hash_p = name_hash;
+            *nameval_hash_p = app_name->een_nameval_hash;
+            return app_name->een_static_full_id;
+        }
+        /* A value can only match if the name is in the static table */
+        if (app_name->een_static_name_id >= 0
+                && (static_id = find_in_static_full(name, xhdr->name_len,
+                                            value, xhdr->val_len)) >= 0)
+            goto static_match;
+        *name_hash_p = name_hash;
+        *nameval_hash_p = QPACK_HASH(value, xhdr->val_len, name_hash);
+        return -1;
+    }
+
+    /* The static table is searched without hashing; the hashes are only
+     * needed for the dynamic table and history.
+     */
+    static_id = find_in_static_full(name, xhdr->name_len, value,
+                                                                xhdr->val_len);
+    if (static_id >= 0)
+    {
+  static_match:
+        *name_hash_p = 0;
+        *nameval_hash_p = 0;
+        return static_id;
+    }
+
+    if (xhdr->flags & LSXPACK_NAME_HASH)
+        name_hash = xhdr->name_hash;
+    else if (xhdr->flags & LSXPACK_QPACK_IDX)
+        name_hash = name_hashes[ xhdr->qpack_index ];
+    else
+        name_hash = QPACK_HASH(name, xhdr->name_len, LSQPACK_HASH_SEED);
+    if (xhdr->flags & LSXPACK_NAMEVAL_HASH)
+        nameval_hash = xhdr->nameval_hash;
+    else
+        nameval_hash = QPACK_HASH(value, xhdr->val_len, name_hash);
+    E_DEBUG("name hash: 0x%X; nameval hash: 0x%X", name_hash, nameval_hash);
+    *name_hash_p = name_hash;
+    *nameval_hash_p = nameval_hash;
+    return -1;
+}
+
+
+/* Encode header field whose hashes and full static table match have been
+ * calculated using qenc_hash_and_find_static().
+ */
+static enum lsqpack_enc_status
+qenc_encode_field (struct lsqpack_enc *enc,
         unsigned char *enc_buf, size_t *enc_sz_p,
         unsigned char *hea_buf, size_t *hea_sz_p,
         const struct lsxpack_header *xhdr,
-        enum lsqpack_enc_flags flags)
+        enum lsqpack_enc_flags flags, int static_id,
+        unsigned name_hash, unsigned nameval_hash)
 {
     unsigned char *const enc_buf_end = enc_buf + *enc_sz_p;
     unsigned char *const hea_buf_end = hea_buf + *hea_sz_p;
     struct lsqpack_enc_table_entry *entry, *new_entry;
     struct lsqpack_enc_table_entry *candidates[2];
+    const struct lsqpack_enc_name *app_name;
     struct encode_program prog;
-    int index, risk, use_dyn_table, static_id, enough_room, seen_nameval;
-    int update_hist;
-    unsigned name_hash, nameval_hash, buckno;
+    int index, risk, use_dyn_table, enough_room, seen_nameval;
+    int update_hist, huff_val;
+    unsigned buckno, huff_saved;
 
     size_t enc_sz, hea_sz, sz;
     unsigned char *dst;
@@ -1623,33 +2565,8 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
     if (xhdr->flags & LSXPACK_NEVER_INDEX)
         flags |= LQEF_NEVER_INDEX;
 
-    /* Look for a full match in the static table */
-    if ((xhdr->flags & (LSXPACK_QPACK_IDX|LSXPACK_VAL_MATCHED))
-                                != (LSXPACK_QPACK_IDX|LSXPACK_VAL_MATCHED))
-    {
-        /* Hash calculation is delayed until we really have to do it */
-        if (xhdr->flags & LSXPACK_NAME_HASH)
-            name_hash = xhdr->name_hash;
-        else if (xhdr->flags & LSXPACK_QPACK_IDX)
-            name_hash = name_hashes[ xhdr->qpack_index ];
-        else
-            name_hash = XXH32(name, name_len, LSQPACK_XXH_SEED);
-        if (xhdr->flags & LSXPACK_NAMEVAL_HASH)
-            nameval_hash = xhdr->nameval_hash;
-        else
-            nameval_hash = XXH32(value, value_len, name_hash);
-        E_DEBUG("name hash: 0x%X; nameval hash: 0x%X", name_hash, nameval_hash);
-        static_id = find_in_static_full(nameval_hash, name, name_len, value,
-                                                                value_len);
-    }
-    else
-    {
-        static_id = xhdr->qpack_index;
-        goto static_nameval_match;
-    }
     if (static_id >= 0)
     {
-  static_nameval_match:
         id = static_id;
         prog = (struct encode_program) {
                     .ep_enc_action = EEA_NONE,
@@ -1658,9 +2575,8 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
                     .ep_flags      = 0,
         };
         update_hist = 0;
+        huff_val = 0;
 #if USE_USELESS_INITIALIZATION
-        nameval_hash = 0;
-        name_hash = 0;
         use_dyn_table = 0;
         risk = 0;
         entry = NULL;
@@ -1673,6 +2589,37 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
         id = 0;
 #endif
 
+    /* A value that is still Huffman-encoded is copied to the header block
+     * as is.  The tables and the history hold plain strings, so the field
+     * is not looked up, inserted, or recorded.  The name may still refer
+     * to the static table.
+     */
+    huff_val = (xhdr->flags & LSXPACK_VAL_HUFFMAN) != 0;
+    if (huff_val)
+    {
+        if (xhdr->flags & LSXPACK_QPACK_IDX)
+            static_id = xhdr->qpack_index;
+        else if ((app_name = qenc_app_name(enc, xhdr)) != NULL)
+            static_id = app_name->een_static_name_id;
+        else
+            static_id = lsqpack_find_in_static_headers(name, name_len);
+        if (static_id >= 0)
+        {
+            id = static_id;
+            prog = (struct encode_program) { EEA_NONE, EHA_LIT_WITH_NAME_STAT, ETA_NOOP, 0, };
+        }
+        else
+            prog = (struct encode_program) { EEA_NONE, EHA_LIT, ETA_NOOP, 0, };
+        update_hist = 0;
+#if USE_USELESS_INITIALIZATION
+        use_dyn_table = 0;
+        risk = 0;
+        entry = NULL;
+        index = 0;
+#endif
+        goto execute_program;
+    }
+
     use_dyn_table = !(flags & LQEF_NO_DYN)
         && enc_use_dynamic_table(enc)
         ;
@@ -1793,8 +2740,10 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
         static_id = xhdr->qpack_index;
         goto static_name_match;
     }
+    else if ((app_name = qenc_app_name(enc, xhdr)) != NULL)
+        static_id = app_name->een_static_name_id;
     else
-        static_id = lsqpack_find_in_static_headers(name_hash, name, name_len);
+        static_id = lsqpack_find_in_static_headers(name, name_len);
     if (static_id >= 0)
     {
   static_name_match:
@@ -1812,7 +2761,9 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
                 [1][1][0] = { EEA_INS_NAMEREF_STATIC, EHA_INDEXED_NEW,        ETA_NEW,  EPF_REF_NEW, },
                 [1][1][1] = { EEA_NONE,               EHA_LIT_WITH_NAME_STAT, ETA_NOOP, 0, },   /* Invalid state */
             };
-            seen_nameval = qenc_hist_seen(enc, HE_NAMEVAL, nameval_hash);
+            seen_nameval = qenc_should_insert(enc, IK_NAMEREF_STATIC,
+                    name_hash, nameval_hash, name, name_len, value, value_len,
+                    risk);
             prog = programs[seen_nameval][risk][use_dyn_table && n_cand > 0];
         }
         else
@@ -1845,7 +2796,9 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
             {
                 id = entry->ete_id;
                 if (index && enough_room && risk
-                                && qenc_hist_seen(enc, HE_NAMEVAL, nameval_hash))
+                        && qenc_should_insert(enc, IK_NAMEREF_DYNAMIC,
+                            name_hash, nameval_hash, name, name_len, value,
+                            value_len, risk))
                     prog = (struct encode_program) { EEA_INS_NAMEREF_DYNAMIC,
                                 EHA_INDEXED_NEW, ETA_NEW,
                                 EPF_REF_NEW|EPF_REF_FOUND, };
@@ -1859,7 +2812,8 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
     /* No matches found */
     if (index
             && (seen_nameval < 0 ? (seen_nameval
-                    = qenc_hist_seen(enc, HE_NAMEVAL, nameval_hash)) : seen_nameval)
+                    = qenc_should_insert(enc, IK_LIT, name_hash, nameval_hash,
+                        name, name_len, value, value_len, risk)) : seen_nameval)
             && (enough_room < 0 ?
             (enough_room = qenc_has_or_can_evict_at_least(enc,
                             ENTRY_COST(name_len, value_len))) : enough_room))
@@ -1872,7 +2826,8 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
         };
         prog = programs[risk][use_dyn_table && n_cand > 0];
     }
-    else if (index && qenc_hist_seen(enc, HE_NAME, name_hash)
+    else if (index && qenc_should_insert(enc, IK_LIT_NAME, name_hash,
+                    nameval_hash, name, name_len, value, value_len, risk)
                 && qenc_has_or_can_evict_at_least(enc, ENTRY_COST(name_len, 0)))
     {
         static const struct encode_program programs[2] = {
@@ -1915,6 +2870,7 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
     E_DEBUG("program: %s; %s; %s; flags: 0x%X",
         eea2str[ prog.ep_enc_action ], eha2str[ prog.ep_hea_action ],
         eta2str[ prog.ep_tab_action ], prog.ep_flags);
+    huff_saved = 0;
     switch (prog.ep_enc_action)
     {
     case EEA_DUP:
@@ -1935,7 +2891,7 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
         dst = lsqpack_enc_int(dst, enc_buf_end, id, 6);
         if (dst <= enc_buf)
             return LQES_NOBUF_ENC;
-        r = lsqpack_enc_enc_str(7, dst, enc_buf_end - dst,
+        r = qenc_enc_str(&huff_saved, 7, dst, enc_buf_end - dst,
                                     (const unsigned char *) value, value_len);
         if (r < 0)
             return LQES_NOBUF_ENC;
@@ -1950,7 +2906,7 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
         dst = lsqpack_enc_int(dst, enc_buf_end, enc->qpe_ins_count - id, 6);
         if (dst <= enc_buf)
             return LQES_NOBUF_ENC;
-        r = lsqpack_enc_enc_str(7, dst, enc_buf_end - dst,
+        r = qenc_enc_str(&huff_saved, 7, dst, enc_buf_end - dst,
                                     (const unsigned char *) value, value_len);
         if (r < 0)
             return LQES_NOBUF_ENC;
@@ -1963,12 +2919,12 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
             return LQES_NOBUF_ENC;
         dst = enc_buf;
         *dst = 0x40;
-        r = lsqpack_enc_enc_str(5, dst, enc_buf_end - dst,
+        r = qenc_enc_str(&huff_saved, 5, dst, enc_buf_end - dst,
                                 (const unsigned char *) name, name_len);
         if (r < 0)
             return LQES_NOBUF_ENC;
         dst += r;
-        r = lsqpack_enc_enc_str(7, dst, enc_buf_end - dst,
+        r = qenc_enc_str(&huff_saved, 7, dst, enc_buf_end - dst,
                         (const unsigned char *) value,
                         prog.ep_enc_action == EEA_INS_LIT ? value_len : 0);
         if (r < 0)
@@ -2017,12 +2973,16 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
         *dst = 0x20
                | (((flags & LQEF_NEVER_INDEX) > 0) << 4)
                ;
-        r = lsqpack_enc_enc_str(3, dst, hea_buf_end - dst,
+        r = qenc_enc_str(&huff_saved, 3, dst, hea_buf_end - dst,
                                 (const unsigned char *) name, name_len);
         if (r < 0)
             return LQES_NOBUF_HEAD;
         dst += r;
-        r = lsqpack_enc_enc_str(7, dst, hea_buf_end - dst,
+        if (huff_val)
+            r = qenc_enc_huff_str(7, dst, hea_buf_end - dst,
+                                (const unsigned char *) value, value_len);
+        else
+            r = qenc_enc_str(&huff_saved, 7, dst, hea_buf_end - dst,
                                 (const unsigned char *) value, value_len);
         if (r < 0)
             return LQES_NOBUF_HEAD;
@@ -2038,7 +2998,7 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
                                     id - enc->qpe_cur_header.base_idx - 1, 3);
         if (dst <= hea_buf)
             return LQES_NOBUF_HEAD;
-        r = lsqpack_enc_enc_str(7, dst, hea_buf_end - dst,
+        r = qenc_enc_str(&huff_saved, 7, dst, hea_buf_end - dst,
                                 (const unsigned char *) value, value_len);
         if (r < 0)
             return LQES_NOBUF_HEAD;
@@ -2055,7 +3015,7 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
                                         enc->qpe_cur_header.base_idx - id, 4);
         if (dst <= hea_buf)
             return LQES_NOBUF_HEAD;
-        r = lsqpack_enc_enc_str(7, dst, hea_buf_end - dst,
+        r = qenc_enc_str(&huff_saved, 7, dst, hea_buf_end - dst,
                                 (const unsigned char *) value, value_len);
         if (r < 0)
             return LQES_NOBUF_HEAD;
@@ -2071,7 +3031,11 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
         dst = lsqpack_enc_int(dst, hea_buf_end, id, 4);
         if (dst <= hea_buf)
             return LQES_NOBUF_HEAD;
-        r = lsqpack_enc_enc_str(7, dst, hea_buf_end - dst,
+        if (huff_val)
+            r = qenc_enc_huff_str(7, dst, hea_buf_end - dst,
+                                (const unsigned char *) value, value_len);
+        else
+            r = qenc_enc_str(&huff_saved, 7, dst, hea_buf_end - dst,
                                 (const unsigned char *) value, value_len);
         if (r < 0)
             return LQES_NOBUF_HEAD;
@@ -2118,6 +3082,42 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
 
     qenc_remove_overflow_entries(enc);
 
+#if LSQPACK_STATS
+    switch (prog.ep_enc_action)
+    {
+    case EEA_NONE:
+        break;
+    case EEA_DUP:
+        ++enc->qpe_stats.n_dups;
+        break;
+    default:
+        ++enc->qpe_stats.n_inserts;
+        break;
+    }
+    switch (prog.ep_hea_action)
+    {
+    case EHA_INDEXED_STAT:
+        ++enc->qpe_stats.n_static_hits;
+        break;
+    case EHA_INDEXED_NEW:
+    case EHA_INDEXED_DYN:
+        ++enc->qpe_stats.n_dynamic_hits;
+        break;
+    case EHA_LIT_WITH_NAME_STAT:
+        ++enc->qpe_stats.n_static_name_hits;
+        break;
+    case EHA_LIT_WITH_NAME_DYN:
+    case EHA_LIT_WITH_NAME_NEW:
+        ++enc->qpe_stats.n_dynamic_name_hits;
+        break;
+    default:
+        assert(prog.ep_hea_action == EHA_LIT);
+        ++enc->qpe_stats.n_literals;
+        break;
+    }
+    enc->qpe_stats.n_huff_bytes_saved += huff_saved;
+#endif
+
     if (update_hist)
     {
         assert(enc->qpe_hist_els);
@@ -2133,6 +3133,8 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
         enc_sz += sz;
         qenc_remove_overflow_entries(enc);
     }
+    STATS_PEAK(enc->qpe_stats, peak_table_size, enc->qpe_cur_bytes_used);
+    STATS_PEAK(enc->qpe_stats, peak_table_nelem, enc->qpe_nelem);
 
     enc->qpe_bytes_in += name_len + value_len;
     enc->qpe_bytes_out += enc_sz + hea_sz;
@@ -2151,74 +3153,1208 @@ lsqpack_enc_encode (struct lsqpack_enc *enc,
 }
 
 
-int
-lsqpack_enc_set_max_capacity (struct lsqpack_enc *enc, unsigned capacity,
-                                    unsigned char *tsu_buf, size_t *tsu_buf_sz)
+/* Upper bound on the number of bytes a single header field may produce in
+ * either the encoder stream or the header block.  Huffman encoding is only
+ * used when it is shorter than the literal, so the literal sizes are used.
+ */
+static size_t
+qenc_field_max_size (const struct lsxpack_header *xhdr)
 {
-    unsigned char *p;
+    return lsqpack_val2len(xhdr->name_len, 3) + xhdr->name_len
+         + lsqpack_val2len(xhdr->val_len, 7) + xhdr->val_len
+         + lsqpack_val2len(LSQPACK_MAX_ABS_ID, 3)
+         ;
+}
 
-    if (capacity > enc->qpe_real_max_capacity)
-    {
-        errno = EINVAL;
-        return -1;
-    }
 
-    if (capacity == enc->qpe_cur_max_capacity)
-    {
-        E_DEBUG("set_capacity: capacity stays unchanged at %u", capacity);
-        *tsu_buf_sz = 0;
-        return 0;
-    }
+/* Cookies are split into crumbs only if there is more than one */
+static int
+qenc_is_crumbly (const struct lsqpack_enc *enc,
+                                            const struct lsxpack_header *xhdr)
+{
+    const char *value, *end;
 
-    if (!(tsu_buf && tsu_buf_sz))
-    {
-        errno = EINVAL;
-        return -1;
-    }
-    p = tsu_buf;
-    *p = 0x20;
-    p = lsqpack_enc_int(p, tsu_buf + *tsu_buf_sz, capacity, 5);
-    if (p <= tsu_buf)
-    {
-        errno = ENOBUFS;
-        return -1;
-    }
-    *tsu_buf_sz = p - tsu_buf;
+    if (!(enc->qpe_flags & LSQPACK_ENC_CRUMBLE_COOKIES)
+            || (xhdr->flags & LSXPACK_VAL_HUFFMAN)
+            || xhdr->name_len != 6
+            || 0 != memcmp(lsxpack_header_get_name(xhdr), "cookie", 6))
+        return 0;
 
-    E_DEBUG("maximum capacity goes from %u to %u", enc->qpe_cur_max_capacity,
-                                                                    capacity);
-    enc->qpe_cur_max_capacity = capacity;
-    qenc_remove_overflow_entries(enc);
+    value = lsxpack_header_get_value(xhdr);
+    end = value + xhdr->val_len;
+    for ( ; value + 1 < end; ++value)
+        if (value[0] == ';' && value[1] == ' ')
+            return 1;
     return 0;
 }
 
 
-static void
-qenc_update_risked_list (struct lsqpack_enc *enc)
+/* Set `crumb' to the cookie crumb that starts at `*off' and advance `*off'
+ * past it and the delimiter.  Return 0 when there are no more crumbs.  The
+ * crumbs are not trimmed, so that joining them with "; " reproduces the
+ * original value exactly.
+ */
+static int
+qenc_next_crumb (const struct lsxpack_header *xhdr,
+                        struct lsxpack_header *crumb, unsigned *off)
 {
-    struct lsqpack_header_info *hinfo, *next;
+    const char *const value = lsxpack_header_get_value(xhdr);
+    const char *const end = value + xhdr->val_len;
+    const char *p;
 
-    for (hinfo = TAILQ_FIRST(&enc->qpe_risked_hinfos); hinfo; hinfo = next)
-    {
-        next = TAILQ_NEXT(hinfo, qhi_next_risked);
-        if (!qenc_hinfo_at_risk(enc, hinfo))
-            qenc_remove_from_risked_list(enc, hinfo);
-    }
+    if (*off > xhdr->val_len)
+        return 0;
+
+    for (p = value + *off; p + 1 < end && !(p[0] == ';' && p[1] == ' '); ++p)
+        ;
+    if (p + 1 >= end)
+        p = end;
+
+    *crumb = *xhdr;
+    crumb->val_offset = xhdr->val_offset + *off;
+    crumb->val_len = (lsxpack_strlen_t) (p - value - *off);
+    crumb->flags &= ~(LSXPACK_NAMEVAL_HASH|LSXPACK_VAL_MATCHED);
+    *off += crumb->val_len + 2;
+    return 1;
 }
 
 
-static int
-enc_proc_header_ack (struct lsqpack_enc *enc, uint64_t stream_id)
+static size_t
+qenc_cookie_max_size (const struct lsxpack_header *xhdr)
 {
-    struct lsqpack_header_info *hinfo;
+    struct lsxpack_header crumb;
+    unsigned off;
+    size_t size;
 
-    E_DEBUG("got Header Ack instruction, stream=%"PRIu64, stream_id);
-    if (stream_id > MAX_QUIC_STREAM_ID)
-        return -1;
+    size = 0;
+    for (off = 0; qenc_next_crumb(xhdr, &crumb, &off); )
+        size += qenc_field_max_size(&crumb);
+    return size;
+}
 
-    TAILQ_FOREACH(hinfo, &enc->qpe_all_hinfos, qhi_next_all)
-        if (stream_id == hinfo->qhi_stream_id)
-            break;
+
+/* Encode cookie crumbs as separate fields.  The buffers must be at least
+ * qenc_cookie_max_size() bytes long; each crumb is given the room left
+ * over after reserving the maximum size of the crumbs following it.
+ */
+static enum lsqpack_enc_status
+qenc_encode_crumbs (struct lsqpack_enc *enc,
+        unsigned char *enc_buf, size_t *enc_sz_p,
+        unsigned char *hea_buf, size_t *hea_sz_p,
+        const struct lsxpack_header *xhdr, enum lsqpack_enc_flags flags)
+{
+    struct lsxpack_header crumb;
+    enum lsqpack_enc_status st;
+    unsigned name_hash, nameval_hash, off, n_crumbs;
+    size_t rest, enc_off, hea_off, enc_sz, hea_sz;
+    int static_id;
+
+    rest = qenc_cookie_max_size(xhdr);
+    assert(*enc_sz_p >= rest && *hea_sz_p >= rest);
+    enc_off = 0;
+    hea_off = 0;
+    n_crumbs = 0;
+    for (off = 0; qenc_next_crumb(xhdr, &crumb, &off); ++n_crumbs)
+    {
+        rest -= qenc_field_max_size(&crumb);
+        static_id = qenc_hash_and_find_static(enc, &crumb, &name_hash,
+                                                            &nameval_hash);
+        enc_sz = *enc_sz_p - enc_off - rest;
+        hea_sz = *hea_sz_p - hea_off - rest;
+        st = qenc_encode_field(enc, enc_buf + enc_off, &enc_sz,
+                        hea_buf + hea_off, &hea_sz, &crumb, flags, static_id,
+                        name_hash, nameval_hash);
+        if (st != LQES_OK)
+            return st;
+        enc_off += enc_sz;
+        hea_off += hea_sz;
+    }
+
+    E_DEBUG("encoded cookie as %u crumbs", n_crumbs);
+    *enc_sz_p = enc_off;
+    *hea_sz_p = hea_off;
+    return LQES_OK;
+}
+
+
+/* Maximum size of a header field passed to lsqpack_enc_encode_list() */
+static size_t
+qenc_list_field_max_size (const struct lsqpack_enc *enc,
+                                            const struct lsxpack_header *xhdr)
+{
+    if (qenc_is_crumbly(enc, xhdr))
+        return qenc_cookie_max_size(xhdr);
+    else
+        return qenc_field_max_size(xhdr);
+}
+
+
+#define MIN_QUEUE_SIZE 0x400
+
+/* Return pointer to the end of the encoder stream queue, where at least
+ * `need' bytes are available, or NULL if memory cannot be allocated.  The
+ * number of available bytes is written to `avail'.  The bytes are added
+ * to the queue by incrementing eq_len.
+ */
+static unsigned char *
+qenc_queue_reserve (struct lsqpack_enc *enc, size_t need, size_t *avail)
+{
+    unsigned char *buf;
+    size_t size;
+
+    if (enc->qpe_queue.eq_size - enc->qpe_queue.eq_off - enc->qpe_queue.eq_len
+                                                                        < need)
+    {
+        if (enc->qpe_queue.eq_off)
+        {
+            memmove(enc->qpe_queue.eq_buf,
+                    enc->qpe_queue.eq_buf + enc->qpe_queue.eq_off,
+                    enc->qpe_queue.eq_len);
+            enc->qpe_queue.eq_off = 0;
+        }
+        if (enc->qpe_queue.eq_size - enc->qpe_queue.eq_len < need)
+        {
+            size = MAX(enc->qpe_queue.eq_size * 2, MIN_QUEUE_SIZE);
+            while (size < enc->qpe_queue.eq_len + need)
+                size *= 2;
+            buf = realloc(enc->qpe_queue.eq_buf, size);
+            if (!buf)
+                return NULL;
+            E_DEBUG("grew encoder stream queue from %zu to %zu bytes",
+                                            enc->qpe_queue.eq_size, size);
+            enc->qpe_queue.eq_buf = buf;
+            enc->qpe_queue.eq_size = size;
+        }
+    }
+
+    *avail = enc->qpe_queue.eq_size - enc->qpe_queue.eq_off
+                                                    - enc->qpe_queue.eq_len;
+    return enc->qpe_queue.eq_buf + enc->qpe_queue.eq_off
+                                                    + enc->qpe_queue.eq_len;
+}
+
+
+size_t
+lsqpack_enc_pending (const struct lsqpack_enc *enc)
+{
+    return enc->qpe_queue.eq_len;
+}
+
+
+ssize_t
+lsqpack_enc_writev (struct lsqpack_enc *enc,
+    ssize_t (*writev)(void *ctx, const struct iovec *, int iovcnt),
+    void *ctx)
+{
+    struct iovec iov;
+    ssize_t nw;
+
+    if (enc->qpe_queue.eq_len == 0)
+        return 0;
+
+    /* Queued bytes are kept contiguous, so one iovec is enough */
+    iov.iov_base = enc->qpe_queue.eq_buf + enc->qpe_queue.eq_off;
+    iov.iov_len = enc->qpe_queue.eq_len;
+    nw = writev(ctx, &iov, 1);
+    if (nw > 0)
+    {
+        assert((size_t) nw <= enc->qpe_queue.eq_len);
+        enc->qpe_queue.eq_off += (size_t) nw;
+        enc->qpe_queue.eq_len -= (size_t) nw;
+        if (enc->qpe_queue.eq_len == 0)
+            enc->qpe_queue.eq_off = 0;
+        E_DEBUG("wrote %zd queued encoder stream bytes; %zu bytes left", nw,
+                                                    enc->qpe_queue.eq_len);
+    }
+    return nw;
+}
+
+
+enum lsqpack_enc_status
+lsqpack_enc_encode (struct lsqpack_enc *enc,
+        unsigned char *enc_buf, size_t *enc_sz_p,
+        unsigned char *hea_buf, size_t *hea_sz_p,
+        const struct lsxpack_header *xhdr,
+        enum lsqpack_enc_flags flags)
+{
+    enum lsqpack_enc_status st;
+    unsigned name_hash, nameval_hash;
+    size_t enc_sz, max_sz;
+    int static_id, crumble;
+
+    if (qenc_is_crumbly(enc, xhdr))
+    {
+        max_sz = qenc_cookie_max_size(xhdr);
+        crumble = *hea_sz_p >= max_sz && ((enc->qpe_flags & LSQPACK_ENC_QUEUE)
+                                                    || *enc_sz_p >= max_sz);
+    }
+    else
+        crumble = 0;
+
+    if (!(enc->qpe_flags & LSQPACK_ENC_QUEUE))
+    {
+        if (crumble)
+            return qenc_encode_crumbs(enc, enc_buf, enc_sz_p, hea_buf,
+                                                    hea_sz_p, xhdr, flags);
+        static_id = qenc_hash_and_find_static(enc, xhdr, &name_hash,
+                                                            &nameval_hash);
+        return qenc_encode_field(enc, enc_buf, enc_sz_p, hea_buf, hea_sz_p,
+                            xhdr, flags, static_id, name_hash, nameval_hash);
+    }
+
+    if (enc_sz_p)
+        *enc_sz_p = 0;
+    if (!crumble)
+        max_sz = qenc_field_max_size(xhdr);
+    enc_buf = qenc_queue_reserve(enc, max_sz, &enc_sz);
+    if (!enc_buf)
+        return LQES_NOBUF_ENC;
+    if (crumble)
+        st = qenc_encode_crumbs(enc, enc_buf, &enc_sz, hea_buf, hea_sz_p,
+                                                                xhdr, flags);
+    else
+    {
+        static_id = qenc_hash_and_find_static(enc, xhdr, &name_hash,
+                                                            &nameval_hash);
+        st = qenc_encode_field(enc, enc_buf, &enc_sz, hea_buf, hea_sz_p,
+                    xhdr, flags, static_id, name_hash, nameval_hash);
+    }
+    if (st == LQES_OK)
+        enc->qpe_queue.eq_len += enc_sz;
+    return st;
+}
+
+
+/* Number of header fields whose hashes and static table matches are
+ * calculated in one go by lsqpack_enc_encode_list().
+ */
+#define ENCODE_LIST_BATCH 16
+
+/* Header lists larger than this are not cached */
+#define HBLOCK_CACHE_MAX_SIZE 0x1000
+
+/* How a header field is stored in the header block cache.  The name and the
+ * value follow it.
+ */
+struct hblock_field
+{
+    unsigned    name_len;
+    unsigned    val_len;
+    unsigned    flags;      /* HBLOCK_FIELD_FLAGS */
+};
+
+/* Flags that change how the same name and value bytes are encoded */
+#define HBLOCK_FIELD_FLAGS (LSXPACK_NEVER_INDEX|LSXPACK_VAL_HUFFMAN)
+
+
+static unsigned
+qenc_list_hash (const struct lsxpack_header *xhdrs, unsigned n_xhdrs,
+                                                enum lsqpack_enc_flags flags)
+{
+    const struct lsxpack_header *xhdr;
+    unsigned hash;
+
+    hash = LSQPACK_HASH_SEED ^ n_xhdrs ^ ((unsigned) flags << 24);
+    for (xhdr = xhdrs; xhdr < xhdrs + n_xhdrs; ++xhdr)
+    {
+        hash = QPACK_HASH(lsxpack_header_get_name(xhdr), xhdr->name_len,
+                                                                        hash);
+        hash = QPACK_HASH(lsxpack_header_get_value(xhdr), xhdr->val_len,
+                                                                        hash);
+        hash ^= xhdr->flags & HBLOCK_FIELD_FLAGS;
+    }
+    return hash;
+}
+
+
+static int
+qenc_hblock_matches (const struct lsqpack_enc_hblock *eh, unsigned hash,
+            const struct lsxpack_header *xhdrs, unsigned n_xhdrs,
+            enum lsqpack_enc_flags flags)
+{
+    const struct lsxpack_header *xhdr;
+    const unsigned char *p;
+    struct hblock_field field;
+
+    if (eh->eh_hash != hash || eh->eh_n_fields != n_xhdrs
+                || eh->eh_flags != (unsigned) flags || eh->eh_hblock_sz == 0)
+        return 0;
+
+    p = eh->eh_buf;
+    for (xhdr = xhdrs; xhdr < xhdrs + n_xhdrs; ++xhdr)
+    {
+        memcpy(&field, p, sizeof(field));
+        p += sizeof(field);
+        if (field.name_len != xhdr->name_len
+                || field.val_len != xhdr->val_len
+                || field.flags != (xhdr->flags & HBLOCK_FIELD_FLAGS)
+                || 0 != memcmp(p, lsxpack_header_get_name(xhdr),
+                                                            field.name_len)
+                || 0 != memcmp(p + field.name_len,
+                        lsxpack_header_get_value(xhdr), field.val_len))
+            return 0;
+        p += field.name_len + field.val_len;
+    }
+    return 1;
+}
+
+
+/* A cached header block is valid for as long as the entries it references
+ * are in the dynamic table.  If it references none, a new entry means that
+ * the header list could now be encoded differently.
+ */
+static int
+qenc_hblock_valid (const struct lsqpack_enc *enc,
+                                        const struct lsqpack_enc_hblock *eh)
+{
+    const struct lsqpack_enc_table_entry *oldest;
+
+    if (eh->eh_min_id == 0)
+        return eh->eh_ins_count == enc->qpe_ins_count;
+    oldest = STAILQ_FIRST(&enc->qpe_all_entries);
+    return oldest && oldest->ete_id <= eh->eh_min_id;
+}
+
+
+/* Return 0 if the header block was found in the cache and copied to
+ * `hea_buf'.
+ */
+static int
+qenc_hblock_cache_get (struct lsqpack_enc *enc, unsigned hash,
+        uint64_t stream_id, unsigned seqno,
+        const struct lsxpack_header *xhdrs, unsigned n_xhdrs,
+        enum lsqpack_enc_flags flags, unsigned char *hea_buf, size_t *hea_sz)
+{
+    struct lsqpack_enc_hblock *eh;
+    struct lsqpack_header_info *hinfo;
+
+    if (!enc->qpe_hblock_cache)
+        return -1;
+
+    eh = &enc->qpe_hblock_cache[BUCKNO(LSQPACK_ENC_HBLOCK_CACHE_BITS, hash)];
+    if (!(eh->eh_stable && eh->eh_hblock_sz <= *hea_sz
+                && qenc_hblock_valid(enc, eh)
+                && qenc_hblock_matches(eh, hash, xhdrs, n_xhdrs, flags)))
+        return -1;
+
+    /* Referenced entries must not be evicted until the header block is
+     * acknowledged.
+     */
+    if (eh->eh_min_id)
+    {
+        hinfo = enc_alloc_hinfo(enc, stream_id);
+        if (!hinfo)
+            return -1;
+        hinfo->qhi_seqno = seqno;
+        hinfo->qhi_min_id = eh->eh_min_id;
+        hinfo->qhi_max_id = eh->eh_max_id;
+    }
+
+    memcpy(hea_buf, eh->eh_buf + eh->eh_list_sz, eh->eh_hblock_sz);
+    *hea_sz = eh->eh_hblock_sz;
+    enc->qpe_bytes_in += eh->eh_bytes_in;
+    enc->qpe_bytes_out += (unsigned) eh->eh_hblock_sz;
+    STATS_ADD(enc->qpe_stats, n_hblock_cache_hits, 1);
+    E_DEBUG("header block for stream %"PRIu64" found in cache: %zu bytes",
+                                                stream_id, eh->eh_hblock_sz);
+    return 0;
+}
+
+
+/* Called with a header block that did not produce encoder stream output and
+ * has no at-risk references.  It becomes stable if the same list was just
+ * encoded the same way.
+ */
+static void
+qenc_hblock_cache_put (struct lsqpack_enc *enc, unsigned hash,
+        const struct lsxpack_header *xhdrs, unsigned n_xhdrs,
+        enum lsqpack_enc_flags flags, const unsigned char *hblock,
+        size_t hblock_sz, lsqpack_abs_id_t min_id, lsqpack_abs_id_t max_id)
+{
+    const struct lsxpack_header *xhdr;
+    struct lsqpack_enc_hblock *eh;
+    struct hblock_field field;
+    unsigned char *p;
+    size_t list_sz;
+    unsigned bytes_in;
+
+    if (!enc->qpe_hblock_cache)
+    {
+        enc->qpe_hblock_cache = calloc(N_BUCKETS(LSQPACK_ENC_HBLOCK_CACHE_BITS),
+                                            sizeof(enc->qpe_hblock_cache[0]));
+        if (!enc->qpe_hblock_cache)
+            return;
+    }
+
+    eh = &enc->qpe_hblock_cache[BUCKNO(LSQPACK_ENC_HBLOCK_CACHE_BITS, hash)];
+    if (eh->eh_hblock_sz == hblock_sz && eh->eh_min_id == min_id
+            && eh->eh_max_id == max_id
+            && qenc_hblock_matches(eh, hash, xhdrs, n_xhdrs, flags)
+            && 0 == memcmp(eh->eh_buf + eh->eh_list_sz, hblock, hblock_sz))
+    {
+        if (!eh->eh_stable)
+            E_DEBUG("header block with hash 0x%X is now cached", hash);
+        eh->eh_stable = 1;
+        eh->eh_ins_count = enc->qpe_ins_count;
+        return;
+    }
+
+    list_sz = 0;
+    bytes_in = 0;
+    for (xhdr = xhdrs; xhdr < xhdrs + n_xhdrs; ++xhdr)
+    {
+        list_sz += sizeof(field) + xhdr->name_len + xhdr->val_len;
+        bytes_in += xhdr->name_len + xhdr->val_len;
+    }
+
+    eh->eh_stable = 0;
+    eh->eh_hblock_sz = 0;
+    if (list_sz + hblock_sz > HBLOCK_CACHE_MAX_SIZE)
+        return;
+    if (eh->eh_buf_sz < list_sz + hblock_sz)
+    {
+        p = realloc(eh->eh_buf, list_sz + hblock_sz);
+        if (!p)
+            return;
+        eh->eh_buf = p;
+        eh->eh_buf_sz = list_sz + hblock_sz;
+    }
+
+    p = eh->eh_buf;
+    for (xhdr = xhdrs; xhdr < xhdrs + n_xhdrs; ++xhdr)
+    {
+        field.name_len = xhdr->name_len;
+        field.val_len = xhdr->val_len;
+        field.flags = xhdr->flags & HBLOCK_FIELD_FLAGS;
+        memcpy(p, &field, sizeof(field));
+        p += sizeof(field);
+        memcpy(p, lsxpack_header_get_name(xhdr), xhdr->name_len);
+        p += xhdr->name_len;
+        memcpy(p, lsxpack_header_get_value(xhdr), xhdr->val_len);
+        p += xhdr->val_len;
+    }
+    memcpy(p, hblock, hblock_sz);
+    eh->eh_list_sz = list_sz;
+    eh->eh_hblock_sz = hblock_sz;
+    eh->eh_hash = hash;
+    eh->eh_n_fields = n_xhdrs;
+    eh->eh_flags = (unsigned) flags;
+    eh->eh_bytes_in = bytes_in;
+    eh->eh_min_id = min_id;
+    eh->eh_max_id = max_id;
+}
+
+
+int
+lsqpack_enc_encode_list (struct lsqpack_enc *enc, uint64_t stream_id,
+        unsigned seqno, unsigned char *enc_buf, size_t *enc_sz_p,
+        unsigned char *hea_buf, size_t *hea_sz_p,
+        const struct lsxpack_header *xhdrs, unsigned n_xhdrs,
+        enum lsqpack_enc_flags flags,
+        enum lsqpack_enc_header_flags *header_flags)
+{
+    struct {
+        unsigned    name_hash;
+        unsigned    nameval_hash;
+        int         static_id;
+        int         crumble;
+    } batch[ENCODE_LIST_BATCH];
+    enum lsqpack_enc_status st;
+    enum lsqpack_enc_header_flags hflags;
+    size_t max_field_sz, enc_need, hea_need, enc_off, hea_off, prefix_sz,
+                                            enc_sz, hea_sz, enc_buf_sz;
+    ssize_t nw;
+    lsqpack_abs_id_t min_id, max_id;
+    unsigned i, j, n_batch, list_hash;
+    int queue;
+
+    if (enc->qpe_flags & LSQPACK_ENC_HEADER)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (enc->qpe_flags & LSQPACK_ENC_HBLOCK_CACHE)
+    {
+        list_hash = qenc_list_hash(xhdrs, n_xhdrs, flags);
+        if (0 == qenc_hblock_cache_get(enc, list_hash, stream_id, seqno,
+                                xhdrs, n_xhdrs, flags, hea_buf, hea_sz_p))
+        {
+            if (enc_sz_p)
+                *enc_sz_p = 0;
+            if (header_flags)
+                *header_flags = 0;
+            return 0;
+        }
+    }
+    else
+        list_hash = 0;
+
+    /* Check that the whole header list fits before modifying any state */
+    prefix_sz = lsqpack_enc_header_block_prefix_size(enc);
+    max_field_sz = 0;
+    for (i = 0; i < n_xhdrs; ++i)
+        max_field_sz += qenc_list_field_max_size(enc, &xhdrs[i]);
+    queue = (enc->qpe_flags & LSQPACK_ENC_QUEUE) != 0;
+    enc_need = queue ? 0 : max_field_sz;
+    hea_need = prefix_sz + max_field_sz;
+    if ((!queue && *enc_sz_p < enc_need) || *hea_sz_p < hea_need)
+    {
+        E_DEBUG("encode list: need %zu enc and %zu header bytes, have %zu "
+            "and %zu", enc_need, hea_need, queue ? 0 : *enc_sz_p, *hea_sz_p);
+        if (enc_sz_p)
+            *enc_sz_p = enc_need;
+        *hea_sz_p = hea_need;
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (queue)
+    {
+        enc_buf = qenc_queue_reserve(enc, max_field_sz, &enc_buf_sz);
+        if (!enc_buf)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    else
+        enc_buf_sz = *enc_sz_p;
+
+    if (0 != lsqpack_enc_start_header(enc, stream_id, seqno))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Header fields are written after the space reserved for the prefix.
+     * Each field is given the room left over after reserving the maximum
+     * size of the fields following it, so that opportunistic duplication
+     * of draining entries cannot starve them.
+     */
+    enc_off = 0;
+    hea_off = prefix_sz;
+    for (i = 0; i < n_xhdrs; i += n_batch)
+    {
+        n_batch = n_xhdrs - i;
+        if (n_batch > ENCODE_LIST_BATCH)
+            n_batch = ENCODE_LIST_BATCH;
+        for (j = 0; j < n_batch; ++j)
+        {
+            batch[j].crumble = qenc_is_crumbly(enc, &xhdrs[i + j]);
+            if (!batch[j].crumble)
+                batch[j].static_id = qenc_hash_and_find_static(enc,
+                                &xhdrs[i + j], &batch[j].name_hash,
+                                &batch[j].nameval_hash);
+        }
+        for (j = 0; j < n_batch; ++j)
+        {
+            if (batch[j].crumble)
+                max_field_sz -= qenc_cookie_max_size(&xhdrs[i + j]);
+            else
+                max_field_sz -= qenc_field_max_size(&xhdrs[i + j]);
+            enc_sz = enc_buf_sz - enc_off - max_field_sz;
+            hea_sz = *hea_sz_p - hea_off - max_field_sz;
+            if (batch[j].crumble)
+                st = qenc_encode_crumbs(enc, enc_buf + enc_off, &enc_sz,
+                        hea_buf + hea_off, &hea_sz, &xhdrs[i + j], flags);
+            else
+                st = qenc_encode_field(enc, enc_buf + enc_off, &enc_sz,
+                        hea_buf + hea_off, &hea_sz, &xhdrs[i + j], flags,
+                        batch[j].static_id, batch[j].name_hash,
+                        batch[j].nameval_hash);
+            assert(st == LQES_OK);
+            if (st != LQES_OK)
+                goto err;
+            enc_off += enc_sz;
+            hea_off += hea_sz;
+        }
+    }
+
+    if (enc->qpe_cur_header.hinfo
+                        && HINFO_IDS_SET(enc->qpe_cur_header.hinfo))
+    {
+        min_id = enc->qpe_cur_header.hinfo->qhi_min_id;
+        max_id = enc->qpe_cur_header.hinfo->qhi_max_id;
+    }
+    else
+        min_id = max_id = 0;
+
+    nw = lsqpack_enc_end_header(enc, hea_buf, prefix_sz, &hflags);
+    assert(nw > 0);
+    if (nw <= 0)
+        goto err;
+    if ((size_t) nw < prefix_sz)
+        memmove(hea_buf + nw, hea_buf + prefix_sz, hea_off - prefix_sz);
+    if (header_flags)
+        *header_flags = hflags;
+
+    if ((enc->qpe_flags & LSQPACK_ENC_HBLOCK_CACHE) && enc_off == 0
+                    && !(hflags & (LSQECH_REF_AT_RISK|LSQECH_REF_NEW_ENTRIES)))
+        qenc_hblock_cache_put(enc, list_hash, xhdrs, n_xhdrs, flags, hea_buf,
+                            hea_off - prefix_sz + nw, min_id, max_id);
+
+    if (queue)
+    {
+        enc->qpe_queue.eq_len += enc_off;
+        if (enc_sz_p)
+            *enc_sz_p = 0;
+    }
+    else
+        *enc_sz_p = enc_off;
+    *hea_sz_p = hea_off - prefix_sz + nw;
+    return 0;
+
+  err:
+    /* Not reached: the buffers were checked above */
+    if (enc->qpe_flags & LSQPACK_ENC_HEADER)
+        (void) lsqpack_enc_end_header(enc, hea_buf, prefix_sz, NULL);
+    errno = ENOBUFS;
+    return -1;
+}
+
+
+/* Encode header field using only the static table.  Returns the number of
+ * bytes written or -1 if there is not enough room.
+ */
+static int
+qenc_encode_field_static (unsigned char *dst, unsigned char *const end,
+        const struct lsxpack_header *xhdr, enum lsqpack_enc_flags flags)
+{
+    unsigned char *const dst_orig = dst;
+    const char *const name = lsxpack_header_get_name(xhdr);
+    const char *const value = lsxpack_header_get_value(xhdr);
+    unsigned huff_saved;
+    int static_id, never, r;
+
+    if (dst >= end)
+        return -1;
+
+    never = (flags & LQEF_NEVER_INDEX) || (xhdr->flags & LSXPACK_NEVER_INDEX);
+
+    if ((xhdr->flags & (LSXPACK_QPACK_IDX|LSXPACK_VAL_MATCHED))
+                                == (LSXPACK_QPACK_IDX|LSXPACK_VAL_MATCHED))
+        static_id = xhdr->qpack_index;
+    else if (xhdr->flags & LSXPACK_VAL_HUFFMAN)
+        static_id = -1;
+    else
+        static_id = find_in_static_full(name, xhdr->name_len, value,
+                                                                xhdr->val_len);
+    if (static_id >= 0)
+    {
+        *dst = 0x80 | 0x40;
+        dst = lsqpack_enc_int(dst, end, static_id, 6);
+        return dst > dst_orig ? dst - dst_orig : -1;
+    }
+
+    if (xhdr->flags & LSXPACK_QPACK_IDX)
+        static_id = xhdr->qpack_index;
+    else
+        static_id = lsqpack_find_in_static_headers(name, xhdr->name_len);
+    if (static_id >= 0)
+    {
+        *dst = 0x40 | (never << 5) | 0x10;
+        dst = lsqpack_enc_int(dst, end, static_id, 4);
+        if (dst <= dst_orig)
+            return -1;
+    }
+    else
+    {
+        *dst = 0x20 | (never << 4);
+        r = qenc_enc_str(&huff_saved, 3, dst, end - dst,
+                        (const unsigned char *) name, xhdr->name_len);
+        if (r < 0)
+            return -1;
+        dst += r;
+    }
+
+    if (dst >= end)
+        return -1;
+    if (xhdr->flags & LSXPACK_VAL_HUFFMAN)
+        r = qenc_enc_huff_str(7, dst, end - dst,
+                        (const unsigned char *) value, xhdr->val_len);
+    else
+        r = qenc_enc_str(&huff_saved, 7, dst, end - dst,
+                        (const unsigned char *) value, xhdr->val_len);
+    if (r < 0)
+        return -1;
+    return dst + r - dst_orig;
+}
+
+
+int
+lsqpack_enc_encode_stateless (unsigned char *buf, size_t *buf_sz,
+        const struct lsxpack_header *xhdrs, unsigned n_xhdrs,
+        enum lsqpack_enc_flags flags)
+{
+    unsigned char *const end = buf + *buf_sz;
+    unsigned char *dst;
+    size_t need;
+    unsigned i;
+    int r;
+
+    if (*buf_sz < 2)
+        goto nobufs;
+
+    /* Required Insert Count and Delta Base are both zero */
+    buf[0] = 0;
+    buf[1] = 0;
+    dst = buf + 2;
+    for (i = 0; i < n_xhdrs; ++i)
+    {
+        r = qenc_encode_field_static(dst, end, &xhdrs[i], flags);
+        if (r < 0)
+            goto nobufs;
+        dst += r;
+    }
+
+    *buf_sz = dst - buf;
+    return 0;
+
+  nobufs:
+    need = 2;
+    for (i = 0; i < n_xhdrs; ++i)
+        need += qenc_field_max_size(&xhdrs[i]);
+    *buf_sz = need;
+    errno = ENOBUFS;
+    return -1;
+}
+
+
+struct dict_field
+{
+    const struct lsxpack_header    *xhdr;
+    unsigned                        name_hash;
+    unsigned                        nameval_hash;
+    unsigned                        count;
+    unsigned                        first;
+};
+
+
+static int
+dict_field_cmp_contents (const struct dict_field *a, const struct dict_field *b)
+{
+    int r;
+
+    if (a->nameval_hash != b->nameval_hash)
+        return a->nameval_hash < b->nameval_hash ? -1 : 1;
+    if (a->xhdr->name_len != b->xhdr->name_len)
+        return a->xhdr->name_len < b->xhdr->name_len ? -1 : 1;
+    if (a->xhdr->val_len != b->xhdr->val_len)
+        return a->xhdr->val_len < b->xhdr->val_len ? -1 : 1;
+    r = memcmp(lsxpack_header_get_name(a->xhdr),
+                    lsxpack_header_get_name(b->xhdr), a->xhdr->name_len);
+    if (r == 0)
+        r = memcmp(lsxpack_header_get_value(a->xhdr),
+                    lsxpack_header_get_value(b->xhdr), a->xhdr->val_len);
+    return r;
+}
+
+
+static int
+dict_field_cmp_nameval (const void *ap, const void *bp)
+{
+    const struct dict_field *a = ap, *b = bp;
+    int r;
+
+    r = dict_field_cmp_contents(a, b);
+    if (r == 0)
+        r = (a->first > b->first) - (a->first < b->first);
+    return r;
+}
+
+
+/* More frequent first; ties are broken by order of appearance */
+static int
+dict_field_cmp_count (const void *ap, const void *bp)
+{
+    const struct dict_field *a = ap, *b = bp;
+
+    if (a->count != b->count)
+        return a->count > b->count ? -1 : 1;
+    return (a->first > b->first) - (a->first < b->first);
+}
+
+
+int
+lsqpack_enc_dict_init (struct lsqpack_enc_dict *dict,
+    const struct lsxpack_header *xhdrs, unsigned n_xhdrs, unsigned max_entries)
+{
+    struct lsqpack_enc_dict_entry *ede;
+    struct dict_field *fields;
+    const struct lsxpack_header *xhdr;
+    const char *name, *value;
+    unsigned char *dst, *end;
+    size_t buf_sz;
+    unsigned i, n, n_uniq, huff_saved;
+    int static_id, r;
+
+    memset(dict, 0, sizeof(*dict));
+    if (n_xhdrs == 0)
+        return 0;
+
+    fields = malloc(sizeof(fields[0]) * n_xhdrs);
+    if (!fields)
+        return -1;
+
+    for (i = 0, n = 0; i < n_xhdrs; ++i)
+    {
+        xhdr = &xhdrs[i];
+        name = lsxpack_header_get_name(xhdr);
+        value = lsxpack_header_get_value(xhdr);
+        if ((xhdr->flags & LSXPACK_VAL_HUFFMAN)
+                || find_in_static_full(name, xhdr->name_len, value,
+                                                        xhdr->val_len) >= 0)
+            continue;
+        fields[n].xhdr = xhdr;
+        fields[n].name_hash = QPACK_HASH(name, xhdr->name_len,
+                                                            LSQPACK_HASH_SEED);
+        fields[n].nameval_hash = QPACK_HASH(value, xhdr->val_len,
+                                                        fields[n].name_hash);
+        fields[n].count = 1;
+        fields[n].first = i;
+        ++n;
+    }
+
+    /* Collapse identical fields into the earliest one */
+    qsort(fields, n, sizeof(fields[0]), dict_field_cmp_nameval);
+    for (i = 1, n_uniq = n > 0; i < n; ++i)
+        if (0 == dict_field_cmp_contents(&fields[i], &fields[n_uniq - 1]))
+            ++fields[n_uniq - 1].count;
+        else
+            fields[n_uniq++] = fields[i];
+    qsort(fields, n_uniq, sizeof(fields[0]), dict_field_cmp_count);
+    if (max_entries && n_uniq > max_entries)
+        n_uniq = max_entries;
+
+    buf_sz = 0;
+    for (i = 0; i < n_uniq; ++i)
+        buf_sz += fields[i].xhdr->name_len + fields[i].xhdr->val_len
+                                        + qenc_field_max_size(fields[i].xhdr);
+
+    /* One extra so that the allocations succeed for an empty dictionary */
+    dict->qed_entries = malloc(sizeof(dict->qed_entries[0]) * (n_uniq + 1));
+    dict->qed_buf = malloc(buf_sz + 1);
+    if (!(dict->qed_entries && dict->qed_buf))
+        goto err;
+
+    dst = dict->qed_buf;
+    end = dict->qed_buf + buf_sz;
+    for (i = 0; i < n_uniq; ++i)
+    {
+        xhdr = fields[i].xhdr;
+        name = lsxpack_header_get_name(xhdr);
+        value = lsxpack_header_get_value(xhdr);
+        ede = &dict->qed_entries[i];
+        ede->ede_name_hash = fields[i].name_hash;
+        ede->ede_nameval_hash = fields[i].nameval_hash;
+        ede->ede_name_off = dst - dict->qed_buf;
+        ede->ede_name_len = xhdr->name_len;
+        ede->ede_val_len = xhdr->val_len;
+        memcpy(dst, name, xhdr->name_len);
+        dst += xhdr->name_len;
+        memcpy(dst, value, xhdr->val_len);
+        dst += xhdr->val_len;
+
+        /* Both forms of the instruction do not depend on the state of the
+         * dynamic table, which is what makes it possible to encode them
+         * ahead of time.
+         */
+        ede->ede_ins_off = dst - dict->qed_buf;
+        huff_saved = 0;
+        static_id = lsqpack_find_in_static_headers(name, xhdr->name_len);
+        if (static_id >= 0)
+        {
+            *dst = 0x80 | 0x40;
+            dst = lsqpack_enc_int(dst, end, static_id, 6);
+        }
+        else
+        {
+            *dst = 0x40;
+            r = qenc_enc_str(&huff_saved, 5, dst, end - dst,
+                                (const unsigned char *) name, xhdr->name_len);
+            if (r < 0)
+                goto err;
+            dst += r;
+        }
+        r = qenc_enc_str(&huff_saved, 7, dst, end - dst,
+                                (const unsigned char *) value, xhdr->val_len);
+        if (r < 0)
+            goto err;
+        dst += r;
+        ede->ede_ins_len = dst - dict->qed_buf - ede->ede_ins_off;
+        ede->ede_huff_saved = huff_saved;
+    }
+
+    dict->qed_n_entries = n_uniq;
+    free(fields);
+    return 0;
+
+  err:
+    free(fields);
+    lsqpack_enc_dict_cleanup(dict);
+    return -1;
+}
+
+
+void
+lsqpack_enc_dict_cleanup (struct lsqpack_enc_dict *dict)
+{
+    free(dict->qed_entries);
+    free(dict->qed_buf);
+    memset(dict, 0, sizeof(*dict));
+}
+
+
+int
+lsqpack_enc_use_dict (struct lsqpack_enc *enc,
+        const struct lsqpack_enc_dict *dict, unsigned max_inserts,
+        unsigned char *enc_buf, size_t *enc_sz_p)
+{
+    const struct lsqpack_enc_dict_entry *ede;
+    struct lsqpack_enc_table_entry *entry;
+    const char *name;
+    size_t enc_off, enc_buf_sz;
+    unsigned i, n_hist;
+
+    if ((enc->qpe_flags & LSQPACK_ENC_HEADER) || enc->qpe_ins_count)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (enc->qpe_hist_els)
+    {
+        n_hist = MIN(dict->qed_n_entries, enc->qpe_max_entries);
+        if (n_hist > enc->qpe_hist_nels)
+            qenc_hist_update_size(enc, n_hist);
+        n_hist = MIN(n_hist, enc->qpe_hist_nels);
+        /* Most frequent fields are added last to be evicted last */
+        for (i = n_hist; i > 0; --i)
+            qenc_hist_add(enc, dict->qed_entries[i - 1].ede_name_hash,
+                                dict->qed_entries[i - 1].ede_nameval_hash);
+        E_DEBUG("seeded history with %u entr%s from dictionary", n_hist,
+                                                n_hist == 1 ? "y" : "ies");
+    }
+
+    if (enc->qpe_flags & LSQPACK_ENC_QUEUE)
+    {
+        enc_buf_sz = 0;
+        for (i = 0; i < max_inserts && i < dict->qed_n_entries; ++i)
+            enc_buf_sz += dict->qed_entries[i].ede_ins_len;
+        enc_buf = qenc_queue_reserve(enc, enc_buf_sz, &enc_buf_sz);
+        if (!enc_buf)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    else
+        enc_buf_sz = *enc_sz_p;
+
+    enc_off = 0;
+    if (enc->qpe_buckets)
+        for (i = 0; i < max_inserts && i < dict->qed_n_entries; ++i)
+        {
+            ede = &dict->qed_entries[i];
+            if (enc->qpe_cur_bytes_used
+                        + ENTRY_COST(ede->ede_name_len, ede->ede_val_len)
+                                                > enc->qpe_cur_max_capacity
+                                || enc_off + ede->ede_ins_len > enc_buf_sz)
+                break;
+            name = (const char *) dict->qed_buf + ede->ede_name_off;
+            entry = lsqpack_enc_push_entry(enc, ede->ede_name_hash,
+                        ede->ede_nameval_hash, name, ede->ede_name_len,
+                        name + ede->ede_name_len, ede->ede_val_len);
+            if (!entry)
+                break;
+            memcpy(enc_buf + enc_off, dict->qed_buf + ede->ede_ins_off,
+                                                            ede->ede_ins_len);
+            enc_off += ede->ede_ins_len;
+            STATS_ADD(enc->qpe_stats, n_inserts, 1);
+            STATS_ADD(enc->qpe_stats, n_huff_bytes_saved,
+                                                        ede->ede_huff_saved);
+        }
+    STATS_PEAK(enc->qpe_stats, peak_table_size, enc->qpe_cur_bytes_used);
+    STATS_PEAK(enc->qpe_stats, peak_table_nelem, enc->qpe_nelem);
+
+    /* The Insert instructions are not charged to the compression ratio:
+     * they cannot be attributed to any input and would only discourage
+     * inserts while the first header blocks are encoded.
+     */
+    E_DEBUG("inserted %u entr%s from dictionary, %zu bytes", enc->qpe_nelem,
+                                enc->qpe_nelem == 1 ? "y" : "ies", enc_off);
+    if (enc->qpe_flags & LSQPACK_ENC_QUEUE)
+    {
+        enc->qpe_queue.eq_len += enc_off;
+        if (enc_sz_p)
+            *enc_sz_p = 0;
+    }
+    else
+        *enc_sz_p = enc_off;
+    return 0;
+}
+
+
+void
+lsqpack_enc_names_init (struct lsqpack_enc_names *names)
+{
+    memset(names, 0, sizeof(*names));
+}
+
+
+int
+lsqpack_enc_names_add (struct lsqpack_enc_names *names, const char *name,
+                unsigned name_len, const char *value, unsigned val_len)
+{
+    struct lsqpack_enc_name *new_names, *app_name;
+    unsigned n_alloc;
+
+    if (names->qen_n_names >= LSQPACK_MAX_ENC_NAMES)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (names->qen_n_names >= names->qen_n_alloc)
+    {
+        n_alloc = names->qen_n_alloc ? names->qen_n_alloc * 2 : 16;
+        new_names = realloc(names->qen_names,
+                                        sizeof(new_names[0]) * n_alloc);
+        if (!new_names)
+            return -1;
+        names->qen_names = new_names;
+        names->qen_n_alloc = n_alloc;
+    }
+
+    app_name = &names->qen_names[ names->qen_n_names ];
+    app_name->een_name = name;
+    app_name->een_name_len = name_len;
+    app_name->een_name_hash = QPACK_HASH(name, name_len, LSQPACK_HASH_SEED);
+    app_name->een_static_name_id = lsqpack_find_in_static_headers(name,
+                                                                    name_len);
+    app_name->een_value = value;
+    if (value)
+    {
+        app_name->een_val_len = val_len;
+        app_name->een_nameval_hash = QPACK_HASH(value, val_len,
+                                                    app_name->een_name_hash);
+        app_name->een_static_full_id = find_in_static_full(name, name_len,
+                                                            value, val_len);
+    }
+    else
+    {
+        app_name->een_val_len = 0;
+        app_name->een_nameval_hash = 0;
+        app_name->een_static_full_id = -1;
+    }
+
+    return (int) names->qen_n_names++;
+}
+
+
+void
+lsqpack_enc_names_cleanup (struct lsqpack_enc_names *names)
+{
+    free(names->qen_names);
+    memset(names, 0, sizeof(*names));
+}
+
+
+void
+lsqpack_enc_set_names (struct lsqpack_enc *enc,
+                                        const struct lsqpack_enc_names *names)
+{
+    enc->qpe_names = names;
+    E_DEBUG("%s name registry with %u name%.*s", names ? "set" : "unset",
+        names ? names->qen_n_names : 0,
+        !names || names->qen_n_names != 1, "s");
+}
+
+int
+lsqpack_enc_set_max_capacity (struct lsqpack_enc *enc, unsigned capacity,
+                                    unsigned char *tsu_buf, size_t *tsu_buf_sz)
+{
+    unsigned char *p;
+    size_t avail;
+
+    if (capacity > enc->qpe_real_max_capacity)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (capacity == enc->qpe_cur_max_capacity)
+    {
+        E_DEBUG("set_capacity: capacity stays unchanged at %u", capacity);
+        if (tsu_buf_sz)
+            *tsu_buf_sz = 0;
+        return 0;
+    }
+
+    if (enc->qpe_flags & LSQPACK_ENC_QUEUE)
+    {
+        tsu_buf = qenc_queue_reserve(enc, LSQPACK_LONGEST_SDTC, &avail);
+        if (!tsu_buf)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    else if (tsu_buf && tsu_buf_sz)
+        avail = *tsu_buf_sz;
+    else
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    p = tsu_buf;
+    *p = 0x20;
+    p = lsqpack_enc_int(p, tsu_buf + avail, capacity, 5);
+    if (p <= tsu_buf)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+    if (enc->qpe_flags & LSQPACK_ENC_QUEUE)
+    {
+        enc->qpe_queue.eq_len += p - tsu_buf;
+        if (tsu_buf_sz)
+            *tsu_buf_sz = 0;
+    }
+    else
+        *tsu_buf_sz = p - tsu_buf;
+
+    E_DEBUG("maximum capacity goes from %u to %u", enc->qpe_cur_max_capacity,
+                                                                    capacity);
+    enc->qpe_cur_max_capacity = capacity;
+    qenc_remove_overflow_entries(enc);
+    return 0;
+}
+
+
+/* Called after the acknowledged ID advances */
+static void
+qenc_update_risked_list (struct lsqpack_enc *enc)
+{
+    struct lsqpack_header_info *hinfo;
+
+    while ((hinfo = TAILQ_FIRST(&enc->qpe_risked_hinfos))
+                                        && !qenc_hinfo_at_risk(enc, hinfo))
+        qenc_remove_from_risked_list(enc, hinfo);
+}
+
+
+static int
+enc_proc_header_ack (struct lsqpack_enc *enc, uint64_t stream_id)
+{
+    struct lsqpack_header_info *hinfo;
+
+    E_DEBUG("got Header Ack instruction, stream=%"PRIu64, stream_id);
+    if (stream_id > MAX_QUIC_STREAM_ID)
+        return -1;
+
+    hinfo = enc_find_hinfo(enc, stream_id);
 
     /*
      * XXX if an ACK comes in while a header is being encoded, it will not
@@ -2229,6 +4365,7 @@ enc_proc_header_ack (struct lsqpack_enc *enc, uint64_t stream_id)
     if (!hinfo)
         return -1;
 
+    TRACE3(enc_header_ack, enc, stream_id, hinfo->qhi_max_id);
     if (hinfo->qhi_max_id > enc->qpe_max_acked_id)
     {
         qenc_remove_from_risked_list(enc, hinfo);
@@ -2269,6 +4406,7 @@ enc_proc_ici (struct lsqpack_enc *enc, uint64_t ins_count)
         return -1;
     }
 
+    TRACE2(enc_ici, enc, max_acked);
     if (max_acked > enc->qpe_max_acked_id)
     {
         enc->qpe_last_ici = max_acked;
@@ -2299,9 +4437,11 @@ enc_proc_stream_cancel (struct lsqpack_enc *enc, uint64_t stream_id)
     }
 
     count = 0;
-    for (hinfo = TAILQ_FIRST(&enc->qpe_all_hinfos); hinfo; hinfo = next)
+    hinfo = enc->qpe_hinfo_buckets ? TAILQ_FIRST(&enc->qpe_hinfo_buckets[
+                    HINFO_BUCKNO(enc->qpe_hinfo_nbits, stream_id)]) : NULL;
+    for ( ; hinfo; hinfo = next)
     {
-        next = TAILQ_NEXT(hinfo, qhi_next_all);
+        next = TAILQ_NEXT(hinfo, qhi_next_id);
         if (hinfo->qhi_stream_id == stream_id)
         {
             E_DEBUG("cancel header block for stream %"PRIu64", seqno %u",
@@ -2315,6 +4455,7 @@ enc_proc_stream_cancel (struct lsqpack_enc *enc, uint64_t stream_id)
 
     E_DEBUG("cancelled %u header block%.*s of stream %"PRIu64,
                                         count, count != 1, "s", stream_id);
+    TRACE3(enc_cancel, enc, stream_id, count);
     return 0;
 }
 
@@ -2335,6 +4476,10 @@ lsqpack_dec_int (const unsigned char **src_p, const unsigned char *src_end,
     unsigned char prefix_max;
     unsigned M, nread;
     uint64_t val, B;
+#if LSQPACK_FAST_INT
+    uint64_t w, stop;
+    unsigned nbits;
+#endif
 
     src = *src_p;
 
@@ -2356,6 +4501,33 @@ lsqpack_dec_int (const unsigned char **src_p, const unsigned char *src_end,
         return 0;
     }
 
+#if LSQPACK_FAST_INT
+    if (src_end - src >= 8)
+    {
+        memcpy(&w, src, sizeof(w));
+        /* The last byte is the first one without the continuation bit */
+        stop = ~w & 0x8080808080808080ull;
+        if (stop)
+        {
+            nbits = (unsigned) __builtin_ctzll(stop) + 1;
+            w &= ~0ull >> (64 - nbits);
+            w &= 0x7F7F7F7F7F7F7F7Full;
+            /* Gather 7-bit groups: 14 bits per quarter, 28 bits per half,
+             * and 56 bits total.
+             */
+            w = ((w & 0x7F007F007F007F00ull) >> 1)
+                                        | (w & 0x007F007F007F007Full);
+            w = ((w & 0x3FFF00003FFF0000ull) >> 2)
+                                        | (w & 0x00003FFF00003FFFull);
+            w = ((w & 0x0FFFFFFF00000000ull) >> 4)
+                                        | (w & 0x000000000FFFFFFFull);
+            *src_p = src + nbits / 8;
+            *value_p = val + w;
+            return 0;
+        }
+    }
+#endif
+
     M = 0;
     do
     {
@@ -2380,7 +4552,8 @@ lsqpack_dec_int (const unsigned char **src_p, const unsigned char *src_end,
                 return -2;
         }
     }
-    while (B & 0x80);
+    /* Stop after ten continuation bytes: more do not fit into 64 bits */
+    while ((B & 0x80) && M <= 63);
 
     if (M <= 63 || (M == 70 && src[-1] <= 1 && (val & (1ull << 63))))
     {
@@ -2472,26 +4645,583 @@ lsqpack_enc_decoder_in (struct lsqpack_enc *enc,
             break;
         }
     }
-    enc->qpe_bytes_out += buf_sz;
+    enc->qpe_bytes_out += buf_sz;
+
+    return 0;
+}
+
+
+void
+lsqpack_enc_get_stats (const struct lsqpack_enc *enc,
+                                            struct lsqpack_enc_stats *stats)
+{
+    *stats = enc->qpe_stats;
+}
+
+
+float
+lsqpack_enc_ratio (const struct lsqpack_enc *enc)
+{
+    float ratio;
+
+    if (enc->qpe_bytes_in)
+    {
+        ratio = (float) enc->qpe_bytes_out / (float) enc->qpe_bytes_in;
+        E_DEBUG("bytes out: %u; bytes in: %u, ratio: %.3f",
+                            enc->qpe_bytes_out, enc->qpe_bytes_in, ratio);
+        return ratio;
+    }
+    else
+        return 0;
+}
+
+
+/* Saved state is a flat sequence of fixed-width little-endian integers and
+ * byte strings.  It contains no pointers: lists are saved in order and
+ * links between elements are saved as ordinals.
+ *
+ * When saving, bytes that do not fit into the output buffer are counted,
+ * but not written.  This way, the same code calculates the state size.
+ * When restoring, reading past the end of the input sets si_err.
+ */
+#define LSQPACK_ENC_STATE_MAGIC 0x53455051u     /* "QPES" */
+#define LSQPACK_DEC_STATE_MAGIC 0x53445051u     /* "QPDS" */
+#define LSQPACK_STATE_VERSION 1
+
+/* Hashes are saved along with entries.  To make sure that they can be used
+ * after restore, the state records the hash of a fixed string.
+ */
+#define STATE_HASH_CHECK() QPACK_HASH("lsqpack", 7, LSQPACK_HASH_SEED)
+
+struct state_out
+{
+    unsigned char          *so_buf;     /* Set to NULL once it is full */
+    size_t                  so_size;
+    size_t                  so_off;
+};
+
+
+struct state_in
+{
+    const unsigned char    *si_p;
+    const unsigned char    *si_end;
+    int                     si_err;
+};
+
+
+static void
+state_put (struct state_out *out, const void *src, size_t len)
+{
+    if (out->so_buf && out->so_size - out->so_off >= len)
+        memcpy(out->so_buf + out->so_off, src, len);
+    else
+        out->so_buf = NULL;
+    out->so_off += len;
+}
+
+
+static void
+state_put_u32 (struct state_out *out, uint32_t val)
+{
+    const unsigned char buf[4] = {
+        (unsigned char) val,         (unsigned char) (val >> 8),
+        (unsigned char) (val >> 16), (unsigned char) (val >> 24),
+    };
+
+    state_put(out, buf, sizeof(buf));
+}
+
+
+static void
+state_put_u64 (struct state_out *out, uint64_t val)
+{
+    state_put_u32(out, (uint32_t) val);
+    state_put_u32(out, (uint32_t) (val >> 32));
+}
+
+
+static void
+state_put_float (struct state_out *out, float val)
+{
+    uint32_t u32;
+
+    memcpy(&u32, &val, sizeof(u32));
+    state_put_u32(out, u32);
+}
+
+
+static const unsigned char *
+state_get (struct state_in *in, size_t len)
+{
+    const unsigned char *p;
+
+    if ((size_t) (in->si_end - in->si_p) >= len)
+    {
+        p = in->si_p;
+        in->si_p += len;
+        return p;
+    }
+    else
+    {
+        in->si_p = in->si_end;
+        in->si_err = 1;
+        return NULL;
+    }
+}
+
+
+static uint32_t
+state_get_u32 (struct state_in *in)
+{
+    const unsigned char *p;
+
+    p = state_get(in, 4);
+    if (p)
+        return (uint32_t) p[0]         | (uint32_t) p[1] << 8
+             | (uint32_t) p[2] << 16   | (uint32_t) p[3] << 24;
+    else
+        return 0;
+}
+
+
+static uint64_t
+state_get_u64 (struct state_in *in)
+{
+    uint64_t val;
+
+    val = state_get_u32(in);
+    return val | (uint64_t) state_get_u32(in) << 32;
+}
+
+
+static float
+state_get_float (struct state_in *in)
+{
+    uint32_t u32;
+    float val;
+
+    u32 = state_get_u32(in);
+    memcpy(&val, &u32, sizeof(val));
+    return val;
+}
+
+
+/* Return true if there is enough input left for `count' records of
+ * `rec_size' bytes.  Used to check counts before allocating memory.
+ */
+static int
+state_has (const struct state_in *in, uint32_t count, size_t rec_size)
+{
+    return (size_t) (in->si_end - in->si_p) / rec_size >= count;
+}
+
+
+/* Decoder stream handler is saved as a number */
+enum dec_stream_handler {
+    DSH_NONE, DSH_HEADER_ACK, DSH_ICI, DSH_STREAM_CANCEL,
+};
+
+
+static void
+qenc_write_state (const struct lsqpack_enc *enc, struct state_out *out)
+{
+    const struct lsqpack_enc_table_entry *entry;
+    const struct lsqpack_header_info *hinfo, *risked, *same;
+    enum dec_stream_handler handler;
+    unsigned n, count;
+
+    state_put_u32(out, LSQPACK_ENC_STATE_MAGIC);
+    state_put_u32(out, LSQPACK_STATE_VERSION);
+    state_put_u32(out, STATE_HASH_CHECK());
+    state_put_u32(out, enc->qpe_real_max_capacity);
+    state_put_u32(out, enc->qpe_cur_max_capacity);
+    state_put_u32(out, enc->qpe_ins_count);
+    state_put_u32(out, enc->qpe_max_acked_id);
+    state_put_u32(out, enc->qpe_last_ici);
+    state_put_u32(out, enc->qpe_dropped);
+    state_put_u32(out, enc->qpe_cur_streams_at_risk);
+    state_put_u32(out, enc->qpe_bytes_in);
+    state_put_u32(out, enc->qpe_bytes_out);
+    state_put_float(out, enc->qpe_table_nelem_ema);
+    state_put_float(out, enc->qpe_header_count_ema);
+    state_put_float(out, enc->qpe_ins_bytes_ema);
+
+    if (enc->qpe_dec_stream_state.handler == enc_proc_header_ack)
+        handler = DSH_HEADER_ACK;
+    else if (enc->qpe_dec_stream_state.handler == enc_proc_ici)
+        handler = DSH_ICI;
+    else if (enc->qpe_dec_stream_state.handler == enc_proc_stream_cancel)
+        handler = DSH_STREAM_CANCEL;
+    else
+        handler = DSH_NONE;
+    state_put_u32(out, handler);
+    state_put_u32(out, enc->qpe_dec_stream_state.dec_int_state.resume);
+    state_put_u32(out, enc->qpe_dec_stream_state.dec_int_state.M);
+    state_put_u32(out, enc->qpe_dec_stream_state.dec_int_state.nread);
+    state_put_u64(out, enc->qpe_dec_stream_state.dec_int_state.val);
+
+    /* Entries, oldest first */
+    state_put_u32(out, enc->qpe_nelem);
+    STAILQ_FOREACH(entry, &enc->qpe_all_entries, ete_next_all)
+    {
+        state_put_u32(out, entry->ete_id);
+        state_put_u32(out, entry->ete_when_added_used);
+        state_put_u32(out, entry->ete_when_added_dropped);
+        state_put_u32(out, entry->ete_n_reffd);
+        state_put_u32(out, entry->ete_name_hash);
+        state_put_u32(out, entry->ete_nameval_hash);
+        state_put_u32(out, entry->ete_name_len);
+        state_put_u32(out, entry->ete_val_len);
+        state_put(out, entry->ete_buf,
+                                entry->ete_name_len + entry->ete_val_len);
+    }
+
+    state_put_u32(out, enc->qpe_hinfo_nelem);
+    TAILQ_FOREACH(hinfo, &enc->qpe_all_hinfos, qhi_next_all)
+    {
+        state_put_u64(out, hinfo->qhi_stream_id);
+        state_put_u32(out, hinfo->qhi_seqno);
+        state_put_u32(out, hinfo->qhi_bytes_inserted);
+        state_put_u32(out, hinfo->qhi_min_id);
+        state_put_u32(out, hinfo->qhi_max_id);
+    }
+
+    /* No header is in progress, so the risked list contains exactly the
+     * header infos that are at risk.  They are saved in the order of the
+     * list of all header infos: the risked list order is recreated from
+     * their IDs.  Each risked header info is saved as its ordinal in the
+     * list of all header infos, followed by the ordinal among the risked
+     * header infos of the next header info in the same-stream ring.
+     */
+    count = 0;
+    TAILQ_FOREACH(risked, &enc->qpe_risked_hinfos, qhi_next_risked)
+        ++count;
+    state_put_u32(out, count);
+    n = 0;
+    TAILQ_FOREACH(hinfo, &enc->qpe_all_hinfos, qhi_next_all)
+    {
+        if (qenc_hinfo_at_risk(enc, hinfo))
+        {
+            state_put_u32(out, n);
+            count = 0;
+            TAILQ_FOREACH(same, &enc->qpe_all_hinfos, qhi_next_all)
+                if (same == hinfo->qhi_same_stream_id)
+                    break;
+                else if (qenc_hinfo_at_risk(enc, same))
+                    ++count;
+            state_put_u32(out, count);
+        }
+        ++n;
+    }
+
+    state_put_u32(out, enc->qpe_hist_els != NULL);
+    if (enc->qpe_hist_els)
+    {
+        state_put_u32(out, enc->qpe_hist_nels);
+        state_put_u32(out, enc->qpe_hist_idx);
+        state_put_u32(out, enc->qpe_hist_wrapped);
+        count = enc->qpe_hist_wrapped ? enc->qpe_hist_nels : enc->qpe_hist_idx;
+        for (n = 0; n < count; ++n)
+        {
+            state_put_u32(out, enc->qpe_hist_els[n].he_hashes[HE_NAME]);
+            state_put_u32(out, enc->qpe_hist_els[n].he_hashes[HE_NAMEVAL]);
+        }
+    }
+
+    state_put_u32(out, (uint32_t) enc->qpe_queue.eq_len);
+    if (enc->qpe_queue.eq_len)
+        state_put(out, enc->qpe_queue.eq_buf + enc->qpe_queue.eq_off,
+                                                    enc->qpe_queue.eq_len);
+}
+
+
+size_t
+lsqpack_enc_state_size (const struct lsqpack_enc *enc)
+{
+    struct state_out out = { NULL, 0, 0, };
+
+    qenc_write_state(enc, &out);
+    return out.so_off;
+}
+
+
+ssize_t
+lsqpack_enc_save_state (const struct lsqpack_enc *enc, unsigned char *buf,
+                                                                size_t bufsz)
+{
+    struct state_out out = { buf, bufsz, 0, };
+
+    if (enc->qpe_flags & LSQPACK_ENC_HEADER)
+    {
+        E_INFO("cannot save state: header block is being encoded");
+        errno = EBUSY;
+        return -1;
+    }
+
+    qenc_write_state(enc, &out);
+    if (out.so_buf)
+    {
+        E_DEBUG("saved %zu bytes of state", out.so_off);
+        return (ssize_t) out.so_off;
+    }
+    else
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+}
+
+
+/* Entry with no name and no value: eight integers */
+#define ENC_STATE_ENTRY_SIZE (8 * 4)
+#define ENC_STATE_HINFO_SIZE (8 + 4 * 4)
+
+int
+lsqpack_enc_restore_state (struct lsqpack_enc *enc, const unsigned char *buf,
+                                                                size_t bufsz)
+{
+    struct state_in in = { buf, buf + bufsz, 0, };
+    struct lsqpack_enc_table_entry *entry;
+    struct lsqpack_header_info *hinfo;
+    struct risked_hinfo {
+        struct lsqpack_header_info *hinfo;
+        uint32_t                    same;   /* Ordinal in risked[] */
+    }                              *risked = NULL;
+    const unsigned char *bytes;
+    unsigned char *dst;
+    uint32_t n, count, n_hinfos, n_risked, ordinal, id;
+    uint32_t name_len, val_len, name_hash, nameval_hash, vals[4];
+    uint32_t hist_nels, hist_idx, hist_wrapped;
+    uint64_t stream_id;
+    size_t avail;
+    unsigned prev, handler;
+
+    if (enc->qpe_ins_count || enc->qpe_nelem
+            || !TAILQ_EMPTY(&enc->qpe_all_hinfos)
+            || (enc->qpe_flags & LSQPACK_ENC_HEADER)
+            || enc->qpe_hist_idx || enc->qpe_hist_wrapped
+            || enc->qpe_queue.eq_len)
+    {
+        E_INFO("cannot restore state: encoder is not new");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (state_get_u32(&in) != LSQPACK_ENC_STATE_MAGIC
+            || state_get_u32(&in) != LSQPACK_STATE_VERSION
+            || state_get_u32(&in) != STATE_HASH_CHECK()
+            || state_get_u32(&in) != enc->qpe_real_max_capacity)
+    {
+        E_INFO("cannot restore state: it is not from a compatible encoder");
+        errno = EINVAL;
+        return -1;
+    }
+
+    enc->qpe_cur_max_capacity = state_get_u32(&in);
+    enc->qpe_ins_count = state_get_u32(&in);
+    enc->qpe_max_acked_id = state_get_u32(&in);
+    enc->qpe_last_ici = state_get_u32(&in);
+    enc->qpe_dropped = state_get_u32(&in);
+    enc->qpe_cur_streams_at_risk = state_get_u32(&in);
+    enc->qpe_bytes_in = state_get_u32(&in);
+    enc->qpe_bytes_out = state_get_u32(&in);
+    enc->qpe_table_nelem_ema = state_get_float(&in);
+    enc->qpe_header_count_ema = state_get_float(&in);
+    enc->qpe_ins_bytes_ema = state_get_float(&in);
+    if (enc->qpe_cur_max_capacity > enc->qpe_real_max_capacity
+            || enc->qpe_cur_streams_at_risk > enc->qpe_max_risked_streams)
+        goto einval;
+
+    handler = state_get_u32(&in);
+    enc->qpe_dec_stream_state.dec_int_state.resume = state_get_u32(&in);
+    enc->qpe_dec_stream_state.dec_int_state.M = state_get_u32(&in);
+    enc->qpe_dec_stream_state.dec_int_state.nread = state_get_u32(&in);
+    enc->qpe_dec_stream_state.dec_int_state.val = state_get_u64(&in);
+    switch (handler)
+    {
+    case DSH_HEADER_ACK:
+        enc->qpe_dec_stream_state.handler = enc_proc_header_ack;
+        break;
+    case DSH_ICI:
+        enc->qpe_dec_stream_state.handler = enc_proc_ici;
+        break;
+    case DSH_STREAM_CANCEL:
+        enc->qpe_dec_stream_state.handler = enc_proc_stream_cancel;
+        break;
+    case DSH_NONE:
+        enc->qpe_dec_stream_state.handler = NULL;
+        break;
+    default:
+        goto einval;
+    }
+    if (enc->qpe_dec_stream_state.dec_int_state.resume > 1
+            || (enc->qpe_dec_stream_state.dec_int_state.resume
+                                && handler == DSH_NONE))
+        goto einval;
+
+    /* Entries keep their hashes: no rehashing is necessary */
+    count = state_get_u32(&in);
+    if (count > enc->qpe_max_entries
+                        || !state_has(&in, count, ENC_STATE_ENTRY_SIZE))
+        goto einval;
+    for (n = 0; n < count; ++n)
+    {
+        id = state_get_u32(&in);
+        vals[0] = state_get_u32(&in);
+        vals[1] = state_get_u32(&in);
+        vals[2] = state_get_u32(&in);
+        name_hash = state_get_u32(&in);
+        nameval_hash = state_get_u32(&in);
+        name_len = state_get_u32(&in);
+        val_len = state_get_u32(&in);
+        if (name_len > enc->qpe_cur_max_capacity
+                || val_len > enc->qpe_cur_max_capacity)
+            goto einval;
+        bytes = state_get(&in, (size_t) name_len + val_len);
+        if (!bytes || id != enc->qpe_ins_count - count + 1 + n)
+            goto einval;
+        if (enc->qpe_nelem >= N_BUCKETS(enc->qpe_nbits) / 2
+                                            && 0 != qenc_grow_tables(enc))
+            goto enomem;
+        entry = ring_arena_alloc(&enc->qpe_arena,
+                                sizeof(*entry) + name_len + val_len);
+        if (!entry)
+            goto enomem;
+        entry->ete_id = id;
+        entry->ete_when_added_used = vals[0];
+        entry->ete_when_added_dropped = vals[1];
+        entry->ete_n_reffd = vals[2];
+        entry->ete_name_hash = name_hash;
+        entry->ete_nameval_hash = nameval_hash;
+        entry->ete_name_len = name_len;
+        entry->ete_val_len = val_len;
+        memcpy(entry->ete_buf, bytes, (size_t) name_len + val_len);
+        qenc_link_entry(enc, entry);
+    }
+    if (enc->qpe_cur_bytes_used > enc->qpe_cur_max_capacity)
+        goto einval;
+
+    /* Header infos are allocated after the capacity is set, as it limits
+     * the memory they take up.
+     */
+    n_hinfos = state_get_u32(&in);
+    if (!state_has(&in, n_hinfos, ENC_STATE_HINFO_SIZE))
+        goto einval;
+    count = 0;
+    for (n = 0; n < n_hinfos; ++n)
+    {
+        stream_id = state_get_u64(&in);
+        hinfo = enc_alloc_hinfo(enc, stream_id);
+        if (!hinfo)
+            goto enomem;
+        hinfo->qhi_seqno = state_get_u32(&in);
+        hinfo->qhi_bytes_inserted = state_get_u32(&in);
+        hinfo->qhi_min_id = state_get_u32(&in);
+        hinfo->qhi_max_id = state_get_u32(&in);
+        count += qenc_hinfo_at_risk(enc, hinfo);
+    }
+
+    /* Every header info that is at risk must be on the risked list */
+    n_risked = state_get_u32(&in);
+    if (n_risked != count || !state_has(&in, n_risked, 2 * 4))
+        goto einval;
+    if (n_risked)
+    {
+        risked = malloc(sizeof(risked[0]) * n_risked);
+        if (!risked)
+            goto enomem;
+    }
+    hinfo = TAILQ_FIRST(&enc->qpe_all_hinfos);
+    prev = 0;
+    for (n = 0; n < n_risked; ++n)
+    {
+        ordinal = state_get_u32(&in);
+        risked[n].same = state_get_u32(&in);
+        if (ordinal < prev + (n > 0) || ordinal >= n_hinfos
+                                            || risked[n].same >= n_risked)
+            goto einval;
+        for ( ; prev < ordinal; ++prev)
+            hinfo = TAILQ_NEXT(hinfo, qhi_next_all);
+        if (!qenc_hinfo_at_risk(enc, hinfo))
+            goto einval;
+        risked[n].hinfo = hinfo;
+        qenc_insert_risked(enc, hinfo);
+    }
+    for (n = 0; n < n_risked; ++n)
+    {
+        hinfo = risked[ risked[n].same ].hinfo;
+        if (hinfo->qhi_stream_id != risked[n].hinfo->qhi_stream_id)
+            goto einval;
+        risked[n].hinfo->qhi_same_stream_id = hinfo;
+    }
+    free(risked);
+    risked = NULL;
+
+    /* History */
+    if (state_get_u32(&in) != (enc->qpe_hist_els != NULL))
+    {
+        E_INFO("cannot restore state: history setting does not match");
+        errno = EINVAL;
+        goto err;
+    }
+    if (enc->qpe_hist_els)
+    {
+        hist_nels = state_get_u32(&in);
+        hist_idx = state_get_u32(&in);
+        hist_wrapped = state_get_u32(&in);
+        if ((hist_nels ? hist_idx >= hist_nels : hist_idx != 0)
+                                                        || hist_wrapped > 1)
+            goto einval;
+        count = hist_wrapped ? hist_nels : hist_idx;
+        if (!state_has(&in, count, 2 * 4))
+            goto einval;
+        qenc_hist_update_size(enc, hist_nels);
+        if (enc->qpe_hist_nels != hist_nels)
+            goto enomem;
+        /* There was nothing to carry over, but the buckets may have been
+         * linked as if the history were full.
+         */
+        memset(enc->qpe_hist_buckets, 0xFF, sizeof(enc->qpe_hist_buckets[0])
+                                    * N_HES * N_BUCKETS(enc->qpe_hist_nbits));
+        for (n = 0; n < count; ++n)
+        {
+            enc->qpe_hist_els[n].he_hashes[HE_NAME] = state_get_u32(&in);
+            enc->qpe_hist_els[n].he_hashes[HE_NAMEVAL] = state_get_u32(&in);
+            qenc_hist_link(enc, n);
+        }
+        enc->qpe_hist_idx = hist_idx;
+        enc->qpe_hist_wrapped = hist_wrapped;
+    }
 
-    return 0;
-}
+    count = state_get_u32(&in);
+    if (count)
+    {
+        bytes = state_get(&in, count);
+        if (!bytes || !(enc->qpe_flags & LSQPACK_ENC_QUEUE))
+            goto einval;
+        dst = qenc_queue_reserve(enc, count, &avail);
+        if (!dst)
+            goto enomem;
+        memcpy(dst, bytes, count);
+        enc->qpe_queue.eq_len += count;
+    }
 
+    if (in.si_err || in.si_p != in.si_end)
+        goto einval;
 
-float
-lsqpack_enc_ratio (const struct lsqpack_enc *enc)
-{
-    float ratio;
+    E_DEBUG("restored state: %u entries, %u header infos, %u at risk",
+        enc->qpe_nelem, enc->qpe_hinfo_nelem, n_risked);
+    return 0;
 
-    if (enc->qpe_bytes_in)
-    {
-        ratio = (float) enc->qpe_bytes_out / (float) enc->qpe_bytes_in;
-        E_DEBUG("bytes out: %u; bytes in: %u, ratio: %.3f",
-                            enc->qpe_bytes_out, enc->qpe_bytes_in, ratio);
-        return ratio;
-    }
-    else
-        return 0;
+  einval:
+    E_INFO("cannot restore state: it is malformed");
+    errno = EINVAL;
+    goto err;
+  enomem:
+    errno = ENOMEM;
+  err:
+    free(risked);
+    return -1;
 }
 
 
@@ -2521,10 +5251,15 @@ struct lsqpack_dec_table_entry
     unsigned    dte_name_hash;
     unsigned    dte_nameval_hash;
     unsigned    dte_name_idx;
+    unsigned    dte_alloc_size; /* Size requested from the allocator */
+    unsigned    dte_app_token;  /* Valid if DTEF_APP_TOKEN is set */
     enum {
         DTEF_NAME_HASH      = 1 << 0,
         DTEF_NAMEVAL_HASH   = 1 << 1,
         DTEF_NAME_IDX       = 1 << 2,
+        /* Name has been looked up in the decoder name registry */
+        DTEF_APP_RESOLVED   = 1 << 3,
+        DTEF_APP_TOKEN      = 1 << 4,
     }           dte_flags;
     char        dte_buf[0];     /* Contains both name and value */
 };
@@ -2623,6 +5358,30 @@ ringbuf_cleanup (struct lsqpack_ringbuf *rbuf)
 }
 
 
+/* Reallocate the element array to hold `nalloc' slots.  The ring must have
+ * fewer than `nalloc' elements.  Failure leaves the ring as it was.
+ */
+static void
+ringbuf_shrink (struct lsqpack_ringbuf *rbuf, unsigned nalloc)
+{
+    void **els;
+    unsigned count, i;
+
+    count = ringbuf_count(rbuf);
+    assert(count < nalloc);
+    els = malloc(nalloc * sizeof(rbuf->rb_els[0]));
+    if (!els)
+        return;
+    for (i = 0; i < count; ++i)
+        els[i] = rbuf->rb_els[(rbuf->rb_tail + i) % rbuf->rb_nalloc];
+    free(rbuf->rb_els);
+    rbuf->rb_els = els;
+    rbuf->rb_nalloc = nalloc;
+    rbuf->rb_tail = 0;
+    rbuf->rb_head = count;
+}
+
+
 static void *
 ringbuf_get_head (const struct lsqpack_ringbuf *rbuf, unsigned off)
 {
@@ -2652,116 +5411,427 @@ ringbuf_add (struct lsqpack_ringbuf *rbuf, void *el)
 
     if (!ringbuf_full(rbuf))
     {
-  insert:
-        rbuf->rb_els[ rbuf->rb_head ] = el;
-        rbuf->rb_head = (rbuf->rb_head + 1) % rbuf->rb_nalloc;
-        return 0;
+  insert:
+        rbuf->rb_els[ rbuf->rb_head ] = el;
+        rbuf->rb_head = (rbuf->rb_head + 1) % rbuf->rb_nalloc;
+        return 0;
+    }
+
+    if (rbuf->rb_nalloc)
+    {
+        els = malloc(rbuf->rb_nalloc * 2 * sizeof(rbuf->rb_els[0]));
+        if (els)
+        {
+            if (rbuf->rb_head >= rbuf->rb_tail)
+            {
+                count = rbuf->rb_head - rbuf->rb_tail + 1;
+                memcpy(els, rbuf->rb_els + rbuf->rb_tail,
+                                    count * sizeof(rbuf->rb_els[0]));
+                rbuf->rb_tail = 0;
+                rbuf->rb_head = count - 1;
+            }
+            else
+            {
+                memcpy(els, rbuf->rb_els,
+                            (rbuf->rb_head + 1) * sizeof(rbuf->rb_els[0]));
+                memcpy(els + rbuf->rb_nalloc + rbuf->rb_tail,
+                        rbuf->rb_els + rbuf->rb_tail,
+                        (rbuf->rb_nalloc - rbuf->rb_tail)
+                                                * sizeof(rbuf->rb_els[0]));
+                rbuf->rb_tail += rbuf->rb_nalloc;
+
+            }
+            free(rbuf->rb_els);
+            rbuf->rb_els = els;
+            rbuf->rb_nalloc *= 2;
+            goto insert;
+        }
+        return -1;
+    }
+    else
+    {
+        /* First time */
+        rbuf->rb_els = malloc(4 * sizeof(rbuf->rb_els[0]));
+        if (rbuf->rb_els)
+        {
+            rbuf->rb_nalloc = 4;
+            goto insert;
+        }
+        return -1;
+    }
+}
+
+
+#define ID_MINUS(a, b) ( (dec)->qpd_max_entries ? \
+    ((a) + (dec)->qpd_max_entries * 2 - (b)) % ((dec)->qpd_max_entries * 2) : 0)
+
+#define ID_PLUS(a, b) ( (dec)->qpd_max_entries ? \
+    ((a) + (b)) % ((dec)->qpd_max_entries * 2) : 0 )
+
+static struct lsqpack_dec_table_entry *
+qdec_get_table_entry_rel (const struct lsqpack_dec *dec,
+                                            lsqpack_abs_id_t relative_idx)
+{
+    ++relative_idx;
+    if (ringbuf_count(&dec->qpd_dyn_table) >= relative_idx)
+        return ringbuf_get_head(&dec->qpd_dyn_table, relative_idx);
+    else
+        return NULL;
+}
+
+
+static struct lsqpack_dec_table_entry *
+qdec_get_table_entry_abs (const struct lsqpack_dec *dec,
+                                                lsqpack_abs_id_t abs_idx)
+{
+    unsigned off;
+
+    off = ID_MINUS(dec->qpd_last_id, abs_idx);
+    return qdec_get_table_entry_rel(dec, off);
+}
+
+
+static void *
+qdec_malloc (void *ctx, size_t size)
+{
+    return malloc(size);
+}
+
+
+static void *
+qdec_realloc (void *ctx, void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+
+static void
+qdec_free (void *ctx, void *ptr)
+{
+    free(ptr);
+}
+
+
+static const struct lsqpack_dec_alloc_if malloc_alloc_if =
+{
+    .dai_alloc      = qdec_malloc,
+    .dai_realloc    = qdec_realloc,
+    .dai_free       = qdec_free,
+};
+
+
+static const struct lsqpack_dec_alloc_if arena_alloc_if =
+{
+    .dai_alloc      = ring_arena_alloc,
+    .dai_realloc    = ring_arena_realloc,
+    .dai_free       = ring_arena_free,
+};
+
+
+void
+lsqpack_dec_init (struct lsqpack_dec *dec, void *logger_ctx,
+    unsigned dyn_table_size, unsigned max_risked_streams,
+    const struct lsqpack_dec_hset_if *dh_if, enum lsqpack_dec_opts opts)
+{
+    memset(dec, 0, sizeof(*dec));
+    dec->qpd_opts = opts;
+    dec->qpd_logger_ctx = logger_ctx;
+    dec->qpd_max_capacity = dyn_table_size;
+    dec->qpd_cur_max_capacity = dyn_table_size;
+    dec->qpd_max_entries = dec->qpd_max_capacity / DYNAMIC_ENTRY_OVERHEAD;
+    dec->qpd_last_id = dec->qpd_max_entries * 2 - 1;
+    dec->qpd_largest_known_id = dec->qpd_max_entries * 2 - 1;
+    dec->qpd_max_risked_streams = max_risked_streams;
+    dec->qpd_dh_if = dh_if;
+    TAILQ_INIT(&dec->qpd_hbrcs);
+    TAILQ_INIT(&dec->qpd_free_hbrcs);
+    /* Live entries fit into the dynamic table capacity, but a new entry is
+     * allocated before old entries are evicted to make room for it, and
+     * chunk headers take up some space, too.
+     */
+    if ((opts & LSQPACK_DEC_OPT_RING_ARENA) && dyn_table_size)
+    {
+        dec->qpd_arena.ra_size = (size_t) dyn_table_size * 2;
+        dec->qpd_arena.ra_buf = malloc(dec->qpd_arena.ra_size);
+    }
+    if (dec->qpd_arena.ra_buf)
+    {
+        dec->qpd_alloc_if = &arena_alloc_if;
+        dec->qpd_alloc_ctx = &dec->qpd_arena;
+    }
+    else
+        dec->qpd_alloc_if = &malloc_alloc_if;
+    D_DEBUG("initialized.  max capacity=%u; max risked streams=%u",
+        dec->qpd_max_capacity, dec->qpd_max_risked_streams);
+}
+
+
+void
+lsqpack_dec_set_alloc_if (struct lsqpack_dec *dec,
+                const struct lsqpack_dec_alloc_if *alloc_if, void *alloc_ctx)
+{
+    free(dec->qpd_arena.ra_buf);
+    memset(&dec->qpd_arena, 0, sizeof(dec->qpd_arena));
+    dec->qpd_flags &= ~LSQPACK_DEC_RESIZE_ARENA;
+    dec->qpd_alloc_if = alloc_if;
+    dec->qpd_alloc_ctx = alloc_ctx;
+}
+
+
+void
+lsqpack_dec_set_hbrc_alloc_if (struct lsqpack_dec *dec,
+                const struct lsqpack_dec_alloc_if *alloc_if, void *alloc_ctx)
+{
+    dec->qpd_hbrc_alloc_if = alloc_if;
+    dec->qpd_hbrc_alloc_ctx = alloc_ctx;
+}
+
+
+#define DEC_NAMES_MASK (sizeof(((struct lsqpack_dec_names *) 0)->qdn_buckets) \
+            / sizeof(((struct lsqpack_dec_names *) 0)->qdn_buckets[0]) - 1)
+
+void
+lsqpack_dec_names_init (struct lsqpack_dec_names *names)
+{
+    unsigned i;
+
+    memset(names, 0, sizeof(*names));
+    for (i = 0; i < sizeof(names->qdn_static_tokens)
+                                / sizeof(names->qdn_static_tokens[0]); ++i)
+        names->qdn_static_tokens[i] = -1;
+}
+
+
+/* Returns the token or -1 if the name is not registered */
+static int
+qdec_names_find (const struct lsqpack_dec_names *names, const char *name,
+                                        unsigned name_len, unsigned name_hash)
+{
+    const struct lsqpack_dec_name *dec_name;
+    unsigned idx;
+
+    for (idx = name_hash & DEC_NAMES_MASK; names->qdn_buckets[idx];
+                                            idx = (idx + 1) & DEC_NAMES_MASK)
+    {
+        dec_name = &names->qdn_names[ names->qdn_buckets[idx] - 1 ];
+        if (dec_name->dn_name_hash == name_hash
+                && dec_name->dn_name_len == name_len
+                && 0 == memcmp(dec_name->dn_name, name, name_len))
+            return (int) dec_name->dn_token;
+    }
+
+    return -1;
+}
+
+
+int
+lsqpack_dec_names_add (struct lsqpack_dec_names *names, const char *name,
+                                        unsigned name_len, unsigned token)
+{
+    struct lsqpack_dec_name *new_names, *dec_name;
+    unsigned n_alloc, name_hash, idx, i;
+
+    if (token > 255)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    name_hash = QPACK_HASH(name, name_len, LSQPACK_HASH_SEED);
+    if (qdec_names_find(names, name, name_len, name_hash) >= 0)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+
+    if (names->qdn_n_names >= LSQPACK_MAX_DEC_NAMES)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    if (names->qdn_n_names >= names->qdn_n_alloc)
+    {
+        n_alloc = names->qdn_n_alloc ? names->qdn_n_alloc * 2 : 16;
+        new_names = realloc(names->qdn_names,
+                                        sizeof(new_names[0]) * n_alloc);
+        if (!new_names)
+            return -1;
+        names->qdn_names = new_names;
+        names->qdn_n_alloc = n_alloc;
+    }
+
+    dec_name = &names->qdn_names[ names->qdn_n_names ];
+    dec_name->dn_name = name;
+    dec_name->dn_name_len = name_len;
+    dec_name->dn_name_hash = name_hash;
+    dec_name->dn_token = token;
+
+    /* The buckets are never more than half full */
+    for (idx = name_hash & DEC_NAMES_MASK; names->qdn_buckets[idx];
+                                            idx = (idx + 1) & DEC_NAMES_MASK)
+        ;
+    names->qdn_buckets[idx] = (uint16_t) ++names->qdn_n_names;
+
+    /* Several static table entries may share the name */
+    for (i = 0; i < QPACK_STATIC_TABLE_SIZE; ++i)
+        if (static_table[i].name_len == name_len
+                && 0 == memcmp(static_table[i].name, name, name_len))
+            names->qdn_static_tokens[i] = (short) token;
+
+    return 0;
+}
+
+
+void
+lsqpack_dec_names_cleanup (struct lsqpack_dec_names *names)
+{
+    free(names->qdn_names);
+    lsqpack_dec_names_init(names);
+}
+
+
+void
+lsqpack_dec_set_names (struct lsqpack_dec *dec,
+                                        const struct lsqpack_dec_names *names)
+{
+    struct lsqpack_dec_table_entry *entry;
+    struct ringbuf_iter riter;
+
+    dec->qpd_names = names;
+    /* Cached lookups may be stale */
+    for (entry = ringbuf_iter_first(&riter, &dec->qpd_dyn_table);
+                                    entry; entry = ringbuf_iter_next(&riter))
+        entry->dte_flags &= ~(DTEF_APP_RESOLVED|DTEF_APP_TOKEN);
+    D_DEBUG("%s name registry with %u name%.*s", names ? "set" : "unset",
+        names ? names->qdn_n_names : 0,
+        !names || names->qdn_n_names != 1, "s");
+}
+
+
+/* Entries that live in the ring arena are accounted for by its size */
+static size_t
+qdec_entry_mem (const struct lsqpack_dec *dec,
+                                const struct lsqpack_dec_table_entry *entry)
+{
+    if (dec->qpd_alloc_if == &arena_alloc_if
+                                && ring_arena_owns(&dec->qpd_arena, entry))
+        return 0;
+    else
+        return entry->dte_alloc_size;
+}
+
+
+/* Size the ring arena after the current dynamic table capacity.  Live
+ * chunks cannot be moved, so a non-empty arena is only marked for resizing.
+ */
+static void
+qdec_resize_arena (struct lsqpack_dec *dec)
+{
+    struct lsqpack_ring_arena *const arena = &dec->qpd_arena;
+    size_t size;
+
+    size = (size_t) dec->qpd_cur_max_capacity * 2;
+    if (size == arena->ra_size)
+    {
+        dec->qpd_flags &= ~LSQPACK_DEC_RESIZE_ARENA;
+        return;
     }
 
-    if (rbuf->rb_nalloc)
+    if (arena->ra_nchunks > 0)
     {
-        els = malloc(rbuf->rb_nalloc * 2 * sizeof(rbuf->rb_els[0]));
-        if (els)
-        {
-            if (rbuf->rb_head >= rbuf->rb_tail)
-            {
-                count = rbuf->rb_head - rbuf->rb_tail + 1;
-                memcpy(els, rbuf->rb_els + rbuf->rb_tail,
-                                    count * sizeof(rbuf->rb_els[0]));
-                rbuf->rb_tail = 0;
-                rbuf->rb_head = count - 1;
-            }
-            else
-            {
-                memcpy(els, rbuf->rb_els,
-                            (rbuf->rb_head + 1) * sizeof(rbuf->rb_els[0]));
-                memcpy(els + rbuf->rb_nalloc + rbuf->rb_tail,
-                        rbuf->rb_els + rbuf->rb_tail,
-                        (rbuf->rb_nalloc - rbuf->rb_tail)
-                                                * sizeof(rbuf->rb_els[0]));
-                rbuf->rb_tail += rbuf->rb_nalloc;
-
-            }
-            free(rbuf->rb_els);
-            rbuf->rb_els = els;
-            rbuf->rb_nalloc *= 2;
-            goto insert;
-        }
-        return -1;
+        dec->qpd_flags |= LSQPACK_DEC_RESIZE_ARENA;
+        return;
     }
-    else
+
+    free(arena->ra_buf);
+    memset(arena, 0, sizeof(*arena));
+    if (size)
     {
-        /* First time */
-        rbuf->rb_els = malloc(4 * sizeof(rbuf->rb_els[0]));
-        if (rbuf->rb_els)
-        {
-            rbuf->rb_nalloc = 4;
-            goto insert;
-        }
-        return -1;
+        arena->ra_buf = malloc(size);
+        if (arena->ra_buf)
+            arena->ra_size = size;
     }
+    dec->qpd_flags &= ~LSQPACK_DEC_RESIZE_ARENA;
+    D_DEBUG("ring arena resized to %zu bytes", arena->ra_size);
 }
 
 
-#define ID_MINUS(a, b) ( (dec)->qpd_max_entries ? \
-    ((a) + (dec)->qpd_max_entries * 2 - (b)) % ((dec)->qpd_max_entries * 2) : 0)
-
-#define ID_PLUS(a, b) ( (dec)->qpd_max_entries ? \
-    ((a) + (b)) % ((dec)->qpd_max_entries * 2) : 0 )
-
 static struct lsqpack_dec_table_entry *
-qdec_get_table_entry_rel (const struct lsqpack_dec *dec,
-                                            lsqpack_abs_id_t relative_idx)
+qdec_alloc_entry (struct lsqpack_dec *dec, size_t size)
 {
-    ++relative_idx;
-    if (ringbuf_count(&dec->qpd_dyn_table) >= relative_idx)
-        return ringbuf_get_head(&dec->qpd_dyn_table, relative_idx);
+    struct lsqpack_dec_table_entry *entry;
+
+    /* Let the arena drain so that it can be resized */
+    if (dec->qpd_flags & LSQPACK_DEC_RESIZE_ARENA)
+        entry = malloc(size);
     else
-        return NULL;
+        entry = dec->qpd_alloc_if->dai_alloc(dec->qpd_alloc_ctx, size);
+    if (entry)
+    {
+        entry->dte_alloc_size = (unsigned) size;
+        dec->qpd_entry_bytes += qdec_entry_mem(dec, entry);
+    }
+    return entry;
 }
 
 
 static struct lsqpack_dec_table_entry *
-qdec_get_table_entry_abs (const struct lsqpack_dec *dec,
-                                                lsqpack_abs_id_t abs_idx)
+qdec_realloc_entry (struct lsqpack_dec *dec,
+                        struct lsqpack_dec_table_entry *entry, size_t size)
 {
-    unsigned off;
+    size_t mem;
 
-    off = ID_MINUS(dec->qpd_last_id, abs_idx);
-    return qdec_get_table_entry_rel(dec, off);
+    mem = qdec_entry_mem(dec, entry);
+    entry = dec->qpd_alloc_if->dai_realloc(dec->qpd_alloc_ctx, entry, size);
+    if (entry)
+    {
+        dec->qpd_entry_bytes -= mem;
+        entry->dte_alloc_size = (unsigned) size;
+        dec->qpd_entry_bytes += qdec_entry_mem(dec, entry);
+    }
+    return entry;
 }
 
 
-void
-lsqpack_dec_init (struct lsqpack_dec *dec, void *logger_ctx,
-    unsigned dyn_table_size, unsigned max_risked_streams,
-    const struct lsqpack_dec_hset_if *dh_if, enum lsqpack_dec_opts opts)
+static void
+qdec_free_entry (struct lsqpack_dec *dec,
+                                        struct lsqpack_dec_table_entry *entry)
 {
-    unsigned i;
-    memset(dec, 0, sizeof(*dec));
-    dec->qpd_opts = opts;
-    dec->qpd_logger_ctx = logger_ctx;
-    dec->qpd_max_capacity = dyn_table_size;
-    dec->qpd_cur_max_capacity = dyn_table_size;
-    dec->qpd_max_entries = dec->qpd_max_capacity / DYNAMIC_ENTRY_OVERHEAD;
-    dec->qpd_last_id = dec->qpd_max_entries * 2 - 1;
-    dec->qpd_largest_known_id = dec->qpd_max_entries * 2 - 1;
-    dec->qpd_max_risked_streams = max_risked_streams;
-    dec->qpd_dh_if = dh_if;
-    TAILQ_INIT(&dec->qpd_hbrcs);
-    for (i = 0; i < (1 << LSQPACK_DEC_BLOCKED_BITS); ++i)
-        TAILQ_INIT(&dec->qpd_blocked_headers[i]);
-    D_DEBUG("initialized.  max capacity=%u; max risked streams=%u",
-        dec->qpd_max_capacity, dec->qpd_max_risked_streams);
+    dec->qpd_entry_bytes -= qdec_entry_mem(dec, entry);
+    dec->qpd_alloc_if->dai_free(dec->qpd_alloc_ctx, entry);
+    if ((dec->qpd_flags & LSQPACK_DEC_RESIZE_ARENA)
+                                            && dec->qpd_arena.ra_nchunks == 0)
+        qdec_resize_arena(dec);
 }
 
 
 static void
-qdec_decref_entry (struct lsqpack_dec_table_entry *entry)
+qdec_decref_entry (struct lsqpack_dec *dec,
+                                        struct lsqpack_dec_table_entry *entry)
 {
     --entry->dte_refcnt;
     if (0 == entry->dte_refcnt)
-        free(entry);
+        qdec_free_entry(dec, entry);
+}
+
+
+/* Entries are sized for the longest string they may need to hold.  Once the
+ * entry is complete, give the unused space back to the arena.  The entry
+ * being read is always the newest chunk, so it is trimmed in place.
+ */
+static void
+qdec_trim_entry (struct lsqpack_dec *dec,
+                                        struct lsqpack_dec_table_entry *entry)
+{
+    if (dec->qpd_alloc_if == &arena_alloc_if
+                                && ring_arena_owns(&dec->qpd_arena, entry))
+    {
+        entry->dte_alloc_size = sizeof(*entry)
+                                + entry->dte_name_len + entry->dte_val_len;
+        (void) ring_arena_realloc(&dec->qpd_arena, entry,
+                                                        entry->dte_alloc_size);
+    }
 }
 
 
@@ -2786,6 +5856,7 @@ enum {
 struct header_block_read_ctx
 {
     TAILQ_ENTRY(header_block_read_ctx)  hbrc_next_all,
+                                        hbrc_next_hblock,
                                         hbrc_next_blocked;
     void                               *hbrc_hblock;
     uint64_t                            hbrc_stream_id;
@@ -2794,6 +5865,9 @@ struct header_block_read_ctx
     lsqpack_abs_id_t                    hbrc_largest_ref;   /* Parsed from prefix */
     lsqpack_abs_id_t                    hbrc_base_index;    /* Parsed from prefix */
     unsigned                            hbrc_header_count;
+    unsigned                            hbrc_n_out;         /* Headers passed to dhi_process_header() */
+    unsigned                            hbrc_last_cookie;   /* 1 + ordinal of last cookie, 0 if none */
+    struct lsqpack_dec_hlist           *hbrc_hlist;         /* Output, if not using callbacks */
 
     struct {
         struct lsxpack_header          *xhdr;               /* Current header */
@@ -2884,6 +5958,16 @@ parse_header_data (struct lsqpack_dec *,
         struct header_block_read_ctx *, const unsigned char *, size_t);
 
 
+void
+lsqpack_dec_get_stats (const struct lsqpack_dec *dec,
+                                            struct lsqpack_dec_stats *stats)
+{
+    *stats = dec->qpd_stats;
+    stats->n_huff_bytes_saved = dec->qpd_huff_bytes_saved > 0
+                                ? (uint64_t) dec->qpd_huff_bytes_saved : 0;
+}
+
+
 float
 lsqpack_dec_ratio (const struct lsqpack_dec *dec)
 {
@@ -2894,6 +5978,45 @@ lsqpack_dec_ratio (const struct lsqpack_dec *dec)
 }
 
 
+size_t
+lsqpack_dec_mem_used (const struct lsqpack_dec *dec)
+{
+    size_t mem;
+
+    mem = dec->qpd_entry_bytes
+        + dec->qpd_arena.ra_size
+        + dec->qpd_dyn_table.rb_nalloc * sizeof(dec->qpd_dyn_table.rb_els[0])
+        + (dec->qpd_n_hbrcs + dec->qpd_n_free_hbrcs)
+                                    * sizeof(struct header_block_read_ctx);
+    if (dec->qpd_hbrc_buckets)
+        mem += N_BUCKETS(dec->qpd_hbrc_nbits)
+                                        * sizeof(dec->qpd_hbrc_buckets[0]);
+    if (dec->qpd_blocked_headers)
+        mem += N_BUCKETS(dec->qpd_blocked_nbits)
+                                        * sizeof(dec->qpd_blocked_headers[0]);
+    return mem;
+}
+
+
+void
+lsqpack_dec_set_mem_limit (struct lsqpack_dec *dec, size_t limit)
+{
+    dec->qpd_mem_limit = limit;
+    D_DEBUG("memory limit set to %zu bytes", limit);
+}
+
+
+static void
+qdec_release_read_ctx (struct lsqpack_dec *dec,
+                        struct header_block_read_ctx *read_ctx)
+{
+    if (dec->qpd_hbrc_alloc_if)
+        dec->qpd_hbrc_alloc_if->dai_free(dec->qpd_hbrc_alloc_ctx, read_ctx);
+    else
+        free(read_ctx);
+}
+
+
 void
 lsqpack_dec_cleanup (struct lsqpack_dec *dec)
 {
@@ -2904,32 +6027,243 @@ lsqpack_dec_cleanup (struct lsqpack_dec *dec)
                                                     read_ctx = next_read_ctx)
     {
         next_read_ctx = TAILQ_NEXT(read_ctx, hbrc_next_all);
-        free(read_ctx);
+        qdec_release_read_ctx(dec, read_ctx);
+    }
+    for (read_ctx = TAILQ_FIRST(&dec->qpd_free_hbrcs); read_ctx;
+                                                    read_ctx = next_read_ctx)
+    {
+        next_read_ctx = TAILQ_NEXT(read_ctx, hbrc_next_all);
+        qdec_release_read_ctx(dec, read_ctx);
     }
+    free(dec->qpd_hbrc_buckets);
+    free(dec->qpd_blocked_headers);
+    /* No point resizing the arena as it is about to be freed */
+    dec->qpd_flags &= ~LSQPACK_DEC_RESIZE_ARENA;
 
     if (dec->qpd_enc_state.resume >= DEI_WINR_READ_NAME_IDX
             && dec->qpd_enc_state.resume <= DEI_WINR_READ_VALUE_HUFFMAN)
     {
         if (dec->qpd_enc_state.ctx_u.with_namref.entry)
-            free(dec->qpd_enc_state.ctx_u.with_namref.entry);
+            qdec_free_entry(dec, dec->qpd_enc_state.ctx_u.with_namref.entry);
+        if (dec->qpd_enc_state.ctx_u.with_namref.reffed_entry)
+            qdec_decref_entry(dec,
+                        dec->qpd_enc_state.ctx_u.with_namref.reffed_entry);
     }
     else if (dec->qpd_enc_state.resume >= DEI_WONR_READ_NAME_LEN
             && dec->qpd_enc_state.resume <= DEI_WONR_READ_VALUE_PLAIN)
     {
         if (dec->qpd_enc_state.ctx_u.wo_namref.entry)
-            free(dec->qpd_enc_state.ctx_u.wo_namref.entry);
+            qdec_free_entry(dec, dec->qpd_enc_state.ctx_u.wo_namref.entry);
     }
 
     while (!ringbuf_empty(&dec->qpd_dyn_table))
     {
         entry = ringbuf_advance_tail(&dec->qpd_dyn_table);
-        qdec_decref_entry(entry);
+        qdec_decref_entry(dec, entry);
     }
     ringbuf_cleanup(&dec->qpd_dyn_table);
+    free(dec->qpd_arena.ra_buf);
     D_DEBUG("cleaned up");
 }
 
 
+/* Zero-copy mode is not used when HTTP/1.x output is requested, as it
+ * requires the separators to be written between name and value.
+ */
+#define DEC_ZERO_COPY(dec_) (((dec_)->qpd_opts & (LSQPACK_DEC_OPT_ZERO_COPY \
+    |LSQPACK_DEC_OPT_HTTP1X)) == LSQPACK_DEC_OPT_ZERO_COPY)
+#define HBRC_ZERO_COPY(dec_, read_ctx_) (DEC_ZERO_COPY(dec_) \
+    && !(read_ctx_)->hbrc_hlist)
+#define DEC_LAZY_VALUES(dec_) (((dec_)->qpd_opts & (LSQPACK_DEC_OPT_LAZY_VALUES \
+    |LSQPACK_DEC_OPT_HTTP1X)) == LSQPACK_DEC_OPT_LAZY_VALUES)
+
+
+#define MIN_HLIST_BUF_SIZE 0x400
+#define MIN_HLIST_XHDRS 16
+
+
+int
+lsqpack_dec_hlist_reserve (struct lsqpack_dec_hlist *hlist, size_t buf_size,
+                                                            unsigned n_xhdrs)
+{
+    struct lsxpack_header *xhdrs;
+    char *buf;
+    unsigned n;
+
+    if (hlist->dhl_buf_size < buf_size)
+    {
+        /* The fields are moved by hand, as they point into the buffer */
+        buf = malloc(buf_size);
+        if (!buf)
+            return -1;
+        if (hlist->dhl_buf)
+        {
+            memcpy(buf, hlist->dhl_buf, hlist->dhl_buf_size);
+            for (n = 0; n < hlist->dhl_n_xhdrs; ++n)
+                hlist->dhl_xhdrs[n].buf = buf
+                                + (hlist->dhl_xhdrs[n].buf - hlist->dhl_buf);
+            free(hlist->dhl_buf);
+        }
+        hlist->dhl_buf = buf;
+        hlist->dhl_buf_size = buf_size;
+    }
+
+    if (hlist->dhl_xhdrs_size < n_xhdrs)
+    {
+        xhdrs = realloc(hlist->dhl_xhdrs, n_xhdrs * sizeof(xhdrs[0]));
+        if (!xhdrs)
+            return -1;
+        memset(xhdrs + hlist->dhl_xhdrs_size, 0,
+                (n_xhdrs - hlist->dhl_xhdrs_size) * sizeof(xhdrs[0]));
+        hlist->dhl_xhdrs = xhdrs;
+        hlist->dhl_xhdrs_size = n_xhdrs;
+    }
+
+    return 0;
+}
+
+
+void
+lsqpack_dec_hlist_cleanup (struct lsqpack_dec_hlist *hlist)
+{
+    free(hlist->dhl_buf);
+    free(hlist->dhl_xhdrs);
+    memset(hlist, 0, sizeof(*hlist));
+}
+
+
+/* Header fields are placed one after another.  The field being decoded is
+ * always the one past the last field and it is given all the space left
+ * in the buffer.
+ */
+static struct lsxpack_header *
+qdec_hlist_prepare_decode (struct lsqpack_dec_hlist *hlist,
+                                    struct lsxpack_header *xhdr, size_t space)
+{
+    size_t size, avail;
+    unsigned n_xhdrs;
+
+    assert(!xhdr || xhdr == &hlist->dhl_xhdrs[ hlist->dhl_n_xhdrs ]);
+    if (!xhdr && hlist->dhl_n_xhdrs >= hlist->dhl_xhdrs_size)
+    {
+        n_xhdrs = MAX(hlist->dhl_xhdrs_size * 2, MIN_HLIST_XHDRS);
+        if (0 != lsqpack_dec_hlist_reserve(hlist, 0, n_xhdrs))
+            return NULL;
+    }
+
+    if (hlist->dhl_buf_size - hlist->dhl_buf_len < space)
+    {
+        size = MAX(hlist->dhl_buf_size * 2, MIN_HLIST_BUF_SIZE);
+        while (size - hlist->dhl_buf_len < space)
+            size *= 2;
+        if (0 != lsqpack_dec_hlist_reserve(hlist, size, 0))
+            return NULL;
+    }
+
+    avail = hlist->dhl_buf_size - hlist->dhl_buf_len;
+    if (avail > LSXPACK_MAX_STRLEN)
+        avail = LSXPACK_MAX_STRLEN;
+    if (xhdr)
+    {
+        xhdr->buf = hlist->dhl_buf + hlist->dhl_buf_len;
+        xhdr->val_len = avail;
+    }
+    else
+    {
+        xhdr = &hlist->dhl_xhdrs[ hlist->dhl_n_xhdrs ];
+        lsxpack_header_prepare_decode(xhdr,
+                                hlist->dhl_buf + hlist->dhl_buf_len, 0, avail);
+    }
+    return xhdr;
+}
+
+
+static struct lsxpack_header *
+qdec_prepare_decode (struct lsqpack_dec *dec,
+        struct header_block_read_ctx *read_ctx, struct lsxpack_header *xhdr,
+        size_t space)
+{
+    if (read_ctx->hbrc_hlist)
+        xhdr = qdec_hlist_prepare_decode(read_ctx->hbrc_hlist, xhdr, space);
+    else
+        xhdr = dec->qpd_dh_if->dhi_prepare_decode(read_ctx->hbrc_hblock, xhdr,
+                                                                    space);
+    /* The application may reuse a header without clearing it.  Only fields
+     * output in zero-copy mode may have `name_ptr' set, as that is what
+     * lsqpack_dec_release_header() uses to find the pinned entry.
+     */
+    if (xhdr)
+        xhdr->name_ptr = NULL;
+    return xhdr;
+}
+
+
+/* All decoded headers are passed to the user through this function */
+static int
+qdec_process_header (struct lsqpack_dec *dec,
+                struct header_block_read_ctx *read_ctx,
+                struct lsxpack_header *xhdr)
+{
+    if (dec->qpd_opts & LSQPACK_DEC_OPT_COOKIE_CHAIN)
+    {
+        /* Links are one plus ordinal number: past UINT16_MAX headers, the
+         * chain stops.
+         */
+        if (xhdr->name_len == 6 && read_ctx->hbrc_n_out < UINT16_MAX
+                && 0 == memcmp(lsxpack_header_get_name(xhdr), "cookie", 6))
+        {
+            if (read_ctx->hbrc_hlist)
+            {
+                /* Earlier headers are still at hand: link forward */
+                xhdr->chain_next_idx = 0;
+                if (read_ctx->hbrc_last_cookie)
+                    read_ctx->hbrc_hlist->dhl_xhdrs[
+                        read_ctx->hbrc_last_cookie - 1].chain_next_idx
+                                    = (uint16_t) (read_ctx->hbrc_n_out + 1);
+            }
+            else
+                xhdr->chain_next_idx = (uint16_t) read_ctx->hbrc_last_cookie;
+            read_ctx->hbrc_last_cookie = read_ctx->hbrc_n_out + 1;
+        }
+        ++read_ctx->hbrc_n_out;
+    }
+    if (read_ctx->hbrc_hlist)
+    {
+        assert(xhdr == &read_ctx->hbrc_hlist->dhl_xhdrs[
+                                        read_ctx->hbrc_hlist->dhl_n_xhdrs ]);
+        read_ctx->hbrc_hlist->dhl_buf_len += xhdr->val_offset + xhdr->val_len
+                        + ((dec->qpd_opts & LSQPACK_DEC_OPT_HTTP1X) ? 2 : 0);
+        ++read_ctx->hbrc_hlist->dhl_n_xhdrs;
+        return 0;
+    }
+    return dec->qpd_dh_if->dhi_process_header(read_ctx->hbrc_hblock, xhdr);
+}
+
+
+void
+lsqpack_dec_release_header (struct lsqpack_dec *dec,
+                                                struct lsxpack_header *xhdr)
+{
+    struct lsqpack_dec_table_entry *entry;
+
+    if (!DEC_ZERO_COPY(dec) || !xhdr->name_ptr)
+        return;
+
+    if ((xhdr->flags & (LSXPACK_QPACK_IDX|LSXPACK_VAL_MATCHED))
+                                    == (LSXPACK_QPACK_IDX|LSXPACK_VAL_MATCHED)
+        && xhdr->qpack_index < QPACK_STATIC_TABLE_SIZE
+        && xhdr->name_ptr == static_table[ xhdr->qpack_index ].name)
+        return;
+
+    entry = (struct lsqpack_dec_table_entry *)
+        (xhdr->name_ptr - offsetof(struct lsqpack_dec_table_entry, dte_buf));
+    D_DEBUG("release pinned entry `%.*s'", (int) entry->dte_name_len,
+                                                            DTE_NAME(entry));
+    xhdr->name_ptr = NULL;
+    qdec_decref_entry(dec, entry);
+}
+
+
 static void
 qdec_maybe_update_entry_hashes (const struct lsqpack_dec *dec,
                                     struct lsqpack_dec_table_entry *entry)
@@ -2939,17 +6273,77 @@ qdec_maybe_update_entry_hashes (const struct lsqpack_dec *dec,
                                 && !(entry->dte_flags & DTEF_NAME_HASH))
     {
         entry->dte_flags |= DTEF_NAME_HASH;
-        entry->dte_name_hash = XXH32(DTE_NAME(entry), entry->dte_name_len,
-                                                            LSQPACK_XXH_SEED);
+        entry->dte_name_hash = QPACK_HASH(DTE_NAME(entry),
+                                    entry->dte_name_len, LSQPACK_HASH_SEED);
     }
     if ((dec->qpd_opts & LSQPACK_DEC_OPT_HASH_NAMEVAL)
                                 && !(entry->dte_flags & DTEF_NAMEVAL_HASH))
     {
         assert(entry->dte_flags & DTEF_NAME_HASH);
         entry->dte_flags |= DTEF_NAMEVAL_HASH;
-        entry->dte_nameval_hash = XXH32(DTE_VALUE(entry), entry->dte_val_len,
-                                                        entry->dte_name_hash);
+        entry->dte_nameval_hash = QPACK_HASH(DTE_VALUE(entry),
+                                entry->dte_val_len, entry->dte_name_hash);
+    }
+}
+
+
+static void
+qdec_set_app_token (struct lsxpack_header *xhdr, int token)
+{
+    if (token >= 0)
+    {
+        xhdr->app_index = (uint8_t) token;
+        xhdr->flags |= LSXPACK_APP_IDX;
+    }
+}
+
+
+static void
+qdec_set_static_app_token (const struct lsqpack_dec *dec,
+                                    struct lsxpack_header *xhdr, unsigned idx)
+{
+    if (dec->qpd_names)
+        qdec_set_app_token(xhdr, dec->qpd_names->qdn_static_tokens[idx]);
+}
+
+
+/* The lookup result is cached in the entry, so that the registry is
+ * searched once per entry rather than once per reference.
+ */
+static void
+qdec_set_entry_app_token (const struct lsqpack_dec *dec,
+        struct lsxpack_header *xhdr, struct lsqpack_dec_table_entry *entry)
+{
+    int token;
+
+    if (!dec->qpd_names)
+        return;
+
+    if (!(entry->dte_flags & DTEF_APP_RESOLVED))
+    {
+        if (entry->dte_flags & DTEF_NAME_IDX)
+            token = dec->qpd_names->qdn_static_tokens[ entry->dte_name_idx ];
+        else
+        {
+            if (!(entry->dte_flags & DTEF_NAME_HASH))
+            {
+                entry->dte_flags |= DTEF_NAME_HASH;
+                entry->dte_name_hash = QPACK_HASH(DTE_NAME(entry),
+                                    entry->dte_name_len, LSQPACK_HASH_SEED);
+            }
+            token = qdec_names_find(dec->qpd_names, DTE_NAME(entry),
+                                entry->dte_name_len, entry->dte_name_hash);
+        }
+        entry->dte_flags |= DTEF_APP_RESOLVED;
+        if (token >= 0)
+        {
+            entry->dte_flags |= DTEF_APP_TOKEN;
+            entry->dte_app_token = (unsigned) token;
+        }
     }
+
+    if (entry->dte_flags & DTEF_APP_TOKEN)
+        qdec_set_app_token(xhdr, (int) entry->dte_app_token);
 }
 
 
@@ -2966,9 +6360,12 @@ header_out_static_entry (struct lsqpack_dec *dec,
         return -1;
 
     http1x = !!(dec->qpd_opts & LSQPACK_DEC_OPT_HTTP1X) << 2; /* 0 or 4 */
-    need = static_table[ idx ].name_len + static_table[ idx ].val_len + http1x;
-    xhdr = dec->qpd_dh_if->dhi_prepare_decode(read_ctx->hbrc_hblock, NULL,
-                                                                        need);
+    if (HBRC_ZERO_COPY(dec, read_ctx))
+        need = 0;
+    else
+        need = static_table[ idx ].name_len + static_table[ idx ].val_len
+                                                                    + http1x;
+    xhdr = qdec_prepare_decode(dec, read_ctx, NULL, need);
     if (!xhdr)
         return -1;
 
@@ -2980,6 +6377,14 @@ header_out_static_entry (struct lsqpack_dec *dec,
     xhdr->val_len = static_table[ idx ].val_len;
     xhdr->name_hash = name_hashes[ idx ];
     xhdr->nameval_hash = nameval_hashes[ idx ];
+    qdec_set_static_app_token(dec, xhdr, idx);
+    if (HBRC_ZERO_COPY(dec, read_ctx))
+    {
+        xhdr->name_ptr = static_table[ idx ].name;
+        xhdr->buf = (char *) static_table[ idx ].val;
+        xhdr->val_offset = 0;
+        goto process;
+    }
     dst = xhdr->buf + xhdr->name_offset;
     memcpy(dst, static_table[ idx ].name, static_table[ idx ].name_len);
     dst += static_table[ idx ].name_len;
@@ -2993,10 +6398,14 @@ header_out_static_entry (struct lsqpack_dec *dec,
     dst += static_table[ idx ].val_len;
     if (http1x)
         memcpy(dst, "\r\n", 2);
-    r = dec->qpd_dh_if->dhi_process_header(read_ctx->hbrc_hblock, xhdr);
+  process:
+    r = qdec_process_header(dec, read_ctx, xhdr);
     if (r == 0)
+    {
         dec->qpd_bytes_out += static_table[ idx ].name_len
                             + static_table[ idx ].val_len;
+        STATS_ADD(dec->qpd_stats, n_static_hits, 1);
+    }
     return r;
 }
 
@@ -3016,9 +6425,11 @@ header_out_dynamic_entry (struct lsqpack_dec *dec,
         return -1;
 
     http1x = !!(dec->qpd_opts & LSQPACK_DEC_OPT_HTTP1X) << 2; /* 0 or 4 */
-    need = entry->dte_name_len + entry->dte_val_len + http1x;
-    xhdr = dec->qpd_dh_if->dhi_prepare_decode(read_ctx->hbrc_hblock, NULL,
-                                                                        need);
+    if (HBRC_ZERO_COPY(dec, read_ctx))
+        need = 0;
+    else
+        need = entry->dte_name_len + entry->dte_val_len + http1x;
+    xhdr = qdec_prepare_decode(dec, read_ctx, NULL, need);
     if (!xhdr)
         return -1;
 
@@ -3038,9 +6449,32 @@ header_out_dynamic_entry (struct lsqpack_dec *dec,
         xhdr->flags |= LSXPACK_QPACK_IDX;
         xhdr->qpack_index = entry->dte_name_idx;
     }
+    qdec_set_entry_app_token(dec, xhdr, entry);
     xhdr->dec_overhead = http1x;
     xhdr->name_len = entry->dte_name_len;
     xhdr->val_len = entry->dte_val_len;
+    if (HBRC_ZERO_COPY(dec, read_ctx))
+    {
+        /* The entry is pinned until lsqpack_dec_release_header(), which
+         * the application may call from dhi_process_header().
+         */
+        xhdr->name_ptr = DTE_NAME(entry);
+        xhdr->buf = DTE_VALUE(entry);
+        xhdr->val_offset = 0;
+        ++entry->dte_refcnt;
+        r = qdec_process_header(dec, read_ctx, xhdr);
+        if (r == 0)
+        {
+            dec->qpd_bytes_out += entry->dte_name_len + entry->dte_val_len;
+            STATS_ADD(dec->qpd_stats, n_dynamic_hits, 1);
+        }
+        else if (xhdr->name_ptr == DTE_NAME(entry))
+        {
+            xhdr->name_ptr = NULL;
+            qdec_decref_entry(dec, entry);
+        }
+        return r;
+    }
     dst = xhdr->buf + xhdr->name_offset;
     memcpy(dst, DTE_NAME(entry), entry->dte_name_len);
     dst += entry->dte_name_len;
@@ -3054,9 +6488,12 @@ header_out_dynamic_entry (struct lsqpack_dec *dec,
     dst += entry->dte_val_len;
     if (http1x)
         memcpy(dst, "\r\n", 2);
-    r = dec->qpd_dh_if->dhi_process_header(read_ctx->hbrc_hblock, xhdr);
+    r = qdec_process_header(dec, read_ctx, xhdr);
     if (r == 0)
+    {
         dec->qpd_bytes_out += entry->dte_name_len + entry->dte_val_len;
+        STATS_ADD(dec->qpd_stats, n_dynamic_hits, 1);
+    }
     return r;
 }
 
@@ -3076,8 +6513,8 @@ header_out_begin_static_nameref (struct lsqpack_dec *dec,
 
     http1x = !!(dec->qpd_opts & LSQPACK_DEC_OPT_HTTP1X) << 2; /* 0 or 4 */
     need = static_table[ idx ].name_len + http1x;
-    read_ctx->hbrc_out.xhdr = xhdr = dec->qpd_dh_if->dhi_prepare_decode(
-                                        read_ctx->hbrc_hblock, NULL, need);
+    read_ctx->hbrc_out.xhdr = xhdr = qdec_prepare_decode(dec, read_ctx,
+                                                                NULL, need);
     if (!xhdr)
         return -1;
 
@@ -3085,6 +6522,7 @@ header_out_begin_static_nameref (struct lsqpack_dec *dec,
     xhdr->qpack_index = idx;
     xhdr->flags |= LSXPACK_QPACK_IDX | LSXPACK_NAME_HASH;
     xhdr->name_hash = name_hashes[ idx ];
+    qdec_set_static_app_token(dec, xhdr, idx);
     if (is_never)
         xhdr->flags |= LSXPACK_NEVER_INDEX;
     xhdr->name_len = static_table[ idx ].name_len;
@@ -3099,6 +6537,7 @@ header_out_begin_static_nameref (struct lsqpack_dec *dec,
     xhdr->val_offset = dst - xhdr->buf;
     read_ctx->hbrc_out.state = XOUT_VALUE;
     read_ctx->hbrc_out.off = 0;
+    STATS_ADD(dec->qpd_stats, n_static_name_hits, 1);
     return 0;
 }
 
@@ -3116,8 +6555,8 @@ header_out_begin_dynamic_nameref (struct lsqpack_dec *dec,
 
     http1x = !!(dec->qpd_opts & LSQPACK_DEC_OPT_HTTP1X) << 2; /* 0 or 4 */
     need = entry->dte_name_len + http1x;
-    read_ctx->hbrc_out.xhdr = xhdr = dec->qpd_dh_if->dhi_prepare_decode(
-                                        read_ctx->hbrc_hblock, NULL, need);
+    read_ctx->hbrc_out.xhdr = xhdr = qdec_prepare_decode(dec, read_ctx,
+                                                                NULL, need);
     if (!xhdr)
         return -1;
 
@@ -3135,6 +6574,7 @@ header_out_begin_dynamic_nameref (struct lsqpack_dec *dec,
         xhdr->flags |= LSXPACK_QPACK_IDX;
         xhdr->qpack_index = entry->dte_name_idx;
     }
+    qdec_set_entry_app_token(dec, xhdr, entry);
     xhdr->name_len = entry->dte_name_len;
     dst = xhdr->buf + xhdr->name_offset;
     memcpy(dst, DTE_NAME(entry), entry->dte_name_len);
@@ -3147,6 +6587,7 @@ header_out_begin_dynamic_nameref (struct lsqpack_dec *dec,
     xhdr->val_offset = dst - xhdr->buf;
     read_ctx->hbrc_out.state = XOUT_VALUE;
     read_ctx->hbrc_out.off = 0;
+    STATS_ADD(dec->qpd_stats, n_dynamic_name_hits, 1);
     return 0;
 }
 
@@ -3162,8 +6603,8 @@ header_out_begin_literal (struct lsqpack_dec *dec,
 
     http1x = !!(dec->qpd_opts & LSQPACK_DEC_OPT_HTTP1X) << 2; /* 0 or 4 */
     need += http1x;
-    read_ctx->hbrc_out.xhdr = xhdr = dec->qpd_dh_if->dhi_prepare_decode(
-                                        read_ctx->hbrc_hblock, NULL, need);
+    read_ctx->hbrc_out.xhdr = xhdr = qdec_prepare_decode(dec, read_ctx,
+                                                                NULL, need);
     if (!xhdr)
         return -1;
 
@@ -3172,6 +6613,7 @@ header_out_begin_literal (struct lsqpack_dec *dec,
         xhdr->flags |= LSXPACK_NEVER_INDEX;
     read_ctx->hbrc_out.state = XOUT_NAME;
     read_ctx->hbrc_out.off = 0;
+    STATS_ADD(dec->qpd_stats, n_literals, 1);
     return 0;
 }
 
@@ -3191,9 +6633,8 @@ header_out_write_name (struct lsqpack_dec *dec,
         {
             if (read_ctx->hbrc_out.off + 2 > xhdr->val_len)
             {
-                read_ctx->hbrc_out.xhdr = xhdr = dec->qpd_dh_if
-                    ->dhi_prepare_decode(read_ctx->hbrc_hblock, xhdr,
-                            read_ctx->hbrc_out.off + 2);
+                read_ctx->hbrc_out.xhdr = xhdr = qdec_prepare_decode(dec,
+                            read_ctx, xhdr, read_ctx->hbrc_out.off + 2);
                 if (!xhdr)
                     return -1;
             }
@@ -3206,13 +6647,17 @@ header_out_write_name (struct lsqpack_dec *dec,
         xhdr->name_len = read_ctx->hbrc_out.off;
         read_ctx->hbrc_out.state = XOUT_VALUE;
         read_ctx->hbrc_out.off = 0;
-        if (dec->qpd_opts & (LSQPACK_DEC_OPT_HASH_NAME
-                            |LSQPACK_DEC_OPT_HASH_NAMEVAL))
+        if ((dec->qpd_opts & (LSQPACK_DEC_OPT_HASH_NAME
+                            |LSQPACK_DEC_OPT_HASH_NAMEVAL)) || dec->qpd_names)
         {
-            xhdr->name_hash = XXH32(xhdr->buf + xhdr->name_offset,
-                                            xhdr->name_len, LSQPACK_XXH_SEED);
+            xhdr->name_hash = QPACK_HASH(xhdr->buf + xhdr->name_offset,
+                                            xhdr->name_len, LSQPACK_HASH_SEED);
             xhdr->flags |= LSXPACK_NAME_HASH;
         }
+        if (dec->qpd_names)
+            qdec_set_app_token(xhdr, qdec_names_find(dec->qpd_names,
+                xhdr->buf + xhdr->name_offset, xhdr->name_len,
+                xhdr->name_hash));
     }
 
     return 0;
@@ -3235,8 +6680,8 @@ header_out_write_value (struct lsqpack_dec *dec,
         {
             if (xhdr->val_offset + read_ctx->hbrc_out.off + 2 > xhdr->val_len)
             {
-                read_ctx->hbrc_out.xhdr = xhdr = dec->qpd_dh_if
-                    ->dhi_prepare_decode(read_ctx->hbrc_hblock, xhdr,
+                read_ctx->hbrc_out.xhdr = xhdr = qdec_prepare_decode(dec,
+                            read_ctx, xhdr,
                             xhdr->val_offset + read_ctx->hbrc_out.off + 2);
                 if (!xhdr)
                     return -1;
@@ -3245,14 +6690,17 @@ header_out_write_value (struct lsqpack_dec *dec,
                                                                 "\r\n", 2);
         }
         xhdr->val_len = read_ctx->hbrc_out.off;
-        if (dec->qpd_opts & LSQPACK_DEC_OPT_HASH_NAME)
+        if (DEC_LAZY_VALUES(dec)
+                            && read_ctx->hbrc_parse_ctx_u.data.is_huffman)
+            xhdr->flags |= LSXPACK_VAL_HUFFMAN;
+        else if (dec->qpd_opts & LSQPACK_DEC_OPT_HASH_NAME)
         {
             assert(xhdr->flags & LSXPACK_NAME_HASH);
-            xhdr->nameval_hash = XXH32(xhdr->buf + xhdr->val_offset,
+            xhdr->nameval_hash = QPACK_HASH(xhdr->buf + xhdr->val_offset,
                                             xhdr->val_len, xhdr->name_hash);
             xhdr->flags |= LSXPACK_NAMEVAL_HASH;
         }
-        r = dec->qpd_dh_if->dhi_process_header(read_ctx->hbrc_hblock, xhdr);
+        r = qdec_process_header(dec, read_ctx, xhdr);
         ++read_ctx->hbrc_header_count;
         memset(&read_ctx->hbrc_out, 0, sizeof(read_ctx->hbrc_out));
         if (r != 0)
@@ -3289,8 +6737,8 @@ header_out_grow_buf (struct lsqpack_dec *dec,
     need = read_ctx->hbrc_out.xhdr->val_len + size / 2;
     if (need > LSXPACK_MAX_STRLEN)
         need = LSXPACK_MAX_STRLEN;
-    read_ctx->hbrc_out.xhdr = dec->qpd_dh_if->dhi_prepare_decode(
-                        read_ctx->hbrc_hblock, read_ctx->hbrc_out.xhdr, need);
+    read_ctx->hbrc_out.xhdr = qdec_prepare_decode(dec, read_ctx,
+                                            read_ctx->hbrc_out.xhdr, need);
     if (!read_ctx->hbrc_out.xhdr)
         return -1;
     if (read_ctx->hbrc_out.xhdr->val_len < need)
@@ -3323,8 +6771,8 @@ guarantee_out_bytes (struct lsqpack_dec *dec,
     if (avail < extra)
     {
         need = read_ctx->hbrc_out.xhdr->val_len + extra - avail;
-        read_ctx->hbrc_out.xhdr = dec->qpd_dh_if->dhi_prepare_decode(
-                        read_ctx->hbrc_hblock, read_ctx->hbrc_out.xhdr, need);
+        read_ctx->hbrc_out.xhdr = qdec_prepare_decode(dec, read_ctx,
+                                            read_ctx->hbrc_out.xhdr, need);
         if (!read_ctx->hbrc_out.xhdr)
             return -1;
     }
@@ -3370,7 +6818,20 @@ struct huff_decode_retval
 };
 
 
+#define DEC_HUFF_SAVED(dec_, hdr_) STATS_ADD(*(dec_), qpd_huff_bytes_saved, \
+                            (int64_t) (hdr_).n_dst - (int64_t) (hdr_).n_src)
+
+
 #if LS_QPACK_USE_LARGE_TABLES
+/* Resume value used by huff_decode_fast(); values 1 through 3 are used by
+ * lsqpack_huff_decode_full().
+ */
+#define HUFF_RESUME_FAST 4
+/* Same as above, but the first `nbits' bits are in the first byte of the
+ * next input chunk: the byte was given back partially decoded.
+ */
+#define HUFF_RESUME_FAST_REREAD 5
+
 static struct huff_decode_retval
 huff_decode_fast (const unsigned char *src, int src_len,
             unsigned char *dst, int dst_len,
@@ -3454,12 +6915,12 @@ lsqpack_huff_decode_full (const unsigned char *src, int src_len,
 
 
 #if LS_QPACK_USE_LARGE_TABLES
-static struct huff_decode_retval
+STATIC struct huff_decode_retval
 lsqpack_huff_decode (const unsigned char *src, int src_len,
             unsigned char *dst, int dst_len,
             struct lsqpack_huff_decode_state *state, int final)
 {
-    if (state->resume == 0 && final)
+    if (state->resume == 0 || state->resume >= HUFF_RESUME_FAST)
         return huff_decode_fast(src, src_len, dst, dst_len, state, final);
     else
         return lsqpack_huff_decode_full(src, src_len, dst, dst_len, state,
@@ -3468,6 +6929,43 @@ lsqpack_huff_decode (const unsigned char *src, int src_len,
 #endif
 
 
+ssize_t
+lsqpack_dec_get_value (const struct lsxpack_header *xhdr, char *buf,
+                                                                size_t bufsz)
+{
+    struct lsqpack_huff_decode_state state;
+    struct huff_decode_retval hdr;
+
+    if (!(xhdr->flags & LSXPACK_VAL_HUFFMAN))
+    {
+        if (xhdr->val_len > bufsz)
+        {
+            errno = ENOBUFS;
+            return -1;
+        }
+        memcpy(buf, lsxpack_header_get_value(xhdr), xhdr->val_len);
+        return xhdr->val_len;
+    }
+
+    state.resume = 0;
+    hdr = lsqpack_huff_decode(
+                (const unsigned char *) lsxpack_header_get_value(xhdr),
+                xhdr->val_len, (unsigned char *) buf, (int) MIN(bufsz, INT_MAX),
+                &state, 1);
+    switch (hdr.status)
+    {
+    case HUFF_DEC_OK:
+        return hdr.n_dst;
+    case HUFF_DEC_END_DST:
+        errno = ENOBUFS;
+        return -1;
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+
 static void
 check_dyn_table_errors (struct header_block_read_ctx *read_ctx,
                                                         lsqpack_abs_id_t id)
@@ -3614,7 +7112,7 @@ parse_header_data (struct lsqpack_dec *dec,
             {
                 if (DATA.left)
                 {
-                    if (DATA.is_huffman)
+                    if (DATA.is_huffman && !DEC_LAZY_VALUES(dec))
                     {
                         if (0 != guarantee_out_bytes(dec, read_ctx,
                                                     DATA.left + DATA.left / 2))
@@ -3623,7 +7121,7 @@ parse_header_data (struct lsqpack_dec *dec,
                         DATA.state = DATA_STATE_READ_VAL_HUFFMAN;
                     }
                     else
-                    {
+                    {   /* Lazy values are copied as is */
                         if (0 != guarantee_out_bytes(dec, read_ctx, DATA.left))
                             RETURN_ERROR();
                         DATA.state = DATA_STATE_READ_VAL_PLAIN;
@@ -3645,6 +7143,7 @@ parse_header_data (struct lsqpack_dec *dec,
             dst = get_dst(dec, read_ctx, &dst_size);
             hdr = lsqpack_huff_decode(buf, size, dst, dst_size,
                     &DATA.dec_huff_state, DATA.left == size);
+            DEC_HUFF_SAVED(dec, hdr);
             buf += hdr.n_src;
             DATA.left -= hdr.n_src;
             switch (hdr.status)
@@ -3715,6 +7214,7 @@ parse_header_data (struct lsqpack_dec *dec,
             dst = get_dst(dec, read_ctx, &dst_size);
             hdr = lsqpack_huff_decode(buf, size, dst, dst_size,
                     &DATA.dec_huff_state, DATA.left == size);
+            DEC_HUFF_SAVED(dec, hdr);
             buf += hdr.n_src;
             DATA.left -= hdr.n_src;
             switch (hdr.status)
@@ -3973,6 +7473,268 @@ parse_header_prefix (struct lsqpack_dec *dec,
 }
 
 
+/* The whole string is available: decode it in one go, growing the output
+ * buffer as necessary.
+ */
+static int
+qdec_huff_whole (struct lsqpack_dec *dec,
+        struct header_block_read_ctx *read_ctx, const unsigned char *src,
+        unsigned len, int (*write)(struct lsqpack_dec *,
+                            struct header_block_read_ctx *, size_t, int))
+{
+    struct lsqpack_huff_decode_state state;
+    struct huff_decode_retval hdr;
+    size_t dst_size;
+    unsigned char *dst;
+
+    state.resume = 0;
+    while (1)
+    {
+        dst = get_dst(dec, read_ctx, &dst_size);
+        hdr = lsqpack_huff_decode(src, len, dst, dst_size, &state, 1);
+        DEC_HUFF_SAVED(dec, hdr);
+        src += hdr.n_src;
+        len -= hdr.n_src;
+        switch (hdr.status)
+        {
+        case HUFF_DEC_OK:
+            return write(dec, read_ctx, hdr.n_dst, 1);
+        case HUFF_DEC_END_DST:
+            if (hdr.n_dst && 0 != write(dec, read_ctx, hdr.n_dst, 0))
+                return -1;
+            if (0 != header_out_grow_buf(dec, read_ctx))
+                return -1;
+            break;
+        default:
+            return -1;
+        }
+    }
+}
+
+
+static int
+qdec_int24_whole (const unsigned char **src_p, const unsigned char *src_end,
+                                    unsigned prefix_bits, unsigned *value_p)
+{
+    struct lsqpack_dec_int_state state;
+
+    state.resume = 0;
+    return lsqpack_dec_int24(src_p, src_end, prefix_bits, value_p, &state);
+}
+
+
+/* Straight-line version of parse_header_prefix() and parse_header_data()
+ * used when the whole header block is available.  Running out of input is
+ * an error here, so there is no state to save between instructions.  If
+ * the header block is blocked, the rest is left to the resumable parser.
+ */
+static enum lsqpack_read_header_status
+parse_header_block_whole (struct lsqpack_dec *dec,
+                                    struct header_block_read_ctx *read_ctx)
+{
+    const unsigned char *const begin = read_ctx->hbrc_buf.buf
+                                                    + read_ctx->hbrc_buf.off;
+    const unsigned char *const end = begin + read_ctx->hbrc_size;
+    const unsigned char *p = begin;
+    struct lsqpack_dec_int_state int_state;
+    struct lsqpack_dec_table_entry *entry;
+    uint64_t ric, delb;
+    size_t dst_size;
+    unsigned value, len;
+    int sign, is_static, is_never, is_huffman, r;
+
+    int_state.resume = 0;
+    if (0 != lsqpack_dec_int(&p, end, 8, &ric, &int_state))
+        return LQRHS_ERROR;
+    if (ric)
+    {
+        if (ric > dec_max_encoded_RIC(dec))
+            return LQRHS_ERROR;
+        read_ctx->hbrc_largest_ref = ID_MINUS(ric, 2);
+        read_ctx->hbrc_flags |= HBRC_LARGEST_REF_READ|HBRC_LARGEST_REF_SET;
+        if (qdec_in_future(dec, read_ctx->hbrc_largest_ref))
+        {
+            read_ctx->hbrc_parse_ctx_u.prefix.state
+                                        = PREFIX_STATE_BEGIN_READING_BASE_IDX;
+            read_ctx->hbrc_buf.off += p - begin;
+            read_ctx->hbrc_size -= p - begin;
+            return LQRHS_BLOCKED;
+        }
+    }
+    else
+        read_ctx->hbrc_flags |= HBRC_LARGEST_REF_READ;
+
+    if (p >= end)
+        return LQRHS_ERROR;
+    sign = (p[0] & 0x80) > 0;
+    int_state.resume = 0;
+    if (0 != lsqpack_dec_int(&p, end, 7, &delb, &int_state))
+        return LQRHS_ERROR;
+    if (read_ctx->hbrc_flags & HBRC_LARGEST_REF_SET)
+    {
+        if (sign)
+            read_ctx->hbrc_base_index =
+                            ID_MINUS(read_ctx->hbrc_largest_ref, delb + 1);
+        else
+            read_ctx->hbrc_base_index =
+                                ID_PLUS(read_ctx->hbrc_largest_ref, delb);
+    }
+    else
+        read_ctx->hbrc_base_index = 0;
+
+    /* As in parse_header_prefix(), the prefix may not be all there is */
+    if (p >= end)
+        return LQRHS_ERROR;
+
+#define RETURN_ERROR() do { dec->qpd_err.line = __LINE__; goto err; } while (0)
+
+    while (p < end)
+    {
+        /* Indexed Field Line */
+        if (p[0] & 0x80)
+        {
+            is_static = p[0] & 0x40;
+            if (0 != qdec_int24_whole(&p, end, 6, &value))
+                RETURN_ERROR();
+            if (is_static)
+                r = header_out_static_entry(dec, read_ctx, value);
+            else
+            {
+                value = ID_MINUS(read_ctx->hbrc_base_index, value);
+                r = header_out_dynamic_entry(dec, read_ctx, value);
+                check_dyn_table_errors(read_ctx, value);
+            }
+            if (r != 0)
+                RETURN_ERROR();
+            continue;
+        }
+        /* Literal Field Line With Name Reference */
+        else if (p[0] & 0x40)
+        {
+            is_never = p[0] & 0x20;
+            is_static = p[0] & 0x10;
+            if (0 != qdec_int24_whole(&p, end, 4, &value))
+                RETURN_ERROR();
+            if (is_static)
+            {
+                if (0 != header_out_begin_static_nameref(dec, read_ctx,
+                                                            value, is_never))
+                    RETURN_ERROR();
+            }
+            else
+            {
+                value = ID_MINUS(read_ctx->hbrc_base_index, value);
+                entry = qdec_get_table_entry_abs(dec, value);
+                if (!entry)
+                    RETURN_ERROR();
+                check_dyn_table_errors(read_ctx, value);
+                if (0 != header_out_begin_dynamic_nameref(dec, read_ctx,
+                                                            entry, is_never))
+                    RETURN_ERROR();
+            }
+        }
+        /* Literal Field Line With Literal Name */
+        else if (p[0] & 0x20)
+        {
+            is_never = p[0] & 0x10;
+            is_huffman = p[0] & 0x08;
+            if (0 != qdec_int24_whole(&p, end, 3, &len))
+                RETURN_ERROR();
+            if (len > (unsigned) (end - p))
+                RETURN_ERROR();
+            if (0 != header_out_begin_literal(dec, read_ctx,
+                                is_huffman ? len + len / 2 : len, is_never))
+                RETURN_ERROR();
+            if (is_huffman && len)
+                r = qdec_huff_whole(dec, read_ctx, p, len,
+                                                    header_out_write_name);
+            else
+            {
+                memcpy(get_dst(dec, read_ctx, &dst_size), p, len);
+                r = header_out_write_name(dec, read_ctx, len, 1);
+            }
+            if (r != 0)
+                RETURN_ERROR();
+            p += len;
+        }
+        /* Indexed Field Line With Post-Base Index */
+        else if (p[0] & 0x10)
+        {
+            if (0 != qdec_int24_whole(&p, end, 4, &value))
+                RETURN_ERROR();
+            value = ID_PLUS(read_ctx->hbrc_base_index, value + 1);
+            r = header_out_dynamic_entry(dec, read_ctx, value);
+            check_dyn_table_errors(read_ctx, value);
+            if (r != 0)
+                RETURN_ERROR();
+            continue;
+        }
+        /* Literal Field Line With Post-Base Name Reference */
+        else
+        {
+            is_never = p[0] & 0x08;
+            if (0 != qdec_int24_whole(&p, end, 3, &value))
+                RETURN_ERROR();
+            value = ID_PLUS(value, read_ctx->hbrc_base_index + 1);
+            entry = qdec_get_table_entry_abs(dec, value);
+            if (!entry)
+                RETURN_ERROR();
+            check_dyn_table_errors(read_ctx, value);
+            if (0 != header_out_begin_dynamic_nameref(dec, read_ctx,
+                                                            entry, is_never))
+                RETURN_ERROR();
+        }
+
+        /* Value of a literal field line */
+        if (p >= end)
+            RETURN_ERROR();
+        is_huffman = p[0] & 0x80;
+        if (0 != qdec_int24_whole(&p, end, 7, &len))
+            RETURN_ERROR();
+        if (len > (unsigned) (end - p))
+            RETURN_ERROR();
+        read_ctx->hbrc_parse_ctx_u.data.is_huffman = is_huffman;
+        if (len == 0)
+            r = header_out_write_value(dec, read_ctx, 0, 1);
+        else if (is_huffman && !DEC_LAZY_VALUES(dec))
+        {
+            if (0 != guarantee_out_bytes(dec, read_ctx, len + len / 2))
+                RETURN_ERROR();
+            r = qdec_huff_whole(dec, read_ctx, p, len,
+                                                    header_out_write_value);
+        }
+        else
+        {   /* Lazy values are copied as is */
+            if (0 != guarantee_out_bytes(dec, read_ctx, len))
+                RETURN_ERROR();
+            memcpy(get_dst(dec, read_ctx, &dst_size), p, len);
+            r = header_out_write_value(dec, read_ctx, len, 1);
+        }
+        if (r != 0)
+            RETURN_ERROR();
+        p += len;
+    }
+
+    if ((read_ctx->hbrc_flags & (HBRC_LARGEST_REF_SET|HBRC_LARGEST_REF_USED))
+                                                    == HBRC_LARGEST_REF_SET)
+        RETURN_ERROR();
+    if (read_ctx->hbrc_flags & HBRC_DYN_USED_IN_ERR)
+        RETURN_ERROR();
+    read_ctx->hbrc_buf.off += p - begin;
+    read_ctx->hbrc_size = 0;
+    return LQRHS_DONE;
+
+ err:
+    dec->qpd_err.type = LSQPACK_DEC_ERR_LOC_HEADER_BLOCK;
+    dec->qpd_err.off = p - begin;
+    dec->qpd_err.stream_id = read_ctx->hbrc_stream_id;
+    D_DEBUG("header block error on line %d, offset %"PRIu64", stream id "
+        "%"PRIu64, dec->qpd_err.line, dec->qpd_err.off, dec->qpd_err.stream_id);
+    return LQRHS_ERROR;
+#undef RETURN_ERROR
+}
+
+
 static size_t
 max_to_read (const struct header_block_read_ctx *read_ctx)
 {
@@ -4004,6 +7766,12 @@ qdec_read_header (struct lsqpack_dec *dec,
     size_t n_to_read;
     size_t buf_sz;
 
+    if (read_ctx->hbrc_parse == parse_header_prefix
+            && read_ctx->hbrc_size == read_ctx->hbrc_orig_size
+            && read_ctx->hbrc_buf.sz - read_ctx->hbrc_buf.off
+                                                    >= read_ctx->hbrc_size)
+        return parse_header_block_whole(dec, read_ctx);
+
     while (read_ctx->hbrc_size > 0)
     {
         n_to_read = max_to_read(read_ctx);
@@ -4028,29 +7796,121 @@ qdec_read_header (struct lsqpack_dec *dec,
 }
 
 
-static void
-destroy_header_block_read_ctx (struct lsqpack_dec *dec,
-                        struct header_block_read_ctx *read_ctx)
+/* Fibonacci hashing: hblock pointers are usually aligned and allocated
+ * at regular intervals, so their low bits are a poor source of entropy.
+ */
+#define HBRC_BUCKNO(n_bits, hblock) ((unsigned) \
+    (((uint64_t) (uintptr_t) (hblock) * 0x9E3779B97F4A7C15ULL) >> (64 - (n_bits))))
+#define HBRC_MIN_NBITS 4
+
+#define BLOCKED_BUCKNO(n_bits, id) ((id) & (N_BUCKETS(n_bits) - 1))
+
+
+static int
+qdec_grow_hbrc_buckets (struct lsqpack_dec *dec)
 {
-    lsqpack_abs_id_t id;
+    struct lsqpack_hbrc_head *new_buckets;
+    struct header_block_read_ctx *read_ctx;
+    unsigned n, nbits;
 
-    TAILQ_REMOVE(&dec->qpd_hbrcs, read_ctx, hbrc_next_all);
-    if (read_ctx->hbrc_flags & HBRC_BLOCKED)
-    {
-        id = read_ctx->hbrc_largest_ref & ((1 << LSQPACK_DEC_BLOCKED_BITS) - 1);
-        TAILQ_REMOVE(&dec->qpd_blocked_headers[id], read_ctx, hbrc_next_blocked);
-        --dec->qpd_n_blocked;
-    }
-    free(read_ctx);
+    if (dec->qpd_hbrc_buckets)
+        nbits = dec->qpd_hbrc_nbits + 1;
+    else
+        nbits = HBRC_MIN_NBITS;
+
+    new_buckets = malloc(sizeof(new_buckets[0]) * N_BUCKETS(nbits));
+    if (!new_buckets)
+        return -1;
+
+    for (n = 0; n < N_BUCKETS(nbits); ++n)
+        TAILQ_INIT(&new_buckets[n]);
+
+    TAILQ_FOREACH(read_ctx, &dec->qpd_hbrcs, hbrc_next_all)
+        TAILQ_INSERT_TAIL(&new_buckets[
+                            HBRC_BUCKNO(nbits, read_ctx->hbrc_hblock)],
+                                                read_ctx, hbrc_next_hblock);
+
+    free(dec->qpd_hbrc_buckets);
+    dec->qpd_hbrc_buckets = new_buckets;
+    dec->qpd_hbrc_nbits   = nbits;
+    return 0;
+}
+
+
+static int
+qdec_grow_blocked_headers (struct lsqpack_dec *dec)
+{
+    struct lsqpack_hbrc_head *new_buckets;
+    struct header_block_read_ctx *read_ctx;
+    unsigned n, nbits;
+
+    if (dec->qpd_blocked_headers)
+        nbits = dec->qpd_blocked_nbits + 1;
+    else
+        nbits = LSQPACK_DEC_BLOCKED_BITS;
+
+    new_buckets = malloc(sizeof(new_buckets[0]) * N_BUCKETS(nbits));
+    if (!new_buckets)
+        return -1;
+
+    for (n = 0; n < N_BUCKETS(nbits); ++n)
+        TAILQ_INIT(&new_buckets[n]);
+
+    /* Header blocks with the same Required Insert Count share a bucket
+     * before and after, keeping the order in which they are unblocked.
+     */
+    if (dec->qpd_blocked_headers)
+        for (n = 0; n < N_BUCKETS(dec->qpd_blocked_nbits); ++n)
+            while (read_ctx = TAILQ_FIRST(&dec->qpd_blocked_headers[n]),
+                                                            read_ctx != NULL)
+            {
+                TAILQ_REMOVE(&dec->qpd_blocked_headers[n], read_ctx,
+                                                            hbrc_next_blocked);
+                TAILQ_INSERT_TAIL(&new_buckets[
+                            BLOCKED_BUCKNO(nbits, read_ctx->hbrc_largest_ref)],
+                                                read_ctx, hbrc_next_blocked);
+            }
+
+    free(dec->qpd_blocked_headers);
+    dec->qpd_blocked_headers = new_buckets;
+    dec->qpd_blocked_nbits   = nbits;
+    D_DEBUG("blocked headers hash now has %u buckets", N_BUCKETS(nbits));
+    return 0;
 }
 
 
 static void
+qdec_unblock_header (struct lsqpack_dec *dec,
+                        struct header_block_read_ctx *read_ctx)
+{
+    TAILQ_REMOVE(&dec->qpd_blocked_headers[
+                BLOCKED_BUCKNO(dec->qpd_blocked_nbits, read_ctx->hbrc_largest_ref)],
+                                                read_ctx, hbrc_next_blocked);
+    --dec->qpd_n_blocked;
+    read_ctx->hbrc_flags &= ~HBRC_BLOCKED;
+}
+
+
+static int
 qdec_insert_header_block (struct lsqpack_dec *dec,
                         struct header_block_read_ctx *read_ctx)
 {
+    if (!dec->qpd_hbrc_buckets)
+    {
+        if (0 != qdec_grow_hbrc_buckets(dec))
+            return -1;
+    }
+    else if (dec->qpd_n_hbrcs >= N_BUCKETS(dec->qpd_hbrc_nbits) * 2)
+        /* Failure to grow is not fatal: the chains just get longer */
+        (void) qdec_grow_hbrc_buckets(dec);
+
     TAILQ_INSERT_TAIL(&dec->qpd_hbrcs, read_ctx, hbrc_next_all);
+    TAILQ_INSERT_TAIL(&dec->qpd_hbrc_buckets[
+                    HBRC_BUCKNO(dec->qpd_hbrc_nbits, read_ctx->hbrc_hblock)],
+                                                read_ctx, hbrc_next_hblock);
+    ++dec->qpd_n_hbrcs;
     read_ctx->hbrc_flags |= HBRC_ON_LIST;
+    return 0;
 }
 
 
@@ -4059,30 +7919,124 @@ qdec_remove_header_block (struct lsqpack_dec *dec,
                         struct header_block_read_ctx *read_ctx)
 {
     TAILQ_REMOVE(&dec->qpd_hbrcs, read_ctx, hbrc_next_all);
+    TAILQ_REMOVE(&dec->qpd_hbrc_buckets[
+                    HBRC_BUCKNO(dec->qpd_hbrc_nbits, read_ctx->hbrc_hblock)],
+                                                read_ctx, hbrc_next_hblock);
+    --dec->qpd_n_hbrcs;
     read_ctx->hbrc_flags &= ~HBRC_ON_LIST;
 }
 
 
-static int
-stash_blocked_header (struct lsqpack_dec *dec,
-                        struct header_block_read_ctx *read_ctx)
+/* Maximum number of read contexts kept on the free list */
+#define MAX_FREE_HBRCS 8
+
+static struct header_block_read_ctx *
+qdec_alloc_read_ctx (struct lsqpack_dec *dec)
 {
-    lsqpack_abs_id_t id;
+    struct header_block_read_ctx *read_ctx;
 
-    if (dec->qpd_n_blocked < dec->qpd_max_risked_streams)
+    read_ctx = TAILQ_FIRST(&dec->qpd_free_hbrcs);
+    if (read_ctx)
     {
-        id = read_ctx->hbrc_largest_ref & ((1 << LSQPACK_DEC_BLOCKED_BITS) - 1);
-        TAILQ_INSERT_TAIL(&dec->qpd_blocked_headers[id], read_ctx, hbrc_next_blocked);
-        ++dec->qpd_n_blocked;
-        read_ctx->hbrc_flags |= HBRC_BLOCKED;
-        return 0;
+        TAILQ_REMOVE(&dec->qpd_free_hbrcs, read_ctx, hbrc_next_all);
+        --dec->qpd_n_free_hbrcs;
+        return read_ctx;
+    }
+    else if (dec->qpd_hbrc_alloc_if)
+        return dec->qpd_hbrc_alloc_if->dai_alloc(dec->qpd_hbrc_alloc_ctx,
+                                                        sizeof(*read_ctx));
+    else
+        return malloc(sizeof(*read_ctx));
+}
+
+
+static void
+qdec_free_read_ctx (struct lsqpack_dec *dec,
+                        struct header_block_read_ctx *read_ctx)
+{
+    if (dec->qpd_n_free_hbrcs < MAX_FREE_HBRCS)
+    {
+        TAILQ_INSERT_HEAD(&dec->qpd_free_hbrcs, read_ctx, hbrc_next_all);
+        ++dec->qpd_n_free_hbrcs;
     }
     else
+        qdec_release_read_ctx(dec, read_ctx);
+}
+
+
+static void
+destroy_header_block_read_ctx (struct lsqpack_dec *dec,
+                        struct header_block_read_ctx *read_ctx)
+{
+    qdec_remove_header_block(dec, read_ctx);
+    if (read_ctx->hbrc_flags & HBRC_BLOCKED)
+        qdec_unblock_header(dec, read_ctx);
+    qdec_free_read_ctx(dec, read_ctx);
+}
+
+
+static int
+stash_blocked_header (struct lsqpack_dec *dec,
+                        struct header_block_read_ctx *read_ctx)
+{
+    if (dec->qpd_n_blocked >= dec->qpd_max_risked_streams)
     {
         D_INFO("cannot block another header: reached maximum of %u",
                                                 dec->qpd_max_risked_streams);
         return -1;
     }
+
+    if (!dec->qpd_blocked_headers)
+    {
+        if (0 != qdec_grow_blocked_headers(dec))
+            return -1;
+    }
+    else if (dec->qpd_n_blocked >= N_BUCKETS(dec->qpd_blocked_nbits) * 2
+                /* There are only this many distinct Required Insert Counts */
+                && N_BUCKETS(dec->qpd_blocked_nbits) < dec->qpd_max_entries * 2)
+        (void) qdec_grow_blocked_headers(dec);
+
+    TAILQ_INSERT_TAIL(&dec->qpd_blocked_headers[
+                BLOCKED_BUCKNO(dec->qpd_blocked_nbits, read_ctx->hbrc_largest_ref)],
+                                                read_ctx, hbrc_next_blocked);
+    ++dec->qpd_n_blocked;
+    STATS_ADD(dec->qpd_stats, n_blocked, 1);
+    TRACE3(dec_blocked, dec, read_ctx->hbrc_stream_id,
+                                                read_ctx->hbrc_largest_ref);
+    read_ctx->hbrc_flags |= HBRC_BLOCKED;
+    return 0;
+}
+
+
+/* Saving a blocked header block costs a read context unless one is already
+ * saved or one can be reused.  Growing a hash table is not counted: it is
+ * not fatal if that fails.
+ */
+static int
+qdec_check_mem_limit (struct lsqpack_dec *dec,
+                        const struct header_block_read_ctx *read_ctx)
+{
+    size_t need;
+
+    if (dec->qpd_mem_limit == 0)
+        return 0;
+
+    if ((read_ctx->hbrc_flags & HBRC_ON_LIST) || dec->qpd_n_free_hbrcs > 0)
+        need = 0;
+    else
+        need = sizeof(*read_ctx);
+    if (lsqpack_dec_mem_used(dec) + need <= dec->qpd_mem_limit)
+        return 0;
+
+    D_INFO("cannot block header block for stream %"PRIu64": memory limit "
+        "of %zu bytes reached", read_ctx->hbrc_stream_id, dec->qpd_mem_limit);
+    dec->qpd_err = (struct lsqpack_dec_err) {
+        .line = __LINE__,
+        .type = LSQPACK_DEC_ERR_LOC_MEM_LIMIT,
+        .off = read_ctx->hbrc_orig_size - read_ctx->hbrc_size,
+        .stream_id = read_ctx->hbrc_stream_id,
+    };
+    return -1;
 }
 
 
@@ -4091,7 +8045,12 @@ find_header_block_read_ctx (struct lsqpack_dec *dec, void *hblock)
 {
     struct header_block_read_ctx *read_ctx;
 
-    TAILQ_FOREACH(read_ctx, &dec->qpd_hbrcs, hbrc_next_all)
+    if (!dec->qpd_hbrc_buckets)
+        return NULL;
+
+    TAILQ_FOREACH(read_ctx, &dec->qpd_hbrc_buckets[
+                            HBRC_BUCKNO(dec->qpd_hbrc_nbits, hblock)],
+                                                            hbrc_next_hblock)
         if (read_ctx->hbrc_hblock == hblock)
             return read_ctx;
 
@@ -4111,6 +8070,7 @@ qdec_try_writing_header_ack (struct lsqpack_dec *dec, uint64_t stream_id,
         p = lsqpack_enc_int(p, p + *dec_buf_sz, stream_id, 7);
         if (p > dec_buf)
         {
+            TRACE2(dec_header_ack, dec, stream_id);
             *dec_buf_sz = p - dec_buf;
             return 0;
         }
@@ -4176,17 +8136,27 @@ qdec_header_process (struct lsqpack_dec *dec,
         break;
     case LQRHS_NEED:
     case LQRHS_BLOCKED:
+        if (st == LQRHS_BLOCKED && 0 != qdec_check_mem_limit(dec, read_ctx))
+        {
+            st = LQRHS_ERROR;
+            break;
+        }
         if (!(read_ctx->hbrc_flags & HBRC_ON_LIST))
         {
-            read_ctx_copy = malloc(sizeof(*read_ctx_copy));
+            read_ctx_copy = qdec_alloc_read_ctx(dec);
             if (!read_ctx_copy)
             {
                 st = LQRHS_ERROR;
                 break;
             }
             memcpy(read_ctx_copy, read_ctx, sizeof(*read_ctx));
+            if (0 != qdec_insert_header_block(dec, read_ctx_copy))
+            {
+                qdec_free_read_ctx(dec, read_ctx_copy);
+                st = LQRHS_ERROR;
+                break;
+            }
             read_ctx = read_ctx_copy;
-            qdec_insert_header_block(dec, read_ctx);
         }
         if (st == LQRHS_BLOCKED && 0 != stash_blocked_header(dec, read_ctx))
         {
@@ -4208,10 +8178,12 @@ qdec_header_process (struct lsqpack_dec *dec,
         break;
     }
 
+    TRACE3(dec_header_end, dec, read_ctx->hbrc_stream_id, st);
+
     if (read_ctx->hbrc_flags & HBRC_ON_LIST)
     {
         qdec_remove_header_block(dec, read_ctx);
-        free(read_ctx);
+        qdec_free_read_ctx(dec, read_ctx);
     }
 
     return st;
@@ -4241,10 +8213,11 @@ lsqpack_dec_header_read (struct lsqpack_dec *dec, void *hblock,
 }
 
 
-enum lsqpack_read_header_status
-lsqpack_dec_header_in (struct lsqpack_dec *dec, void *hblock,
+static enum lsqpack_read_header_status
+qdec_header_in (struct lsqpack_dec *dec, void *hblock,
             uint64_t stream_id, size_t header_size, const unsigned char **buf,
-            size_t bufsz, unsigned char *dec_buf, size_t *dec_buf_sz)
+            size_t bufsz, unsigned char *dec_buf, size_t *dec_buf_sz,
+            struct lsqpack_dec_hlist *hlist)
 {
     if (header_size < 2)
     {
@@ -4265,14 +8238,39 @@ lsqpack_dec_header_in (struct lsqpack_dec *dec, void *hblock,
         .hbrc_size      = header_size,
         .hbrc_orig_size = header_size,
         .hbrc_parse     = parse_header_prefix,
+        .hbrc_hlist     = hlist,
     };
 
     D_DEBUG("begin reading header block for stream %"PRIu64, stream_id);
+    TRACE3(dec_header_begin, dec, stream_id, header_size);
     return qdec_header_process(dec, &read_ctx, buf, bufsz,
                                dec_buf, dec_buf_sz);
 }
 
 
+enum lsqpack_read_header_status
+lsqpack_dec_header_in (struct lsqpack_dec *dec, void *hblock,
+            uint64_t stream_id, size_t header_size, const unsigned char **buf,
+            size_t bufsz, unsigned char *dec_buf, size_t *dec_buf_sz)
+{
+    return qdec_header_in(dec, hblock, stream_id, header_size, buf, bufsz,
+                                                dec_buf, dec_buf_sz, NULL);
+}
+
+
+enum lsqpack_read_header_status
+lsqpack_dec_header_in_hlist (struct lsqpack_dec *dec, void *hblock,
+            uint64_t stream_id, size_t header_size, const unsigned char **buf,
+            size_t bufsz, unsigned char *dec_buf, size_t *dec_buf_sz,
+            struct lsqpack_dec_hlist *hlist)
+{
+    hlist->dhl_buf_len = 0;
+    hlist->dhl_n_xhdrs = 0;
+    return qdec_header_in(dec, hblock, stream_id, header_size, buf, bufsz,
+                                                dec_buf, dec_buf_sz, hlist);
+}
+
+
 static void
 qdec_drop_oldest_entry (struct lsqpack_dec *dec)
 {
@@ -4280,7 +8278,9 @@ qdec_drop_oldest_entry (struct lsqpack_dec *dec)
 
     entry = ringbuf_advance_tail(&dec->qpd_dyn_table);
     dec->qpd_cur_capacity -= DTE_SIZE(entry);
-    qdec_decref_entry(entry);
+    STATS_ADD(dec->qpd_stats, n_evictions, 1);
+    TRACE2(dec_evict, dec, DTE_SIZE(entry));
+    qdec_decref_entry(dec, entry);
 }
 
 
@@ -4295,11 +8295,28 @@ qdec_remove_overflow_entries (struct lsqpack_dec *dec)
 }
 
 
+/* Once entries that no longer fit have been evicted, give back memory
+ * used by the table index and by the arena.
+ */
 static void
 qdec_update_max_capacity (struct lsqpack_dec *dec, unsigned new_capacity)
 {
+    unsigned nalloc;
+
     dec->qpd_cur_max_capacity = new_capacity;
     qdec_remove_overflow_entries(dec);
+
+    /* ringbuf_add() starts with four slots and doubles as needed */
+    nalloc = 4;
+    while (nalloc <= new_capacity / DYNAMIC_ENTRY_OVERHEAD)
+        nalloc *= 2;
+    if (new_capacity == 0 && ringbuf_empty(&dec->qpd_dyn_table))
+        ringbuf_cleanup(&dec->qpd_dyn_table);
+    else if (nalloc < dec->qpd_dyn_table.rb_nalloc)
+        ringbuf_shrink(&dec->qpd_dyn_table, nalloc);
+
+    if (dec->qpd_alloc_if == &arena_alloc_if)
+        qdec_resize_arena(dec);
 }
 
 
@@ -4307,21 +8324,21 @@ static void
 qdec_process_blocked_headers (struct lsqpack_dec *dec)
 {
     struct header_block_read_ctx *read_ctx, *next;
-    lsqpack_abs_id_t id;
 
-    id = dec->qpd_last_id & ((1 << LSQPACK_DEC_BLOCKED_BITS) - 1);
-    for (read_ctx = TAILQ_FIRST(&dec->qpd_blocked_headers[id]); read_ctx;
-                                                            read_ctx = next)
+    if (!dec->qpd_blocked_headers)
+        return;
+
+    for (read_ctx = TAILQ_FIRST(&dec->qpd_blocked_headers[
+                        BLOCKED_BUCKNO(dec->qpd_blocked_nbits, dec->qpd_last_id)]);
+                                                    read_ctx; read_ctx = next)
     {
         next = TAILQ_NEXT(read_ctx, hbrc_next_blocked);
         if (read_ctx->hbrc_largest_ref == dec->qpd_last_id)
         {
-            read_ctx->hbrc_flags &= ~HBRC_BLOCKED;
-            TAILQ_REMOVE(&dec->qpd_blocked_headers[id], read_ctx,
-                                                            hbrc_next_blocked);
-            --dec->qpd_n_blocked;
+            qdec_unblock_header(dec, read_ctx);
             D_DEBUG("header block for stream %"PRIu64" has become unblocked",
                 read_ctx->hbrc_stream_id);
+            TRACE2(dec_unblocked, dec, read_ctx->hbrc_stream_id);
             dec->qpd_dh_if->dhi_unblocked(read_ctx->hbrc_hblock);
         }
     }
@@ -4351,6 +8368,7 @@ lsqpack_dec_write_ici (struct lsqpack_dec *dec, unsigned char *buf, size_t sz)
         if (p > buf)
         {
             D_DEBUG("wrote ICI: count=%u", count);
+            TRACE2(dec_ici, dec, count);
             dec->qpd_largest_known_id = dec->qpd_last_id;
             return p - buf;
         }
@@ -4465,7 +8483,12 @@ lsqpack_dec_push_entry (struct lsqpack_dec *dec,
                                 (int) entry->dte_val_len, DTE_VALUE(entry),
                                 dec->qpd_cur_capacity);
         dec->qpd_last_id = ID_PLUS(dec->qpd_last_id, 1);
+        TRACE4(dec_insert, dec, dec->qpd_last_id, entry->dte_name_len,
+                                                        entry->dte_val_len);
         qdec_remove_overflow_entries(dec);
+        STATS_PEAK(dec->qpd_stats, peak_table_size, dec->qpd_cur_capacity);
+        STATS_PEAK(dec->qpd_stats, peak_table_nelem,
+                                        ringbuf_count(&dec->qpd_dyn_table));
         qdec_process_blocked_headers(dec);
         if (dec->qpd_cur_capacity <= dec->qpd_cur_max_capacity)
             return 0;
@@ -4475,6 +8498,14 @@ lsqpack_dec_push_entry (struct lsqpack_dec *dec,
 }
 
 
+/* Entries are allocated in one shot to fit the longest string that the
+ * Huffman-encoded string could decode to: the shortest code is five bits
+ * long.  The extra byte keeps the output buffer from filling up before the
+ * decoder sees the end of the string.
+ */
+#define HUFF_DEC_MAX_LEN(enc_len) ((enc_len) * 8 / 5 + 1)
+
+
 int
 lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                                                                 size_t buf_sz)
@@ -4588,11 +8619,11 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                                     - WINR.name_len) << (WINR.is_huffman << 1)))
                     return -1;
                 if (WINR.is_huffman)
-                    WINR.alloced_val_len = WINR.val_len + WINR.val_len / 2;
+                    WINR.alloced_val_len = HUFF_DEC_MAX_LEN(WINR.val_len);
                 else
                     WINR.alloced_val_len = WINR.val_len;
-                WINR.entry = malloc(sizeof(*WINR.entry) + WINR.name_len
-                                                    + WINR.alloced_val_len);
+                WINR.entry = qdec_alloc_entry(dec,
+                    sizeof(*WINR.entry) + WINR.name_len + WINR.alloced_val_len);
                 if (!WINR.entry)
                     return -1;
                 if (WINR.is_static)
@@ -4604,10 +8635,13 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                 else
                 {
                     WINR.entry->dte_flags = WINR.reffed_entry->dte_flags
-                                            & (DTEF_NAME_HASH|DTEF_NAME_IDX);
+                                & (DTEF_NAME_HASH|DTEF_NAME_IDX
+                                  |DTEF_APP_RESOLVED|DTEF_APP_TOKEN);
                     WINR.entry->dte_name_hash
                                         = WINR.reffed_entry->dte_name_hash;
                     WINR.entry->dte_name_idx = WINR.reffed_entry->dte_name_idx;
+                    WINR.entry->dte_app_token
+                                        = WINR.reffed_entry->dte_app_token;
                 }
                 WINR.entry->dte_name_len = WINR.name_len;
                 WINR.nread = 0;
@@ -4636,26 +8670,29 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                     (unsigned char *) DTE_VALUE(WINR.entry) + WINR.val_off,
                     WINR.alloced_val_len - WINR.val_off,
                     &WINR.dec_huff_state, WINR.nread + size == WINR.val_len);
+            DEC_HUFF_SAVED(dec, hdr);
             switch (hdr.status)
             {
             case HUFF_DEC_OK:
                 buf += hdr.n_src;
                 WINR.entry->dte_val_len = WINR.val_off + hdr.n_dst;
                 WINR.entry->dte_refcnt = 1;
+                qdec_trim_entry(dec, WINR.entry);
                 memcpy(DTE_NAME(WINR.entry), WINR.name, WINR.name_len);
                 if (WINR.reffed_entry)
                 {
-                    qdec_decref_entry(WINR.reffed_entry);
+                    qdec_decref_entry(dec, WINR.reffed_entry);
                     WINR.reffed_entry = NULL;
                 }
                 r = lsqpack_dec_push_entry(dec, WINR.entry);
                 if (0 == r)
                 {
                     dec->qpd_enc_state.resume = 0;
+                    STATS_ADD(dec->qpd_stats, n_inserts, 1);
                     WINR.entry = NULL;
                     break;
                 }
-                qdec_decref_entry(WINR.entry);
+                qdec_decref_entry(dec, WINR.entry);
                 WINR.entry = NULL;
                 return -1;
             case HUFF_DEC_END_SRC:
@@ -4663,18 +8700,7 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                 WINR.nread += hdr.n_src;
                 WINR.val_off += hdr.n_dst;
                 break;
-            case HUFF_DEC_END_DST:
-                WINR.alloced_val_len *= 2;
-                entry = realloc(WINR.entry, sizeof(*WINR.entry)
-                                        + WINR.name_len + WINR.alloced_val_len);
-                if (!entry)
-                    return -1;
-                WINR.entry = entry;
-                buf += hdr.n_src;
-                WINR.nread += hdr.n_src;
-                WINR.val_off += hdr.n_dst;
-                break;
-            default:
+            default:    /* HUFF_DEC_END_DST cannot happen: see HUFF_DEC_MAX_LEN */
                 return -1;
             }
             break;
@@ -4692,17 +8718,18 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                 memcpy(DTE_NAME(WINR.entry), WINR.name, WINR.name_len);
                 if (WINR.reffed_entry)
                 {
-                    qdec_decref_entry(WINR.reffed_entry);
+                    qdec_decref_entry(dec, WINR.reffed_entry);
                     WINR.reffed_entry = NULL;
                 }
                 r = lsqpack_dec_push_entry(dec, WINR.entry);
                 if (0 == r)
                 {
                     dec->qpd_enc_state.resume = 0;
+                    STATS_ADD(dec->qpd_stats, n_inserts, 1);
                     WINR.entry = NULL;
                     break;
                 }
-                qdec_decref_entry(WINR.entry);
+                qdec_decref_entry(dec, WINR.entry);
                 WINR.entry = NULL;
                 return -1;
             }
@@ -4719,9 +8746,12 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                 if (WONR.str_len > (dec->qpd_cur_max_capacity
                                                     << (WONR.is_huffman << 1)))
                     return -1;
-                WONR.alloced_len = WONR.str_len ? WONR.str_len + WONR.str_len / 2 : 16;
-                size = sizeof(*new_entry) + WONR.alloced_len;
-                WONR.entry = malloc(size);
+                if (WONR.is_huffman)
+                    WONR.alloced_len = HUFF_DEC_MAX_LEN(WONR.str_len);
+                else
+                    WONR.alloced_len = WONR.str_len;
+                WONR.entry = qdec_alloc_entry(dec,
+                                    sizeof(*WONR.entry) + WONR.alloced_len);
                 if (!WONR.entry)
                     return -1;
                 WONR.entry->dte_flags = 0;
@@ -4746,6 +8776,7 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                     (unsigned char *) DTE_NAME(WONR.entry) + WONR.str_off,
                     WONR.alloced_len - WONR.str_off,
                     &WONR.dec_huff_state, WONR.nread + size == WONR.str_len);
+            DEC_HUFF_SAVED(dec, hdr);
             switch (hdr.status)
             {
             case HUFF_DEC_OK:
@@ -4758,18 +8789,7 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                 WONR.nread += hdr.n_src;
                 WONR.str_off += hdr.n_dst;
                 break;
-            case HUFF_DEC_END_DST:
-                WONR.alloced_len *= 2;
-                entry = realloc(WONR.entry, sizeof(*WONR.entry)
-                                                        + WONR.alloced_len);
-                if (!entry)
-                    return -1;
-                WONR.entry = entry;
-                buf += hdr.n_src;
-                WONR.nread += hdr.n_src;
-                WONR.str_off += hdr.n_dst;
-                break;
-            default:
+            default:    /* HUFF_DEC_END_DST cannot happen: see HUFF_DEC_MAX_LEN */
                 return -1;
             }
             break;
@@ -4802,6 +8822,20 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                 if (WONR.str_len > ((dec->qpd_cur_max_capacity
                         - WONR.entry->dte_name_len) << (WONR.is_huffman << 1)))
                     return -1;
+                /* Now that the name has been read, size the entry to fit
+                 * the value.
+                 */
+                size = WONR.entry->dte_name_len + (WONR.is_huffman
+                            ? HUFF_DEC_MAX_LEN(WONR.str_len) : WONR.str_len);
+                if (WONR.alloced_len < size)
+                {
+                    entry = qdec_realloc_entry(dec, WONR.entry,
+                                                sizeof(*WONR.entry) + size);
+                    if (!entry)
+                        return -1;
+                    WONR.entry = entry;
+                    WONR.alloced_len = size;
+                }
                 WONR.nread = 0;
                 WONR.str_off = 0;
                 if (WONR.str_len)
@@ -4828,20 +8862,23 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                     (unsigned char *) DTE_VALUE(WONR.entry) + WONR.str_off,
                     WONR.alloced_len - WONR.entry->dte_name_len - WONR.str_off,
                     &WONR.dec_huff_state, WONR.nread + size == WONR.str_len);
+            DEC_HUFF_SAVED(dec, hdr);
             switch (hdr.status)
             {
             case HUFF_DEC_OK:
                 buf += hdr.n_src;
                 WONR.entry->dte_val_len = WONR.str_off + hdr.n_dst;
                 WONR.entry->dte_refcnt = 1;
+                qdec_trim_entry(dec, WONR.entry);
                 r = lsqpack_dec_push_entry(dec, WONR.entry);
                 if (0 == r)
                 {
                     dec->qpd_enc_state.resume = 0;
+                    STATS_ADD(dec->qpd_stats, n_inserts, 1);
                     WONR.entry = NULL;
                     break;
                 }
-                qdec_decref_entry(WONR.entry);
+                qdec_decref_entry(dec, WONR.entry);
                 WONR.entry = NULL;
                 return -1;
             case HUFF_DEC_END_SRC:
@@ -4849,33 +8886,12 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                 WONR.nread += hdr.n_src;
                 WONR.str_off += hdr.n_dst;
                 break;
-            case HUFF_DEC_END_DST:
-                assert(WONR.alloced_len);
-                WONR.alloced_len *= 2;
-                entry = realloc(WONR.entry, sizeof(*WONR.entry)
-                                                        + WONR.alloced_len);
-                if (!entry)
-                    return -1;
-                WONR.entry = entry;
-                buf += hdr.n_src;
-                WONR.nread += hdr.n_src;
-                WONR.str_off += hdr.n_dst;
-                break;
-            default:
+            default:    /* HUFF_DEC_END_DST cannot happen: see HUFF_DEC_MAX_LEN */
                 return -1;
             }
             break;
         case DEI_WONR_READ_VALUE_PLAIN:
-            if (WONR.alloced_len < WONR.entry->dte_name_len + WONR.str_len)
-            {
-                WONR.alloced_len = WONR.entry->dte_name_len + WONR.str_len;
-                entry = realloc(WONR.entry, sizeof(*WONR.entry)
-                                                        + WONR.alloced_len);
-                if (entry)
-                    WONR.entry = entry;
-                else
-                    return -1;
-            }
+            assert(WONR.alloced_len >= WONR.entry->dte_name_len + WONR.str_len);
             size = MIN((unsigned) (end - buf), WONR.str_len - WONR.str_off);
             memcpy(DTE_VALUE(WONR.entry) + WONR.str_off, buf, size);
             WONR.str_off += size;
@@ -4885,14 +8901,16 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
   wonr_insert_entry:
                 WONR.entry->dte_val_len = WONR.str_off;
                 WONR.entry->dte_refcnt = 1;
+                qdec_trim_entry(dec, WONR.entry);
                 r = lsqpack_dec_push_entry(dec, WONR.entry);
                 if (0 == r)
                 {
                     dec->qpd_enc_state.resume = 0;
+                    STATS_ADD(dec->qpd_stats, n_inserts, 1);
                     WONR.entry = NULL;
                     break;
                 }
-                qdec_decref_entry(WONR.entry);
+                qdec_decref_entry(dec, WONR.entry);
                 WONR.entry = NULL;
                 return -1;
             }
@@ -4908,17 +8926,19 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
                     return -1;
                 size = sizeof(*new_entry) + entry->dte_name_len
                                                         + entry->dte_val_len;
-                new_entry = malloc(size);
+                new_entry = qdec_alloc_entry(dec, size);
                 if (!new_entry)
                     return -1;
                 memcpy(new_entry, entry, size);
                 new_entry->dte_refcnt = 1;
+                new_entry->dte_alloc_size = (unsigned) size;
                 if (0 == lsqpack_dec_push_entry(dec, new_entry))
                 {
                     dec->qpd_enc_state.resume = 0;
+                    STATS_ADD(dec->qpd_stats, n_dups, 1);
                     break;
                 }
-                qdec_decref_entry(new_entry);
+                qdec_decref_entry(dec, new_entry);
                 return -1;
             }
             else if (r == -1)
@@ -4959,6 +8979,281 @@ lsqpack_dec_enc_in (struct lsqpack_dec *dec, const unsigned char *buf,
 }
 
 
+static void
+qdec_write_state (const struct lsqpack_dec *dec, struct state_out *out)
+{
+    const struct lsqpack_dec_table_entry *entry;
+    const struct header_block_read_ctx *read_ctx;
+    struct ringbuf_iter riter;
+
+    state_put_u32(out, LSQPACK_DEC_STATE_MAGIC);
+    state_put_u32(out, LSQPACK_STATE_VERSION);
+    state_put_u32(out, STATE_HASH_CHECK());
+    state_put_u32(out, dec->qpd_max_capacity);
+    state_put_u32(out, dec->qpd_cur_max_capacity);
+    state_put_u32(out, dec->qpd_last_id);
+    state_put_u32(out, dec->qpd_largest_known_id);
+    state_put_u32(out, dec->qpd_bytes_in);
+    state_put_u32(out, dec->qpd_bytes_out);
+    state_put_float(out, dec->qpd_hlist_size_ema);
+
+    /* Entries, oldest first */
+    state_put_u32(out, ringbuf_count(&dec->qpd_dyn_table));
+    for (entry = ringbuf_iter_first(&riter, &dec->qpd_dyn_table);
+                                    entry; entry = ringbuf_iter_next(&riter))
+    {
+        state_put_u32(out, entry->dte_name_len);
+        state_put_u32(out, entry->dte_val_len);
+        /* Registry lookups are not saved: they are redone after restore */
+        state_put_u32(out, entry->dte_flags
+                        & (DTEF_NAME_HASH|DTEF_NAMEVAL_HASH|DTEF_NAME_IDX));
+        state_put_u32(out, entry->dte_name_hash);
+        state_put_u32(out, entry->dte_nameval_hash);
+        state_put_u32(out, entry->dte_name_idx);
+        state_put(out, entry->dte_buf,
+                                entry->dte_name_len + entry->dte_val_len);
+    }
+
+    /* A blocked header block has only had its Required Insert Count read:
+     * there is not much to it.
+     */
+    state_put_u32(out, dec->qpd_n_blocked);
+    TAILQ_FOREACH(read_ctx, &dec->qpd_hbrcs, hbrc_next_all)
+        if (read_ctx->hbrc_flags & HBRC_BLOCKED)
+        {
+            state_put_u64(out, read_ctx->hbrc_stream_id);
+            state_put_u64(out, read_ctx->hbrc_orig_size);
+            state_put_u64(out, read_ctx->hbrc_size);
+            state_put_u32(out, read_ctx->hbrc_largest_ref);
+            state_put_u32(out, read_ctx->hbrc_hlist != NULL);
+        }
+}
+
+
+size_t
+lsqpack_dec_state_size (const struct lsqpack_dec *dec)
+{
+    struct state_out out = { NULL, 0, 0, };
+
+    qdec_write_state(dec, &out);
+    return out.so_off;
+}
+
+
+ssize_t
+lsqpack_dec_save_state (const struct lsqpack_dec *dec, unsigned char *buf,
+                                                                size_t bufsz)
+{
+    struct state_out out = { buf, bufsz, 0, };
+    const struct header_block_read_ctx *read_ctx;
+
+    if (dec->qpd_enc_state.resume)
+    {
+        D_INFO("cannot save state: encoder stream instruction is partially "
+                                                                    "read");
+        errno = EBUSY;
+        return -1;
+    }
+
+    TAILQ_FOREACH(read_ctx, &dec->qpd_hbrcs, hbrc_next_all)
+        if (!(read_ctx->hbrc_flags & HBRC_BLOCKED))
+        {
+            D_INFO("cannot save state: header block for stream %"PRIu64
+                " is being read", read_ctx->hbrc_stream_id);
+            errno = EBUSY;
+            return -1;
+        }
+
+    qdec_write_state(dec, &out);
+    if (out.so_buf)
+    {
+        D_DEBUG("saved %zu bytes of state", out.so_off);
+        return (ssize_t) out.so_off;
+    }
+    else
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+}
+
+
+/* Entry with no name and no value: six integers */
+#define DEC_STATE_ENTRY_SIZE (6 * 4)
+#define DEC_STATE_HBLOCK_SIZE (3 * 8 + 2 * 4)
+
+/* An ID is valid if it is within range of qpd_last_id; without a dynamic
+ * table, qpd_last_id does not change.
+ */
+#define DEC_STATE_ID_OK(dec, id) ((dec)->qpd_max_entries ?              \
+    (id) < (dec)->qpd_max_entries * 2 : (id) == (dec)->qpd_last_id)
+
+int
+lsqpack_dec_restore_state (struct lsqpack_dec *dec, const unsigned char *buf,
+            size_t bufsz, void *(*get_hblock)(void *ctx, uint64_t stream_id,
+                                        struct lsqpack_dec_hlist **hlist),
+            void *ctx)
+{
+    struct state_in in = { buf, buf + bufsz, 0, };
+    struct lsqpack_dec_table_entry *entry;
+    struct header_block_read_ctx *read_ctx;
+    struct lsqpack_dec_hlist *hlist;
+    const unsigned char *bytes;
+    void *hblock;
+    uint64_t stream_id, orig_size, size;
+    uint32_t n, count, name_len, val_len, flags, vals[3];
+    uint32_t cur_max_capacity, last_id, largest_known_id, largest_ref;
+    uint32_t is_hlist;
+
+    if (!ringbuf_empty(&dec->qpd_dyn_table) || !TAILQ_EMPTY(&dec->qpd_hbrcs)
+                                                || dec->qpd_enc_state.resume)
+    {
+        D_INFO("cannot restore state: decoder is not new");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (state_get_u32(&in) != LSQPACK_DEC_STATE_MAGIC
+            || state_get_u32(&in) != LSQPACK_STATE_VERSION
+            || state_get_u32(&in) != STATE_HASH_CHECK()
+            || state_get_u32(&in) != dec->qpd_max_capacity)
+    {
+        D_INFO("cannot restore state: it is not from a compatible decoder");
+        errno = EINVAL;
+        return -1;
+    }
+
+    cur_max_capacity = state_get_u32(&in);
+    last_id = state_get_u32(&in);
+    largest_known_id = state_get_u32(&in);
+    if (cur_max_capacity > dec->qpd_max_capacity
+            || !DEC_STATE_ID_OK(dec, last_id)
+            || !DEC_STATE_ID_OK(dec, largest_known_id))
+        goto einval;
+    dec->qpd_bytes_in = state_get_u32(&in);
+    dec->qpd_bytes_out = state_get_u32(&in);
+    dec->qpd_hlist_size_ema = state_get_float(&in);
+    if (cur_max_capacity != dec->qpd_cur_max_capacity)
+        qdec_update_max_capacity(dec, cur_max_capacity);
+
+    /* Entries keep their hashes: no rehashing is necessary */
+    count = state_get_u32(&in);
+    if (count > dec->qpd_max_entries
+                        || !state_has(&in, count, DEC_STATE_ENTRY_SIZE))
+        goto einval;
+    for (n = 0; n < count; ++n)
+    {
+        name_len = state_get_u32(&in);
+        val_len = state_get_u32(&in);
+        flags = state_get_u32(&in);
+        vals[0] = state_get_u32(&in);
+        vals[1] = state_get_u32(&in);
+        vals[2] = state_get_u32(&in);
+        if (name_len > dec->qpd_cur_max_capacity
+                || val_len > dec->qpd_cur_max_capacity
+                || dec->qpd_cur_capacity + ENTRY_COST(name_len, val_len)
+                                                > dec->qpd_cur_max_capacity
+                || (flags & ~(DTEF_NAME_HASH|DTEF_NAMEVAL_HASH|DTEF_NAME_IDX)))
+            goto einval;
+        bytes = state_get(&in, (size_t) name_len + val_len);
+        if (!bytes)
+            goto einval;
+        entry = qdec_alloc_entry(dec, sizeof(*entry) + name_len + val_len);
+        if (!entry)
+            goto enomem;
+        entry->dte_name_len = name_len;
+        entry->dte_val_len = val_len;
+        entry->dte_refcnt = 1;
+        entry->dte_flags = flags;
+        entry->dte_name_hash = vals[0];
+        entry->dte_nameval_hash = vals[1];
+        entry->dte_name_idx = vals[2];
+        memcpy(entry->dte_buf, bytes, (size_t) name_len + val_len);
+        if (0 != ringbuf_add(&dec->qpd_dyn_table, entry))
+        {
+            qdec_free_entry(dec, entry);
+            goto enomem;
+        }
+        dec->qpd_cur_capacity += DTE_SIZE(entry);
+    }
+    /* Set the IDs only now, so that no header block is unblocked above */
+    dec->qpd_last_id = last_id;
+    dec->qpd_largest_known_id = largest_known_id;
+
+    count = state_get_u32(&in);
+    if (count > dec->qpd_max_risked_streams
+                        || !state_has(&in, count, DEC_STATE_HBLOCK_SIZE))
+        goto einval;
+    for (n = 0; n < count; ++n)
+    {
+        stream_id = state_get_u64(&in);
+        orig_size = state_get_u64(&in);
+        size = state_get_u64(&in);
+        largest_ref = state_get_u32(&in);
+        is_hlist = state_get_u32(&in);
+        if (size > orig_size || orig_size > SIZE_MAX || is_hlist > 1
+                || !DEC_STATE_ID_OK(dec, largest_ref)
+                || !qdec_in_future(dec, largest_ref))
+            goto einval;
+
+        hlist = NULL;
+        hblock = get_hblock(ctx, stream_id, is_hlist ? &hlist : NULL);
+        if (!hblock)
+        {
+            D_INFO("cannot restore state: no header block for stream "
+                                                    "%"PRIu64, stream_id);
+            errno = ENOENT;
+            return -1;
+        }
+        if (is_hlist && !hlist)
+            goto einval;
+        if (hlist)
+        {
+            hlist->dhl_buf_len = 0;
+            hlist->dhl_n_xhdrs = 0;
+        }
+
+        read_ctx = qdec_alloc_read_ctx(dec);
+        if (!read_ctx)
+            goto enomem;
+        memset(read_ctx, 0, sizeof(*read_ctx));
+        read_ctx->hbrc_hblock = hblock;
+        read_ctx->hbrc_stream_id = stream_id;
+        read_ctx->hbrc_orig_size = (size_t) orig_size;
+        read_ctx->hbrc_size = (size_t) size;
+        read_ctx->hbrc_largest_ref = largest_ref;
+        read_ctx->hbrc_hlist = hlist;
+        read_ctx->hbrc_parse = parse_header_prefix;
+        read_ctx->hbrc_flags = HBRC_LARGEST_REF_READ|HBRC_LARGEST_REF_SET;
+        read_ctx->hbrc_parse_ctx_u.prefix.state
+                                        = PREFIX_STATE_BEGIN_READING_BASE_IDX;
+        if (0 != qdec_insert_header_block(dec, read_ctx))
+        {
+            qdec_free_read_ctx(dec, read_ctx);
+            goto enomem;
+        }
+        /* The number of blocked header blocks was checked above */
+        if (0 != stash_blocked_header(dec, read_ctx))
+            goto enomem;
+    }
+
+    if (in.si_err || in.si_p != in.si_end)
+        goto einval;
+
+    D_DEBUG("restored state: %u entries, %u blocked header blocks",
+        ringbuf_count(&dec->qpd_dyn_table), dec->qpd_n_blocked);
+    return 0;
+
+  einval:
+    D_INFO("cannot restore state: it is malformed");
+    errno = EINVAL;
+    return -1;
+  enomem:
+    errno = ENOMEM;
+    return -1;
+}
+
+
 void
 lsqpack_dec_print_table (const struct lsqpack_dec *dec, FILE *out)
 {
@@ -5001,6 +9296,45 @@ lsqpack_dec_get_err_info (const struct lsqpack_dec *dec)
 #endif
 #endif
 
+/* Write out a full accumulator in network byte order.  Where we can, this
+ * is done using a single store instead of one store per byte.
+ */
+static inline unsigned char *
+qenc_write_bits (unsigned char *dst, uintptr_t bits)
+{
+#if __GNUC__ && defined(__BYTE_ORDER__) \
+                            && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#if UINTPTR_MAX == 18446744073709551615ull
+    const uint64_t be = __builtin_bswap64(bits);
+#else
+    const uint32_t be = __builtin_bswap32(bits);
+#endif
+    memcpy(dst, &be, sizeof(be));
+    return dst + sizeof(be);
+#elif __GNUC__ && defined(__BYTE_ORDER__) \
+                            && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    memcpy(dst, &bits, sizeof(bits));
+    return dst + sizeof(bits);
+#else
+#if UINTPTR_MAX == 18446744073709551615ull
+    *dst++ = bits >> 56;
+    *dst++ = bits >> 48;
+    *dst++ = bits >> 40;
+    *dst++ = bits >> 32;
+#endif
+    *dst++ = bits >> 24;
+    *dst++ = bits >> 16;
+    *dst++ = bits >> 8;
+    *dst++ = bits;
+    return dst;
+#endif
+}
+
+
+/* Code positions could be computed in parallel using a prefix sum of the
+ * code lengths, but an AVX2 encoder built that way was measured to be
+ * slower than the loop below, which takes two symbols per table lookup.
+ */
 static unsigned char *
 qenc_huffman_enc (const unsigned char *src, const unsigned char *const src_end,
     unsigned char *dst)
@@ -5019,7 +9353,8 @@ qenc_huffman_enc (const unsigned char *src, const unsigned char *const src_end,
     const struct henc *henc;
     uint16_t idx;
 
-    while (src + sizeof(bits) * 8 / SHORTEST_CODE + sizeof(idx) < src_end)
+    while (src_end - src > (ptrdiff_t) (sizeof(bits) * 8 / SHORTEST_CODE
+                                                            + sizeof(idx)))
     {
         memcpy(&idx, src, 2);
         henc = &hencs[idx];
@@ -5038,16 +9373,7 @@ qenc_huffman_enc (const unsigned char *src, const unsigned char *const src_end,
             bits <<= sizeof(bits) * 8 - bits_used;
             bits_used = henc->lens - (sizeof(bits) * 8 - bits_used);
             bits |= henc->code >> bits_used;
-#if UINTPTR_MAX == 18446744073709551615ull
-            *dst++ = bits >> 56;
-            *dst++ = bits >> 48;
-            *dst++ = bits >> 40;
-            *dst++ = bits >> 32;
-#endif
-            *dst++ = bits >> 24;
-            *dst++ = bits >> 16;
-            *dst++ = bits >> 8;
-            *dst++ = bits;
+            dst = qenc_write_bits(dst, bits);
             bits = henc->code;   /* OK not to clear high bits */
         }
         else
@@ -5073,16 +9399,7 @@ qenc_huffman_enc (const unsigned char *src, const unsigned char *const src_end,
             bits <<= sizeof(bits) * 8 - bits_used;
             bits_used = cur_enc_code.bits - (sizeof(bits) * 8 - bits_used);
             bits |= cur_enc_code.code >> bits_used;
-#if UINTPTR_MAX == 18446744073709551615ull
-            *dst++ = bits >> 56;
-            *dst++ = bits >> 48;
-            *dst++ = bits >> 40;
-            *dst++ = bits >> 32;
-#endif
-            *dst++ = bits >> 24;
-            *dst++ = bits >> 16;
-            *dst++ = bits >> 8;
-            *dst++ = bits;
+            dst = qenc_write_bits(dst, bits);
             bits = cur_enc_code.code;   /* OK not to clear high bits */
         }
     }
@@ -5118,9 +9435,19 @@ static unsigned
 qenc_enc_str_size (const unsigned char *str, unsigned str_len)
 {
     unsigned const char *const end = str + str_len;
-    unsigned enc_size_bits, enc_size_bytes;
+    unsigned enc_size_bits, enc_size_bytes, acc[4];
 
-    enc_size_bits = 0;
+    /* Independent accumulators let the table lookups proceed in parallel */
+    acc[0] = acc[1] = acc[2] = acc[3] = 0;
+    while (end - str >= 4)
+    {
+        acc[0] += encode_table[str[0]].bits;
+        acc[1] += encode_table[str[1]].bits;
+        acc[2] += encode_table[str[2]].bits;
+        acc[3] += encode_table[str[3]].bits;
+        str += 4;
+    }
+    enc_size_bits = acc[0] + acc[1] + acc[2] + acc[3];
     while (str < end)
         enc_size_bits += encode_table[*str++].bits;
     enc_size_bytes = enc_size_bits / 8 + ((enc_size_bits & 7) != 0);
@@ -5151,12 +9478,44 @@ qdec_huff_dec4bits (uint8_t src_4bits, unsigned char *dst,
 
 
 #if LS_QPACK_USE_LARGE_TABLES
+#define LONGEST_CODE 30
+
+/* Decode a code longer than 16 bits.  Returns the symbol and sets `bits'
+ * to the code length.  If fewer than 32 bits are available, the window is
+ * padded with ones, like EOF; the caller checks that the code fits.
+ */
+static unsigned
+qdec_huff_dec_long (uint64_t buf, unsigned avail_bits, unsigned *bits)
+{
+    const struct hdec_long *hl;
+    uint32_t window;
+
+    if (avail_bits >= 32)
+        window = (uint32_t) (buf >> (avail_bits - 32));
+    else
+        window = (uint32_t) (buf << (32 - avail_bits))
+                                        | ((1u << (32 - avail_bits)) - 1);
+
+    for (hl = hdec_longs; hl < hdec_longs
+            + sizeof(hdec_longs) / sizeof(hdec_longs[0]) - 1
+                                            && window >= hl->limit; ++hl)
+        ;
+    *bits = hl->bits;
+    return hdec_long_syms[ hl->offset + (window >> (32 - hl->bits))
+                                                                - hl->first ];
+}
+
+
 /* The decoder is optimized for the common case.  Most of the time, we decode
  * data whose encoding is 16 bits or shorter.  This lets us use a 64 KB table
  * indexed by two bytes of input and outputs 1, 2, or 3 bytes at a time.
+ * Longer codes are decoded using hdec_longs[].
  *
- * In the case a longer code is encoutered, we fall back to the original
- * Huffman decoder that supports all code lengths.
+ * The decoder is resumable: when input runs out before the end of the
+ * string, the bits that have not been decoded yet are carried over to the
+ * next call in `state'.  When output runs out, at least one byte of input
+ * is given back to the caller, so that the caller has input to come back
+ * with even at the end of the string.
  */
 static struct huff_decode_retval
 huff_decode_fast (const unsigned char *src, int src_len,
@@ -5166,9 +9525,8 @@ huff_decode_fast (const unsigned char *src, int src_len,
     unsigned char *const orig_dst = dst;
     const unsigned char *const src_end = src + src_len;
     unsigned char *const dst_end = dst + dst_len;
-    uintptr_t buf;      /* OK not to initialize the buffer */
-    unsigned avail_bits, len;
-    struct huff_decode_retval rv;
+    uint64_t buf;       /* OK not to initialize the buffer */
+    unsigned avail_bits, len, sym;
     struct hdec hdec;
     uint16_t idx;
 
@@ -5180,50 +9538,57 @@ huff_decode_fast (const unsigned char *src, int src_len,
     buf = 0;
 #endif
 
-    avail_bits = 0;
+    if (dst_len == 0)
+        return (struct huff_decode_retval) {
+            .status = HUFF_DEC_END_DST,
+            .n_dst  = 0,
+            .n_src  = 0,
+        };
+
+    if (state->resume == HUFF_RESUME_FAST)
+    {
+        buf = state->bits;
+        avail_bits = state->nbits;
+    }
+    else if (state->resume == HUFF_RESUME_FAST_REREAD)
+    {
+        buf = *src++;
+        avail_bits = state->nbits;
+    }
+    else
+        avail_bits = 0;
+
     while (1)
     {
-        if (src + sizeof(buf) <= src_end)
+        if (avail_bits <= 16 && src + sizeof(buf) <= src_end)
         {
             len = (sizeof(buf) * 8 - avail_bits) >> 3;
             avail_bits += len << 3;
             switch (len)
             {
-#if UINTPTR_MAX == 18446744073709551615ull
             case 8:
                 buf <<= 8;
-                buf |= (uintptr_t) *src++;
+                buf |= (uint64_t) *src++;
             case 7:
                 buf <<= 8;
-                buf |= (uintptr_t) *src++;
+                buf |= (uint64_t) *src++;
             default:
                 buf <<= 48;
-                buf |= (uintptr_t) *src++ << 40;
-                buf |= (uintptr_t) *src++ << 32;
-                buf |= (uintptr_t) *src++ << 24;
-                buf |= (uintptr_t) *src++ << 16;
-#else
-            case 4:
-                buf <<= 8;
-                buf |= (uintptr_t) *src++;
-            case 3:
-                buf <<= 8;
-                buf |= (uintptr_t) *src++;
-            default:
-                buf <<= 16;
-#endif
-                buf |= (uintptr_t) *src++ <<  8;
-                buf |= (uintptr_t) *src++ <<  0;
+                buf |= (uint64_t) *src++ << 40;
+                buf |= (uint64_t) *src++ << 32;
+                buf |= (uint64_t) *src++ << 24;
+                buf |= (uint64_t) *src++ << 16;
+                buf |= (uint64_t) *src++ <<  8;
+                buf |= (uint64_t) *src++ <<  0;
             }
         }
         else if (src < src_end)
-            do
+            while (src < src_end && avail_bits <= sizeof(buf) * 8 - 8)
             {
                 buf <<= 8;
-                buf |= (uintptr_t) *src++;
+                buf |= (uint64_t) *src++;
                 avail_bits += 8;
             }
-            while (src < src_end && avail_bits <= sizeof(buf) * 8 - 8);
         else
             break;  /* Normal case terminating condition: out of input */
 
@@ -5244,9 +9609,9 @@ huff_decode_fast (const unsigned char *src, int src_len,
             while (avail_bits >= 16 && hdec.lens);
             if (avail_bits < 16)
                 continue;
-            goto slow_path;
         }
         else
+        {
             while (avail_bits >= 16)
             {
                 idx = buf >> (avail_bits - 16);
@@ -5271,32 +9636,79 @@ huff_decode_fast (const unsigned char *src, int src_len,
                     }
                     avail_bits -= hdec.lens >> 2;
                 }
-                else if (dst + len > dst_end)
+                else if (len && dst < dst_end)
+                {
+                    /* Not all symbols fit: output just the first one */
+                    *dst++ = hdec.out[0];
+                    avail_bits -= encode_table[ hdec.out[0] ].bits;
+                }
+                else if (len)
                     goto dst_ended;
                 else
-                    goto slow_path;
+                    break;
             }
+            if (avail_bits < 16)
+                continue;
+        }
+
+        /* The next code is longer than 16 bits */
+        if (avail_bits < LONGEST_CODE)
+        {
+            if (src < src_end)
+                continue;
+            break;
+        }
+        sym = qdec_huff_dec_long(buf, avail_bits, &len);
+        TRACE2(dec_huff_long_code, sym, len);
+        if (sym > 255)
+            goto error;     /* EOS in the string is an error */
+        if (dst >= dst_end)
+            goto dst_ended;
+        *dst++ = sym;
+        avail_bits -= len;
+    }
+
+    if (!final)
+    {
+        state->resume = HUFF_RESUME_FAST;
+        state->bits   = buf;
+        state->nbits  = avail_bits;
+        return (struct huff_decode_retval) {
+            .status = HUFF_DEC_END_SRC,
+            .n_dst  = dst - orig_dst,
+            .n_src  = src_len,
+        };
     }
 
-    if (avail_bits >= SHORTEST_CODE)
+    while (avail_bits >= SHORTEST_CODE)
     {
-        idx = buf << (16 - avail_bits);
-        idx |= (1 << (16 - avail_bits)) - 1;    /* EOF */
-        if (idx == 0xFFFF && avail_bits < 8)
-            goto end;
+        if (avail_bits >= 16)
+            idx = buf >> (avail_bits - 16);
+        else
+        {
+            idx = buf << (16 - avail_bits);
+            idx |= (1 << (16 - avail_bits)) - 1;    /* EOF */
+            if (idx == 0xFFFF && avail_bits < 8)
+                goto end;
+        }
         /* If a byte or more of input is left, this mean there is a valid
          * encoding, not just EOF.
          */
         hdec = hdecs[idx];
         len = hdec.lens & 3;
-        if ((hdec.lens >> 2) > avail_bits)
-            return (struct huff_decode_retval) {
-                .status = HUFF_DEC_ERROR,
-                .n_dst  = 0,
-                .n_src  = 0,
-            };
-        if (len && dst + len <= dst_end)
+        if (len)
         {
+            if ((hdec.lens >> 2) > avail_bits)
+                goto error;
+            if (dst >= dst_end)
+                goto dst_ended;
+            if (dst + len > dst_end)
+            {
+                /* Not all symbols fit: output just the first one */
+                *dst++ = hdec.out[0];
+                avail_bits -= encode_table[ hdec.out[0] ].bits;
+                continue;
+            }
             switch (len)
             {
             case 3:
@@ -5314,65 +9726,72 @@ huff_decode_fast (const unsigned char *src, int src_len,
             }
             avail_bits -= hdec.lens >> 2;
         }
-        else if (dst + len > dst_end)
-            goto dst_ended;
         else
+        {
+            sym = qdec_huff_dec_long(buf, avail_bits, &len);
             /* This must be an invalid code, otherwise it would have fit */
-            return (struct huff_decode_retval) {
-                .status = HUFF_DEC_ERROR,
-                .n_dst  = 0,
-                .n_src  = 0,
-            };
+            if (sym > 255 || len > avail_bits)
+                goto error;
+            if (dst >= dst_end)
+                goto dst_ended;
+            *dst++ = sym;
+            avail_bits -= len;
+        }
     }
 
     if (avail_bits > 0)
     {
         if (((1u << avail_bits) - 1) != (buf & ((1u << avail_bits) - 1)))
-            return (struct huff_decode_retval) { /* Not EOF as expected */
-                .status = HUFF_DEC_ERROR,
-                .n_dst  = 0,
-                .n_src  = 0,
-            };
+            goto error; /* Not EOF as expected */
     }
 #if __GNUC__
 #pragma GCC diagnostic pop
 #endif
 
   end:
+    state->resume = 0;
     return (struct huff_decode_retval) {
         .status = HUFF_DEC_OK,
         .n_dst  = dst - orig_dst,
-        .n_src  = src_len - (src_end - src),
+        .n_src  = src_len,
     };
 
   dst_ended:
-    /* Find previous byte boundary.  It is OK not to consume all input, as we
-     * always grow the destination buffer and try again.
+    /* Give back whole bytes that have not been decoded yet.  If there are
+     * none, give back the partially decoded byte and remember how much of
+     * it is left.
      */
-    while ((avail_bits & 7) && dst > orig_dst)
-        avail_bits += encode_table[ *--dst ].bits;
-    assert((avail_bits & 7) == 0);
-    src -= avail_bits >> 3;
+    len = MIN(avail_bits >> 3, (unsigned) (src_len - (src_end - src)));
+    if (len)
+    {
+        src -= len;
+        avail_bits -= len << 3;
+        if (avail_bits)
+            buf >>= len << 3;
+        state->resume = HUFF_RESUME_FAST;
+    }
+    else if (src_len - (src_end - src) > 0)
+    {
+        assert(avail_bits < 8);
+        --src;
+        state->resume = HUFF_RESUME_FAST_REREAD;
+    }
+    else
+        state->resume = HUFF_RESUME_FAST;
+    state->bits   = buf;
+    state->nbits  = avail_bits;
     return (struct huff_decode_retval) {
         .status = HUFF_DEC_END_DST,
-        .n_dst  = dst_len - (dst_end - dst),
+        .n_dst  = dst - orig_dst,
         .n_src  = src_len - (src_end - src),
     };
 
-  slow_path:
-    /* Find previous byte boundary and finish decoding thence. */
-    while ((avail_bits & 7) && dst > orig_dst)
-        avail_bits += encode_table[ *--dst ].bits;
-    assert((avail_bits & 7) == 0);
-    src -= avail_bits >> 3;
-    rv = lsqpack_huff_decode_full(src, src_end - src, dst, dst_end - dst,
-                                                                state, final);
-    if (rv.status == HUFF_DEC_OK || rv.status == HUFF_DEC_END_DST)
-    {
-        rv.n_dst += dst_len - (dst_end - dst);
-        rv.n_src += src_len - (src_end - src);
-    }
-    return rv;
+  error:
+    return (struct huff_decode_retval) {
+        .status = HUFF_DEC_ERROR,
+        .n_dst  = 0,
+        .n_src  = 0,
+    };
 }
 #endif
 #if __GNUC__
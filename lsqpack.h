@@ -64,8 +64,8 @@ enum lsqpack_enc_opts
      * Client and server follow different heuristics.  The encoder is either
      * in one or the other mode.
      *
-     * At the moment this option is a no-op.  This is a potential future
-     * work item where some heuristics may be added to the library.
+     * This option only has effect when used together with
+     * @ref LSQPACK_ENC_OPT_COST_MODEL.
      */
     LSQPACK_ENC_OPT_SERVER  = 1 << 0,
 
@@ -102,6 +102,70 @@ enum lsqpack_enc_opts
      * This is useful for some forms of testing.
      */
     LSQPACK_ENC_OPT_NO_MEM_GUARD = 1 << 4,
+
+    /**
+     * Allocate dynamic table entries from a ring buffer sized after the
+     * maximum table capacity and size the hash table for the maximum
+     * number of entries up front.  This way, the encoder does not allocate
+     * memory for the dynamic table once initialized, at the expense of
+     * more memory used at the outset.
+     */
+    LSQPACK_ENC_OPT_RING_ARENA = 1 << 5,
+
+    /**
+     * Decide whether to insert, duplicate, or encode a field as a literal by
+     * estimating the bytes each choice saves.  The estimate is based on the
+     * field's size and frequency in history, on how soon the entry would be
+     * evicted, and on whether the entry can be referenced before it is
+     * acknowledged.  The default is to insert any field seen in history.
+     *
+     * Client and server heuristics differ: see @ref LSQPACK_ENC_OPT_SERVER.
+     */
+    LSQPACK_ENC_OPT_COST_MODEL = 1 << 6,
+
+    /**
+     * Queue encoder stream output inside the encoder instead of writing it
+     * to the buffers supplied by the caller.  The queue grows as needed, so
+     * that encoding never fails for lack of encoder stream buffer space.
+     * This way, instructions generated for many header blocks can be
+     * written out in a single STREAM frame.
+     *
+     * When this option is set, the encoder stream buffers passed to
+     * @ref lsqpack_enc_encode(), @ref lsqpack_enc_encode_list(),
+     * @ref lsqpack_enc_set_max_capacity(), and @ref lsqpack_enc_use_dict()
+     * are ignored and may be NULL.  The output sizes are set to zero if
+     * not NULL.  Use @ref lsqpack_enc_pending() and @ref lsqpack_enc_writev()
+     * to drain the queue.
+     *
+     * The Set Dynamic Table Capacity instruction generated by
+     * @ref lsqpack_enc_init() is still written to `sdtc_buf'.
+     */
+    LSQPACK_ENC_OPT_ENC_QUEUE = 1 << 7,
+
+    /**
+     * Cache header blocks produced by @ref lsqpack_enc_encode_list().  Once
+     * two encodings of the same header list in a row produce the same
+     * header block without encoder stream output or at-risk references,
+     * the header block is returned for that list without encoding it
+     * again.  A cached header block is dropped when an entry it references
+     * is evicted; one that does not reference the dynamic table is dropped
+     * when a new entry is inserted.
+     *
+     * Header lists returned from the cache are not added to history.
+     */
+    LSQPACK_ENC_OPT_HBLOCK_CACHE = 1 << 8,
+
+    /**
+     * Split `cookie' header fields into crumbs at each "; " delimiter and
+     * encode each crumb as a separate field (RFC 9114, Section 4.2.1), so
+     * that crumbs that do not change are indexed on their own.  A cookie
+     * is encoded whole if the buffers passed to @ref lsqpack_enc_encode()
+     * are not large enough to hold all of its crumbs.
+     *
+     * The decoder produces one header per crumb; see
+     * @ref LSQPACK_DEC_OPT_COOKIE_CHAIN.
+     */
+    LSQPACK_ENC_OPT_CRUMBLE_COOKIES = 1 << 9,
 };
 
 
@@ -280,6 +344,73 @@ ssize_t
 lsqpack_enc_end_header (struct lsqpack_enc *, unsigned char *buf, size_t,
     enum lsqpack_enc_header_flags *flags /* Optional */);
 
+/**
+ * Encode a whole header list in one call.  This is equivalent to calling
+ * @ref lsqpack_enc_start_header(), @ref lsqpack_enc_encode() for each
+ * header field, and @ref lsqpack_enc_end_header(), but hashes and static
+ * table lookups are performed in batches and buffer space is checked once.
+ *
+ * enc_sz and header_sz are used for both input and output.  On success,
+ * zero is returned and they contain the number of bytes written to enc_buf
+ * and header_buf.  header_buf contains the complete header block, including
+ * the prefix.
+ *
+ * If a header block is already started, -1 is returned and errno is set to
+ * EINVAL.  If the buffers are smaller than the worst-case encoding of the
+ * header list, -1 is returned, errno is set to ENOBUFS, enc_sz and header_sz
+ * are set to the required sizes, and the encoder state is not modified.
+ */
+int
+lsqpack_enc_encode_list (struct lsqpack_enc *, uint64_t stream_id,
+    unsigned seqno, unsigned char *enc_buf, size_t *enc_sz,
+    unsigned char *header_buf, size_t *header_sz,
+    const struct lsxpack_header *, unsigned n_headers,
+    enum lsqpack_enc_flags flags,
+    enum lsqpack_enc_header_flags *header_flags /* Optional */);
+
+/**
+ * Encode a whole header list without using the dynamic table.  Fields are
+ * encoded as static table references or as literals with static or literal
+ * names; the header block is the same as that produced by an encoder whose
+ * dynamic table capacity is zero.  No encoder object is needed: this
+ * function keeps no state and can be called from several threads at once.
+ *
+ * Of the flags, only LQEF_NEVER_INDEX has an effect.  The LSXPACK_APP_IDX
+ * flag is ignored, as there is no encoder to register names with.
+ *
+ * On success, zero is returned and `buf_sz' is set to the size of the
+ * complete header block, including the prefix, written to `buf'.  If the
+ * header block does not fit, -1 is returned, errno is set to ENOBUFS, and
+ * `buf_sz' is set to the worst-case size of the header block.
+ */
+int
+lsqpack_enc_encode_stateless (unsigned char *buf, size_t *buf_sz,
+    const struct lsxpack_header *, unsigned n_headers,
+    enum lsqpack_enc_flags flags);
+
+/**
+ * Return number of bytes queued for the encoder stream.  This is always
+ * zero unless the encoder was initialized with
+ * @ref LSQPACK_ENC_OPT_ENC_QUEUE.
+ */
+size_t
+lsqpack_enc_pending (const struct lsqpack_enc *);
+
+struct iovec;
+
+/**
+ * Write bytes queued for the encoder stream using the `writev' callback,
+ * which has the same semantics as writev(2).  Bytes reported written by
+ * the callback are removed from the queue.
+ *
+ * Returns the return value of the callback, or zero if the queue is empty
+ * and the callback was not called.
+ */
+ssize_t
+lsqpack_enc_writev (struct lsqpack_enc *,
+    ssize_t (*writev)(void *ctx, const struct iovec *, int iovcnt),
+    void *ctx);
+
 /**
  * Process next chunk of bytes from the decoder stream.  Returns 0 on success,
  * -1 on failure.  The failure should be treated as fatal.
@@ -296,15 +427,178 @@ lsqpack_enc_decoder_in (struct lsqpack_enc *, const unsigned char *, size_t);
 float
 lsqpack_enc_ratio (const struct lsqpack_enc *);
 
+/**
+ * Encoder counters.  They are updated as the encoder runs unless the library
+ * is compiled with LSQPACK_STATS set to 0, in which case they stay zero.
+ * Field counts are of successfully encoded header fields.
+ */
+struct lsqpack_enc_stats
+{
+    /** Insert instructions written to the encoder stream */
+    uint64_t    n_inserts;
+    /** Duplicate instructions written to the encoder stream */
+    uint64_t    n_dups;
+    /** Entries evicted from the dynamic table */
+    uint64_t    n_evictions;
+    /** Fields encoded as static table references */
+    uint64_t    n_static_hits;
+    /** Fields encoded as literals with static table name references */
+    uint64_t    n_static_name_hits;
+    /** Fields encoded as dynamic table references */
+    uint64_t    n_dynamic_hits;
+    /** Fields encoded as literals with dynamic table name references */
+    uint64_t    n_dynamic_name_hits;
+    /** Fields encoded as literals with literal names */
+    uint64_t    n_literals;
+    /** History lookups that found the name or name/value */
+    uint64_t    n_hist_hits;
+    /** History lookups that did not find the name or name/value */
+    uint64_t    n_hist_misses;
+    /** Header blocks ended with at-risk references */
+    uint64_t    n_at_risk_hblocks;
+    /** Bytes saved by using Huffman encoding for strings */
+    uint64_t    n_huff_bytes_saved;
+    /** Header blocks returned from the cache: see
+     *  @ref LSQPACK_ENC_OPT_HBLOCK_CACHE
+     */
+    uint64_t    n_hblock_cache_hits;
+    /** Maximum dynamic table fill, in bytes */
+    unsigned    peak_table_size;
+    /** Maximum number of entries in the dynamic table */
+    unsigned    peak_table_nelem;
+};
+
+void
+lsqpack_enc_get_stats (const struct lsqpack_enc *, struct lsqpack_enc_stats *);
+
 /**
  * Return maximum size needed to encode Header Block Prefix
  */
 size_t
 lsqpack_enc_header_block_prefix_size (const struct lsqpack_enc *);
 
+/**
+ * Return number of bytes needed to save encoder state using
+ * @ref lsqpack_enc_save_state().
+ */
+size_t
+lsqpack_enc_state_size (const struct lsqpack_enc *);
+
+/**
+ * Save encoder state -- dynamic table, outstanding header blocks, history,
+ * decoder stream state, and queued encoder stream output -- to `buf'.  The
+ * format is flat and contains no pointers: it can be written to a file or
+ * passed to another process, where @ref lsqpack_enc_restore_state() picks
+ * up where this encoder left off.  Statistics and the header block cache
+ * are not saved.
+ *
+ * Returns number of bytes written.  If `buf' is too small, -1 is returned
+ * and errno is set to ENOBUFS.  If a header block is being encoded, -1 is
+ * returned and errno is set to EBUSY.
+ */
+ssize_t
+lsqpack_enc_save_state (const struct lsqpack_enc *, unsigned char *buf,
+                                                                size_t);
+
+/**
+ * Restore state saved by @ref lsqpack_enc_save_state().  The encoder must
+ * have just been initialized with the same maximum table size as the one
+ * whose state was saved; options and the maximum number of risked streams
+ * are taken from the initialization.  Entry hashes are taken from the saved
+ * state, so the library must be built with the same hash function.
+ *
+ * Returns 0 on success.  On failure, -1 is returned and errno is set to
+ * EINVAL if the state is malformed or does not match the encoder and to
+ * ENOMEM if memory could not be allocated.  The encoder is not usable after
+ * a failure; it should be cleaned up using @ref lsqpack_enc_cleanup().
+ */
+int
+lsqpack_enc_restore_state (struct lsqpack_enc *, const unsigned char *buf,
+                                                                size_t);
+
 void
 lsqpack_enc_cleanup (struct lsqpack_enc *);
 
+struct lsqpack_enc_dict;
+
+/**
+ * Build a read-only encoder dictionary from a training set of header
+ * fields, for example the contents of a QIF file.  Unique fields are
+ * ranked by frequency and at most `max_entries' of them are kept (zero
+ * means no limit).  Fields that match the static table in full are
+ * skipped, as they never go into the dynamic table.  So are fields with
+ * Huffman-encoded values (LSXPACK_VAL_HUFFMAN).
+ *
+ * The dictionary holds precomputed hashes and encoded Insert instructions,
+ * so that it can be applied to new encoders cheaply using
+ * @ref lsqpack_enc_use_dict().  Once built, it is never modified and can
+ * be shared by any number of encoders, including from several threads.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+int
+lsqpack_enc_dict_init (struct lsqpack_enc_dict *,
+    const struct lsxpack_header *, unsigned n_headers, unsigned max_entries);
+
+void
+lsqpack_enc_dict_cleanup (struct lsqpack_enc_dict *);
+
+/**
+ * Seed a freshly initialized encoder from the dictionary: its history
+ * is filled with the dictionary's fields, so that they are inserted into
+ * the dynamic table the first time they are encoded.
+ *
+ * If `max_inserts' is not zero, up to that many of the most frequent fields
+ * are inserted into the dynamic table right away and the Insert instructions
+ * are written to enc_buf.  enc_sz is used for both input and output.
+ * Inserting stops when either the dynamic table capacity or enc_buf is
+ * exhausted.  The instructions must be sent on the encoder stream before
+ * any header block produced by this encoder.
+ *
+ * This function must be called after @ref lsqpack_enc_init() and before
+ * the first header is started; otherwise, -1 is returned and errno is set
+ * to EINVAL.
+ */
+int
+lsqpack_enc_use_dict (struct lsqpack_enc *, const struct lsqpack_enc_dict *,
+    unsigned max_inserts, unsigned char *enc_buf, size_t *enc_sz);
+
+struct lsqpack_enc_names;
+
+void
+lsqpack_enc_names_init (struct lsqpack_enc_names *);
+
+/**
+ * Register a well-known header name and, optionally, its constant value.
+ * Hashes and static table IDs are calculated once and cached.  The strings
+ * are not copied and must stay valid for as long as the registry is used.
+ *
+ * Returns the index of the new entry, which the application places into
+ * `app_index' field of struct lsxpack_header along with LSXPACK_APP_IDX
+ * flag.  Header fields marked this way are encoded without calculating
+ * hashes or searching the static table.  The value may differ from the
+ * registered value, in which case only the name is looked up.  If the name
+ * in the header field is not the registered name, the index is ignored
+ * and the field is encoded as if it were not marked.
+ *
+ * Returns -1 on failure.  If the registry is full (indices are eight bits),
+ * errno is set to ENOSPC.
+ */
+int
+lsqpack_enc_names_add (struct lsqpack_enc_names *, const char *name,
+        unsigned name_len, const char *value /* Optional */, unsigned val_len);
+
+void
+lsqpack_enc_names_cleanup (struct lsqpack_enc_names *);
+
+/**
+ * Make the encoder use the name registry.  Call it after the encoder has
+ * been initialized.  The registry is not modified by the encoder and can be
+ * shared by several encoders.  Passing NULL turns the registry off.
+ */
+void
+lsqpack_enc_set_names (struct lsqpack_enc *, const struct lsqpack_enc_names *);
+
 /** Decoder header set interface */
 struct lsqpack_dec_hset_if
 {
@@ -326,6 +620,60 @@ enum lsqpack_dec_opts
     LSQPACK_DEC_OPT_HASH_NAME       = 1 << 1,
     /** Include nameval hash into lsxpack_header */
     LSQPACK_DEC_OPT_HASH_NAMEVAL    = 1 << 2,
+    /**
+     * Allocate dynamic table entries from a ring buffer sized after the
+     * dynamic table capacity instead of calling malloc(3) for each entry.
+     * Entries that do not fit into the ring are allocated using malloc(3).
+     */
+    LSQPACK_DEC_OPT_RING_ARENA      = 1 << 3,
+    /**
+     * Do not copy fields that are fully indexed: instead, point lsxpack_header
+     * at the static table or at the dynamic table entry.  Name is set using
+     * `name_ptr' and value using `buf', which replaces the buffer returned
+     * by dhi_prepare_decode().  Dynamic table entries stay pinned until the
+     * header is released using @ref lsqpack_dec_release_header().  This
+     * option has no effect if LSQPACK_DEC_OPT_HTTP1X is set.
+     */
+    LSQPACK_DEC_OPT_ZERO_COPY       = 1 << 4,
+    /**
+     * Do not Huffman-decode literal values.  Instead, the encoded bytes are
+     * copied into lsxpack_header and LSXPACK_VAL_HUFFMAN flag is set; use
+     * @ref lsqpack_dec_get_value() to decode the value when it is needed.
+     * Such values are not hashed, are not counted as saved bytes in
+     * decoder statistics, and errors in their encoding are only detected
+     * when they are decoded.  This option has no effect if
+     * LSQPACK_DEC_OPT_HTTP1X is set.
+     *
+     * Such headers can be passed to the encoder as they are.  The encoder
+     * copies a value with LSXPACK_VAL_HUFFMAN set to the header block
+     * without decoding it, with the Huffman bit set.  The field does not
+     * use or go into the dynamic table and is not added to the history,
+     * though the name may still refer to the static table.  A cookie with
+     * such a value is not split into crumbs.  For the field to be indexed,
+     * decode the value using @ref lsqpack_dec_get_value() and pass the
+     * plain value to the encoder instead.
+     */
+    LSQPACK_DEC_OPT_LAZY_VALUES     = 1 << 5,
+    /**
+     * Link `cookie' headers in a header block together using
+     * `chain_next_idx', so that the crumbs can be joined with "; " without
+     * searching the header list.  Ordinal numbers count all headers in the
+     * header block, starting with zero.
+     *
+     * When headers are passed to dhi_process_header(), the link points
+     * backward: in each cookie header, `chain_next_idx' is set to one plus
+     * the ordinal number of the previous cookie header in the header
+     * block, or to zero in the first one.  When the header block is
+     * decoded using @ref lsqpack_dec_header_in_hlist(), the link points
+     * forward: in each cookie header, `chain_next_idx' is set to one plus
+     * the index of the next cookie header in `dhl_xhdrs', or to zero in
+     * the last one.
+     *
+     * `chain_next_idx' of other headers is not modified.  Neither is it
+     * in cookie headers whose ordinal number is UINT16_MAX or larger: the
+     * chain stops before them, as their links would not fit.
+     */
+    LSQPACK_DEC_OPT_COOKIE_CHAIN    = 1 << 6,
 };
 
 void
@@ -333,6 +681,111 @@ lsqpack_dec_init (struct lsqpack_dec *, void *logger_ctx,
     unsigned dyn_table_size, unsigned max_risked_streams,
     const struct lsqpack_dec_hset_if *, enum lsqpack_dec_opts);
 
+/**
+ * Decoder dynamic table entry allocator interface.  An entry is allocated
+ * when an insert instruction is read from the encoder stream and freed when
+ * it is evicted from the dynamic table.  Other than on error and cleanup,
+ * entries are freed in the order in which they were allocated, unless they
+ * are pinned in LSQPACK_DEC_OPT_ZERO_COPY mode.
+ */
+struct lsqpack_dec_alloc_if
+{
+    void *  (*dai_alloc)(void *alloc_ctx, size_t size);
+    /** Only ever called for the most recently allocated entry */
+    void *  (*dai_realloc)(void *alloc_ctx, void *ptr, size_t size);
+    void    (*dai_free)(void *alloc_ctx, void *ptr);
+};
+
+/**
+ * Use custom allocator for dynamic table entries.  This function must be
+ * called after @ref lsqpack_dec_init() and before any data is passed to the
+ * decoder.  It overrides LSQPACK_DEC_OPT_RING_ARENA.
+ */
+void
+lsqpack_dec_set_alloc_if (struct lsqpack_dec *,
+                        const struct lsqpack_dec_alloc_if *, void *alloc_ctx);
+
+/**
+ * Use custom allocator for header block read contexts.  Only `dai_alloc'
+ * and `dai_free' are used, and all allocations are of the same size.
+ * Unlike dynamic table entries, read contexts are freed in any order.
+ * This function must be called after @ref lsqpack_dec_init() and before
+ * any data is passed to the decoder.
+ */
+void
+lsqpack_dec_set_hbrc_alloc_if (struct lsqpack_dec *,
+                        const struct lsqpack_dec_alloc_if *, void *alloc_ctx);
+
+struct lsqpack_dec_names;
+
+void
+lsqpack_dec_names_init (struct lsqpack_dec_names *);
+
+/**
+ * Map header name to application token.  Decoded header fields with this
+ * name have `app_index' set to `token' and LSXPACK_APP_IDX flag set.  The
+ * token must be smaller than 256.  The name must be lowercase, as that is
+ * how header names appear on the wire.  The string is not copied and must
+ * stay valid for as long as the registry is used.
+ *
+ * Returns 0 on success and -1 on failure.  errno is set to EINVAL if the
+ * token is out of range, to EEXIST if the name has already been added, and
+ * to ENOSPC if the registry is full.
+ */
+int
+lsqpack_dec_names_add (struct lsqpack_dec_names *, const char *name,
+                                        unsigned name_len, unsigned token);
+
+void
+lsqpack_dec_names_cleanup (struct lsqpack_dec_names *);
+
+/**
+ * Make the decoder use the name registry.  Call it after the decoder has
+ * been initialized; names added to the registry afterwards take effect
+ * once this function is called again.  Names are resolved the first time
+ * a static or dynamic table entry is output and the result is cached in
+ * the dynamic table entry.  The registry is not modified by the decoder
+ * and can be shared by several decoders.  Passing NULL turns it off.
+ *
+ * Tokens are usually distinct from encoder registry indices (see
+ * @ref lsqpack_enc_names_add()).  An encoder ignores indices that do not
+ * match its registry, but clearing LSXPACK_APP_IDX before passing decoded
+ * header fields to an encoder saves it a name comparison.
+ */
+void
+lsqpack_dec_set_names (struct lsqpack_dec *, const struct lsqpack_dec_names *);
+
+/**
+ * Release header passed to dhi_process_header() in LSQPACK_DEC_OPT_ZERO_COPY
+ * mode, unpinning the dynamic table entry it points to.  It is safe to call
+ * this function for any decoded header, as the decoder clears `name_ptr' in
+ * headers that do not point into the tables, even if dhi_prepare_decode()
+ * returns a header that has not been reset.  The application must not
+ * change `name_ptr' before releasing the header.  All headers must be
+ * released before @ref lsqpack_dec_cleanup() is called.
+ */
+void
+lsqpack_dec_release_header (struct lsqpack_dec *, struct lsxpack_header *);
+
+/**
+ * The largest size of a Huffman-encoded string of `len_' bytes once it is
+ * decoded.  The shortest Huffman code is five bits long.
+ */
+#define LSQPACK_HUFF_DEC_MAX_SIZE(len_) ((len_) * 8 / 5)
+
+/**
+ * Write value of header field passed to dhi_process_header() to `buf',
+ * decoding it first if LSXPACK_VAL_HUFFMAN flag is set.  See
+ * LSQPACK_DEC_OPT_LAZY_VALUES.  The buffer does not need to be larger than
+ * LSQPACK_HUFF_DEC_MAX_SIZE(val_len).
+ *
+ * Returns the length of the value.  On failure, -1 is returned and errno
+ * is set to ENOBUFS if `buf' is too small or to EINVAL if the value is not
+ * encoded correctly.
+ */
+ssize_t
+lsqpack_dec_get_value (const struct lsxpack_header *, char *buf, size_t);
+
 /**
  * Values returned by @ref lsqpack_dec_header_in() and
  * @ref lsqpack_dec_header_read()
@@ -367,7 +820,8 @@ enum lsqpack_read_header_status
     LQRHS_NEED,
     /**
      * An error has occurred.  This can be any error: decoding error, memory
-     * allocation failure, or some internal error.
+     * allocation failure, or some internal error.  Use
+     * @ref lsqpack_dec_get_err_info() to tell memory limit rejection apart.
      */
     LQRHS_ERROR,
 };
@@ -416,6 +870,56 @@ lsqpack_dec_header_read (struct lsqpack_dec *dec, void *hblock_ctx,
                          const unsigned char **buf, size_t bufsz,
                          unsigned char *dec_buf, size_t *dec_buf_sz);
 
+/**
+ * Header list decoded by @ref lsqpack_dec_header_in_hlist().  Header fields
+ * are written back to back into `dhl_buf' and described by `dhl_xhdrs'.
+ * In LSQPACK_DEC_OPT_HTTP1X mode, the first `dhl_buf_len' bytes of
+ * `dhl_buf' form an HTTP/1.x header block.
+ *
+ * Both arrays are allocated by the decoder, grow as needed, and are reused
+ * by the following header blocks.  Zero the structure before first use,
+ * optionally size it using @ref lsqpack_dec_hlist_reserve(), and free it
+ * using @ref lsqpack_dec_hlist_cleanup().
+ */
+struct lsqpack_dec_hlist
+{
+    char                   *dhl_buf;
+    struct lsxpack_header  *dhl_xhdrs;
+    size_t                  dhl_buf_len;    /**< Bytes used in dhl_buf */
+    size_t                  dhl_buf_size;   /**< Bytes allocated */
+    unsigned                dhl_n_xhdrs;    /**< Number of header fields */
+    unsigned                dhl_xhdrs_size; /**< Elements allocated */
+};
+
+/**
+ * Allocate room for at least `buf_size' bytes of header fields and for
+ * `n_xhdrs' header fields.  Returns 0 on success and -1 on failure.
+ */
+int
+lsqpack_dec_hlist_reserve (struct lsqpack_dec_hlist *, size_t buf_size,
+                                                            unsigned n_xhdrs);
+
+void
+lsqpack_dec_hlist_cleanup (struct lsqpack_dec_hlist *);
+
+/**
+ * Like @ref lsqpack_dec_header_in(), but the header list is written to
+ * `hlist' instead of being passed to dhi_prepare_decode() and
+ * dhi_process_header(), which are not called for this header block.
+ * Continue decoding using @ref lsqpack_dec_header_read() as usual.
+ *
+ * `hlist' is reset before decoding starts.  It must stay valid until
+ * LQRHS_DONE or LQRHS_ERROR is returned, and it cannot be used by two
+ * header blocks at the same time.  LSQPACK_DEC_OPT_ZERO_COPY has no effect
+ * on such header blocks.
+ */
+enum lsqpack_read_header_status
+lsqpack_dec_header_in_hlist (struct lsqpack_dec *, void *hblock_ctx,
+                       uint64_t stream_id, size_t header_block_size,
+                       const unsigned char **buf, size_t bufsz,
+                       unsigned char *dec_buf, size_t *dec_buf_sz,
+                       struct lsqpack_dec_hlist *hlist);
+
 /**
  * Feed encoder stream data to the decoder.  Zero is returned on success,
  * negative value on error.
@@ -484,6 +988,72 @@ lsqpack_dec_unref_stream (struct lsqpack_dec *, void *hblock_ctx);
 float
 lsqpack_dec_ratio (const struct lsqpack_dec *);
 
+/**
+ * Return the number of bytes of memory currently allocated by the decoder:
+ * dynamic table entries and its index, the ring arena, saved header block
+ * read contexts (including those kept for reuse) and hash tables.  The
+ * size of struct lsqpack_dec itself is not included.  When a custom entry
+ * allocator is used, entries are counted at the size requested from it.
+ *
+ * When the dynamic table capacity is lowered by the encoder, memory used
+ * by the table index and by the ring arena is shrunk to match it.
+ */
+size_t
+lsqpack_dec_mem_used (const struct lsqpack_dec *);
+
+/**
+ * Limit memory used by the decoder, as reported by
+ * @ref lsqpack_dec_mem_used(), to `limit' bytes.  A header block that
+ * becomes blocked is rejected with LQRHS_ERROR if saving it would take the
+ * decoder over the limit.  Zero, the default, means no limit.
+ *
+ * Such rejection is reported by @ref lsqpack_dec_get_err_info() as
+ * LSQPACK_DEC_ERR_LOC_MEM_LIMIT.  The header block is not malformed and
+ * the decoder remains usable: the application should reset the stream and
+ * write Stream Cancellation (see @ref lsqpack_dec_cancel_stream_id())
+ * instead of closing the connection with QPACK_DECOMPRESSION_FAILED.
+ *
+ * The dynamic table is not subject to this limit: it is bounded by the
+ * capacity passed to @ref lsqpack_dec_init().
+ */
+void
+lsqpack_dec_set_mem_limit (struct lsqpack_dec *, size_t limit);
+
+/**
+ * Decoder counters.  They are updated as the decoder runs unless the library
+ * is compiled with LSQPACK_STATS set to 0, in which case they stay zero.
+ */
+struct lsqpack_dec_stats
+{
+    /** Insert instructions read from the encoder stream */
+    uint64_t    n_inserts;
+    /** Duplicate instructions read from the encoder stream */
+    uint64_t    n_dups;
+    /** Entries evicted from the dynamic table */
+    uint64_t    n_evictions;
+    /** Fields that are static table references */
+    uint64_t    n_static_hits;
+    /** Literal fields with static table name references */
+    uint64_t    n_static_name_hits;
+    /** Fields that are dynamic table references */
+    uint64_t    n_dynamic_hits;
+    /** Literal fields with dynamic table name references */
+    uint64_t    n_dynamic_name_hits;
+    /** Literal fields with literal names */
+    uint64_t    n_literals;
+    /** Header blocks that were blocked waiting for dynamic table entries */
+    uint64_t    n_blocked;
+    /** Bytes saved by Huffman encoding, on both streams */
+    uint64_t    n_huff_bytes_saved;
+    /** Maximum dynamic table fill, in bytes */
+    unsigned    peak_table_size;
+    /** Maximum number of entries in the dynamic table */
+    unsigned    peak_table_nelem;
+};
+
+void
+lsqpack_dec_get_stats (const struct lsqpack_dec *, struct lsqpack_dec_stats *);
+
 /**
  * Clean up the decoder.  If any there are any blocked header blocks,
  * references to them will be discarded.
@@ -503,6 +1073,11 @@ struct lsqpack_dec_err
     enum {
         LSQPACK_DEC_ERR_LOC_HEADER_BLOCK,
         LSQPACK_DEC_ERR_LOC_ENC_STREAM,
+        /**
+         * Header block was rejected because of the limit set by
+         * @ref lsqpack_dec_set_mem_limit().  This is not a decoding error.
+         */
+        LSQPACK_DEC_ERR_LOC_MEM_LIMIT,
     }           type;
     int         line;       /* In the source file */
     uint64_t    off;        /* Offset in header block or on encoder stream */
@@ -513,6 +1088,68 @@ struct lsqpack_dec_err
 const struct lsqpack_dec_err *
 lsqpack_dec_get_err_info (const struct lsqpack_dec *);
 
+/**
+ * Return number of bytes needed to save decoder state using
+ * @ref lsqpack_dec_save_state().
+ */
+size_t
+lsqpack_dec_state_size (const struct lsqpack_dec *);
+
+/**
+ * Save decoder state -- dynamic table and blocked header blocks -- to
+ * `buf'.  Like that of @ref lsqpack_enc_save_state(), the format is flat.
+ * Statistics are not saved.
+ *
+ * Returns number of bytes written.  If `buf' is too small, -1 is returned
+ * and errno is set to ENOBUFS.  If an encoder stream instruction has been
+ * partially read or a header block that is not blocked is being read, -1
+ * is returned and errno is set to EBUSY.
+ */
+ssize_t
+lsqpack_dec_save_state (const struct lsqpack_dec *, unsigned char *buf,
+                                                                size_t);
+
+/**
+ * Restore state saved by @ref lsqpack_dec_save_state().  The decoder must
+ * have just been initialized with the same dynamic table size as the one
+ * whose state was saved; options and the header set interface are taken
+ * from the initialization.
+ *
+ * For each blocked header block, `get_hblock' is called with the stream ID.
+ * It returns the header block pointer to be passed to dhi_unblocked() and
+ * to @ref lsqpack_dec_header_read().  If the header block was started using
+ * @ref lsqpack_dec_header_in_hlist(), `hlist' is not NULL and the callback
+ * must set it to the header list to decode into.  Once unblocked, the rest
+ * of the header block is read as usual.
+ *
+ * Returns 0 on success.  On failure, -1 is returned and errno is set to
+ * EINVAL if the state is malformed or does not match the decoder, to
+ * ENOENT if the callback returned NULL, and to ENOMEM if memory could not
+ * be allocated.  The decoder is not usable after a failure; it should be
+ * cleaned up using @ref lsqpack_dec_cleanup().
+ */
+int
+lsqpack_dec_restore_state (struct lsqpack_dec *, const unsigned char *buf,
+            size_t, void *(*get_hblock)(void *ctx, uint64_t stream_id,
+                                        struct lsqpack_dec_hlist **hlist),
+            void *ctx);
+
+/** Seed of the name hash.  See @ref lsqpack_hash(). */
+#define LSQPACK_HASH_SEED 39378473
+
+/**
+ * Hash function used for name and name/value hashes in lsxpack_header
+ * (see LSXPACK_NAME_HASH and LSXPACK_NAMEVAL_HASH).  Name hash is
+ * lsqpack_hash(name, name_len, LSQPACK_HASH_SEED) and name/value hash is
+ * lsqpack_hash(value, val_len, name_hash).
+ *
+ * This is XXH32, unless the library is built with LSQPACK_CRC32C set to 1,
+ * in which case it is CRC32C.  Applications that supply hashes to the
+ * encoder must calculate them using this function.
+ */
+uint32_t
+lsqpack_hash (const void *buf, size_t len, uint32_t seed);
+
 /**
  * Enum for name/value entries in the static table.  Use it to speed up
  * encoding by setting xhdr->qpack_index and LSXPACK_QPACK_IDX flag.  If
@@ -637,6 +1274,7 @@ STAILQ_HEAD(lsqpack_enc_head, lsqpack_enc_table_entry);
 struct lsqpack_double_enc_head;
 
 struct lsqpack_header_info_arr;
+struct lsqpack_hinfo_head;
 
 struct lsqpack_dec_int_state
 {
@@ -645,6 +1283,113 @@ struct lsqpack_dec_int_state
     uint64_t    val;
 };
 
+/** Ring arena used when LSQPACK_ENC_OPT_RING_ARENA or
+ * LSQPACK_DEC_OPT_RING_ARENA is set.  Live chunks occupy [ra_tail, ra_head)
+ * or, after the ring has wrapped, [ra_tail, ra_wrap) and [0, ra_head).
+ */
+struct lsqpack_ring_arena
+{
+    unsigned char          *ra_buf;
+    size_t                  ra_size;
+    size_t                  ra_head;
+    size_t                  ra_tail;
+    /** Zero if the ring has not wrapped */
+    size_t                  ra_wrap;
+    unsigned                ra_nchunks;
+};
+
+/** A header block cached when LSQPACK_ENC_OPT_HBLOCK_CACHE is set.  eh_buf
+ * contains a copy of the header list followed by the header block.
+ */
+struct lsqpack_enc_hblock
+{
+    unsigned char              *eh_buf;
+    size_t                      eh_buf_sz;
+    size_t                      eh_list_sz;
+    size_t                      eh_hblock_sz;
+    unsigned                    eh_hash;
+    unsigned                    eh_n_fields;
+    unsigned                    eh_flags;   /* enum lsqpack_enc_flags */
+    /** Sum of name and value lengths, for the compression ratio */
+    unsigned                    eh_bytes_in;
+    /** Referenced entries; zero if the dynamic table is not referenced */
+    lsqpack_abs_id_t            eh_min_id;
+    lsqpack_abs_id_t            eh_max_id;
+    /** Value of qpe_ins_count when the header block became stable */
+    lsqpack_abs_id_t            eh_ins_count;
+    /** Set once two encodings in a row produced the same header block */
+    int                         eh_stable;
+};
+
+struct lsqpack_enc_dict_entry
+{
+    unsigned                    ede_name_hash;
+    unsigned                    ede_nameval_hash;
+    /** Offset of the name in qed_buf; the value follows the name */
+    unsigned                    ede_name_off;
+    unsigned                    ede_name_len;
+    unsigned                    ede_val_len;
+    /** Offset of the encoded Insert instruction in qed_buf */
+    unsigned                    ede_ins_off;
+    unsigned                    ede_ins_len;
+    unsigned                    ede_huff_saved;
+};
+
+struct lsqpack_enc_dict
+{
+    /** Entries sorted from most to least frequent */
+    struct lsqpack_enc_dict_entry  *qed_entries;
+    unsigned                        qed_n_entries;
+    unsigned char                  *qed_buf;
+};
+
+struct lsqpack_enc_name
+{
+    const char                 *een_name;
+    /** NULL if the value is not registered */
+    const char                 *een_value;
+    unsigned                    een_name_len;
+    unsigned                    een_val_len;
+    unsigned                    een_name_hash;
+    unsigned                    een_nameval_hash;
+    /** Static table IDs, -1 if there is no match */
+    int                         een_static_name_id;
+    int                         een_static_full_id;
+};
+
+#define LSQPACK_MAX_ENC_NAMES 256
+
+struct lsqpack_dec_name
+{
+    const char                 *dn_name;
+    unsigned                    dn_name_len;
+    unsigned                    dn_name_hash;
+    unsigned                    dn_token;
+};
+
+#define LSQPACK_MAX_DEC_NAMES 256
+
+struct lsqpack_dec_names
+{
+    struct lsqpack_dec_name    *qdn_names;
+    unsigned                    qdn_n_names;
+    unsigned                    qdn_n_alloc;
+    /** Open-addressed hash of names keyed by name hash.  Each bucket holds
+     * index into qdn_names plus one; zero means empty.
+     */
+    uint16_t                    qdn_buckets[LSQPACK_MAX_DEC_NAMES * 2];
+    /** Tokens indexed by static table ID, -1 if the name is not registered */
+    short                       qdn_static_tokens[
+                                    LSQPACK_TNV_X_FRAME_OPTIONS_SAMEORIGIN + 1];
+};
+
+struct lsqpack_enc_names
+{
+    struct lsqpack_enc_name    *qen_names;
+    unsigned                    qen_n_names;
+    unsigned                    qen_n_alloc;
+};
+
 struct lsqpack_enc
 {
     /* The number of all the entries in the dynamic table that have been
@@ -658,6 +1403,11 @@ struct lsqpack_enc
         LSQPACK_ENC_HEADER  = 1 << 0,
         LSQPACK_ENC_USE_DUP = 1 << 1,
         LSQPACK_ENC_NO_MEM_GUARD    = 1 << 2,
+        LSQPACK_ENC_COST_MODEL      = 1 << 3,
+        LSQPACK_ENC_SERVER          = 1 << 4,
+        LSQPACK_ENC_QUEUE           = 1 << 5,
+        LSQPACK_ENC_HBLOCK_CACHE    = 1 << 6,
+        LSQPACK_ENC_CRUMBLE_COOKIES = 1 << 7,
     }                           qpe_flags;
 
     unsigned                    qpe_cur_bytes_used;
@@ -693,6 +1443,13 @@ struct lsqpack_enc
     TAILQ_HEAD(, lsqpack_header_info)
                                 qpe_risked_hinfos;
 
+    /* Header infos hashed by stream ID.  The bucket array is allocated
+     * when the first header info is and doubles in size as needed.
+     */
+    unsigned                    qpe_hinfo_nelem;
+    unsigned                    qpe_hinfo_nbits;
+    struct lsqpack_hinfo_head  *qpe_hinfo_buckets;
+
     /* Current header state */
     struct {
         struct lsqpack_header_info  *hinfo, *other_at_risk;
@@ -717,6 +1474,25 @@ struct lsqpack_enc
     unsigned                    qpe_bytes_in;
     unsigned                    qpe_bytes_out;
     void                       *qpe_logger_ctx;
+    struct lsqpack_enc_stats    qpe_stats;
+    const struct lsqpack_enc_names
+                               *qpe_names;
+
+    /* Encoder stream output queued when LSQPACK_ENC_OPT_ENC_QUEUE is set.
+     * Queued bytes are [eq_off, eq_off + eq_len) in eq_buf.
+     */
+    struct {
+        unsigned char          *eq_buf;
+        size_t                  eq_size;
+        size_t                  eq_off;
+        size_t                  eq_len;
+    }                           qpe_queue;
+
+    /* Header block cache, allocated on first use.  It is direct-mapped by
+     * header list hash.
+     */
+#define LSQPACK_ENC_HBLOCK_CACHE_BITS 4
+    struct lsqpack_enc_hblock  *qpe_hblock_cache;
 
     /* Exponential moving averages (EMAs) of the number of elements in the
      * dynamic table and the number of header fields in a single header list.
@@ -724,11 +1500,23 @@ struct lsqpack_enc
      */
     float                       qpe_table_nelem_ema;
     float                       qpe_header_count_ema;
+    /* EMA of bytes inserted into the dynamic table per header list.  Only
+     * used by the cost model.
+     */
+    float                       qpe_ins_bytes_ema;
 
     struct lsqpack_hist_el     *qpe_hist_els;
     unsigned                    qpe_hist_idx;
     unsigned                    qpe_hist_nels;
     int                         qpe_hist_wrapped;
+    /* History elements are hashed for quick lookup */
+    unsigned                   *qpe_hist_buckets;
+    unsigned                    qpe_hist_nbits;
+
+    /* Dynamic table entries are allocated from the arena.  If the arena
+     * has no buffer, malloc(3) is used.
+     */
+    struct lsqpack_ring_arena   qpe_arena;
 };
 
 struct lsqpack_ringbuf
@@ -738,6 +1526,7 @@ struct lsqpack_ringbuf
 };
 
 TAILQ_HEAD(lsqpack_header_sets, lsqpack_header_set_elem);
+TAILQ_HEAD(lsqpack_hbrc_head, header_block_read_ctx);
 
 struct lsqpack_header_block;
 
@@ -751,6 +1540,9 @@ struct lsqpack_huff_decode_state
 {
     int                             resume;
     struct lsqpack_decode_status    status;
+    /* Bits carried over between calls by the fast decoder */
+    unsigned                        nbits;
+    uint64_t                        bits;
 };
 
 struct lsqpack_dec_inst;
@@ -771,6 +1563,13 @@ struct lsqpack_dec
      */
     unsigned                qpd_bytes_in;
     unsigned                qpd_bytes_out;
+    struct lsqpack_dec_stats qpd_stats;
+    /** Huffman savings are summed up with sign, because a chunk of input
+     * may be consumed before it produces output, and a string may be longer
+     * Huffman-encoded than it is decoded.  This is reported as
+     * n_huff_bytes_saved.
+     */
+    int64_t                 qpd_huff_bytes_saved;
     /** ID of the last dynamic table entry.  Has the range
      * [0, qpd_max_entries * 2 - 1 ]
      */
@@ -788,16 +1587,60 @@ struct lsqpack_dec
     TAILQ_HEAD(, header_block_read_ctx)
                             qpd_hbrcs;
 
-    /** Blocked headers are kept in a small hash */
-#define LSQPACK_DEC_BLOCKED_BITS 3
+    /** Header blocks in qpd_hbrcs are also hashed by hblock pointer.  The
+     * bucket array is allocated on first use and doubles as needed.
+     */
+    struct lsqpack_hbrc_head
+                           *qpd_hbrc_buckets;
+    unsigned                qpd_hbrc_nbits;
+    unsigned                qpd_n_hbrcs;
+
+    /** Read contexts of finished header blocks are kept for reuse, so that
+     * blocked and partially read header blocks do not cost an allocation.
+     */
     TAILQ_HEAD(, header_block_read_ctx)
-                            qpd_blocked_headers[1 << LSQPACK_DEC_BLOCKED_BITS];
+                            qpd_free_hbrcs;
+    unsigned                qpd_n_free_hbrcs;
+
+    /** Blocked headers are kept in a hash keyed by Required Insert Count.
+     * It starts with 1 << LSQPACK_DEC_BLOCKED_BITS buckets and doubles as
+     * the number of blocked streams grows.
+     */
+#define LSQPACK_DEC_BLOCKED_BITS 3
+    struct lsqpack_hbrc_head
+                           *qpd_blocked_headers;
+    unsigned                qpd_blocked_nbits;
     /** Number of blocked streams (in qpd_blocked_headers) */
     unsigned                qpd_n_blocked;
 
     /** Average number of header fields in header list */
     float                   qpd_hlist_size_ema;
 
+    /** Set by @ref lsqpack_dec_set_names() */
+    const struct lsqpack_dec_names
+                           *qpd_names;
+
+    /** Dynamic table entry allocator */
+    const struct lsqpack_dec_alloc_if
+                           *qpd_alloc_if;
+    void                   *qpd_alloc_ctx;
+    /** Read context allocator; if NULL, malloc(3) is used */
+    const struct lsqpack_dec_alloc_if
+                           *qpd_hbrc_alloc_if;
+    void                   *qpd_hbrc_alloc_ctx;
+    struct lsqpack_ring_arena
+                            qpd_arena;
+    /** Bytes held by dynamic table entries allocated outside of qpd_arena */
+    size_t                  qpd_entry_bytes;
+    /** Limit set by @ref lsqpack_dec_set_mem_limit(); zero means none */
+    size_t                  qpd_mem_limit;
+    enum {
+        /* qpd_arena is resized to follow the dynamic table capacity once
+         * it is empty.  Until then, new entries are allocated outside of it.
+         */
+        LSQPACK_DEC_RESIZE_ARENA    = 1 << 0,
+    }                       qpd_flags;
+
     /** Reading the encoder stream */
     struct {
         int                                                 resume;
@@ -32,6 +32,7 @@ enum lsxpack_flag
     LSXPACK_NAMEVAL_HASH = 16,
     LSXPACK_VAL_MATCHED = 32,
     LSXPACK_NEVER_INDEX = 64,
+    LSXPACK_VAL_HUFFMAN = 128,  /* value is Huffman-encoded (lazy decoding) */
 };
 
 /**
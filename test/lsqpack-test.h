@@ -35,13 +35,17 @@ struct huff_decode_retval
     unsigned                n_src;
 };
 
+struct huff_decode_retval
+lsqpack_huff_decode (const unsigned char *src, int src_len,
+            unsigned char *dst, int dst_len,
+            struct lsqpack_huff_decode_state *state, int final);
+
 struct huff_decode_retval
 lsqpack_huff_decode_full (const unsigned char *src, int src_len,
             unsigned char *dst, int dst_len,
             struct lsqpack_huff_decode_state *state, int final);
 
 int
-lsqpack_find_in_static_headers (uint32_t name_hash, const char *name,
-                                                        unsigned name_len);
+lsqpack_find_in_static_headers (const char *name, unsigned name_len);
 
 #endif
@@ -24,6 +24,8 @@ GetOptions(
 # To reduce the number of tests from doubling, check HTTP/1.x mode in some
 # input, but not others.  The value of this setting is easy to determine.
 my $http1x = ($aggressive + $table_size + $immed_ack + $risked_streams) & 1;
+# Same for the decoder ring arena.
+my $ring_arena = $immed_ack ? 1 : 0;
 
 my $dir = catfile(($ENV{TMP} || $ENV{TEMP} || "/tmp"),
                                                 "run-qif-out-" . rand . $$);
@@ -53,6 +55,10 @@ if ($immed_ack) {
     $encode_args="$encode_args -a 1";
 }
 
+if ($ring_arena) {
+    $encode_args="$encode_args -R";
+}
+
 if (defined $risked_streams) {
     $encode_args = "$encode_args -s $risked_streams";
     $decode_args = "$decode_args -s $risked_streams";
@@ -68,12 +74,12 @@ copy($ARGV[0], $qif_file) or die "cannot copy original $ARGV[0] to $qif_file";
 if ($^O eq 'MSWin32') {
     system('interop-encode', $encode_args, '-i', $qif_file, '-o', $bin_file)
         and die "interop-encode failed";
-    system('interop-decode', $decode_args, '-m', '1', '-i', $bin_file, '-o', $resulting_qif_file, '-H', $http1x)
+    system('interop-decode', $decode_args, '-m', '1', '-i', $bin_file, '-o', $resulting_qif_file, '-H', $http1x, '-R', $ring_arena)
         and die "interop-decode failed";
 } else {
     system("interop-encode $encode_args -i $qif_file -o $bin_file")
         and die "interop-encode failed";
-    system("interop-decode $decode_args -m 1 -i $bin_file -o $resulting_qif_file -H $http1x")
+    system("interop-decode $decode_args -m 1 -i $bin_file -o $resulting_qif_file -H $http1x -R $ring_arena")
         and die "interop-decode failed";
 }
 
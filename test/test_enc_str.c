@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
@@ -114,6 +115,62 @@ static const struct str_test tests[] =
 };
 
 
+/* Encode pseudo-random strings of different lengths and character sets
+ * and verify that they decode back to the original.  This exercises the
+ * multibyte paths of the Huffman encoder and the encoded size calculation.
+ */
+static void
+test_huffman_round_trip (void)
+{
+    static const char alphabet[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+/=-_";
+    unsigned char str[0x200], out[0x400], dec[0x200];
+    const unsigned char *p;
+    struct lsqpack_dec_int_state dec_int_state;
+    struct lsqpack_huff_decode_state huff_state;
+    struct huff_decode_retval rv;
+    unsigned len, i, iter;
+    uint64_t enc_len;
+    uint32_t rnd = 1;
+    int r, s;
+
+    for (iter = 0; iter < 2; ++iter)
+        for (len = 0; len < sizeof(str); ++len)
+        {
+            for (i = 0; i < len; ++i)
+            {
+                rnd = rnd * 1103515245 + 12345;
+                /* Mostly short codes, with a sprinkling of long ones */
+                if (iter == 0 || (rnd >> 16) % 16)
+                    str[i] = alphabet[(rnd >> 16) % (sizeof(alphabet) - 1)];
+                else
+                    str[i] = rnd >> 24;
+            }
+            out[0] = 0;
+            r = lsqpack_enc_enc_str(7, out, sizeof(out), str, len);
+            assert(r > 0);
+            p = out;
+            dec_int_state.resume = 0;
+            s = lsqpack_dec_int(&p, out + r, 7, &enc_len, &dec_int_state);
+            assert(s == 0);
+            assert(enc_len == (unsigned) (out + r - p));
+            if (!(out[0] & 0x80))
+            {
+                assert(enc_len == len);
+                assert(0 == memcmp(p, str, len));
+                continue;
+            }
+            huff_state.resume = 0;
+            rv = lsqpack_huff_decode_full(p, enc_len, dec, sizeof(dec),
+                                                            &huff_state, 1);
+            assert(rv.status == HUFF_DEC_OK);
+            assert(rv.n_src == enc_len);
+            assert(rv.n_dst == len);
+            assert(0 == memcmp(dec, str, len));
+        }
+}
+
+
 int
 main (void)
 {
@@ -135,5 +192,6 @@ main (void)
     }
 
     free(out);
+    test_huffman_round_trip();
     return 0;
 }
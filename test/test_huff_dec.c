@@ -312,10 +312,31 @@ const struct test_huff_dec tests[] =
         "them to the separation.",
         404,
     },
+    {   __LINE__,
+        (unsigned char *)
+        "\x20\xe5\xff\xfe\x3f\xff\xee\xa9\xff\x8f\xff\xfb"
+        "\x1f\xff\xff\x77\xff\xff\xf0\x52\x33\x54\x3b\x3d"
+        "\x7f\xff\xe6\xff\xff\xff\xcf\xff\xe6\x52\x83\xd5"
+        "\x31\x6c\x58\x87\x90\xa8\xff\xff\xff\xf3\xff\xff"
+        "\xff\xef\xff\xff\xff\x7e\x94\xa4\xde\x4b\x22\x86"
+        "\xa9\x4f\xff\xed\xff\xfe\x7f\xff\xef\xff\x1f",
+        71,
+        /* Non-ASCII and control characters have codes longer than 16 bits */
+        (char *)
+        "\x63\x61\x66\xc3\xa9\x20\x00\x01\xff\xfe\x20\x62"
+        "\x69\x6e\x61\x72\x79\x9d\x7f\x80\x20\x6c\x6f\x6e"
+        "\x67\x65\x72\x2d\x63\x6f\x64\x65\x73\x0a\x16\x0d"
+        "\x2c\x20\x6d\x69\x78\x65\x64\x20\x69\x6e\x20\xe2"
+        "\x82\xac\x21",
+        51,
+    },
 };
 
+typedef struct huff_decode_retval (*huff_decode_f) (const unsigned char *,
+        int, unsigned char *, int, struct lsqpack_huff_decode_state *, int);
+
 void
-run_test (const struct test_huff_dec *test)
+run_test (const struct test_huff_dec *test, huff_decode_f huff_decode)
 {
     struct huff_decode_retval retval;
     struct lsqpack_huff_decode_state state;
@@ -340,7 +361,7 @@ run_test (const struct test_huff_dec *test)
             do
             {
                 assert(in_off + n_to_read <= test->src_sz); /* self-test */
-                retval = lsqpack_huff_decode_full(test->src + in_off, n_to_read,
+                retval = huff_decode(test->src + in_off, n_to_read,
                         (unsigned char *) output + out_off, n_to_write, &state,
                         test->src_sz == in_off + n_to_read);
                 switch (retval.status)
@@ -393,7 +414,12 @@ main (int argc, char **argv)
 
     for (test = tests; test < tests + sizeof(tests) / sizeof(tests[0]); ++test)
         if (run_expensive || test->src_sz * test->dst_sz < 150000)
-            run_test(test);
+        {
+            run_test(test, lsqpack_huff_decode_full);
+#if LSQPACK_DEVEL_MODE
+            run_test(test, lsqpack_huff_decode);
+#endif
+        }
 
     return 0;
 }
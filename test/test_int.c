@@ -164,6 +164,75 @@ static const struct int_test tests[] =
 
 };
 
+/* Encode and decode values of all lengths using both the fast path, taken
+ * when there is plenty of room in the buffer, and the byte-by-byte path,
+ * taken at buffer ends.  The results must match.
+ */
+static void
+test_round_trip (void)
+{
+    struct lsqpack_dec_int_state state;
+    const unsigned char *src;
+    unsigned char tight[LSQPACK_UINT64_ENC_SZ], roomy[LSQPACK_UINT64_ENC_SZ + 8];
+    unsigned char *dst;
+    uint64_t value, decoded, rand_state;
+    unsigned prefix_bits, nbits, n;
+    size_t sz;
+    int rv;
+
+    rand_state = 1;
+    for (prefix_bits = 1; prefix_bits <= 8; ++prefix_bits)
+        for (nbits = 0; nbits <= 64; ++nbits)
+            for (n = 0; n < 10; ++n)
+            {
+                rand_state = rand_state * 6364136223846793005ull
+                                                    + 1442695040888963407ull;
+                value = nbits == 0 ? 0 : nbits == 64 ? rand_state
+                            : rand_state & ((1ull << nbits) - 1);
+                if (n == 0 && nbits > 0)
+                    value = nbits == 64 ? UINT64_MAX : (1ull << nbits) - 1;
+
+                memset(roomy, 0xFF, sizeof(roomy));
+                roomy[0] = 0;
+                dst = lsqpack_enc_int(roomy, roomy + sizeof(roomy), value,
+                                                                prefix_bits);
+                assert(dst > roomy);
+                sz = (size_t) (dst - roomy);
+
+                /* Exact fit */
+                tight[0] = 0;
+                dst = lsqpack_enc_int(tight, tight + sz, value, prefix_bits);
+                assert(dst == tight + sz);
+                assert(0 == memcmp(tight, roomy, sz));
+
+                /* One byte short */
+                if (sz > 1)
+                {
+                    tight[0] = 0;
+                    dst = lsqpack_enc_int(tight, tight + sz - 1, value,
+                                                                prefix_bits);
+                    assert(dst == tight);
+                }
+
+                state.resume = 0;
+                src = roomy;
+                rv = lsqpack_dec_int(&src, roomy + sizeof(roomy), prefix_bits,
+                                                            &decoded, &state);
+                assert(rv == 0);
+                assert(src == roomy + sz);
+                assert(decoded == value);
+
+                state.resume = 0;
+                src = tight;
+                rv = lsqpack_dec_int(&src, tight + sz, prefix_bits,
+                                                            &decoded, &state);
+                assert(rv == 0);
+                assert(src == tight + sz);
+                assert(decoded == value);
+            }
+}
+
+
 int
 main (void)
 {
@@ -216,5 +285,29 @@ main (void)
         }
     }
 
+    /* Test the decoder with enough input following the integer for the
+     * fast path to be taken.  Trailing bytes have the continuation bit set
+     * to check that they are ignored.
+     */
+    for (test = tests; test < tests + sizeof(tests) / sizeof(tests[0]); ++test)
+    {
+        unsigned char padded[ sizeof(test->it_encoded) + 8 ];
+        struct lsqpack_dec_int_state state;
+        memset(padded, 0xFF, sizeof(padded));
+        memcpy(padded, test->it_encoded, test->it_enc_sz);
+        state.resume = 0;
+        src = padded;
+        rv = lsqpack_dec_int(&src, padded + sizeof(padded),
+                                    test->it_prefix_bits, &val, &state);
+        assert(rv == test->it_dec_retval);
+        if (0 == rv)
+        {
+            assert(val == test->it_decoded);
+            assert(src == padded + test->it_enc_sz);
+        }
+    }
+
+    test_round_trip();
+
     return 0;
 }
@@ -0,0 +1,387 @@
+/*
+ * Test multi-threaded decoding helper
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lsqpack.h"
+#include "lsqpack-mt.h"
+#include "lsxpack_header.h"
+
+#define N_THREADS 4
+#define N_CONNS 16
+#define N_LISTS 50
+#define N_FIELDS 4
+
+
+struct test_conn
+{
+    struct lsqpack_enc          enc;
+    struct lsqpack_mt_conn     *mt_conn;
+    unsigned                    id;
+    unsigned                    n_done;     /* Header blocks decoded */
+    int                         closed;
+};
+
+
+/* Filled in by worker threads */
+struct test_hblock
+{
+    struct lsxpack_header       xhdr;
+    char                        buf[0x100];
+    unsigned                    conn_id;
+    unsigned                    list;
+    unsigned                    n_headers;
+    int                         mismatch;
+};
+
+
+static void
+make_list (struct lsxpack_header *xhdrs, char *path, char *conn_val,
+                                                unsigned conn_id, unsigned list)
+{
+    int len;
+
+    lsxpack_header_set_ptr(&xhdrs[0], ":method", 7, "GET", 3);
+    len = snprintf(path, 0x20, "/conn/%u/list/%u", conn_id, list);
+    lsxpack_header_set_ptr(&xhdrs[1], ":path", 5, path, len);
+    len = snprintf(conn_val, 0x20, "%u", conn_id);
+    lsxpack_header_set_ptr(&xhdrs[2], "x-conn", 6, conn_val, len);
+    lsxpack_header_set_ptr(&xhdrs[3], "user-agent", 10, "test-mt", 7);
+}
+
+
+static void
+test_unblocked (void *hblock_ctx)
+{
+    assert(0);  /* The helper does not call it */
+}
+
+
+static struct lsxpack_header *
+test_prepare_decode (void *hblock_ctx, struct lsxpack_header *xhdr,
+                                                                size_t space)
+{
+    struct test_hblock *const hblock = hblock_ctx;
+
+    if (xhdr)
+        return NULL;
+    lsxpack_header_prepare_decode(&hblock->xhdr, hblock->buf, 0,
+                                                        sizeof(hblock->buf));
+    return &hblock->xhdr;
+}
+
+
+static int
+test_process_header (void *hblock_ctx, struct lsxpack_header *xhdr)
+{
+    struct test_hblock *const hblock = hblock_ctx;
+    struct lsxpack_header xhdrs[N_FIELDS];
+    char path[0x20], conn_val[0x20];
+    const struct lsxpack_header *exp;
+
+    make_list(xhdrs, path, conn_val, hblock->conn_id, hblock->list);
+    if (hblock->n_headers >= N_FIELDS)
+    {
+        hblock->mismatch = 1;
+        return 0;
+    }
+    exp = &xhdrs[ hblock->n_headers++ ];
+    if (!(xhdr->name_len == exp->name_len
+            && 0 == memcmp(lsxpack_header_get_name(xhdr),
+                                lsxpack_header_get_name(exp), exp->name_len)
+            && xhdr->val_len == exp->val_len
+            && 0 == memcmp(lsxpack_header_get_value(xhdr),
+                                lsxpack_header_get_value(exp), exp->val_len)))
+        hblock->mismatch = 1;
+    return 0;
+}
+
+
+static const struct lsqpack_dec_hset_if test_hset_if = {
+    .dhi_unblocked      = test_unblocked,
+    .dhi_prepare_decode = test_prepare_decode,
+    .dhi_process_header = test_process_header,
+};
+
+
+static void
+handle_result (struct test_conn *conns, struct lsqpack_mt_result *result)
+{
+    struct test_conn *const conn = result->lmr_conn_ctx;
+    struct test_hblock *hblock;
+    int s;
+
+    assert(conn >= conns && conn < conns + N_CONNS);
+    assert(!conn->closed);
+    switch (result->lmr_type)
+    {
+    case LSQPACK_MT_HEADER_BLOCK:
+        hblock = result->lmr_hblock_ctx;
+        assert(result->lmr_status == LQRHS_DONE);
+        assert(result->lmr_stream_id == hblock->list * 4);
+        assert(hblock->conn_id == conn->id);
+        assert(hblock->n_headers == N_FIELDS);
+        assert(!hblock->mismatch);
+        ++conn->n_done;
+        break;
+    case LSQPACK_MT_ENC_STREAM:
+        assert(result->lmr_status == LQRHS_DONE);
+        assert(result->lmr_dec_buf_sz > 0);
+        break;
+    case LSQPACK_MT_CONN_CLOSED:
+        conn->closed = 1;
+        return;
+    }
+    if (result->lmr_dec_buf_sz)
+    {
+        s = lsqpack_enc_decoder_in(&conn->enc, result->lmr_dec_buf,
+                                                    result->lmr_dec_buf_sz);
+        assert(s == 0);
+    }
+}
+
+
+/* Header blocks of many connections are decoded in several threads.  Some
+ * are blocked, as they arrive before the encoder stream data they need.
+ */
+static void
+test_many_conns (void)
+{
+    struct lsqpack_mt_settings settings;
+    struct lsqpack_mt *mt;
+    struct lsqpack_mt_result *result;
+    struct test_conn *conns, *conn;
+    struct test_hblock *hblocks, *hblock;
+    struct lsxpack_header xhdrs[N_FIELDS];
+    unsigned char enc_buf[0x400], hea_buf[0x400];
+    unsigned char sdtc_buf[LSQPACK_LONGEST_SDTC];
+    char path[0x20], conn_val[0x20];
+    size_t enc_sz, hea_sz, sdtc_sz;
+    unsigned list, n_closed;
+    int s;
+
+    memset(&settings, 0, sizeof(settings));
+    settings.lms_n_threads = N_THREADS;
+    settings.lms_dyn_table_size = 0x400;
+    settings.lms_max_risked_streams = 100;
+    settings.lms_hset_if = &test_hset_if;
+    mt = lsqpack_mt_new(&settings);
+    assert(mt);
+
+    conns = calloc(N_CONNS, sizeof(conns[0]));
+    hblocks = calloc(N_CONNS * N_LISTS, sizeof(hblocks[0]));
+    assert(conns && hblocks);
+    for (conn = conns; conn < conns + N_CONNS; ++conn)
+    {
+        conn->id = conn - conns;
+        sdtc_sz = sizeof(sdtc_buf);
+        s = lsqpack_enc_init(&conn->enc, NULL, 0x400, 0x400, 100, 0,
+                                                        sdtc_buf, &sdtc_sz);
+        assert(s == 0);
+        conn->mt_conn = lsqpack_mt_conn_new(mt, conn);
+        assert(conn->mt_conn);
+        s = lsqpack_mt_enc_in(conn->mt_conn, sdtc_buf, sdtc_sz);
+        assert(s == 0);
+    }
+
+    /* Connections are interleaved, as they would be on a server */
+    for (list = 0; list < N_LISTS; ++list)
+        for (conn = conns; conn < conns + N_CONNS; ++conn)
+        {
+            hblock = &hblocks[ conn->id * N_LISTS + list ];
+            hblock->conn_id = conn->id;
+            hblock->list = list;
+            make_list(xhdrs, path, conn_val, conn->id, list);
+            enc_sz = sizeof(enc_buf);
+            hea_sz = sizeof(hea_buf);
+            s = lsqpack_enc_encode_list(&conn->enc, list * 4, 0, enc_buf,
+                        &enc_sz, hea_buf, &hea_sz, xhdrs, N_FIELDS, 0, NULL);
+            assert(s == 0);
+            s = lsqpack_mt_header_in(conn->mt_conn, hblock, list * 4,
+                                                            hea_buf, hea_sz);
+            assert(s == 0);
+            if (enc_sz)
+            {
+                s = lsqpack_mt_enc_in(conn->mt_conn, enc_buf, enc_sz);
+                assert(s == 0);
+            }
+            /* Pass acknowledgements to the encoders as they come in */
+            while ((result = lsqpack_mt_get_result(mt, 0)))
+            {
+                handle_result(conns, result);
+                lsqpack_mt_result_free(result);
+            }
+        }
+
+    for (conn = conns; conn < conns + N_CONNS; ++conn)
+        lsqpack_mt_conn_destroy(conn->mt_conn);
+    for (n_closed = 0; n_closed < N_CONNS; )
+    {
+        result = lsqpack_mt_get_result(mt, 1);
+        assert(result);
+        handle_result(conns, result);
+        n_closed += result->lmr_type == LSQPACK_MT_CONN_CLOSED;
+        lsqpack_mt_result_free(result);
+    }
+    assert(!lsqpack_mt_get_result(mt, 0));
+
+    for (conn = conns; conn < conns + N_CONNS; ++conn)
+    {
+        assert(conn->closed);
+        assert(conn->n_done == N_LISTS);
+        lsqpack_enc_cleanup(&conn->enc);
+    }
+    lsqpack_mt_destroy(mt);
+    free(hblocks);
+    free(conns);
+}
+
+
+/* A header block that is still blocked when the connection is destroyed is
+ * returned with LQRHS_BLOCKED status, as is input after an encoder stream
+ * error with LQRHS_ERROR.
+ */
+static void
+test_destroy_blocked (void)
+{
+    struct lsqpack_mt_settings settings;
+    struct lsqpack_mt *mt;
+    struct lsqpack_mt_conn *mt_conn;
+    struct lsqpack_mt_result *result;
+    struct test_hblock hblock;
+    int s, conn_ctx;
+    /* Refers to the first dynamic table entry */
+    static const unsigned char header_block[] = "\x02\x00\x80";
+    /* Duplicate of an entry that does not exist */
+    static const unsigned char bad_ins[] = "\x00";
+
+    memset(&settings, 0, sizeof(settings));
+    settings.lms_n_threads = 1;
+    settings.lms_dyn_table_size = 0x100;
+    settings.lms_max_risked_streams = 1;
+    settings.lms_hset_if = &test_hset_if;
+    mt = lsqpack_mt_new(&settings);
+    assert(mt);
+
+    memset(&hblock, 0, sizeof(hblock));
+    mt_conn = lsqpack_mt_conn_new(mt, &conn_ctx);
+    assert(mt_conn);
+    s = lsqpack_mt_header_in(mt_conn, &hblock, 0, header_block,
+                                                    sizeof(header_block) - 1);
+    assert(s == 0);
+    lsqpack_mt_conn_destroy(mt_conn);
+    result = lsqpack_mt_get_result(mt, 1);
+    assert(result->lmr_type == LSQPACK_MT_HEADER_BLOCK);
+    assert(result->lmr_status == LQRHS_BLOCKED);
+    assert(result->lmr_hblock_ctx == &hblock);
+    assert(result->lmr_conn_ctx == &conn_ctx);
+    lsqpack_mt_result_free(result);
+    result = lsqpack_mt_get_result(mt, 1);
+    assert(result->lmr_type == LSQPACK_MT_CONN_CLOSED);
+    assert(result->lmr_conn_ctx == &conn_ctx);
+    lsqpack_mt_result_free(result);
+    assert(!lsqpack_mt_get_result(mt, 0));
+
+    mt_conn = lsqpack_mt_conn_new(mt, &conn_ctx);
+    assert(mt_conn);
+    s = lsqpack_mt_enc_in(mt_conn, bad_ins, sizeof(bad_ins) - 1);
+    assert(s == 0);
+    s = lsqpack_mt_header_in(mt_conn, &hblock, 0, header_block,
+                                                    sizeof(header_block) - 1);
+    assert(s == 0);
+    lsqpack_mt_conn_destroy(mt_conn);
+    result = lsqpack_mt_get_result(mt, 1);
+    assert(result->lmr_type == LSQPACK_MT_ENC_STREAM);
+    assert(result->lmr_status == LQRHS_ERROR);
+    lsqpack_mt_result_free(result);
+    result = lsqpack_mt_get_result(mt, 1);
+    assert(result->lmr_type == LSQPACK_MT_HEADER_BLOCK);
+    assert(result->lmr_status == LQRHS_ERROR);
+    lsqpack_mt_result_free(result);
+    result = lsqpack_mt_get_result(mt, 1);
+    assert(result->lmr_type == LSQPACK_MT_CONN_CLOSED);
+    lsqpack_mt_result_free(result);
+
+    lsqpack_mt_destroy(mt);
+}
+
+
+/* Connections are destroyed right after input is submitted, while workers
+ * may still be processing it.
+ */
+static void
+test_destroy_stress (void)
+{
+    struct lsqpack_mt_settings settings;
+    struct lsqpack_mt *mt;
+    struct lsqpack_mt_conn *mt_conns[64];
+    struct lsqpack_mt_result *result;
+    struct test_hblock hblocks[64];
+    unsigned round, n, n_closed, n_done;
+    int s;
+    /* Encoded without the dynamic table, so that it is never blocked */
+    unsigned char header_block[0x100];
+    size_t hea_sz;
+    struct lsxpack_header xhdrs[N_FIELDS];
+    char path[0x20], conn_val[0x20];
+
+    make_list(xhdrs, path, conn_val, 0, 0);
+    hea_sz = sizeof(header_block);
+    s = lsqpack_enc_encode_stateless(header_block, &hea_sz, xhdrs, N_FIELDS,
+                                                                        0);
+    assert(s == 0);
+
+    memset(&settings, 0, sizeof(settings));
+    settings.lms_n_threads = N_THREADS;
+    settings.lms_hset_if = &test_hset_if;
+    mt = lsqpack_mt_new(&settings);
+    assert(mt);
+
+    for (round = 0; round < 100; ++round)
+    {
+        for (n = 0; n < 64; ++n)
+        {
+            memset(&hblocks[n], 0, sizeof(hblocks[n]));
+            mt_conns[n] = lsqpack_mt_conn_new(mt, &hblocks[n]);
+            assert(mt_conns[n]);
+            s = lsqpack_mt_header_in(mt_conns[n], &hblocks[n], 0,
+                                                    header_block, hea_sz);
+            assert(s == 0);
+            lsqpack_mt_conn_destroy(mt_conns[n]);
+        }
+        for (n_closed = 0, n_done = 0; n_closed < 64; )
+        {
+            result = lsqpack_mt_get_result(mt, 1);
+            assert(result);
+            if (result->lmr_type == LSQPACK_MT_CONN_CLOSED)
+                ++n_closed;
+            else
+            {
+                assert(result->lmr_type == LSQPACK_MT_HEADER_BLOCK);
+                assert(result->lmr_status == LQRHS_DONE);
+                assert(result->lmr_hblock_ctx == result->lmr_conn_ctx);
+                ++n_done;
+            }
+            lsqpack_mt_result_free(result);
+        }
+        assert(n_done == 64);
+    }
+
+    lsqpack_mt_destroy(mt);
+}
+
+
+int
+main (void)
+{
+    test_many_conns();
+    test_destroy_blocked();
+    test_destroy_stress();
+
+    return 0;
+}
@@ -4,10 +4,20 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _MSC_VER
+#include <sys/uio.h>
+#else
+struct iovec
+{
+    void       *iov_base;
+    size_t      iov_len;
+};
+#endif
 
 #include "lsqpack.h"
 #include "lsqpack-test.h"
@@ -1059,6 +1069,3428 @@ test_enc_risked_streams (void)
 }
 
 
+/* Keep many header blocks outstanding, then acknowledge and cancel them
+ * in an order different from the one in which they were created.
+ */
+static void
+test_enc_many_outstanding_hblocks (void)
+{
+    struct lsqpack_enc enc;
+    size_t enc_sz, hea_sz;
+    ssize_t ssz;
+    enum lsqpack_enc_status es;
+    unsigned n;
+    int s;
+    unsigned char enc_buf[0x100], hea_buf[0x100], ins_buf[0x10];
+    unsigned char *end_cmd;
+    struct lsxpack_header xhdr;
+    const unsigned n_streams = 1000;
+
+    enc_sz = sizeof(enc_buf);
+    s = lsqpack_enc_init(&enc, stderr, 0x1000, 0x1000, 0,
+                    LSQPACK_ENC_OPT_IX_AGGR|LSQPACK_ENC_OPT_NO_MEM_GUARD,
+                    enc_buf, &enc_sz);
+    assert(s == 0);
+
+    /* Insert entry and acknowledge it using Insert Count Increment */
+    s = lsqpack_enc_start_header(&enc, 0, 0);
+    assert(s == 0);
+    lsxpack_header_set_ptr(&xhdr, "some", 4, "header", 6);
+    enc_sz = sizeof(enc_buf);
+    hea_sz = sizeof(hea_buf);
+    es = lsqpack_enc_encode(&enc, enc_buf, &enc_sz, hea_buf, &hea_sz,
+                                                                    &xhdr, 0);
+    assert(es == LQES_OK);
+    assert(enc_sz > 0);
+    ssz = lsqpack_enc_end_header(&enc, hea_buf, sizeof(hea_buf), NULL);
+    assert(ssz > 0);
+    ins_buf[0] = 0x00;
+    end_cmd = lsqpack_enc_int(ins_buf, ins_buf + sizeof(ins_buf), 1, 6);
+    s = lsqpack_enc_decoder_in(&enc, ins_buf, end_cmd - ins_buf);
+    assert(s == 0);
+    assert(enc.qpe_hinfo_nelem == 0);
+
+    /* Each of these header blocks references the acknowledged entry */
+    for (n = 1; n <= n_streams; ++n)
+    {
+        s = lsqpack_enc_start_header(&enc, n * 4, 0);
+        assert(s == 0);
+        enc_sz = sizeof(enc_buf);
+        hea_sz = sizeof(hea_buf);
+        es = lsqpack_enc_encode(&enc, enc_buf, &enc_sz, hea_buf, &hea_sz,
+                                                                    &xhdr, 0);
+        assert(es == LQES_OK);
+        assert(enc_sz == 0);
+        ssz = lsqpack_enc_end_header(&enc, hea_buf, sizeof(hea_buf), NULL);
+        assert(ssz > 0);
+    }
+    assert(enc.qpe_hinfo_nelem == n_streams);
+
+    /* Acknowledge even streams from last to first, cancel the rest */
+    for (n = n_streams; n > 0; --n)
+    {
+        if (n & 1)
+        {
+            ins_buf[0] = 0x40;
+            end_cmd = lsqpack_enc_int(ins_buf, ins_buf + sizeof(ins_buf),
+                                                                    n * 4, 6);
+        }
+        else
+        {
+            ins_buf[0] = 0x80;
+            end_cmd = lsqpack_enc_int(ins_buf, ins_buf + sizeof(ins_buf),
+                                                                    n * 4, 7);
+        }
+        s = lsqpack_enc_decoder_in(&enc, ins_buf, end_cmd - ins_buf);
+        assert(s == 0);
+    }
+    assert(enc.qpe_hinfo_nelem == 0);
+    assert(TAILQ_EMPTY(&enc.qpe_all_hinfos));
+
+    /* Header Ack for a stream without outstanding header blocks is an error */
+    ins_buf[0] = 0x80;
+    end_cmd = lsqpack_enc_int(ins_buf, ins_buf + sizeof(ins_buf), 8, 7);
+    s = lsqpack_enc_decoder_in(&enc, ins_buf, end_cmd - ins_buf);
+    assert(s < 0);
+
+    lsqpack_enc_cleanup(&enc);
+}
+
+
+/* The ring arena must not change encoder output.  Once initialized, the
+ * encoder keeps all entries in the arena and never grows the hash table.
+ */
+static void
+test_enc_ring_arena (void)
+{
+    struct lsqpack_enc encs[2];
+    struct lsqpack_enc *enc;
+    size_t enc_sz[2], hea_sz[2], pref_sz[2];
+    enum lsqpack_enc_status es;
+    unsigned n, i, nbits;
+    int s;
+    unsigned char enc_buf[2][0x100], hea_buf[2][0x100], pref_buf[2][0x10];
+    unsigned char ins_buf[0x10], *end_cmd;
+    char name[0x10], value[0x40];
+    struct lsxpack_header xhdr;
+
+    for (enc = encs; enc < encs + 2; ++enc)
+    {
+        enc_sz[0] = sizeof(enc_buf[0]);
+        s = lsqpack_enc_init(enc, NULL, 0x200, 0x200, 0,
+                    LSQPACK_ENC_OPT_IX_AGGR
+                    | (enc == encs ? LSQPACK_ENC_OPT_RING_ARENA : 0),
+                    enc_buf[0], &enc_sz[0]);
+        assert(s == 0);
+    }
+    assert(encs[0].qpe_arena.ra_buf);
+    assert(!encs[1].qpe_arena.ra_buf);
+    nbits = encs[0].qpe_nbits;
+    assert((1u << nbits) / 2 > 0x200 / 32);
+
+    for (n = 0; n < 1000; ++n)
+    {
+        for (i = 0; i < 2; ++i)
+        {
+            enc = &encs[i];
+            s = lsqpack_enc_start_header(enc, n * 4, 0);
+            assert(s == 0);
+            snprintf(name, sizeof(name), "x-%u", n % 17);
+            snprintf(value, sizeof(value), "%.*s", n % 40,
+                                "abcdefghijklmnopqrstuvwxyz0123456789ABCD");
+            lsxpack_header_set_ptr(&xhdr, name, strlen(name), value,
+                                                                strlen(value));
+            enc_sz[i] = sizeof(enc_buf[i]);
+            hea_sz[i] = sizeof(hea_buf[i]);
+            es = lsqpack_enc_encode(enc, enc_buf[i], &enc_sz[i], hea_buf[i],
+                                                        &hea_sz[i], &xhdr, 0);
+            assert(es == LQES_OK);
+            pref_sz[i] = lsqpack_enc_end_header(enc, pref_buf[i],
+                                                    sizeof(pref_buf[i]), NULL);
+            assert(pref_sz[i] > 0);
+            /* Acknowledge new entries using Insert Count Increment */
+            if (enc->qpe_ins_count > enc->qpe_max_acked_id)
+            {
+                ins_buf[0] = 0x00;
+                end_cmd = lsqpack_enc_int(ins_buf, ins_buf + sizeof(ins_buf),
+                                enc->qpe_ins_count - enc->qpe_max_acked_id, 6);
+                s = lsqpack_enc_decoder_in(enc, ins_buf, end_cmd - ins_buf);
+                assert(s == 0);
+            }
+            /* Acknowledge header blocks that reference the dynamic table */
+            if (pref_buf[i][0] != 0)
+            {
+                ins_buf[0] = 0x80;
+                end_cmd = lsqpack_enc_int(ins_buf, ins_buf + sizeof(ins_buf),
+                                                                    n * 4, 7);
+                s = lsqpack_enc_decoder_in(enc, ins_buf, end_cmd - ins_buf);
+                assert(s == 0);
+            }
+        }
+        assert(enc_sz[0] == enc_sz[1]);
+        assert(0 == memcmp(enc_buf[0], enc_buf[1], enc_sz[0]));
+        assert(hea_sz[0] == hea_sz[1]);
+        assert(0 == memcmp(hea_buf[0], hea_buf[1], hea_sz[0]));
+        assert(pref_sz[0] == pref_sz[1]);
+        assert(0 == memcmp(pref_buf[0], pref_buf[1], pref_sz[0]));
+        assert(encs[0].qpe_arena.ra_nchunks == encs[0].qpe_nelem);
+        assert(encs[0].qpe_nbits == nbits);
+    }
+    assert(encs[0].qpe_ins_count > 100);
+
+    lsqpack_enc_cleanup(&encs[0]);
+    lsqpack_enc_cleanup(&encs[1]);
+}
+
+
+/* Encoding a header list in one call must produce the same output as
+ * encoding it field by field.
+ */
+static void
+test_enc_encode_list (void)
+{
+    struct lsqpack_enc encs[2];
+    struct lsqpack_enc *enc;
+    size_t enc_sz[2], hea_sz[2], pref_sz, sz;
+    enum lsqpack_enc_status es;
+    enum lsqpack_enc_header_flags hflags[2];
+    unsigned n, i, j, n_xhdrs;
+    int s;
+    unsigned char enc_buf[2][0x1000], hea_buf[2][0x1000], ins_buf[0x10],
+                                                                *end_cmd;
+    char names[40][0x10], values[40][0x40];
+    struct lsxpack_header xhdrs[40];
+
+    for (enc = encs; enc < encs + 2; ++enc)
+    {
+        enc_sz[0] = sizeof(enc_buf[0]);
+        s = lsqpack_enc_init(enc, NULL, 0x400, 0x400, 4, 0, enc_buf[0],
+                                                                &enc_sz[0]);
+        assert(s == 0);
+    }
+
+    for (n = 0; n < 300; ++n)
+    {
+        /* More than one batch worth of fields, with some repeats and some
+         * static table matches.
+         */
+        n_xhdrs = 1 + n % 40;
+        for (j = 0; j < n_xhdrs; ++j)
+        {
+            if (j % 5 == 4)
+                lsxpack_header_set_ptr(&xhdrs[j], ":method", 7, "GET", 3);
+            else
+            {
+                snprintf(names[j], sizeof(names[j]), "x-%u", (n + j) % 23);
+                snprintf(values[j], sizeof(values[j]), "%.*s", (n * j) % 40,
+                                "abcdefghijklmnopqrstuvwxyz0123456789ABCD");
+                lsxpack_header_set_ptr(&xhdrs[j], names[j], strlen(names[j]),
+                                            values[j], strlen(values[j]));
+            }
+        }
+
+        /* Per-field encoding */
+        enc = &encs[0];
+        s = lsqpack_enc_start_header(enc, n, 0);
+        assert(s == 0);
+        pref_sz = lsqpack_enc_header_block_prefix_size(enc);
+        enc_sz[0] = 0;
+        hea_sz[0] = pref_sz;
+        for (j = 0; j < n_xhdrs; ++j)
+        {
+            size_t esz = sizeof(enc_buf[0]) - enc_sz[0],
+                   hsz = sizeof(hea_buf[0]) - hea_sz[0];
+            es = lsqpack_enc_encode(enc, enc_buf[0] + enc_sz[0], &esz,
+                            hea_buf[0] + hea_sz[0], &hsz, &xhdrs[j], 0);
+            assert(es == LQES_OK);
+            enc_sz[0] += esz;
+            hea_sz[0] += hsz;
+        }
+        s = (int) lsqpack_enc_end_header(enc, hea_buf[0], pref_sz, &hflags[0]);
+        assert(s > 0);
+        memmove(hea_buf[0] + s, hea_buf[0] + pref_sz, hea_sz[0] - pref_sz);
+        hea_sz[0] = hea_sz[0] - pref_sz + s;
+
+        /* Whole-list encoding; first check the size query */
+        enc = &encs[1];
+        enc_sz[1] = 0;
+        hea_sz[1] = 0;
+        s = lsqpack_enc_encode_list(enc, n, 0, enc_buf[1], &enc_sz[1],
+                hea_buf[1], &hea_sz[1], xhdrs, n_xhdrs, 0, &hflags[1]);
+        assert(s == -1 && errno == ENOBUFS);
+        assert(!(enc->qpe_flags & LSQPACK_ENC_HEADER));
+        /* Duplication of draining entries is opportunistic and is not
+         * included in the required encoder stream size.
+         */
+        assert(enc_sz[1] > 0 && enc_sz[1] <= sizeof(enc_buf[1]));
+        assert(hea_sz[1] >= hea_sz[0] && hea_sz[1] <= sizeof(hea_buf[1]));
+        enc_sz[1] = sizeof(enc_buf[1]);
+        hea_sz[1] = sizeof(hea_buf[1]);
+        s = lsqpack_enc_encode_list(enc, n, 0, enc_buf[1], &enc_sz[1],
+                hea_buf[1], &hea_sz[1], xhdrs, n_xhdrs, 0, &hflags[1]);
+        assert(s == 0);
+
+        assert(enc_sz[0] == enc_sz[1]);
+        assert(0 == memcmp(enc_buf[0], enc_buf[1], enc_sz[0]));
+        assert(hea_sz[0] == hea_sz[1]);
+        assert(0 == memcmp(hea_buf[0], hea_buf[1], hea_sz[0]));
+        assert(hflags[0] == hflags[1]);
+
+        /* Acknowledge inserts and header blocks */
+        for (i = 0; i < 2; ++i)
+        {
+            enc = &encs[i];
+            if (enc->qpe_ins_count > enc->qpe_max_acked_id)
+            {
+                ins_buf[0] = 0x00;
+                end_cmd = lsqpack_enc_int(ins_buf,
+                                ins_buf + sizeof(ins_buf),
+                                enc->qpe_ins_count - enc->qpe_max_acked_id,
+                                6);
+                s = lsqpack_enc_decoder_in(enc, ins_buf,
+                                                    end_cmd - ins_buf);
+                assert(s == 0);
+            }
+            if (hea_buf[i][0] != 0)
+            {
+                ins_buf[0] = 0x80;
+                end_cmd = lsqpack_enc_int(ins_buf,
+                                    ins_buf + sizeof(ins_buf), n, 7);
+                s = lsqpack_enc_decoder_in(enc, ins_buf,
+                                                    end_cmd - ins_buf);
+                assert(s == 0);
+            }
+        }
+    }
+    assert(encs[1].qpe_ins_count > 50);
+
+    /* Header block already started */
+    s = lsqpack_enc_start_header(&encs[1], n, 0);
+    assert(s == 0);
+    sz = sizeof(enc_buf[1]);
+    hea_sz[1] = sizeof(hea_buf[1]);
+    s = lsqpack_enc_encode_list(&encs[1], n, 0, enc_buf[1], &sz,
+                        hea_buf[1], &hea_sz[1], xhdrs, 1, 0, NULL);
+    assert(s == -1 && errno == EINVAL);
+
+    lsqpack_enc_cleanup(&encs[0]);
+    lsqpack_enc_cleanup(&encs[1]);
+}
+
+
+/* Header set used by the decoder tests.  Decoded headers are kept in
+ * `xhdrs', up to `max_headers' of them (CAPTURE_MAX_HEADERS if zero); once
+ * these are used up, the last one is reused, so that it always holds the
+ * most recent header.  A zeroed structure is ready to use.
+ */
+#define CAPTURE_MAX_HEADERS 8
+
+struct capture_hset
+{
+    struct lsxpack_header       xhdrs[CAPTURE_MAX_HEADERS];
+    char                        out[CAPTURE_MAX_HEADERS][0x100];
+    unsigned                    max_headers;
+    unsigned                    n_headers;
+    unsigned                    n_unblocked;
+    /* Where to continue reading the header block */
+    const unsigned char        *buf;
+    /* If set, headers are released as soon as they are processed */
+    struct lsqpack_dec         *release_dec;
+    /* If set, the same header is reused without clearing it and copied
+     * into `xhdrs' when it is processed.
+     */
+    int                         reuse_xhdr;
+    struct lsxpack_header       scratch;
+};
+
+
+static unsigned
+capture_max (const struct capture_hset *hset)
+{
+    if (hset->max_headers && hset->max_headers < CAPTURE_MAX_HEADERS)
+        return hset->max_headers;
+    else
+        return CAPTURE_MAX_HEADERS;
+}
+
+
+/* Index of the slot the next header is decoded into */
+static unsigned
+capture_slot (const struct capture_hset *hset)
+{
+    if (hset->n_headers < capture_max(hset))
+        return hset->n_headers;
+    else
+        return capture_max(hset) - 1;
+}
+
+
+/* The most recently processed header */
+static struct lsxpack_header *
+capture_last (struct capture_hset *hset)
+{
+    assert(hset->n_headers > 0);
+    if (hset->n_headers < capture_max(hset))
+        return &hset->xhdrs[ hset->n_headers - 1 ];
+    else
+        return &hset->xhdrs[ capture_max(hset) - 1 ];
+}
+
+
+static void
+capture_unblocked (void *hset_p)
+{
+    struct capture_hset *const hset = hset_p;
+
+    ++hset->n_unblocked;
+}
+
+
+static struct lsxpack_header *
+capture_prepare_decode (void *hset_p, struct lsxpack_header *xhdr,
+                                                                size_t space)
+{
+    struct capture_hset *const hset = hset_p;
+    const unsigned slot = capture_slot(hset);
+
+    if (xhdr)
+        return NULL;
+
+    if (hset->reuse_xhdr)
+    {
+        xhdr = &hset->scratch;
+        xhdr->buf = hset->out[slot];
+        xhdr->name_offset = 0;
+        xhdr->val_len = sizeof(hset->out[0]);
+        return xhdr;
+    }
+
+    xhdr = &hset->xhdrs[slot];
+    lsxpack_header_prepare_decode(xhdr, hset->out[slot], 0,
+                                                    sizeof(hset->out[0]));
+    /* Lets tests tell whether the decoder set it */
+    xhdr->chain_next_idx = 0xFFFF;
+    return xhdr;
+}
+
+
+static int
+capture_process_header (void *hset_p, struct lsxpack_header *xhdr)
+{
+    struct capture_hset *const hset = hset_p;
+    const unsigned slot = capture_slot(hset);
+
+    if (xhdr)
+    {
+        if (hset->reuse_xhdr)
+        {
+            hset->xhdrs[slot] = *xhdr;
+            xhdr = &hset->xhdrs[slot];
+        }
+        else
+            assert(xhdr == &hset->xhdrs[slot]);
+        ++hset->n_headers;
+        if (hset->release_dec)
+            lsqpack_dec_release_header(hset->release_dec, xhdr);
+    }
+    return 0;
+}
+
+
+static const struct lsqpack_dec_hset_if capture_hset_if = {
+    .dhi_unblocked      = capture_unblocked,
+    .dhi_prepare_decode = capture_prepare_decode,
+    .dhi_process_header = capture_process_header,
+};
+
+
+/* Block many header blocks on the same entry, then get rid of some of
+ * them and decode the rest.
+ */
+static void
+test_dec_many_blocked_streams (void)
+{
+    struct lsqpack_dec dec;
+    struct capture_hset *hblocks;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned char dec_buf[0x10];
+    size_t dec_buf_sz;
+    ssize_t nw;
+    unsigned n;
+    int s;
+    /* Required Insert Count 1, Base 1, indexed field line at index 0 */
+    static const unsigned char header_block[] = "\x02\x00\x80";
+    /* Insert With Literal Name `foo: bar' */
+    static const unsigned char ins[] = "\x43" "foo" "\x03" "bar";
+    const unsigned n_streams = 200;
+
+    hblocks = calloc(n_streams, sizeof(hblocks[0]));
+    assert(hblocks);
+    lsqpack_dec_init(&dec, NULL, 0x1000, n_streams, &capture_hset_if, 0);
+
+    for (n = 0; n < n_streams; ++n)
+    {
+        hblocks[n].buf = header_block;
+        rhs = lsqpack_dec_header_in(&dec, &hblocks[n], n * 4,
+                    sizeof(header_block) - 1, &hblocks[n].buf,
+                    sizeof(header_block) - 1, NULL, NULL);
+        assert(rhs == LQRHS_BLOCKED);
+    }
+    assert(dec.qpd_n_blocked == n_streams);
+
+    /* One more is over the limit */
+    buf = header_block;
+    rhs = lsqpack_dec_header_in(&dec, &n, n_streams * 4,
+                    sizeof(header_block) - 1, &buf, sizeof(header_block) - 1,
+                    NULL, NULL);
+    assert(rhs == LQRHS_ERROR);
+
+    nw = lsqpack_dec_cancel_stream(&dec, &hblocks[0], dec_buf,
+                                                            sizeof(dec_buf));
+    assert(nw > 0);
+    s = lsqpack_dec_unref_stream(&dec, &hblocks[1]);
+    assert(s == 0);
+    s = lsqpack_dec_unref_stream(&dec, &hblocks[1]);
+    assert(s < 0);
+    assert(dec.qpd_n_blocked == n_streams - 2);
+
+    s = lsqpack_dec_enc_in(&dec, ins, sizeof(ins) - 1);
+    assert(s == 0);
+    assert(dec.qpd_n_blocked == 0);
+
+    for (n = 0; n < n_streams; ++n)
+    {
+        assert(hblocks[n].n_unblocked == (n >= 2));
+        if (n < 2)
+            continue;
+        dec_buf_sz = sizeof(dec_buf);
+        rhs = lsqpack_dec_header_read(&dec, &hblocks[n], &hblocks[n].buf,
+                    header_block + sizeof(header_block) - 1 - hblocks[n].buf,
+                    dec_buf, &dec_buf_sz);
+        assert(rhs == LQRHS_DONE);
+        assert(dec_buf_sz > 0);
+        assert(hblocks[n].n_headers == 1);
+        assert(hblocks[n].xhdrs[0].name_len == 3);
+        assert(0 == memcmp(lsxpack_header_get_name(&hblocks[n].xhdrs[0]),
+                                                                "foo", 3));
+    }
+
+    /* Read contexts are gone once header blocks are done */
+    buf = header_block;
+    rhs = lsqpack_dec_header_read(&dec, &hblocks[2], &buf, 1, NULL, NULL);
+    assert(rhs == LQRHS_ERROR);
+
+    lsqpack_dec_cleanup(&dec);
+    free(hblocks);
+}
+
+
+/* Insert entries into a small dynamic table, so that the ring arena wraps
+ * around many times.  Each new entry is checked by decoding a header block
+ * that references it.
+ */
+static void
+test_dec_ring_arena (void)
+{
+    struct lsqpack_dec dec;
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned char ins[0x20], header_block[3], dec_buf[0x10];
+    char name[0x10], value[0x10];
+    size_t ins_sz, dec_buf_sz;
+    unsigned n, name_len, val_len;
+    int s, wrapped = 0;
+    /* Insert With Name Reference `:authority: www.netbsd.org', Huffman */
+    static const unsigned char winr[] =
+        "\xc0\x8b\xf1\xe3\xc2\xf5\x15\x31\xa2\x45\xcf\x64\xdf";
+
+    lsqpack_dec_init(&dec, NULL, 0x80, 0, &capture_hset_if,
+                                                LSQPACK_DEC_OPT_RING_ARENA);
+    assert(dec.qpd_arena.ra_buf);
+
+    for (n = 1; n <= 500; ++n)
+    {
+        if (n % 7 == 0)
+        {
+            /* Duplicate the newest entry */
+            ins[0] = 0x00;
+            ins_sz = 1;
+        }
+        else if (n % 3 == 0)
+        {
+            name_len = (unsigned) strlen(":authority");
+            memcpy(name, ":authority", name_len);
+            val_len = (unsigned) strlen("www.netbsd.org");
+            memcpy(value, "www.netbsd.org", val_len);
+            memcpy(ins, winr, sizeof(winr) - 1);
+            ins_sz = sizeof(winr) - 1;
+        }
+        else
+        {
+            /* Insert With Literal Name; values vary in length */
+            name_len = (unsigned) snprintf(name, sizeof(name), "n%03u",
+                                                                    n % 1000);
+            val_len = (unsigned) snprintf(value, sizeof(value), "v%.*s",
+                                                    n % 10, "0123456789");
+            ins[0] = 0x40 | name_len;
+            memcpy(ins + 1, name, name_len);
+            ins[1 + name_len] = val_len;
+            memcpy(ins + 2 + name_len, value, val_len);
+            ins_sz = 2 + name_len + val_len;
+        }
+        s = lsqpack_dec_enc_in(&dec, ins, ins_sz);
+        assert(s == 0);
+        wrapped |= dec.qpd_arena.ra_wrap != 0;
+
+        /* Max entries is 4: Required Insert Count is encoded modulo 8 */
+        header_block[0] = n % 8 + 1;
+        header_block[1] = 0x00;
+        header_block[2] = 0x80;
+        memset(&hblock, 0, sizeof(hblock));
+        buf = header_block;
+        dec_buf_sz = sizeof(dec_buf);
+        rhs = lsqpack_dec_header_in(&dec, &hblock, n * 4, sizeof(header_block),
+                        &buf, sizeof(header_block), dec_buf, &dec_buf_sz);
+        assert(rhs == LQRHS_DONE);
+        assert(hblock.n_headers == 1);
+        assert(hblock.xhdrs[0].name_len == name_len);
+        assert(0 == memcmp(lsxpack_header_get_name(&hblock.xhdrs[0]), name,
+                                                                name_len));
+        assert(hblock.xhdrs[0].val_len == val_len);
+        assert(0 == memcmp(lsxpack_header_get_value(&hblock.xhdrs[0]), value,
+                                                                val_len));
+    }
+
+    assert(wrapped);
+    assert(dec.qpd_arena.ra_nchunks <= 5);
+    lsqpack_dec_cleanup(&dec);
+}
+
+
+/* Indexed fields point into table storage and dynamic entries stay valid
+ * after eviction until the header is released.
+ */
+static void
+test_dec_zero_copy (int ring_arena)
+{
+    struct lsqpack_dec dec;
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned char dec_buf[0x10];
+    size_t dec_buf_sz;
+    unsigned n, nchunks;
+    int s;
+    /* Insert With Literal Name `n001: v1' */
+    static const unsigned char ins[] = "\x44n001\x02v1";
+    /* Required Insert Count 1, Base 1, dynamic index 0, `:method: GET' */
+    static const unsigned char header_block[] = "\x02\x00\x80\xd1";
+
+    lsqpack_dec_init(&dec, NULL, 0x80, 0, &capture_hset_if,
+        LSQPACK_DEC_OPT_ZERO_COPY|(ring_arena ? LSQPACK_DEC_OPT_RING_ARENA : 0));
+
+    s = lsqpack_dec_enc_in(&dec, ins, sizeof(ins) - 1);
+    assert(s == 0);
+
+    memset(&hblock, 0, sizeof(hblock));
+    buf = header_block;
+    dec_buf_sz = sizeof(dec_buf);
+    rhs = lsqpack_dec_header_in(&dec, &hblock, 0, sizeof(header_block) - 1,
+                        &buf, sizeof(header_block) - 1, dec_buf, &dec_buf_sz);
+    assert(rhs == LQRHS_DONE);
+    assert(hblock.n_headers == 2);
+
+    /* Evict the entry by inserting more */
+    for (n = 0; n < 10; ++n)
+    {
+        s = lsqpack_dec_enc_in(&dec, ins, sizeof(ins) - 1);
+        assert(s == 0);
+    }
+
+    for (n = 0; n < 2; ++n)
+        assert(!(lsxpack_header_get_name(&hblock.xhdrs[n]) >= hblock.out[0]
+            && lsxpack_header_get_name(&hblock.xhdrs[n])
+                                    < hblock.out[0] + sizeof(hblock.out)));
+    assert(hblock.xhdrs[0].name_len == 4);
+    assert(0 == memcmp(lsxpack_header_get_name(&hblock.xhdrs[0]), "n001", 4));
+    assert(hblock.xhdrs[0].val_len == 2);
+    assert(0 == memcmp(lsxpack_header_get_value(&hblock.xhdrs[0]), "v1", 2));
+    assert(hblock.xhdrs[1].name_len == 7);
+    assert(0 == memcmp(lsxpack_header_get_name(&hblock.xhdrs[1]), ":method",
+                                                                        7));
+    assert(hblock.xhdrs[1].val_len == 3);
+    assert(0 == memcmp(lsxpack_header_get_value(&hblock.xhdrs[1]), "GET", 3));
+
+    /* The pinned entry is at the tail of the arena, so chunks evicted after
+     * it cannot be reclaimed until it is released.
+     */
+    nchunks = dec.qpd_arena.ra_nchunks;
+    lsqpack_dec_release_header(&dec, &hblock.xhdrs[0]);
+    lsqpack_dec_release_header(&dec, &hblock.xhdrs[1]);
+    if (ring_arena)
+        assert(dec.qpd_arena.ra_nchunks < nchunks);
+
+    lsqpack_dec_cleanup(&dec);
+}
+
+
+/* Releasing header from inside dhi_process_header() must not unpin the
+ * dynamic table entry before it has been pinned.
+ */
+static void
+test_dec_zero_copy_release_early (void)
+{
+    struct lsqpack_dec dec;
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned char dec_buf[0x10];
+    size_t dec_buf_sz;
+    unsigned n;
+    int s;
+    /* Insert With Literal Name `n001: v1' */
+    static const unsigned char ins[] = "\x44n001\x02v1";
+    /* Required Insert Count 1, Base 1, dynamic index 0, `:method: GET' */
+    static const unsigned char header_block[] = "\x02\x00\x80\xd1";
+
+    lsqpack_dec_init(&dec, NULL, 0x80, 0, &capture_hset_if,
+                                                    LSQPACK_DEC_OPT_ZERO_COPY);
+    s = lsqpack_dec_enc_in(&dec, ins, sizeof(ins) - 1);
+    assert(s == 0);
+
+    memset(&hblock, 0, sizeof(hblock));
+    hblock.release_dec = &dec;
+    buf = header_block;
+    dec_buf_sz = sizeof(dec_buf);
+    rhs = lsqpack_dec_header_in(&dec, &hblock, 0, sizeof(header_block) - 1,
+                        &buf, sizeof(header_block) - 1, dec_buf, &dec_buf_sz);
+    assert(rhs == LQRHS_DONE);
+    assert(hblock.n_headers == 2);
+    assert(hblock.xhdrs[0].name_ptr == NULL);
+
+    /* The entry is still in the table and is evicted as usual */
+    assert(dec.qpd_cur_capacity > 0);
+    for (n = 0; n < 10; ++n)
+    {
+        s = lsqpack_dec_enc_in(&dec, ins, sizeof(ins) - 1);
+        assert(s == 0);
+    }
+
+    lsqpack_dec_cleanup(&dec);
+}
+
+
+/* A header that is reused without being cleared still has `name_ptr' from
+ * the previous zero-copy field.  The decoder must clear it in fields that
+ * are copied, or releasing them would unpin the entry again.
+ */
+static void
+test_dec_zero_copy_reused_xhdr (void)
+{
+    struct lsqpack_dec dec;
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned char dec_buf[0x10];
+    size_t dec_buf_sz;
+    int s;
+    /* Insert With Literal Name `n001: v1' */
+    static const unsigned char ins[] = "\x44n001\x02v1";
+    /* Required Insert Count 1, Base 1, dynamic index 0, `:path: /' */
+    static const unsigned char header_block[] = "\x02\x00\x80\x51\x01/";
+
+    lsqpack_dec_init(&dec, NULL, 0x80, 0, &capture_hset_if,
+                                                    LSQPACK_DEC_OPT_ZERO_COPY);
+    s = lsqpack_dec_enc_in(&dec, ins, sizeof(ins) - 1);
+    assert(s == 0);
+
+    memset(&hblock, 0, sizeof(hblock));
+    hblock.reuse_xhdr = 1;
+    buf = header_block;
+    dec_buf_sz = sizeof(dec_buf);
+    rhs = lsqpack_dec_header_in(&dec, &hblock, 0, sizeof(header_block) - 1,
+                        &buf, sizeof(header_block) - 1, dec_buf, &dec_buf_sz);
+    assert(rhs == LQRHS_DONE);
+    assert(hblock.n_headers == 2);
+    assert(hblock.xhdrs[0].name_ptr != NULL);
+    assert(hblock.xhdrs[1].name_ptr == NULL);
+    assert(hblock.xhdrs[1].name_len == 5);
+    assert(0 == memcmp(lsxpack_header_get_name(&hblock.xhdrs[1]), ":path", 5));
+
+    lsqpack_dec_release_header(&dec, &hblock.xhdrs[1]);
+    lsqpack_dec_release_header(&dec, &hblock.xhdrs[0]);
+    assert(hblock.xhdrs[0].name_ptr == NULL);
+    lsqpack_dec_cleanup(&dec);
+}
+
+
+/* Encoder and decoder counters describe the same stream from both ends */
+static void
+test_stats (void)
+{
+    struct lsqpack_enc enc;
+    struct lsqpack_dec dec;
+    struct lsqpack_enc_stats enc_stats;
+    struct lsqpack_dec_stats dec_stats;
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs;
+    enum lsqpack_enc_status es;
+    const unsigned char *buf;
+    unsigned char enc_buf[0x400], hea_buf[0x400], dec_buf[0x20];
+    char names[8][0x10], values[8][0x40];
+    struct lsxpack_header xhdrs[8];
+    size_t enc_sz, hea_sz, dec_buf_sz;
+    unsigned n, j, pref_max;
+    ssize_t pref_sz, ici_sz;
+    int s;
+
+    enc_sz = sizeof(enc_buf);
+    s = lsqpack_enc_init(&enc, NULL, 0x200, 0x200, 4, 0, enc_buf, &enc_sz);
+    assert(s == 0);
+    lsqpack_dec_init(&dec, NULL, 0x200, 4, &capture_hset_if, 0);
+    s = lsqpack_dec_enc_in(&dec, enc_buf, enc_sz);
+    assert(s == 0);
+    pref_max = (unsigned) lsqpack_enc_header_block_prefix_size(&enc);
+
+    for (n = 0; n < 200; ++n)
+    {
+        for (j = 0; j < 8; ++j)
+            if (j == 0)
+                lsxpack_header_set_ptr(&xhdrs[j], ":method", 7, "GET", 3);
+            else if (j == 1)
+                lsxpack_header_set_ptr(&xhdrs[j], ":path", 5, values[j],
+                    snprintf(values[j], sizeof(values[j]), "/%u", n % 13));
+            else
+            {
+                snprintf(names[j], sizeof(names[j]), "x-%u", (n + j) % 11);
+                snprintf(values[j], sizeof(values[j]), "%.*s", (n * j) % 40,
+                                "abcdefghijklmnopqrstuvwxyz0123456789ABCD");
+                lsxpack_header_set_ptr(&xhdrs[j], names[j], strlen(names[j]),
+                                            values[j], strlen(values[j]));
+            }
+
+        s = lsqpack_enc_start_header(&enc, n, 0);
+        assert(s == 0);
+        enc_sz = 0;
+        hea_sz = pref_max;
+        for (j = 0; j < 8; ++j)
+        {
+            size_t esz = sizeof(enc_buf) - enc_sz,
+                   hsz = sizeof(hea_buf) - hea_sz;
+            es = lsqpack_enc_encode(&enc, enc_buf + enc_sz, &esz,
+                                hea_buf + hea_sz, &hsz, &xhdrs[j], 0);
+            assert(es == LQES_OK);
+            enc_sz += esz;
+            hea_sz += hsz;
+        }
+        pref_sz = lsqpack_enc_end_header(&enc, hea_buf, pref_max, NULL);
+        assert(pref_sz > 0);
+        memmove(hea_buf + pref_sz, hea_buf + pref_max, hea_sz - pref_max);
+        hea_sz = hea_sz - pref_max + pref_sz;
+
+        /* Every tenth header block arrives before the encoder stream */
+        if (n % 10 && enc_sz)
+        {
+            s = lsqpack_dec_enc_in(&dec, enc_buf, enc_sz);
+            assert(s == 0);
+        }
+        memset(&hblock, 0, sizeof(hblock));
+        buf = hea_buf;
+        dec_buf_sz = sizeof(dec_buf);
+        rhs = lsqpack_dec_header_in(&dec, &hblock, n, hea_sz, &buf, hea_sz,
+                                                    dec_buf, &dec_buf_sz);
+        if (rhs == LQRHS_BLOCKED)
+        {
+            assert(n % 10 == 0);
+            s = lsqpack_dec_enc_in(&dec, enc_buf, enc_sz);
+            assert(s == 0);
+            assert(hblock.n_unblocked == 1);
+            dec_buf_sz = sizeof(dec_buf);
+            rhs = lsqpack_dec_header_read(&dec, &hblock, &buf,
+                            hea_buf + hea_sz - buf, dec_buf, &dec_buf_sz);
+        }
+        else if (n % 10 == 0 && enc_sz)
+        {
+            s = lsqpack_dec_enc_in(&dec, enc_buf, enc_sz);
+            assert(s == 0);
+        }
+        assert(rhs == LQRHS_DONE);
+        assert(hblock.n_headers == 8);
+        if (dec_buf_sz)
+        {
+            s = lsqpack_enc_decoder_in(&enc, dec_buf, dec_buf_sz);
+            assert(s == 0);
+        }
+        ici_sz = lsqpack_dec_write_ici(&dec, dec_buf, sizeof(dec_buf));
+        assert(ici_sz >= 0);
+        if (ici_sz > 0)
+        {
+            s = lsqpack_enc_decoder_in(&enc, dec_buf, (size_t) ici_sz);
+            assert(s == 0);
+        }
+    }
+
+    lsqpack_enc_get_stats(&enc, &enc_stats);
+    lsqpack_dec_get_stats(&dec, &dec_stats);
+    assert(enc_stats.n_inserts > 0);
+    assert(enc_stats.n_inserts == dec_stats.n_inserts);
+    assert(enc_stats.n_dups == dec_stats.n_dups);
+    assert(enc_stats.n_evictions > 0);
+    assert(enc_stats.n_evictions == dec_stats.n_evictions);
+    assert(enc_stats.n_static_hits == 200);
+    assert(enc_stats.n_static_hits == dec_stats.n_static_hits);
+    assert(enc_stats.n_static_name_hits == dec_stats.n_static_name_hits);
+    assert(enc_stats.n_dynamic_hits > 0);
+    assert(enc_stats.n_dynamic_hits == dec_stats.n_dynamic_hits);
+    assert(enc_stats.n_dynamic_name_hits == dec_stats.n_dynamic_name_hits);
+    assert(enc_stats.n_literals == dec_stats.n_literals);
+    assert(enc_stats.n_static_hits + enc_stats.n_static_name_hits
+        + enc_stats.n_dynamic_hits + enc_stats.n_dynamic_name_hits
+        + enc_stats.n_literals == 200 * 8);
+    assert(enc_stats.n_hist_hits > 0 && enc_stats.n_hist_misses > 0);
+    assert(enc_stats.n_at_risk_hblocks > 0);
+    assert(dec_stats.n_blocked > 0);
+    assert(enc_stats.n_huff_bytes_saved > 0);
+    assert(enc_stats.n_huff_bytes_saved == dec_stats.n_huff_bytes_saved);
+    assert(enc_stats.peak_table_size <= 0x200);
+    assert(enc_stats.peak_table_size == dec_stats.peak_table_size);
+    assert(enc_stats.peak_table_nelem == dec_stats.peak_table_nelem);
+
+    lsqpack_enc_cleanup(&enc);
+    lsqpack_dec_cleanup(&dec);
+}
+
+
+/* Huffman-encoded string may be longer than the decoded one: the savings
+ * must not underflow.
+ */
+static void
+test_dec_huff_longer (void)
+{
+    struct lsqpack_dec dec;
+    struct lsqpack_dec_stats stats;
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    int s, split;
+    /* Literal `x-b' with Huffman-encoded value "\0": 13 bits */
+    static const unsigned char block[] =
+                                "\x00\x00\x23" "x-b" "\x82\xff\xc7";
+    /* Insert `x-c' with the same value */
+    static const unsigned char ins[] = "\x43" "x-c" "\x82\xff\xc7";
+
+    for (split = 0; split < 2; ++split)
+    {
+        lsqpack_dec_init(&dec, NULL, 0x100, 0, &capture_hset_if, 0);
+        s = lsqpack_dec_enc_in(&dec, ins, sizeof(ins) - 1);
+        assert(s == 0);
+        memset(&hblock, 0, sizeof(hblock));
+        buf = block;
+        rhs = lsqpack_dec_header_in(&dec, &hblock, 0, sizeof(block) - 1, &buf,
+                            split ? 1 : sizeof(block) - 1, NULL, NULL);
+        while (rhs == LQRHS_NEED)
+            rhs = lsqpack_dec_header_read(&dec, &hblock, &buf, 1, NULL, NULL);
+        assert(rhs == LQRHS_DONE);
+        lsqpack_dec_get_stats(&dec, &stats);
+        assert(stats.n_huff_bytes_saved == 0);
+        lsqpack_dec_cleanup(&dec);
+    }
+}
+
+
+
+/* Encode header lists in which one field cycles through a few values while
+ * the rest repeat.  The peer acknowledges each header block right away.
+ */
+static void
+cost_model_run (enum lsqpack_enc_opts opts, unsigned max_risked_streams,
+                                    unsigned *n_inserts, size_t *n_bytes)
+{
+    struct lsqpack_enc enc;
+    struct lsqpack_dec dec;
+    struct lsqpack_enc_stats stats;
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs;
+    enum lsqpack_enc_status es;
+    const unsigned char *buf;
+    unsigned char enc_buf[0x400], hea_buf[0x400], dec_buf[0x20];
+    char names[5][0x20], values[5][0x20];
+    struct lsxpack_header xhdrs[5];
+    size_t enc_sz, hea_sz, dec_buf_sz;
+    unsigned n, j, pref_max;
+    ssize_t pref_sz, ici_sz;
+    int s;
+
+    enc_sz = sizeof(enc_buf);
+    s = lsqpack_enc_init(&enc, NULL, 0x100, 0x100, max_risked_streams, opts,
+                                                            enc_buf, &enc_sz);
+    assert(s == 0);
+    lsqpack_dec_init(&dec, NULL, 0x100, max_risked_streams, &capture_hset_if,
+                                                                            0);
+    s = lsqpack_dec_enc_in(&dec, enc_buf, enc_sz);
+    assert(s == 0);
+    *n_bytes = enc_sz;
+    pref_max = (unsigned) lsqpack_enc_header_block_prefix_size(&enc);
+
+    for (n = 0; n < 40; ++n)
+    {
+        for (j = 0; j < 5; ++j)
+        {
+            if (j == 0)
+            {
+                snprintf(names[j], sizeof(names[j]), "x-rare");
+                snprintf(values[j], sizeof(values[j]), "value-number-%u",
+                                                                        n % 3);
+            }
+            else
+            {
+                snprintf(names[j], sizeof(names[j]), "x-filler-%u", j);
+                snprintf(values[j], sizeof(values[j]), "filler-value-%u-%u",
+                                                                    j, n % 2);
+            }
+            lsxpack_header_set_ptr(&xhdrs[j], names[j], strlen(names[j]),
+                                            values[j], strlen(values[j]));
+        }
+
+        s = lsqpack_enc_start_header(&enc, n, 0);
+        assert(s == 0);
+        enc_sz = 0;
+        hea_sz = pref_max;
+        for (j = 0; j < 5; ++j)
+        {
+            size_t esz = sizeof(enc_buf) - enc_sz,
+                   hsz = sizeof(hea_buf) - hea_sz;
+            es = lsqpack_enc_encode(&enc, enc_buf + enc_sz, &esz,
+                                hea_buf + hea_sz, &hsz, &xhdrs[j], 0);
+            assert(es == LQES_OK);
+            enc_sz += esz;
+            hea_sz += hsz;
+        }
+        pref_sz = lsqpack_enc_end_header(&enc, hea_buf, pref_max, NULL);
+        assert(pref_sz > 0);
+        memmove(hea_buf + pref_sz, hea_buf + pref_max, hea_sz - pref_max);
+        hea_sz = hea_sz - pref_max + pref_sz;
+        *n_bytes += enc_sz + hea_sz;
+
+        if (enc_sz)
+        {
+            s = lsqpack_dec_enc_in(&dec, enc_buf, enc_sz);
+            assert(s == 0);
+        }
+        memset(&hblock, 0, sizeof(hblock));
+        buf = hea_buf;
+        dec_buf_sz = sizeof(dec_buf);
+        rhs = lsqpack_dec_header_in(&dec, &hblock, n, hea_sz, &buf, hea_sz,
+                                                    dec_buf, &dec_buf_sz);
+        assert(rhs == LQRHS_DONE);
+        assert(hblock.n_headers == 5);
+        if (dec_buf_sz)
+        {
+            s = lsqpack_enc_decoder_in(&enc, dec_buf, dec_buf_sz);
+            assert(s == 0);
+        }
+        ici_sz = lsqpack_dec_write_ici(&dec, dec_buf, sizeof(dec_buf));
+        assert(ici_sz >= 0);
+        if (ici_sz > 0)
+        {
+            s = lsqpack_enc_decoder_in(&enc, dec_buf, (size_t) ici_sz);
+            assert(s == 0);
+        }
+    }
+
+    lsqpack_enc_get_stats(&enc, &stats);
+    *n_inserts = stats.n_inserts + stats.n_dups;
+    lsqpack_enc_cleanup(&enc);
+    lsqpack_dec_cleanup(&dec);
+}
+
+
+static void
+test_enc_cost_model (void)
+{
+    unsigned n_inserts[3];
+    size_t n_bytes[3];
+    unsigned max_risked_streams;
+
+    for (max_risked_streams = 0; max_risked_streams <= 100;
+                                                    max_risked_streams += 100)
+    {
+        cost_model_run(0, max_risked_streams, &n_inserts[0], &n_bytes[0]);
+        cost_model_run(LSQPACK_ENC_OPT_COST_MODEL, max_risked_streams,
+                                                &n_inserts[1], &n_bytes[1]);
+        cost_model_run(LSQPACK_ENC_OPT_COST_MODEL|LSQPACK_ENC_OPT_SERVER,
+                            max_risked_streams, &n_inserts[2], &n_bytes[2]);
+        assert(n_inserts[1] > 0);
+        assert(n_inserts[1] <= n_inserts[0]);
+        assert(n_bytes[1] <= n_bytes[0]);
+        /* Server weighs encoder stream bytes more heavily */
+        assert(n_inserts[2] <= n_inserts[1]);
+        assert(n_bytes[2] <= n_bytes[0]);
+    }
+
+    /* Server mode means nothing without the cost model */
+    cost_model_run(0, 0, &n_inserts[0], &n_bytes[0]);
+    cost_model_run(LSQPACK_ENC_OPT_SERVER, 0, &n_inserts[1], &n_bytes[1]);
+    assert(n_inserts[0] == n_inserts[1]);
+    assert(n_bytes[0] == n_bytes[1]);
+}
+
+
+struct queue_sink
+{
+    unsigned char   buf[0x4000];
+    size_t          len;
+    unsigned        n_calls;
+};
+
+
+/* Accept a few bytes at a time, like a congested stream would */
+static ssize_t
+queue_sink_writev (void *ctx, const struct iovec *iov, int iovcnt)
+{
+    struct queue_sink *const sink = ctx;
+    size_t n;
+
+    assert(iovcnt == 1);
+    ++sink->n_calls;
+    n = iov->iov_len < 7 ? iov->iov_len : 7;
+    assert(sink->len + n <= sizeof(sink->buf));
+    memcpy(sink->buf + sink->len, iov->iov_base, n);
+    sink->len += n;
+    return (ssize_t) n;
+}
+
+
+/* Encoder with an encoder stream queue produces the same output as the
+ * encoder that writes to caller-supplied buffers.
+ */
+static void
+test_enc_queue (void)
+{
+    struct lsqpack_enc encs[2];
+    struct queue_sink sinks[2];
+    enum lsqpack_enc_status es;
+    unsigned char enc_buf[0x400], hea_bufs[2][0x400], sdtc_buf[0x10];
+    char values[4][0x20];
+    struct lsxpack_header xhdrs[4];
+    size_t enc_sz, hea_sz, hea_szs[2], sdtc_sz, esz, hsz, pref_max;
+    ssize_t nw, pref_sz;
+    unsigned n, i, j;
+    int s;
+
+    memset(sinks, 0, sizeof(sinks));
+    for (i = 0; i < 2; ++i)
+    {
+        sdtc_sz = sizeof(sdtc_buf);
+        s = lsqpack_enc_init(&encs[i], NULL, 0x100, 0x100, 10,
+                    i ? LSQPACK_ENC_OPT_ENC_QUEUE : 0, sdtc_buf, &sdtc_sz);
+        assert(s == 0);
+        memcpy(sinks[i].buf, sdtc_buf, sdtc_sz);
+        sinks[i].len = sdtc_sz;
+    }
+    assert(0 == lsqpack_enc_pending(&encs[0]));
+    assert(0 == lsqpack_enc_pending(&encs[1]));
+    pref_max = (size_t) lsqpack_enc_header_block_prefix_size(&encs[0]);
+
+    for (n = 0; n < 30; ++n)
+    {
+        for (j = 0; j < 4; ++j)
+        {
+            snprintf(values[j], sizeof(values[j]), "value-%u-%u", j, n % 5);
+            lsxpack_header_set_ptr(&xhdrs[j], "x-field", 7, values[j],
+                                                        strlen(values[j]));
+        }
+
+        if (n == 20)
+            for (i = 0; i < 2; ++i)
+            {
+                sdtc_sz = sizeof(sdtc_buf);
+                s = lsqpack_enc_set_max_capacity(&encs[i], 0x80,
+                                            i ? NULL : sdtc_buf, &sdtc_sz);
+                assert(s == 0);
+                if (i == 0)
+                {
+                    memcpy(sinks[i].buf + sinks[i].len, sdtc_buf, sdtc_sz);
+                    sinks[i].len += sdtc_sz;
+                }
+                else
+                    assert(sdtc_sz == 0);
+            }
+
+        for (i = 0; i < 2; ++i)
+        {
+            if (n & 1)
+            {
+                enc_sz = sizeof(enc_buf);
+                hea_szs[i] = sizeof(hea_bufs[i]);
+                s = lsqpack_enc_encode_list(&encs[i], n, 0,
+                        i ? NULL : enc_buf, &enc_sz, hea_bufs[i], &hea_szs[i],
+                        xhdrs, 4, 0, NULL);
+                assert(s == 0);
+            }
+            else
+            {
+                s = lsqpack_enc_start_header(&encs[i], n, 0);
+                assert(s == 0);
+                enc_sz = 0;
+                hea_sz = pref_max;
+                for (j = 0; j < 4; ++j)
+                {
+                    /* Queue does not need the encoder stream buffer */
+                    esz = i ? 0 : sizeof(enc_buf) - enc_sz;
+                    hsz = sizeof(hea_bufs[i]) - hea_sz;
+                    es = lsqpack_enc_encode(&encs[i], i ? NULL
+                        : enc_buf + enc_sz, &esz, hea_bufs[i] + hea_sz, &hsz,
+                        &xhdrs[j], 0);
+                    assert(es == LQES_OK);
+                    enc_sz += esz;
+                    hea_sz += hsz;
+                }
+                pref_sz = lsqpack_enc_end_header(&encs[i], hea_bufs[i],
+                                                            pref_max, NULL);
+                assert(pref_sz > 0);
+                memmove(hea_bufs[i] + pref_sz, hea_bufs[i] + pref_max,
+                                                        hea_sz - pref_max);
+                hea_szs[i] = hea_sz - pref_max + (size_t) pref_sz;
+            }
+            if (i == 0)
+            {
+                memcpy(sinks[i].buf + sinks[i].len, enc_buf, enc_sz);
+                sinks[i].len += enc_sz;
+            }
+            else
+                assert(enc_sz == 0);
+        }
+        assert(hea_szs[0] == hea_szs[1]);
+        assert(0 == memcmp(hea_bufs[0], hea_bufs[1], hea_szs[0]));
+
+        /* Instructions from several header blocks are coalesced */
+        if (n % 5 == 4)
+            while (lsqpack_enc_pending(&encs[1]) > 0)
+            {
+                nw = lsqpack_enc_writev(&encs[1], queue_sink_writev,
+                                                                &sinks[1]);
+                assert(nw > 0);
+            }
+    }
+
+    assert(sinks[0].len > 0);
+    assert(0 == lsqpack_enc_pending(&encs[1]));
+    nw = lsqpack_enc_writev(&encs[1], queue_sink_writev, &sinks[1]);
+    assert(nw == 0);
+    assert(sinks[1].n_calls >= sinks[1].len / 7);
+    assert(sinks[0].len == sinks[1].len);
+    assert(0 == memcmp(sinks[0].buf, sinks[1].buf, sinks[0].len));
+
+    lsqpack_enc_cleanup(&encs[0]);
+    lsqpack_enc_cleanup(&encs[1]);
+}
+
+
+static void
+test_enc_dict (void)
+{
+    struct lsqpack_enc_dict dict;
+    struct lsqpack_enc enc;
+    struct lsqpack_dec dec;
+    struct lsqpack_enc_stats enc_stats;
+    struct lsqpack_dec_stats dec_stats;
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned char enc_buf[0x400], hea_buf[0x400], dec_buf[0x20];
+    struct lsxpack_header training[9], xhdrs[3];
+    size_t enc_sz, hea_sz, dec_buf_sz;
+    unsigned n;
+    int s;
+
+    for (n = 0; n < 3; ++n)
+    {
+        lsxpack_header_set_ptr(&training[n * 3 + 0], ":status", 7, "200", 3);
+        lsxpack_header_set_ptr(&training[n * 3 + 1], "server", 6,
+                                                            "lsqpack", 7);
+        if (n < 2)
+            lsxpack_header_set_ptr(&training[n * 3 + 2], "x-frob", 6,
+                                                            "frobnicate", 10);
+        else
+            lsxpack_header_set_ptr(&training[n * 3 + 2], "x-frob", 6,
+                                                            "other", 5);
+    }
+
+    /* Full static match is skipped, duplicates are merged, and the entries
+     * are ordered by frequency.
+     */
+    s = lsqpack_enc_dict_init(&dict, training, 9, 0);
+    assert(s == 0);
+    assert(dict.qed_n_entries == 3);
+    assert(dict.qed_entries[0].ede_name_len == 6
+        && 0 == memcmp(dict.qed_buf + dict.qed_entries[0].ede_name_off,
+                                                        "serverlsqpack", 13));
+    assert(dict.qed_entries[2].ede_val_len == 5);
+    lsqpack_enc_dict_cleanup(&dict);
+
+    s = lsqpack_enc_dict_init(&dict, training, 9, 2);
+    assert(s == 0);
+    assert(dict.qed_n_entries == 2);
+
+    enc_sz = sizeof(enc_buf);
+    s = lsqpack_enc_init(&enc, NULL, 0x100, 0x100, 1, 0, enc_buf, &enc_sz);
+    assert(s == 0);
+    lsqpack_dec_init(&dec, NULL, 0x100, 1, &capture_hset_if, 0);
+    s = lsqpack_dec_enc_in(&dec, enc_buf, enc_sz);
+    assert(s == 0);
+
+    /* Insert the most frequent field only; the other one is in history */
+    enc_sz = sizeof(enc_buf);
+    s = lsqpack_enc_use_dict(&enc, &dict, 1, enc_buf, &enc_sz);
+    assert(s == 0);
+    assert(enc_sz > 0);
+    s = lsqpack_dec_enc_in(&dec, enc_buf, enc_sz);
+    assert(s == 0);
+
+    lsxpack_header_set_ptr(&xhdrs[0], "server", 6, "lsqpack", 7);
+    lsxpack_header_set_ptr(&xhdrs[1], "x-frob", 6, "frobnicate", 10);
+    lsxpack_header_set_ptr(&xhdrs[2], "x-unknown", 9, "value", 5);
+    enc_sz = sizeof(enc_buf);
+    hea_sz = sizeof(hea_buf);
+    s = lsqpack_enc_encode_list(&enc, 0, 0, enc_buf, &enc_sz, hea_buf,
+                                            &hea_sz, xhdrs, 3, 0, NULL);
+    assert(s == 0);
+
+    lsqpack_enc_get_stats(&enc, &enc_stats);
+    assert(enc_stats.n_dynamic_hits == 2);
+    assert(enc_stats.n_inserts == 2);
+
+    s = lsqpack_dec_enc_in(&dec, enc_buf, enc_sz);
+    assert(s == 0);
+    memset(&hblock, 0, sizeof(hblock));
+    buf = hea_buf;
+    dec_buf_sz = sizeof(dec_buf);
+    rhs = lsqpack_dec_header_in(&dec, &hblock, 0, hea_sz, &buf, hea_sz,
+                                                    dec_buf, &dec_buf_sz);
+    assert(rhs == LQRHS_DONE);
+    assert(hblock.n_headers == 3);
+    lsqpack_dec_get_stats(&dec, &dec_stats);
+    assert(dec_stats.n_inserts == 2);
+    assert(dec_stats.n_dynamic_hits == 2);
+    assert(dec_stats.n_huff_bytes_saved == enc_stats.n_huff_bytes_saved);
+
+    /* Too late to use a dictionary */
+    enc_sz = sizeof(enc_buf);
+    s = lsqpack_enc_use_dict(&enc, &dict, 1, enc_buf, &enc_sz);
+    assert(s == -1 && errno == EINVAL);
+
+    lsqpack_enc_cleanup(&enc);
+    lsqpack_dec_cleanup(&dec);
+    lsqpack_enc_dict_cleanup(&dict);
+}
+
+
+
+static void
+test_enc_names (void)
+{
+    struct lsqpack_enc_names names;
+    struct lsqpack_enc enc[2];
+    unsigned char enc_buf[2][0x400], hea_buf[2][0x400];
+    struct lsxpack_header xhdrs[2][6];
+    size_t enc_sz[2], hea_sz[2];
+    unsigned i, n, pass;
+    int s, idx[3];
+    /* Indices set by someone else, for example, by a decoder: wrong name
+     * length, wrong name of the same length, and out of range.
+     */
+    static const unsigned foreign[6] = { 1, 1, 2, 2, 2, 200, };
+
+    lsqpack_enc_names_init(&names);
+    idx[0] = lsqpack_enc_names_add(&names, ":status", 7, "200", 3);
+    idx[1] = lsqpack_enc_names_add(&names, "server", 6, "lsqpack", 7);
+    idx[2] = lsqpack_enc_names_add(&names, "x-frob", 6, NULL, 0);
+    assert(idx[0] == 0 && idx[1] == 1 && idx[2] == 2);
+    assert(names.qen_names[0].een_static_full_id == 25);
+    assert(names.qen_names[1].een_static_full_id == -1);
+    assert(names.qen_names[1].een_static_name_id == 92);
+    assert(names.qen_names[2].een_static_name_id == -1);
+
+    /* The registry makes no difference to the output, even if the indices
+     * do not match the registry.
+     */
+    for (pass = 0; pass < 2; ++pass)
+    {
+        for (i = 0; i < 2; ++i)
+        {
+            enc_sz[i] = sizeof(enc_buf[i]);
+            s = lsqpack_enc_init(&enc[i], NULL, 0x200, 0x200, 0, 0,
+                                                    enc_buf[i], &enc_sz[i]);
+            assert(s == 0);
+            lsxpack_header_set_ptr(&xhdrs[i][0], ":status", 7, "200", 3);
+            lsxpack_header_set_ptr(&xhdrs[i][1], ":status", 7, "404", 3);
+            lsxpack_header_set_ptr(&xhdrs[i][2], ":status", 7, "299", 3);
+            lsxpack_header_set_ptr(&xhdrs[i][3], "server", 6, "lsqpack", 7);
+            lsxpack_header_set_ptr(&xhdrs[i][4], "server", 6, "other", 5);
+            lsxpack_header_set_ptr(&xhdrs[i][5], "x-frob", 6, "frobnicate",
+                                                                        10);
+        }
+        lsqpack_enc_set_names(&enc[1], &names);
+        for (n = 0; n < 6; ++n)
+        {
+            xhdrs[1][n].flags |= LSXPACK_APP_IDX;
+            if (pass == 0)
+                xhdrs[1][n].app_index = idx[ n < 3 ? 0 : n < 5 ? 1 : 2 ];
+            else
+                xhdrs[1][n].app_index = foreign[n];
+        }
+
+        for (n = 0; n < 3; ++n)
+            for (i = 0; i < 2; ++i)
+            {
+                enc_sz[i] = sizeof(enc_buf[i]);
+                hea_sz[i] = sizeof(hea_buf[i]);
+                s = lsqpack_enc_encode_list(&enc[i], n, 0, enc_buf[i],
+                            &enc_sz[i], hea_buf[i], &hea_sz[i], xhdrs[i], 6,
+                            0, NULL);
+                assert(s == 0);
+                if (i == 1)
+                {
+                    assert(enc_sz[0] == enc_sz[1]);
+                    assert(0 == memcmp(enc_buf[0], enc_buf[1], enc_sz[0]));
+                    assert(hea_sz[0] == hea_sz[1]);
+                    assert(0 == memcmp(hea_buf[0], hea_buf[1], hea_sz[0]));
+                }
+            }
+
+        for (i = 0; i < 2; ++i)
+            lsqpack_enc_cleanup(&enc[i]);
+    }
+
+    for (n = 3; n < 256; ++n)
+    {
+        s = lsqpack_enc_names_add(&names, "x-frob", 6, NULL, 0);
+        assert(s == (int) n);
+    }
+    s = lsqpack_enc_names_add(&names, "x-frob", 6, NULL, 0);
+    assert(s == -1 && errno == ENOSPC);
+    lsqpack_enc_names_cleanup(&names);
+}
+
+
+
+/* Every static table entry is found by the encoder, and names that are not
+ * in the static table are not.
+ */
+static void
+test_static_lookup (void)
+{
+    struct lsqpack_dec dec;
+    struct lsqpack_enc enc;
+    struct capture_hset hblock;
+    struct lsxpack_header xhdr;
+    enum lsqpack_read_header_status rhs;
+    enum lsqpack_enc_status es;
+    const unsigned char *buf;
+    unsigned char header_block[4], enc_buf[0x10], hea_buf[0x10];
+    size_t header_block_sz, enc_sz, hea_sz;
+    unsigned id;
+    int s;
+#ifndef NDEBUG
+    int name_id;
+#endif
+
+    lsqpack_dec_init(&dec, NULL, 0, 0, &capture_hset_if,
+                                                    LSQPACK_DEC_OPT_ZERO_COPY);
+    s = lsqpack_enc_init(&enc, NULL, 0, 0, 0, 0, NULL, NULL);
+    assert(s == 0);
+
+    for (id = 0; id < 99; ++id)
+    {
+        header_block[0] = 0;
+        header_block[1] = 0;
+        if (id < 63)
+        {
+            header_block[2] = 0xC0 | id;
+            header_block_sz = 3;
+        }
+        else
+        {
+            header_block[2] = 0xFF;
+            header_block[3] = id - 63;
+            header_block_sz = 4;
+        }
+        memset(&hblock, 0, sizeof(hblock));
+        buf = header_block;
+        rhs = lsqpack_dec_header_in(&dec, &hblock, id, header_block_sz,
+                                &buf, header_block_sz, NULL, NULL);
+        assert(rhs == LQRHS_DONE);
+        assert(hblock.n_headers == 1);
+
+        /* Drop the static table index set by the decoder */
+        lsxpack_header_set_ptr(&xhdr,
+            lsxpack_header_get_name(&hblock.xhdrs[0]),
+            hblock.xhdrs[0].name_len,
+            lsxpack_header_get_value(&hblock.xhdrs[0]),
+            hblock.xhdrs[0].val_len);
+
+#ifndef NDEBUG
+        name_id = lsqpack_find_in_static_headers(
+                        lsxpack_header_get_name(&xhdr), xhdr.name_len);
+        assert(name_id >= 0 && (unsigned) name_id <= id);
+#endif
+
+        s = lsqpack_enc_start_header(&enc, id, 0);
+        assert(s == 0);
+        enc_sz = sizeof(enc_buf);
+        hea_sz = sizeof(hea_buf);
+        es = lsqpack_enc_encode(&enc, enc_buf, &enc_sz, hea_buf, &hea_sz,
+                                                                    &xhdr, 0);
+        assert(es == LQES_OK);
+        assert(enc_sz == 0);
+        assert(hea_sz == header_block_sz - 2);
+        assert(0 == memcmp(hea_buf, header_block + 2, hea_sz));
+        s = (int) lsqpack_enc_end_header(&enc, hea_buf, sizeof(hea_buf), NULL);
+        assert(s == 2);
+    }
+
+#ifndef NDEBUG
+    assert(-1 == lsqpack_find_in_static_headers("", 0));
+    assert(-1 == lsqpack_find_in_static_headers("x-unknown", 9));
+    assert(-1 == lsqpack_find_in_static_headers(
+                                    "access-control-allow-methodz", 28));
+    assert(-1 == lsqpack_find_in_static_headers(":statuz", 7));
+#endif
+
+    lsqpack_enc_cleanup(&enc);
+    lsqpack_dec_cleanup(&dec);
+}
+
+
+
+static void
+test_dec_lazy_values (void)
+{
+    struct lsqpack_enc enc;
+    struct lsqpack_dec dec;
+    struct capture_hset hblock;
+    struct lsxpack_header xhdrs[3];
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned char enc_buf[0x100], hea_buf[0x100];
+    char value[0x40];
+    size_t enc_sz, hea_sz;
+    ssize_t len;
+    int s;
+
+    s = lsqpack_enc_init(&enc, NULL, 0, 0, 0, 0, NULL, NULL);
+    assert(s == 0);
+    lsxpack_header_set_ptr(&xhdrs[0], ":method", 7, "GET", 3);
+    lsxpack_header_set_ptr(&xhdrs[1], ":path", 5, "/index.html?a=b", 15);
+    lsxpack_header_set_ptr(&xhdrs[2], "x-frob", 6, "\xff\xfe", 2);
+    enc_sz = sizeof(enc_buf);
+    hea_sz = sizeof(hea_buf);
+    s = lsqpack_enc_encode_list(&enc, 0, 0, enc_buf, &enc_sz, hea_buf,
+                                            &hea_sz, xhdrs, 3, 0, NULL);
+    assert(s == 0);
+    assert(enc_sz == 0);
+    lsqpack_enc_cleanup(&enc);
+
+    lsqpack_dec_init(&dec, NULL, 0, 0, &capture_hset_if,
+                LSQPACK_DEC_OPT_LAZY_VALUES|LSQPACK_DEC_OPT_HASH_NAMEVAL);
+    memset(&hblock, 0, sizeof(hblock));
+    buf = hea_buf;
+    rhs = lsqpack_dec_header_in(&dec, &hblock, 0, hea_sz, &buf, hea_sz,
+                                                                NULL, NULL);
+    assert(rhs == LQRHS_DONE);
+    assert(hblock.n_headers == 3);
+
+    /* Static table value */
+    assert(!(hblock.xhdrs[0].flags & LSXPACK_VAL_HUFFMAN));
+    len = lsqpack_dec_get_value(&hblock.xhdrs[0], value, 3);
+    assert(len == 3 && 0 == memcmp(value, "GET", 3));
+
+    /* Huffman-encoded literal value is left encoded */
+    assert(hblock.xhdrs[1].flags & LSXPACK_VAL_HUFFMAN);
+    assert(!(hblock.xhdrs[1].flags & LSXPACK_NAMEVAL_HASH));
+    assert(hblock.xhdrs[1].val_len < 15);
+    assert(LSQPACK_HUFF_DEC_MAX_SIZE(hblock.xhdrs[1].val_len) >= 15);
+    len = lsqpack_dec_get_value(&hblock.xhdrs[1], value, 15);
+    assert(len == 15 && 0 == memcmp(value, "/index.html?a=b", 15));
+    len = lsqpack_dec_get_value(&hblock.xhdrs[1], value, 14);
+    assert(len == -1 && errno == ENOBUFS);
+
+    /* Value that does not compress is not Huffman-encoded */
+    assert(!(hblock.xhdrs[2].flags & LSXPACK_VAL_HUFFMAN));
+    len = lsqpack_dec_get_value(&hblock.xhdrs[2], value, sizeof(value));
+    assert(len == 2 && 0 == memcmp(value, "\xff\xfe", 2));
+    len = lsqpack_dec_get_value(&hblock.xhdrs[2], value, 1);
+    assert(len == -1 && errno == ENOBUFS);
+
+    /* Bad encoding -- EOS symbol -- is detected when the value is decoded */
+    memset(hblock.xhdrs[1].buf + hblock.xhdrs[1].val_offset, 0xFF, 4);
+    len = lsqpack_dec_get_value(&hblock.xhdrs[1], value, sizeof(value));
+    assert(len == -1 && errno == EINVAL);
+
+    lsqpack_dec_cleanup(&dec);
+}
+
+
+/* Headers decoded with lazy values can be passed to the encoder: values that
+ * are still Huffman-encoded are copied to the header block as they are.
+ */
+static void
+test_dec_lazy_reencode (void)
+{
+    struct lsqpack_enc enc;
+    struct lsqpack_dec lazy_dec, dec;
+    struct capture_hset lazy_hblock, hblock;
+    struct lsxpack_header xhdrs[4];
+    enum lsqpack_read_header_status rhs;
+    enum lsqpack_enc_status es;
+    const unsigned char *buf;
+    unsigned char enc_buf[0x100], hea_buf[0x100], sdtc_buf[0x10];
+    size_t enc_sz, hea_sz, sdtc_sz, sz;
+    unsigned n, i, mode;
+    int s;
+
+    lsxpack_header_set_ptr(&xhdrs[0], ":method", 7, "GET", 3);
+    lsxpack_header_set_ptr(&xhdrs[1], ":path", 5, "/index.html?a=b", 15);
+    lsxpack_header_set_ptr(&xhdrs[2], "x-frob", 6, "frobnicate", 10);
+    lsxpack_header_set_ptr(&xhdrs[3], "cookie", 6, "abc=def; ghi=jkl", 16);
+    hea_sz = sizeof(hea_buf);
+    s = lsqpack_enc_encode_stateless(hea_buf, &hea_sz, xhdrs, 4, 0);
+    assert(s == 0);
+
+    lsqpack_dec_init(&lazy_dec, NULL, 0, 0, &capture_hset_if,
+                                                LSQPACK_DEC_OPT_LAZY_VALUES);
+    memset(&lazy_hblock, 0, sizeof(lazy_hblock));
+    buf = hea_buf;
+    rhs = lsqpack_dec_header_in(&lazy_dec, &lazy_hblock, 0, hea_sz, &buf,
+                                                        hea_sz, NULL, NULL);
+    assert(rhs == LQRHS_DONE);
+    assert(lazy_hblock.n_headers == 4);
+    for (n = 1; n < 4; ++n)
+        assert(lazy_hblock.xhdrs[n].flags & LSXPACK_VAL_HUFFMAN);
+
+    /* 0: lsqpack_enc_encode(); 1: lsqpack_enc_encode_list(), twice, so
+     * that the second header block comes from the cache; 2: stateless
+     */
+    for (mode = 0; mode < 3; ++mode)
+    {
+        sdtc_sz = sizeof(sdtc_buf);
+        s = lsqpack_enc_init(&enc, NULL, 0x400, 0x400, 0,
+                LSQPACK_ENC_OPT_CRUMBLE_COOKIES|LSQPACK_ENC_OPT_HBLOCK_CACHE,
+                sdtc_buf, &sdtc_sz);
+        assert(s == 0);
+        lsqpack_dec_init(&dec, NULL, 0x400, 0, &capture_hset_if, 0);
+        s = lsqpack_dec_enc_in(&dec, sdtc_buf, sdtc_sz);
+        assert(s == 0);
+        for (i = 0; i < 1 + (mode == 1); ++i)
+        {
+            enc_sz = 0;
+            hea_sz = sizeof(hea_buf);
+            switch (mode)
+            {
+            case 0:
+                s = lsqpack_enc_start_header(&enc, i * 4, 0);
+                assert(s == 0);
+                hea_sz = 2;
+                for (n = 0; n < 4; ++n)
+                {
+                    enc_sz = sizeof(enc_buf);
+                    sz = sizeof(hea_buf) - hea_sz;
+                    es = lsqpack_enc_encode(&enc, enc_buf, &enc_sz,
+                            hea_buf + hea_sz, &sz, &lazy_hblock.xhdrs[n], 0);
+                    assert(es == LQES_OK);
+                    assert(enc_sz == 0);
+                    hea_sz += sz;
+                }
+                s = (int) lsqpack_enc_end_header(&enc, hea_buf, 2, NULL);
+                assert(s == 2);
+                break;
+            case 1:
+                enc_sz = sizeof(enc_buf);
+                s = lsqpack_enc_encode_list(&enc, i * 4, 0, enc_buf, &enc_sz,
+                        hea_buf, &hea_sz, lazy_hblock.xhdrs, 4, 0, NULL);
+                assert(s == 0);
+                break;
+            default:
+                s = lsqpack_enc_encode_stateless(hea_buf, &hea_sz,
+                                                lazy_hblock.xhdrs, 4, 0);
+                assert(s == 0);
+                break;
+            }
+            /* Nothing is inserted into the dynamic table */
+            assert(enc_sz == 0);
+
+            memset(&hblock, 0, sizeof(hblock));
+            buf = hea_buf;
+            rhs = lsqpack_dec_header_in(&dec, &hblock, i * 4, hea_sz, &buf,
+                                                        hea_sz, NULL, NULL);
+            assert(rhs == LQRHS_DONE);
+            /* The cookie is not split into crumbs */
+            assert(hblock.n_headers == 4);
+            for (n = 0; n < 4; ++n)
+            {
+                assert(hblock.xhdrs[n].name_len == xhdrs[n].name_len);
+                assert(0 == memcmp(lsxpack_header_get_name(&hblock.xhdrs[n]),
+                            lsxpack_header_get_name(&xhdrs[n]),
+                            xhdrs[n].name_len));
+                assert(hblock.xhdrs[n].val_len == xhdrs[n].val_len);
+                assert(0 == memcmp(lsxpack_header_get_value(&hblock.xhdrs[n]),
+                            lsxpack_header_get_value(&xhdrs[n]),
+                            xhdrs[n].val_len));
+            }
+        }
+        lsqpack_dec_cleanup(&dec);
+        lsqpack_enc_cleanup(&enc);
+    }
+
+    lsqpack_dec_cleanup(&lazy_dec);
+}
+
+
+struct hbrc_count
+{
+    unsigned    n_allocs;
+    unsigned    n_frees;
+};
+
+
+static void *
+hbrc_count_alloc (void *ctx, size_t size)
+{
+    struct hbrc_count *const count = ctx;
+
+    ++count->n_allocs;
+    return malloc(size);
+}
+
+
+static void
+hbrc_count_free (void *ctx, void *ptr)
+{
+    struct hbrc_count *const count = ctx;
+
+    ++count->n_frees;
+    free(ptr);
+}
+
+
+static const struct lsqpack_dec_alloc_if hbrc_count_if =
+{
+    .dai_alloc      = hbrc_count_alloc,
+    .dai_free       = hbrc_count_free,
+};
+
+
+/* Read contexts of header blocks that are read in several calls are reused.
+ * They can come from a custom allocator.
+ */
+static void
+test_dec_reuse_read_ctx (void)
+{
+    struct lsqpack_dec dec;
+    struct capture_hset hblock;
+    struct hbrc_count count;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    const void *read_ctx;
+    unsigned n;
+    int custom;
+    /* `:method: GET' and `:path: /' */
+    static const unsigned char header_block[] = "\x00\x00\xd1\xc1";
+
+    for (custom = 0; custom < 2; ++custom)
+    {
+        lsqpack_dec_init(&dec, NULL, 0, 0, &capture_hset_if, 0);
+        memset(&count, 0, sizeof(count));
+        if (custom)
+            lsqpack_dec_set_hbrc_alloc_if(&dec, &hbrc_count_if, &count);
+        read_ctx = NULL;
+        for (n = 0; n < 3; ++n)
+        {
+            memset(&hblock, 0, sizeof(hblock));
+            buf = header_block;
+            rhs = lsqpack_dec_header_in(&dec, &hblock, n * 4,
+                            sizeof(header_block) - 1, &buf, 3, NULL, NULL);
+            assert(rhs == LQRHS_NEED);
+            assert(dec.qpd_n_free_hbrcs == 0);
+            rhs = lsqpack_dec_header_read(&dec, &hblock, &buf,
+                                header_block + sizeof(header_block) - 1 - buf,
+                                NULL, NULL);
+            assert(rhs == LQRHS_DONE);
+            assert(hblock.n_headers == 2);
+            assert(dec.qpd_n_free_hbrcs == 1);
+            if (read_ctx)
+                assert(read_ctx == TAILQ_FIRST(&dec.qpd_free_hbrcs));
+            else
+                read_ctx = TAILQ_FIRST(&dec.qpd_free_hbrcs);
+        }
+        assert(count.n_allocs == (unsigned) custom);
+
+        lsqpack_dec_cleanup(&dec);
+        assert(count.n_frees == (unsigned) custom);
+    }
+}
+
+
+/* Encode header list using lsqpack_enc_encode_list(), decode it, and pass
+ * acknowledgements back to the encoder.
+ */
+static void
+hblock_cache_round_trip (struct lsqpack_enc *enc, struct lsqpack_dec *dec,
+        uint64_t stream_id, const struct lsxpack_header *xhdrs,
+        unsigned n_xhdrs, unsigned char *hea_buf, size_t *hea_sz)
+{
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned char enc_buf[0x400], dec_buf[0x20];
+    size_t enc_sz, dec_buf_sz;
+    ssize_t ici_sz;
+    int s;
+
+    enc_sz = sizeof(enc_buf);
+    s = lsqpack_enc_encode_list(enc, stream_id, 0, enc_buf, &enc_sz,
+                                hea_buf, hea_sz, xhdrs, n_xhdrs, 0, NULL);
+    assert(s == 0);
+    if (enc_sz)
+    {
+        s = lsqpack_dec_enc_in(dec, enc_buf, enc_sz);
+        assert(s == 0);
+    }
+    memset(&hblock, 0, sizeof(hblock));
+    buf = hea_buf;
+    dec_buf_sz = sizeof(dec_buf);
+    rhs = lsqpack_dec_header_in(dec, &hblock, stream_id, *hea_sz, &buf,
+                                        *hea_sz, dec_buf, &dec_buf_sz);
+    assert(rhs == LQRHS_DONE);
+    assert(hblock.n_headers == n_xhdrs);
+    assert(capture_last(&hblock)->val_len == xhdrs[n_xhdrs - 1].val_len);
+    assert(0 == memcmp(lsxpack_header_get_value(capture_last(&hblock)),
+                lsxpack_header_get_value(&xhdrs[n_xhdrs - 1]),
+                xhdrs[n_xhdrs - 1].val_len));
+    if (dec_buf_sz)
+    {
+        s = lsqpack_enc_decoder_in(enc, dec_buf, dec_buf_sz);
+        assert(s == 0);
+    }
+    ici_sz = lsqpack_dec_write_ici(dec, dec_buf, sizeof(dec_buf));
+    assert(ici_sz >= 0);
+    if (ici_sz > 0)
+    {
+        s = lsqpack_enc_decoder_in(enc, dec_buf, (size_t) ici_sz);
+        assert(s == 0);
+    }
+}
+
+
+static void
+test_enc_hblock_cache (void)
+{
+    struct lsqpack_enc enc;
+    struct lsqpack_dec dec;
+    struct lsqpack_enc_stats stats;
+    struct lsxpack_header xhdrs[3], filler;
+    unsigned char enc_buf[0x100], hea_buf[3][0x100];
+    char value[0x80], other_value[] = "text/HTML";
+    size_t enc_sz, hea_sz[3];
+    uint64_t stream_id;
+    unsigned n;
+    int s;
+
+    lsxpack_header_set_ptr(&xhdrs[0], ":status", 7, "200", 3);
+    lsxpack_header_set_ptr(&xhdrs[1], "content-type", 12, "text/html", 9);
+    lsxpack_header_set_ptr(&xhdrs[2], "x-asset-id", 10,
+                                        "0123456789abcdef", 16);
+
+    /* Without the dynamic table, the second encoding is the same as the
+     * first one, and the third one comes from the cache.
+     */
+    s = lsqpack_enc_init(&enc, NULL, 0, 0, 0, LSQPACK_ENC_OPT_HBLOCK_CACHE,
+                                                                NULL, NULL);
+    assert(s == 0);
+    for (n = 0; n < 3; ++n)
+    {
+        enc_sz = sizeof(enc_buf);
+        hea_sz[n] = sizeof(hea_buf[n]);
+        s = lsqpack_enc_encode_list(&enc, n * 4, 0, enc_buf, &enc_sz,
+                        hea_buf[n], &hea_sz[n], xhdrs, 3, 0, NULL);
+        assert(s == 0);
+        assert(enc_sz == 0);
+        lsqpack_enc_get_stats(&enc, &stats);
+        assert(stats.n_hblock_cache_hits == (n == 2));
+        assert(hea_sz[n] == hea_sz[0]);
+        assert(0 == memcmp(hea_buf[n], hea_buf[0], hea_sz[0]));
+    }
+
+    /* Same lengths, different contents */
+    lsxpack_header_set_ptr(&xhdrs[1], "content-type", 12, other_value, 9);
+    enc_sz = sizeof(enc_buf);
+    hea_sz[1] = sizeof(hea_buf[1]);
+    s = lsqpack_enc_encode_list(&enc, 12, 0, enc_buf, &enc_sz, hea_buf[1],
+                                            &hea_sz[1], xhdrs, 3, 0, NULL);
+    assert(s == 0);
+    lsqpack_enc_get_stats(&enc, &stats);
+    assert(stats.n_hblock_cache_hits == 1);
+    assert(!(hea_sz[1] == hea_sz[0]
+                            && 0 == memcmp(hea_buf[1], hea_buf[0], hea_sz[0])));
+    lsqpack_enc_cleanup(&enc);
+    lsxpack_header_set_ptr(&xhdrs[1], "content-type", 12, "text/html", 9);
+
+    /* With the dynamic table, the header list settles on acknowledged
+     * entries and is then served from the cache.
+     */
+    enc_sz = sizeof(enc_buf);
+    s = lsqpack_enc_init(&enc, NULL, 0x100, 0x100, 0,
+                        LSQPACK_ENC_OPT_HBLOCK_CACHE, enc_buf, &enc_sz);
+    assert(s == 0);
+    lsqpack_dec_init(&dec, NULL, 0x100, 0, &capture_hset_if, 0);
+    s = lsqpack_dec_enc_in(&dec, enc_buf, enc_sz);
+    assert(s == 0);
+    stream_id = 0;
+    for (n = 0; n < 10; ++n)
+    {
+        hea_sz[0] = sizeof(hea_buf[0]);
+        hblock_cache_round_trip(&enc, &dec, stream_id, xhdrs, 3, hea_buf[0],
+                                                                &hea_sz[0]);
+        stream_id += 4;
+    }
+    lsqpack_enc_get_stats(&enc, &stats);
+    assert(stats.n_hblock_cache_hits >= 5);
+    assert(stats.n_hblock_cache_hits < 10);
+    /* The cached header block references the dynamic table */
+    assert(hea_buf[0][0] != 0);
+
+    /* Push the referenced entries out of the table */
+    memset(value, 'v', sizeof(value));
+    for (n = 0; n < 10; ++n)
+    {
+        value[0] = 'a' + n / 3;
+        lsxpack_header_set_ptr(&filler, "x-filler", 8, value, sizeof(value));
+        hea_sz[1] = sizeof(hea_buf[1]);
+        hblock_cache_round_trip(&enc, &dec, stream_id, &filler, 1,
+                                                    hea_buf[1], &hea_sz[1]);
+        stream_id += 4;
+    }
+    lsqpack_enc_get_stats(&enc, &stats);
+    assert(stats.n_evictions > 0);
+    n = (unsigned) stats.n_hblock_cache_hits;
+    hea_sz[1] = sizeof(hea_buf[1]);
+    hblock_cache_round_trip(&enc, &dec, stream_id, xhdrs, 3, hea_buf[1],
+                                                                &hea_sz[1]);
+    lsqpack_enc_get_stats(&enc, &stats);
+    assert(stats.n_hblock_cache_hits == n);
+
+    lsqpack_enc_cleanup(&enc);
+    lsqpack_dec_cleanup(&dec);
+}
+
+
+/* The stateless encoder produces the same header block as an encoder whose
+ * dynamic table capacity is zero.
+ */
+static void
+test_enc_stateless (void)
+{
+    struct lsqpack_enc enc;
+    struct lsxpack_header xhdrs[8];
+    unsigned char enc_buf[0x200], hea_buf[0x200], sl_buf[0x200];
+    char long_value[300];
+    size_t enc_sz, hea_sz, sl_sz;
+    unsigned n;
+    int s, pass;
+
+    memset(long_value, 'x', sizeof(long_value));
+    lsxpack_header_set_ptr(&xhdrs[0], ":method", 7, "GET", 3);
+    lsxpack_header_set_ptr(&xhdrs[1], ":path", 5, "/index.html", 11);
+    lsxpack_header_set_ptr(&xhdrs[2], "x-custom-header", 15,
+                                                        "\xff\x00\x01", 3);
+    lsxpack_header_set_ptr(&xhdrs[3], "authorization", 13, "secret", 6);
+    xhdrs[3].flags |= LSXPACK_NEVER_INDEX;
+    lsxpack_header_set_ptr(&xhdrs[4], "x-never", 7, "private", 7);
+    xhdrs[4].flags |= LSXPACK_NEVER_INDEX;
+    lsxpack_header_set_qpack_idx(&xhdrs[5],
+                    LSQPACK_TNV_CONTENT_TYPE_TEXT_HTML_CHARSET_UTF_8,
+                    "text/html; charset=utf-8", 24);
+    xhdrs[5].flags |= LSXPACK_VAL_MATCHED;
+    lsxpack_header_set_qpack_idx(&xhdrs[6], LSQPACK_TNV_CONTENT_LENGTH_0,
+                                                            "1234", 4);
+    lsxpack_header_set_ptr(&xhdrs[7], "x-long", 6, long_value,
+                                                        sizeof(long_value));
+
+    s = lsqpack_enc_init(&enc, NULL, 0, 0, 0, 0, NULL, NULL);
+    assert(s == 0);
+    for (pass = 0; pass < 2; ++pass)
+        for (n = 1; n <= 8; ++n)
+        {
+            enc_sz = sizeof(enc_buf);
+            hea_sz = sizeof(hea_buf);
+            s = lsqpack_enc_encode_list(&enc, n * 4, 0, enc_buf, &enc_sz,
+                hea_buf, &hea_sz, xhdrs, n, pass ? LQEF_NEVER_INDEX : 0,
+                NULL);
+            assert(s == 0);
+            assert(enc_sz == 0);
+            sl_sz = sizeof(sl_buf);
+            s = lsqpack_enc_encode_stateless(sl_buf, &sl_sz, xhdrs, n,
+                                            pass ? LQEF_NEVER_INDEX : 0);
+            assert(s == 0);
+            assert(sl_sz == hea_sz);
+            assert(0 == memcmp(sl_buf, hea_buf, hea_sz));
+        }
+    lsqpack_enc_cleanup(&enc);
+
+    /* Too small a buffer */
+    sl_sz = hea_sz - 1;
+    s = lsqpack_enc_encode_stateless(sl_buf, &sl_sz, xhdrs, 8, 0);
+    assert(s == -1 && errno == ENOBUFS);
+    assert(sl_sz >= hea_sz);
+    s = lsqpack_enc_encode_stateless(sl_buf, &sl_sz, xhdrs, 8, 0);
+    assert(s == 0 && sl_sz == hea_sz);
+    sl_sz = 1;
+    s = lsqpack_enc_encode_stateless(sl_buf, &sl_sz, xhdrs, 0, 0);
+    assert(s == -1 && errno == ENOBUFS && sl_sz == 2);
+}
+
+
+/* Encode header list, decode it, and send acknowledgements back.  Return
+ * the number of bytes written to both streams.  The crumbs are joined by
+ * following the cookie chain backward from the last cookie header.
+ */
+static size_t
+cookie_round_trip (struct lsqpack_enc *enc, struct lsqpack_dec *dec,
+        uint64_t stream_id, const struct lsxpack_header *xhdrs,
+        unsigned n_xhdrs, struct capture_hset *hblock, char *cookie,
+        size_t *cookie_len)
+{
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned char enc_buf[0x400], hea_buf[0x400], dec_buf[0x20];
+    char *p;
+    size_t enc_sz, hea_sz, dec_buf_sz;
+    ssize_t ici_sz;
+    unsigned idx, last;
+    int s;
+
+    enc_sz = sizeof(enc_buf);
+    hea_sz = sizeof(hea_buf);
+    s = lsqpack_enc_encode_list(enc, stream_id, 0, enc_buf, &enc_sz,
+                                hea_buf, &hea_sz, xhdrs, n_xhdrs, 0, NULL);
+    assert(s == 0);
+    if (enc_sz)
+    {
+        s = lsqpack_dec_enc_in(dec, enc_buf, enc_sz);
+        assert(s == 0);
+    }
+    memset(hblock, 0, sizeof(*hblock));
+    buf = hea_buf;
+    dec_buf_sz = sizeof(dec_buf);
+    rhs = lsqpack_dec_header_in(dec, hblock, stream_id, hea_sz, &buf,
+                                        hea_sz, dec_buf, &dec_buf_sz);
+    assert(rhs == LQRHS_DONE);
+    if (dec_buf_sz)
+    {
+        s = lsqpack_enc_decoder_in(enc, dec_buf, dec_buf_sz);
+        assert(s == 0);
+    }
+    ici_sz = lsqpack_dec_write_ici(dec, dec_buf, sizeof(dec_buf));
+    assert(ici_sz >= 0);
+    if (ici_sz > 0)
+    {
+        s = lsqpack_enc_decoder_in(enc, dec_buf, (size_t) ici_sz);
+        assert(s == 0);
+    }
+
+    /* Crumbs are found in reverse order: place them at the end */
+    for (last = hblock->n_headers; last > 0; --last)
+        if (hblock->xhdrs[last - 1].name_len == 6 && 0 == memcmp(
+                    lsxpack_header_get_name(&hblock->xhdrs[last - 1]),
+                    "cookie", 6))
+            break;
+    assert(last > 0);
+    p = cookie + *cookie_len;
+    for (idx = last; idx; idx = hblock->xhdrs[idx - 1].chain_next_idx)
+    {
+        assert(idx <= hblock->n_headers);
+        if (idx != last)
+        {
+            p -= 2;
+            memcpy(p, "; ", 2);
+        }
+        p -= hblock->xhdrs[idx - 1].val_len;
+        assert(p >= cookie);
+        memcpy(p, lsxpack_header_get_value(&hblock->xhdrs[idx - 1]),
+                                        hblock->xhdrs[idx - 1].val_len);
+    }
+    *cookie_len -= p - cookie;
+    memmove(cookie, p, *cookie_len);
+
+    return enc_sz + hea_sz;
+}
+
+
+/* Cookie crumbs are encoded as separate fields and can be joined back using
+ * the chain set by the decoder.  When only one crumb changes, fewer bytes
+ * are produced than when the cookie is encoded whole.
+ */
+static void
+test_cookie_crumbs (void)
+{
+    struct lsqpack_enc enc;
+    struct lsqpack_dec dec;
+    struct capture_hset hblock;
+    struct lsxpack_header xhdrs[3];
+    enum lsqpack_enc_status es;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned char enc_buf[0x400], hea_buf[0x400];
+    char value[0x80], out[0x80];
+    size_t enc_sz, hea_sz, out_len, nw[2];
+    unsigned n;
+    int crumble, s, len;
+
+    for (crumble = 0; crumble < 2; ++crumble)
+    {
+        unsigned char sdtc_buf[LSQPACK_LONGEST_SDTC];
+        size_t sdtc_buf_size = sizeof(sdtc_buf);
+
+        s = lsqpack_enc_init(&enc, NULL, 0x400, 0x400, 0,
+                crumble ? LSQPACK_ENC_OPT_CRUMBLE_COOKIES : 0,
+                sdtc_buf, &sdtc_buf_size);
+        assert(s == 0);
+        lsqpack_dec_init(&dec, NULL, 0x400, 0, &capture_hset_if,
+                                                LSQPACK_DEC_OPT_COOKIE_CHAIN);
+        s = lsqpack_dec_enc_in(&dec, sdtc_buf, sdtc_buf_size);
+        assert(s == 0);
+        nw[crumble] = 0;
+        for (n = 0; n < 20; ++n)
+        {
+            len = snprintf(value, sizeof(value), "session=0123456789abcdef; "
+                        "theme=dark; ; seq=%u; lang=en-US; ", n);
+            lsxpack_header_set_ptr(&xhdrs[0], ":method", 7, "GET", 3);
+            lsxpack_header_set_ptr(&xhdrs[1], "cookie", 6, value, len);
+            lsxpack_header_set_ptr(&xhdrs[2], "user-agent", 10, "test", 4);
+            out_len = sizeof(out);
+            nw[crumble] += cookie_round_trip(&enc, &dec, n * 4, xhdrs, 3,
+                                                    &hblock, out, &out_len);
+            assert(hblock.n_headers == (crumble ? 8u : 3u));
+            assert(out_len == (size_t) len);
+            assert(0 == memcmp(out, value, len));
+            if (crumble)
+            {
+                assert(hblock.xhdrs[1].chain_next_idx == 0);
+                assert(hblock.xhdrs[2].chain_next_idx == 2);
+                assert(hblock.xhdrs[6].chain_next_idx == 6);
+                assert(hblock.xhdrs[3].val_len == 0);
+                assert(hblock.xhdrs[6].val_len == 0);
+            }
+            else
+                assert(hblock.xhdrs[1].chain_next_idx == 0);
+            /* Other headers are left alone */
+            assert(hblock.xhdrs[0].chain_next_idx == 0xFFFF);
+            assert(hblock.xhdrs[hblock.n_headers - 1].chain_next_idx
+                                                                == 0xFFFF);
+        }
+        lsqpack_dec_cleanup(&dec);
+        lsqpack_enc_cleanup(&enc);
+    }
+    assert(nw[1] < nw[0]);
+
+    /* A cookie is encoded whole if the buffers cannot hold all crumbs */
+    s = lsqpack_enc_init(&enc, NULL, 0, 0, 0,
+                            LSQPACK_ENC_OPT_CRUMBLE_COOKIES, NULL, NULL);
+    assert(s == 0);
+    lsqpack_dec_init(&dec, NULL, 0, 0, &capture_hset_if,
+                                                LSQPACK_DEC_OPT_COOKIE_CHAIN);
+    len = snprintf(value, sizeof(value), "a=1; b=2; c=3");
+    lsxpack_header_set_ptr(&xhdrs[0], "cookie", 6, value, len);
+    for (n = 0; n < 2; ++n)
+    {
+        s = lsqpack_enc_start_header(&enc, n * 4, 0);
+        assert(s == 0);
+        enc_sz = sizeof(enc_buf);
+        hea_sz = n ? (size_t) len + 2 : sizeof(hea_buf) - 2;
+        es = lsqpack_enc_encode(&enc, enc_buf, &enc_sz, hea_buf + 2, &hea_sz,
+                                                                &xhdrs[0], 0);
+        assert(es == LQES_OK);
+        assert(enc_sz == 0);
+        s = (int) lsqpack_enc_end_header(&enc, hea_buf, 2, NULL);
+        assert(s == 2);
+        hea_sz += 2;
+        memset(&hblock, 0, sizeof(hblock));
+        buf = hea_buf;
+        rhs = lsqpack_dec_header_in(&dec, &hblock, n * 4, hea_sz, &buf,
+                                                        hea_sz, NULL, NULL);
+        assert(rhs == LQRHS_DONE);
+        assert(hblock.n_headers == (n ? 1u : 3u));
+        assert(hblock.xhdrs[hblock.n_headers - 1].chain_next_idx
+                                                    == hblock.n_headers - 1);
+    }
+    lsqpack_dec_cleanup(&dec);
+    lsqpack_enc_cleanup(&enc);
+}
+
+
+/* When the header block is decoded into a header list, cookie headers are
+ * linked forward.
+ */
+static void
+test_cookie_chain_hlist (void)
+{
+    struct lsqpack_dec dec;
+    struct lsqpack_dec_hlist hlist;
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned n;
+    /* `:method: GET', `cookie: a=1', `:method: GET', `cookie: b=2', and
+     * `cookie: '
+     */
+    static const unsigned char header_block[] = "\x00\x00"
+        "\xd1" "\x55\x03" "a=1" "\xd1" "\x55\x03" "b=2" "\xc5";
+
+    lsqpack_dec_init(&dec, NULL, 0, 0, &capture_hset_if,
+                                                LSQPACK_DEC_OPT_COOKIE_CHAIN);
+    memset(&hlist, 0, sizeof(hlist));
+    memset(&hblock, 0, sizeof(hblock));
+    buf = header_block;
+    rhs = lsqpack_dec_header_in_hlist(&dec, &hblock, 0,
+            sizeof(header_block) - 1, &buf, sizeof(header_block) - 1,
+            NULL, NULL, &hlist);
+    assert(rhs == LQRHS_DONE);
+    assert(hblock.n_headers == 0);
+    assert(hlist.dhl_n_xhdrs == 5);
+    assert(hlist.dhl_xhdrs[1].chain_next_idx == 4);
+    assert(hlist.dhl_xhdrs[3].chain_next_idx == 5);
+    assert(hlist.dhl_xhdrs[4].chain_next_idx == 0);
+    for (n = 0; n < 5; n += 2)
+        assert(0 == memcmp(lsxpack_header_get_name(&hlist.dhl_xhdrs[n]),
+                    n == 4 ? "cookie" : ":method", n == 4 ? 6 : 7));
+    assert(hlist.dhl_xhdrs[0].chain_next_idx == 0);
+    assert(hlist.dhl_xhdrs[2].chain_next_idx == 0);
+
+    lsqpack_dec_hlist_cleanup(&hlist);
+    lsqpack_dec_cleanup(&dec);
+}
+
+
+/* Links cannot point to headers past UINT16_MAX: the cookie chain stops
+ * before them.
+ */
+static void
+test_cookie_chain_limit (void)
+{
+    struct lsqpack_dec dec;
+    struct lsqpack_dec_hlist hlist;
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned char *header_block;
+    const unsigned n_fields = UINT16_MAX + 2;
+    unsigned n, n_headers;
+
+    /* `cookie: ' at the beginning and in the last four fields, `:method:
+     * GET' in between
+     */
+    header_block = malloc(2 + n_fields);
+    assert(header_block);
+    header_block[0] = 0;
+    header_block[1] = 0;
+    for (n = 0; n < n_fields; ++n)
+        header_block[2 + n] = n == 0 || n >= n_fields - 4 ? 0xC5 : 0xD1;
+
+    lsqpack_dec_init(&dec, NULL, 0, 0, &capture_hset_if,
+                                                LSQPACK_DEC_OPT_COOKIE_CHAIN);
+
+    /* Only the first and the most recent headers are kept.  When the
+     * header block is cut short, all cookies fit into the chain.
+     */
+    for (n_headers = n_fields - 2; n_headers <= n_fields; n_headers += 2)
+    {
+        memset(&hblock, 0, sizeof(hblock));
+        hblock.max_headers = 2;
+        buf = header_block;
+        rhs = lsqpack_dec_header_in(&dec, &hblock, 0, 2 + n_headers,
+                                    &buf, 2 + n_headers, NULL, NULL);
+        assert(rhs == LQRHS_DONE);
+        assert(hblock.n_headers == n_headers);
+        assert(hblock.xhdrs[0].chain_next_idx == 0);
+        if (n_headers < n_fields)
+            assert(hblock.xhdrs[1].chain_next_idx == n_headers - 1);
+        else
+            assert(hblock.xhdrs[1].chain_next_idx == 0xFFFF);
+    }
+
+    memset(&hlist, 0, sizeof(hlist));
+    memset(&hblock, 0, sizeof(hblock));
+    buf = header_block;
+    rhs = lsqpack_dec_header_in_hlist(&dec, &hblock, 0, 2 + n_fields, &buf,
+                                        2 + n_fields, NULL, NULL, &hlist);
+    assert(rhs == LQRHS_DONE);
+    assert(hlist.dhl_n_xhdrs == n_fields);
+    assert(hlist.dhl_xhdrs[0].chain_next_idx == n_fields - 4 + 1);
+    assert(hlist.dhl_xhdrs[n_fields - 4].chain_next_idx == n_fields - 3 + 1);
+    assert(hlist.dhl_xhdrs[n_fields - 3].chain_next_idx == 0);
+    assert(hlist.dhl_xhdrs[n_fields - 2].chain_next_idx == 0);
+    assert(hlist.dhl_xhdrs[n_fields - 1].chain_next_idx == 0);
+    lsqpack_dec_hlist_cleanup(&hlist);
+
+    lsqpack_dec_cleanup(&dec);
+    free(header_block);
+}
+
+
+/* Memory used by the decoder is reported, blocked header blocks are rejected
+ * once the limit is reached -- which is told apart from decoding errors --
+ * and lowering dynamic table capacity gives back memory.
+ */
+static void
+test_dec_mem_limit (enum lsqpack_dec_opts opts)
+{
+    struct lsqpack_dec dec;
+    struct capture_hset hblocks[5];
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    const struct lsqpack_dec_err *err;
+    size_t mem, prev_mem, ctx_size;
+    ssize_t ssz;
+    unsigned n;
+    int s;
+    unsigned char cancel[0x10];
+    /* Required Insert Count 2, Base 2, indexed field line at index 0 */
+    static const unsigned char header_block[] = "\x03\x00\x80";
+    /* Same, with Required Insert Count 3 */
+    static const unsigned char header_block_ric3[] = "\x04\x00\x80";
+    /* Insert With Literal Name `foo: bar' */
+    static const unsigned char ins[] = "\x43" "foo" "\x03" "bar";
+    /* Set Dynamic Table Capacity to 0x100 and to 0 */
+    static const unsigned char cap_0x100[] = "\x3f\xe1\x01";
+    static const unsigned char cap_0[] = "\x20";
+
+    lsqpack_dec_init(&dec, NULL, 0x1000, 10, &capture_hset_if, opts);
+    mem = lsqpack_dec_mem_used(&dec);
+    assert(mem == ((opts & LSQPACK_DEC_OPT_RING_ARENA) ? 0x2000u : 0));
+
+    s = lsqpack_dec_enc_in(&dec, ins, sizeof(ins) - 1);
+    assert(s == 0);
+    prev_mem = mem;
+    mem = lsqpack_dec_mem_used(&dec);
+    if (opts & LSQPACK_DEC_OPT_RING_ARENA)
+        /* Only the table index is new */
+        assert(mem == prev_mem + 4 * sizeof(void *));
+    else
+        assert(mem > prev_mem + 4 * sizeof(void *) + 6);
+
+    /* The first blocked header block allocates hash tables, too */
+    memset(hblocks, 0, sizeof(hblocks));
+    for (n = 0; n < 2; ++n)
+    {
+        hblocks[n].buf = header_block;
+        rhs = lsqpack_dec_header_in(&dec, &hblocks[n], n * 4,
+                    sizeof(header_block) - 1, &hblocks[n].buf,
+                    sizeof(header_block) - 1, NULL, NULL);
+        assert(rhs == LQRHS_BLOCKED);
+        prev_mem = mem;
+        mem = lsqpack_dec_mem_used(&dec);
+        assert(mem > prev_mem);
+    }
+    ctx_size = mem - prev_mem;
+
+    /* Room for one more */
+    lsqpack_dec_set_mem_limit(&dec, mem + ctx_size);
+    hblocks[2].buf = header_block;
+    rhs = lsqpack_dec_header_in(&dec, &hblocks[2], 8,
+                sizeof(header_block) - 1, &hblocks[2].buf,
+                sizeof(header_block) - 1, NULL, NULL);
+    assert(rhs == LQRHS_BLOCKED);
+    assert(lsqpack_dec_mem_used(&dec) == mem + ctx_size);
+    buf = header_block;
+    rhs = lsqpack_dec_header_in(&dec, &hblocks[3], 12,
+                sizeof(header_block) - 1, &buf, sizeof(header_block) - 1,
+                NULL, NULL);
+    assert(rhs == LQRHS_ERROR);
+    assert(dec.qpd_n_blocked == 3);
+    err = lsqpack_dec_get_err_info(&dec);
+    assert(err->type == LSQPACK_DEC_ERR_LOC_MEM_LIMIT);
+    assert(err->stream_id == 12);
+    ssz = lsqpack_dec_cancel_stream_id(&dec, 12, cancel, sizeof(cancel));
+    assert(ssz == 1 && cancel[0] == 0x40 + 12);
+    /* A malformed header block is still a decoding error */
+    buf = header_block;
+    rhs = lsqpack_dec_header_in(&dec, &hblocks[3], 20, 1, &buf, 1,
+                                                                NULL, NULL);
+    assert(rhs == LQRHS_ERROR);
+    err = lsqpack_dec_get_err_info(&dec);
+    assert(err->type == LSQPACK_DEC_ERR_LOC_HEADER_BLOCK);
+    assert(err->stream_id == 20);
+
+    /* Finished read contexts are kept for reuse, so they still count... */
+    s = lsqpack_dec_enc_in(&dec, ins, sizeof(ins) - 1);
+    assert(s == 0);
+    assert(dec.qpd_n_blocked == 0);
+    for (n = 0; n < 3; ++n)
+    {
+        rhs = lsqpack_dec_header_read(&dec, &hblocks[n], &hblocks[n].buf,
+                    header_block + sizeof(header_block) - 1 - hblocks[n].buf,
+                    NULL, NULL);
+        assert(rhs == LQRHS_DONE);
+    }
+    mem = lsqpack_dec_mem_used(&dec);
+    assert(mem >= dec.qpd_mem_limit);
+
+    /* ...but reusing one does not take any more memory */
+    lsqpack_dec_set_mem_limit(&dec, mem);
+    hblocks[4].buf = header_block_ric3;
+    rhs = lsqpack_dec_header_in(&dec, &hblocks[4], 16,
+                sizeof(header_block_ric3) - 1, &hblocks[4].buf,
+                sizeof(header_block_ric3) - 1, NULL, NULL);
+    assert(rhs == LQRHS_BLOCKED);
+    assert(lsqpack_dec_mem_used(&dec) == mem);
+    lsqpack_dec_set_mem_limit(&dec, 0);
+    lsqpack_dec_cleanup(&dec);
+
+    /* Fill the table, then lower its capacity */
+    lsqpack_dec_init(&dec, NULL, 0x1000, 0, &capture_hset_if, opts);
+    for (n = 0; n < 100; ++n)
+    {
+        s = lsqpack_dec_enc_in(&dec, ins, sizeof(ins) - 1);
+        assert(s == 0);
+    }
+    assert(dec.qpd_dyn_table.rb_nalloc == 128);
+    mem = lsqpack_dec_mem_used(&dec);
+
+    s = lsqpack_dec_enc_in(&dec, cap_0x100, sizeof(cap_0x100) - 1);
+    assert(s == 0);
+    assert(dec.qpd_dyn_table.rb_nalloc == 16);
+    prev_mem = mem;
+    mem = lsqpack_dec_mem_used(&dec);
+    assert(mem < prev_mem);
+    if (opts & LSQPACK_DEC_OPT_RING_ARENA)
+    {
+        /* Entries still in the arena are evicted by new inserts */
+        assert(dec.qpd_arena.ra_size == 0x2000);
+        for (n = 0; n < 10; ++n)
+        {
+            s = lsqpack_dec_enc_in(&dec, ins, sizeof(ins) - 1);
+            assert(s == 0);
+        }
+        assert(dec.qpd_arena.ra_size == 0x200);
+        assert(lsqpack_dec_mem_used(&dec) < 0x400);
+    }
+
+    s = lsqpack_dec_enc_in(&dec, cap_0, sizeof(cap_0) - 1);
+    assert(s == 0);
+    assert(lsqpack_dec_mem_used(&dec) == 0);
+    lsqpack_dec_cleanup(&dec);
+}
+
+
+struct alloc_log
+{
+    void       *live[0x10];     /* In order of allocation */
+    unsigned    n_live, n_allocs, n_reallocs;
+};
+
+
+static void *
+log_alloc (void *ctx, size_t size)
+{
+    struct alloc_log *const log = ctx;
+    void *ptr;
+
+    assert(log->n_live < sizeof(log->live) / sizeof(log->live[0]));
+    ptr = malloc(size);
+    log->live[ log->n_live++ ] = ptr;
+    ++log->n_allocs;
+    return ptr;
+}
+
+
+static void *
+log_realloc (void *ctx, void *ptr, size_t size)
+{
+    struct alloc_log *const log = ctx;
+
+    assert(log->n_live > 0 && log->live[ log->n_live - 1 ] == ptr);
+    ptr = realloc(ptr, size);
+    log->live[ log->n_live - 1 ] = ptr;
+    ++log->n_reallocs;
+    return ptr;
+}
+
+
+static void
+log_free (void *ctx, void *ptr)
+{
+    struct alloc_log *const log = ctx;
+
+    /* Entries are evicted oldest first */
+    assert(log->n_live > 0 && log->live[0] == ptr);
+    memmove(log->live, log->live + 1, --log->n_live * sizeof(log->live[0]));
+    free(ptr);
+}
+
+
+static const struct lsqpack_dec_alloc_if log_alloc_if =
+{
+    .dai_alloc      = log_alloc,
+    .dai_realloc    = log_realloc,
+    .dai_free       = log_free,
+};
+
+
+static void
+test_dec_alloc_if (void)
+{
+    struct lsqpack_dec dec;
+    struct alloc_log log;
+    unsigned n;
+    int s;
+    /* Insert With Literal Name `foo: ' */
+    static const unsigned char ins_short[] = "\x43" "foo" "\x00";
+    /* Insert With Literal Name `foo: barbarbarbar' */
+    static const unsigned char ins_long[] = "\x43" "foo" "\x0c" "barbarbarbar";
+
+    memset(&log, 0, sizeof(log));
+    lsqpack_dec_init(&dec, NULL, 0x100, 0, &capture_hset_if,
+                                                LSQPACK_DEC_OPT_RING_ARENA);
+    lsqpack_dec_set_alloc_if(&dec, &log_alloc_if, &log);
+    assert(!dec.qpd_arena.ra_buf);
+
+    for (n = 0; n < 100; ++n)
+    {
+        if (n & 1)
+            s = lsqpack_dec_enc_in(&dec, ins_long, sizeof(ins_long) - 1);
+        else
+            s = lsqpack_dec_enc_in(&dec, ins_short, sizeof(ins_short) - 1);
+        assert(s == 0);
+        assert(log.n_live * 32 <= 0x100);
+    }
+
+    assert(log.n_allocs == 100);
+    /* The entry is resized once the value length is known */
+    assert(log.n_reallocs == 50);
+    lsqpack_dec_cleanup(&dec);
+    assert(log.n_live == 0);
+}
+
+
+/* A header list is decoded into a single buffer without calling
+ * dhi_prepare_decode() and dhi_process_header(), also after having been
+ * blocked.  The buffer grows as needed and is reused.
+ */
+static void
+test_dec_hlist (enum lsqpack_dec_opts opts)
+{
+    struct lsqpack_enc enc;
+    struct lsqpack_dec dec;
+    struct lsqpack_dec_hlist hlist;
+    struct capture_hset hblock;
+    struct lsxpack_header xhdrs[4];
+    enum lsqpack_read_header_status rhs;
+    const struct lsxpack_header *xhdr;
+    const unsigned char *buf;
+    unsigned char enc_buf[0x2000], hea_buf[0x2000], dec_buf[0x20];
+    unsigned char sdtc_buf[LSQPACK_LONGEST_SDTC];
+    char long_value[0x1000], *p;
+    const char *hlist_buf;
+    size_t enc_sz, hea_sz, dec_buf_sz, sdtc_buf_sz, len;
+    const int http1x = (opts & LSQPACK_DEC_OPT_HTTP1X) != 0;
+    unsigned n, i;
+    int s;
+
+    memset(long_value, 'v', sizeof(long_value));
+    lsxpack_header_set_ptr(&xhdrs[0], ":method", 7, "GET", 3);
+    lsxpack_header_set_ptr(&xhdrs[1], ":path", 5, "/hlist", 6);
+    lsxpack_header_set_ptr(&xhdrs[2], "x-long", 6, long_value,
+                                                        sizeof(long_value));
+    lsxpack_header_set_ptr(&xhdrs[3], "x-id", 4, "abc", 3);
+
+    sdtc_buf_sz = sizeof(sdtc_buf);
+    s = lsqpack_enc_init(&enc, NULL, 0x2000, 0x2000, 1, 0, sdtc_buf,
+                                                                &sdtc_buf_sz);
+    assert(s == 0);
+    lsqpack_dec_init(&dec, NULL, 0x2000, 1, &capture_hset_if, opts);
+    s = lsqpack_dec_enc_in(&dec, sdtc_buf, sdtc_buf_sz);
+    assert(s == 0);
+    memset(&hlist, 0, sizeof(hlist));
+    s = lsqpack_dec_hlist_reserve(&hlist, 0x10, 2);
+    assert(s == 0);
+
+    for (n = 0; n < 4; ++n)
+    {
+        enc_sz = sizeof(enc_buf);
+        hea_sz = sizeof(hea_buf);
+        s = lsqpack_enc_encode_list(&enc, n * 4, 0, enc_buf, &enc_sz,
+                                hea_buf, &hea_sz, xhdrs, 4, 0, NULL);
+        assert(s == 0);
+        memset(&hblock, 0, sizeof(hblock));
+        buf = hea_buf;
+        dec_buf_sz = sizeof(dec_buf);
+        rhs = lsqpack_dec_header_in_hlist(&dec, &hblock, n * 4, hea_sz, &buf,
+                                hea_sz, dec_buf, &dec_buf_sz, &hlist);
+        if (enc_sz)
+        {
+            /* Header block referencing new entries gets blocked */
+            assert(rhs == LQRHS_BLOCKED);
+            s = lsqpack_dec_enc_in(&dec, enc_buf, enc_sz);
+            assert(s == 0);
+            assert(hblock.n_unblocked == 1);
+            dec_buf_sz = sizeof(dec_buf);
+            rhs = lsqpack_dec_header_read(&dec, &hblock, &buf,
+                        hea_sz - (buf - hea_buf), dec_buf, &dec_buf_sz);
+        }
+        assert(rhs == LQRHS_DONE);
+        assert(buf == hea_buf + hea_sz);
+        assert(hblock.n_headers == 0);
+        if (dec_buf_sz)
+        {
+            s = lsqpack_enc_decoder_in(&enc, dec_buf, dec_buf_sz);
+            assert(s == 0);
+        }
+
+        assert(hlist.dhl_n_xhdrs == 4);
+        assert(hlist.dhl_buf_size >= sizeof(long_value));
+        if (n > 0)
+            assert(hlist.dhl_buf == hlist_buf);
+        hlist_buf = hlist.dhl_buf;
+        p = hlist.dhl_buf;
+        for (i = 0; i < 4; ++i)
+        {
+            xhdr = &hlist.dhl_xhdrs[i];
+            assert(xhdr->buf == p);
+            assert(xhdr->name_len == xhdrs[i].name_len);
+            assert(0 == memcmp(lsxpack_header_get_name(xhdr),
+                    lsxpack_header_get_name(&xhdrs[i]), xhdrs[i].name_len));
+            assert(xhdr->val_len == xhdrs[i].val_len);
+            assert(0 == memcmp(lsxpack_header_get_value(xhdr),
+                    lsxpack_header_get_value(&xhdrs[i]), xhdrs[i].val_len));
+            len = xhdr->name_len + xhdr->val_len;
+            if (http1x)
+            {
+                assert(0 == memcmp(p + xhdr->name_len, ": ", 2));
+                assert(0 == memcmp(p + xhdr->name_len + 2 + xhdr->val_len,
+                                                                "\r\n", 2));
+                len += 4;
+            }
+            p += len;
+        }
+        assert(p == hlist.dhl_buf + hlist.dhl_buf_len);
+    }
+
+    lsqpack_dec_hlist_cleanup(&hlist);
+    assert(!hlist.dhl_buf && !hlist.dhl_xhdrs);
+    lsqpack_dec_cleanup(&dec);
+    lsqpack_enc_cleanup(&enc);
+}
+
+
+/* Header blocks that arrive whole are decoded by a separate straight-line
+ * parser.  Its output must be the same as that of the resumable parser,
+ * which is used when header blocks are fed to the decoder byte by byte.
+ */
+static void
+test_dec_whole_block (enum lsqpack_dec_opts opts)
+{
+    struct lsqpack_dec dec_whole, dec_split;
+    struct lsqpack_dec_hlist hl_whole, hl_split;
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs_whole, rhs_split;
+    const unsigned char *buf;
+    unsigned n, i;
+    int s;
+    /* Insert `foo: bar' and `x-a: aaaa' */
+    static const unsigned char ins[] =
+        "\x43" "foo" "\x03" "bar" "\x43" "x-a" "\x04" "aaaa";
+    static const struct {
+        const char     *block;
+        size_t          size;
+        unsigned        n_xhdrs;    /* 0 means error */
+    } blocks[] = {
+#define B(s_) s_, sizeof(s_) - 1
+        /* Static references, literal with static name reference, literal
+         * with literal name
+         */
+        { B("\x00\x00\xd1\xc1\x5f\x0e\x03" "abc" "\x23" "x-b" "\x02" "bb"),
+                                                                        4, },
+        /* Huffman-encoded value and name */
+        { B("\x00\x00\x50\x8c\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90\xf4"
+            "\xff\x2f\x01\x25\xa8\x49\xe9\x5b\xa9\x7d\x7f\x89\x25\xa8\x49"
+            "\xe9\x5b\xb8\xe8\xb4\xbf"),                                2, },
+        /* Dynamic references relative to Base */
+        { B("\x03\x00\x80\x41\x02" "zz"),                               2, },
+        /* Post-Base references */
+        { B("\x03\x81\x10\x11\x00\x02" "yy" "\x00\x00"),                4, },
+        /* Value is cut short */
+        { B("\x00\x00\x23" "x-b" "\x05" "bb"),                          0, },
+        /* No value */
+        { B("\x00\x00\x23" "x-b"),                                      0, },
+        /* Required Insert Count is not used */
+        { B("\x03\x00\xd1"),                                            0, },
+        /* Reference to entry that does not exist */
+        { B("\x03\x00\x82"),                                            0, },
+        /* Empty field section */
+        { B("\x00\x00"),                                                0, },
+        { B("\x03\x00"),                                                0, },
+        /* Base is missing */
+        { B("\x00"),                                                    0, },
+#undef B
+    };
+
+    lsqpack_dec_init(&dec_whole, NULL, 0x1000, 0, &capture_hset_if, opts);
+    lsqpack_dec_init(&dec_split, NULL, 0x1000, 0, &capture_hset_if, opts);
+    s = lsqpack_dec_enc_in(&dec_whole, ins, sizeof(ins) - 1);
+    assert(s == 0);
+    s = lsqpack_dec_enc_in(&dec_split, ins, sizeof(ins) - 1);
+    assert(s == 0);
+    memset(&hl_whole, 0, sizeof(hl_whole));
+    memset(&hl_split, 0, sizeof(hl_split));
+
+    for (n = 0; n < sizeof(blocks) / sizeof(blocks[0]); ++n)
+    {
+        memset(&hblock, 0, sizeof(hblock));
+        buf = (const unsigned char *) blocks[n].block;
+        rhs_whole = lsqpack_dec_header_in_hlist(&dec_whole, &hblock, n * 4,
+                        blocks[n].size, &buf, blocks[n].size, NULL, NULL,
+                        &hl_whole);
+
+        buf = (const unsigned char *) blocks[n].block;
+        rhs_split = lsqpack_dec_header_in_hlist(&dec_split, &hblock, n * 4,
+                        blocks[n].size, &buf, 1, NULL, NULL, &hl_split);
+        while (rhs_split == LQRHS_NEED)
+            rhs_split = lsqpack_dec_header_read(&dec_split, &hblock, &buf, 1,
+                                                                NULL, NULL);
+
+        assert(rhs_whole == rhs_split);
+        if (blocks[n].n_xhdrs == 0)
+        {
+            assert(rhs_whole == LQRHS_ERROR);
+            continue;
+        }
+        assert(rhs_whole == LQRHS_DONE);
+        assert(hl_whole.dhl_n_xhdrs == blocks[n].n_xhdrs);
+        assert(hl_split.dhl_n_xhdrs == blocks[n].n_xhdrs);
+        assert(hl_whole.dhl_buf_len == hl_split.dhl_buf_len);
+        assert(0 == memcmp(hl_whole.dhl_buf, hl_split.dhl_buf,
+                                                    hl_whole.dhl_buf_len));
+        for (i = 0; i < blocks[n].n_xhdrs; ++i)
+        {
+            assert(hl_whole.dhl_xhdrs[i].name_len
+                                        == hl_split.dhl_xhdrs[i].name_len);
+            assert(hl_whole.dhl_xhdrs[i].val_len
+                                        == hl_split.dhl_xhdrs[i].val_len);
+            assert(hl_whole.dhl_xhdrs[i].flags
+                                        == hl_split.dhl_xhdrs[i].flags);
+            if (hl_whole.dhl_xhdrs[i].flags & LSXPACK_QPACK_IDX)
+                assert(hl_whole.dhl_xhdrs[i].qpack_index
+                                        == hl_split.dhl_xhdrs[i].qpack_index);
+            if (hl_whole.dhl_xhdrs[i].flags & LSXPACK_NAMEVAL_HASH)
+                assert(hl_whole.dhl_xhdrs[i].nameval_hash
+                                        == hl_split.dhl_xhdrs[i].nameval_hash);
+        }
+    }
+
+    lsqpack_dec_hlist_cleanup(&hl_whole);
+    lsqpack_dec_hlist_cleanup(&hl_split);
+    lsqpack_dec_cleanup(&dec_whole);
+    lsqpack_dec_cleanup(&dec_split);
+}
+
+
+static void
+state_drain_queue (struct lsqpack_enc *enc, struct queue_sink *sink)
+{
+    while (lsqpack_enc_pending(enc) > 0)
+        (void) lsqpack_enc_writev(enc, queue_sink_writev, sink);
+}
+
+
+/* Write Header Acknowledgement instruction, return its size */
+static size_t
+state_write_ack (unsigned char *buf, uint64_t stream_id)
+{
+    size_t n;
+
+    if (stream_id < 0x7F)
+    {
+        buf[0] = 0x80 | (unsigned char) stream_id;
+        return 1;
+    }
+    n = 0;
+    buf[n++] = 0xFF;
+    stream_id -= 0x7F;
+    while (stream_id >= 0x80)
+    {
+        buf[n++] = 0x80 | (unsigned char) (stream_id & 0x7F);
+        stream_id >>= 7;
+    }
+    buf[n++] = (unsigned char) stream_id;
+    return n;
+}
+
+
+/* Save encoder state midway, restore it into a new encoder, and check that
+ * both encoders produce the same output from then on.  Header blocks are
+ * acknowledged with a lag, so that some are outstanding and some are at
+ * risk when the state is saved; the save also happens in the middle of a
+ * Header Acknowledgement instruction.
+ */
+static void
+test_enc_state (enum lsqpack_enc_opts opts)
+{
+    struct lsqpack_enc encs[2], enc;
+    struct queue_sink *sinks;
+    unsigned char enc_buf[2][0x400], hea_buf[2][0x400], ack[0x10], tsu[0x10];
+    unsigned char *state;
+    char names[2][0x10], values[2][0x10];
+    struct lsxpack_header xhdrs[3];
+    size_t enc_sz[2], hea_sz[2], tsu_sz, state_sz, ack_sz;
+    ssize_t nw;
+    unsigned n, i, j, partial;
+    int s, reffed[160];   /* Indexed by header block */
+
+    sinks = calloc(2, sizeof(sinks[0]));
+    assert(sinks);
+    for (i = 0; i < 2; ++i)
+    {
+        tsu_sz = sizeof(tsu);
+        s = lsqpack_enc_init(&encs[i], NULL, 0x200, 0x200, 4, opts, tsu,
+                                                                    &tsu_sz);
+        assert(s == 0);
+    }
+
+    partial = ~0u;
+    for (n = 0; n < 160; ++n)
+    {
+        if (n == 80)
+        {
+            /* The latest header block that can be acknowledged is
+             * acknowledged halfway through the instruction.
+             */
+            for (partial = 79; !reffed[partial]; --partial)
+                assert(partial > 74);
+            ack_sz = state_write_ack(ack, partial / 2 * 4);
+            assert(ack_sz > 1);
+            s = lsqpack_enc_decoder_in(&encs[0], ack, 1);
+            assert(s == 0);
+
+            s = lsqpack_enc_start_header(&encs[0], 1000, 0);
+            assert(s == 0);
+            nw = lsqpack_enc_save_state(&encs[0], NULL, 0);
+            assert(nw < 0 && errno == EBUSY);
+            s = lsqpack_enc_cancel_header(&encs[0]);
+            assert(s == 0);
+
+            state_sz = lsqpack_enc_state_size(&encs[0]);
+            state = malloc(state_sz);
+            assert(state);
+            nw = lsqpack_enc_save_state(&encs[0], state, state_sz - 1);
+            assert(nw < 0 && errno == ENOBUFS);
+            nw = lsqpack_enc_save_state(&encs[0], state, state_sz);
+            assert(nw == (ssize_t) state_sz);
+
+            /* The encoder must be new and match the saved one */
+            s = lsqpack_enc_restore_state(&encs[0], state, state_sz);
+            assert(s < 0 && errno == EINVAL);
+            tsu_sz = sizeof(tsu);
+            s = lsqpack_enc_init(&enc, NULL, 0x400, 0x200, 4, opts, tsu,
+                                                                    &tsu_sz);
+            assert(s == 0);
+            s = lsqpack_enc_restore_state(&enc, state, state_sz);
+            assert(s < 0 && errno == EINVAL);
+            lsqpack_enc_cleanup(&enc);
+            tsu_sz = sizeof(tsu);
+            s = lsqpack_enc_init(&enc, NULL, 0x200, 0x200, 4, opts, tsu,
+                                                                    &tsu_sz);
+            assert(s == 0);
+            s = lsqpack_enc_restore_state(&enc, state, state_sz - 1);
+            assert(s < 0 && errno == EINVAL);
+            lsqpack_enc_cleanup(&enc);
+
+            s = lsqpack_enc_restore_state(&encs[1], state, state_sz);
+            assert(s == 0);
+            free(state);
+            assert(encs[1].qpe_nelem == encs[0].qpe_nelem);
+            assert(encs[1].qpe_cur_bytes_used == encs[0].qpe_cur_bytes_used);
+            assert(encs[1].qpe_hinfo_nelem == encs[0].qpe_hinfo_nelem);
+            assert(encs[1].qpe_cur_streams_at_risk > 0);
+            assert(encs[1].qpe_cur_streams_at_risk
+                                        == encs[0].qpe_cur_streams_at_risk);
+            assert(lsqpack_enc_pending(&encs[1])
+                                        == lsqpack_enc_pending(&encs[0]));
+
+            for (i = 0; i < 2; ++i)
+            {
+                s = lsqpack_enc_decoder_in(&encs[i], ack + 1, ack_sz - 1);
+                assert(s == 0);
+            }
+        }
+
+        /* The second field changes every other header list, so that new
+         * entries keep being inserted and the old ones evicted.
+         */
+        snprintf(names[0], sizeof(names[0]), "x-%u", n % 4);
+        snprintf(values[0], sizeof(values[0]), "v-%u", n % 3);
+        snprintf(names[1], sizeof(names[1]), "y-%u", n / 2 % 29);
+        snprintf(values[1], sizeof(values[1]), "w-%u", n / 2);
+        for (j = 0; j < 2; ++j)
+            lsxpack_header_set_ptr(&xhdrs[j], names[j], strlen(names[j]),
+                                            values[j], strlen(values[j]));
+        lsxpack_header_set_ptr(&xhdrs[2], ":method", 7, "GET", 3);
+
+        for (i = 0; i < (n < 80 ? 1 : 2); ++i)
+        {
+            enc_sz[i] = sizeof(enc_buf[i]);
+            hea_sz[i] = sizeof(hea_buf[i]);
+            /* Two header blocks per stream */
+            s = lsqpack_enc_encode_list(&encs[i], n / 2 * 4, n % 2,
+                        enc_buf[i], &enc_sz[i], hea_buf[i], &hea_sz[i],
+                        xhdrs, 3, 0, NULL);
+            assert(s == 0);
+            /* Only header blocks that reference the dynamic table -- those
+             * with non-zero Required Insert Count -- can be acknowledged.
+             */
+            reffed[n] = hea_buf[i][0] != 0;
+            if (n >= 6 && reffed[n - 6] && n - 6 != partial)
+            {
+                ack_sz = state_write_ack(ack, (n - 6) / 2 * 4);
+                s = lsqpack_enc_decoder_in(&encs[i], ack, ack_sz);
+                assert(s == 0);
+            }
+            if (n >= 80 && (opts & LSQPACK_ENC_OPT_ENC_QUEUE))
+                state_drain_queue(&encs[i], &sinks[i]);
+        }
+        if (n >= 80)
+        {
+            assert(enc_sz[0] == enc_sz[1]);
+            assert(0 == memcmp(enc_buf[0], enc_buf[1], enc_sz[0]));
+            assert(hea_sz[0] == hea_sz[1]);
+            assert(0 == memcmp(hea_buf[0], hea_buf[1], hea_sz[0]));
+        }
+    }
+
+    assert(encs[0].qpe_max_acked_id == encs[1].qpe_max_acked_id);
+    assert(encs[0].qpe_dropped > 0);
+    assert(lsqpack_enc_ratio(&encs[0]) == lsqpack_enc_ratio(&encs[1]));
+    assert(sinks[0].len == sinks[1].len);
+    assert(0 == memcmp(sinks[0].buf, sinks[1].buf, sinks[0].len));
+    assert(!(opts & LSQPACK_ENC_OPT_ENC_QUEUE) || sinks[0].len > 0);
+
+    lsqpack_enc_cleanup(&encs[0]);
+    lsqpack_enc_cleanup(&encs[1]);
+    free(sinks);
+}
+
+
+struct state_hblocks
+{
+    struct capture_hset      *hblocks;
+    struct lsqpack_dec_hlist   *hlist;
+    unsigned                    n_calls;
+};
+
+
+static void *
+state_get_hblock (void *ctx, uint64_t stream_id,
+                                        struct lsqpack_dec_hlist **hlist)
+{
+    struct state_hblocks *const sh = ctx;
+
+    ++sh->n_calls;
+    assert(stream_id == 0 || stream_id == 4);
+    assert((stream_id == 4) == (hlist != NULL));
+    if (hlist)
+        *hlist = sh->hlist;
+    return &sh->hblocks[stream_id / 4];
+}
+
+
+/* Block two header blocks -- one of them decoded into a header list -- and
+ * save decoder state.  Once restored, the new decoder unblocks them and
+ * decodes them the same way as the old one.
+ */
+static void
+test_dec_state (enum lsqpack_dec_opts opts)
+{
+    struct lsqpack_dec decs[2], dec;
+    struct capture_hset hblocks[2][2], nonblocked;
+    struct lsqpack_dec_hlist hlists[2];
+    struct state_hblocks sh;
+    enum lsqpack_read_header_status rhs;
+    const unsigned char *buf;
+    unsigned char *state, dec_buf[2][0x10];
+    size_t state_sz, dec_buf_sz[2];
+    ssize_t nw;
+    unsigned i, j;
+    int s;
+    /* Insert `foo: bar' and `x-a: aaaa' */
+    static const unsigned char ins[] =
+        "\x43" "foo" "\x03" "bar" "\x43" "x-a" "\x04" "aaaa";
+    /* Insert `baz: qux' */
+    static const unsigned char ins3[] = "\x43" "baz" "\x03" "qux";
+    /* Required Insert Count 3: references to the third entry, and to the
+     * second and the third entries.
+     */
+    static const unsigned char blocks[2][4] = {
+        "\x04\x00\x80", "\x04\x00\x81\x80",
+    };
+    static const size_t block_sizes[2] = { 3, 4, };
+    static const unsigned char nonblocking[] = "\x00\x00\xd1";
+
+    memset(hblocks, 0, sizeof(hblocks));
+    memset(hlists, 0, sizeof(hlists));
+    lsqpack_dec_init(&decs[0], NULL, 0x1000, 4, &capture_hset_if, opts);
+    lsqpack_dec_init(&decs[1], NULL, 0x1000, 4, &capture_hset_if, opts);
+    s = lsqpack_dec_enc_in(&decs[0], ins, sizeof(ins) - 1);
+    assert(s == 0);
+
+    for (j = 0; j < 2; ++j)
+    {
+        hblocks[0][j].buf = blocks[j];
+        if (j == 0)
+            rhs = lsqpack_dec_header_in(&decs[0], &hblocks[0][j], j * 4,
+                    block_sizes[j], &hblocks[0][j].buf, block_sizes[j],
+                    NULL, NULL);
+        else
+            rhs = lsqpack_dec_header_in_hlist(&decs[0], &hblocks[0][j],
+                    j * 4, block_sizes[j], &hblocks[0][j].buf,
+                    block_sizes[j], NULL, NULL, &hlists[0]);
+        assert(rhs == LQRHS_BLOCKED);
+    }
+
+    /* Header block that is being read cannot be saved */
+    memset(&nonblocked, 0, sizeof(nonblocked));
+    buf = nonblocking;
+    rhs = lsqpack_dec_header_in(&decs[0], &nonblocked, 8,
+                        sizeof(nonblocking) - 1, &buf, 1, NULL, NULL);
+    assert(rhs == LQRHS_NEED);
+    nw = lsqpack_dec_save_state(&decs[0], NULL, 0);
+    assert(nw < 0 && errno == EBUSY);
+    s = lsqpack_dec_unref_stream(&decs[0], &nonblocked);
+    assert(s == 0);
+
+    state_sz = lsqpack_dec_state_size(&decs[0]);
+    state = malloc(state_sz);
+    assert(state);
+    nw = lsqpack_dec_save_state(&decs[0], state, state_sz - 1);
+    assert(nw < 0 && errno == ENOBUFS);
+    nw = lsqpack_dec_save_state(&decs[0], state, state_sz);
+    assert(nw == (ssize_t) state_sz);
+
+    sh.hblocks = hblocks[1];
+    sh.hlist = &hlists[1];
+    sh.n_calls = 0;
+    lsqpack_dec_init(&dec, NULL, 0x800, 4, &capture_hset_if, opts);
+    s = lsqpack_dec_restore_state(&dec, state, state_sz, state_get_hblock,
+                                                                        &sh);
+    assert(s < 0 && errno == EINVAL);
+    lsqpack_dec_cleanup(&dec);
+    lsqpack_dec_init(&dec, NULL, 0x1000, 4, &capture_hset_if, opts);
+    s = lsqpack_dec_restore_state(&dec, state, state_sz - 1,
+                                                    state_get_hblock, &sh);
+    assert(s < 0 && errno == EINVAL);
+    lsqpack_dec_cleanup(&dec);
+    sh.n_calls = 0;
+
+    s = lsqpack_dec_restore_state(&decs[1], state, state_sz,
+                                                    state_get_hblock, &sh);
+    assert(s == 0);
+    assert(sh.n_calls == 2);
+    assert(decs[1].qpd_n_blocked == 2);
+    assert(decs[1].qpd_cur_capacity == decs[0].qpd_cur_capacity);
+    free(state);
+
+    /* The restored decoder takes it from here */
+    for (j = 0; j < 2; ++j)
+        hblocks[1][j].buf = hblocks[0][j].buf;
+    for (i = 0; i < 2; ++i)
+    {
+        s = lsqpack_dec_enc_in(&decs[i], ins3, sizeof(ins3) - 1);
+        assert(s == 0);
+        assert(decs[i].qpd_n_blocked == 0);
+        for (j = 0; j < 2; ++j)
+        {
+            assert(hblocks[i][j].n_unblocked == 1);
+            dec_buf_sz[j] = sizeof(dec_buf[j]);
+            rhs = lsqpack_dec_header_read(&decs[i], &hblocks[i][j],
+                    &hblocks[i][j].buf,
+                    blocks[j] + block_sizes[j] - hblocks[i][j].buf,
+                    dec_buf[j], &dec_buf_sz[j]);
+            assert(rhs == LQRHS_DONE);
+            assert(dec_buf_sz[j] > 0);
+        }
+        assert(hblocks[i][0].n_headers == 1);
+        assert(hblocks[i][0].xhdrs[0].name_len == 3);
+        assert(0 == memcmp(lsxpack_header_get_name(&hblocks[i][0].xhdrs[0]),
+                                                                "baz", 3));
+        assert(hlists[i].dhl_n_xhdrs == 2);
+        assert(hlists[i].dhl_xhdrs[0].name_len == 3);
+        assert(0 == memcmp(lsxpack_header_get_name(&hlists[i].dhl_xhdrs[0]),
+                                                                "x-a", 3));
+        assert(0 == memcmp(lsxpack_header_get_value(&hlists[i].dhl_xhdrs[1]),
+                                                                "qux", 3));
+    }
+    assert(hlists[0].dhl_buf_len == hlists[1].dhl_buf_len);
+    assert(0 == memcmp(hlists[0].dhl_buf, hlists[1].dhl_buf,
+                                                    hlists[0].dhl_buf_len));
+
+    /* Partially read encoder stream instruction cannot be saved */
+    s = lsqpack_dec_enc_in(&decs[1], ins3, 1);
+    assert(s == 0);
+    nw = lsqpack_dec_save_state(&decs[1], NULL, 0);
+    assert(nw < 0 && errno == EBUSY);
+
+    for (i = 0; i < 2; ++i)
+    {
+        lsqpack_dec_hlist_cleanup(&hlists[i]);
+        lsqpack_dec_cleanup(&decs[i]);
+    }
+}
+
+
+/* Decode header block that references registered names in every possible
+ * way and check that the application tokens are set.
+ */
+static void
+test_dec_names (enum lsqpack_dec_opts opts)
+{
+    struct lsqpack_dec_names names, full;
+    struct lsqpack_dec dec;
+    struct lsqpack_dec_hlist hlist;
+    struct capture_hset hblock;
+    enum lsqpack_read_header_status rhs;
+    const struct lsxpack_header *xhdr;
+    const unsigned char *buf;
+    static char many[LSQPACK_MAX_DEC_NAMES + 1][8];
+    unsigned i, round;
+    int s, split;
+    /* Insert `x-foo: 1', `content-type: text/x' (static name reference),
+     * and `x-other: z'.
+     */
+    static const unsigned char ins[] =
+        "\x45" "x-foo" "\x01" "1"
+        "\xed" "\x06" "text/x"
+        "\x47" "x-other" "\x01" "z";
+    static const unsigned char block[] =
+        "\x04\x00"
+        "\xf4"                          /* Static `content-type' */
+        "\xd1"                          /* Static `:method' */
+        "\x82"                          /* Dynamic `x-foo' */
+        "\x81"                          /* Dynamic `content-type' */
+        "\x80"                          /* Dynamic `x-other' */
+        "\x5f\x1e" "\x01" "a"           /* Static name `content-type' */
+        "\x42" "\x01" "b"               /* Dynamic name `x-foo' */
+        "\x25" "x-bar" "\x01" "c"       /* Literal name, registered */
+        "\x25" "x-baz" "\x01" "d"       /* Literal name, not registered */
+        ;
+    /* Only `x-other' is added in the last round */
+    static const int tokens[3][9] = {
+        {  7, -1,  9,  7, -1,  7,  9, 11, -1, },
+        { -1, -1, -1, -1, -1, -1, -1, -1, -1, },
+        {  7, -1,  9,  7, 13,  7,  9, 11, -1, },
+    };
+
+    lsqpack_dec_names_init(&names);
+    s = lsqpack_dec_names_add(&names, "content-type", 12, 7);
+    assert(s == 0);
+    s = lsqpack_dec_names_add(&names, "x-foo", 5, 9);
+    assert(s == 0);
+    s = lsqpack_dec_names_add(&names, "x-bar", 5, 11);
+    assert(s == 0);
+    s = lsqpack_dec_names_add(&names, "x-foo", 5, 12);
+    assert(s == -1 && errno == EEXIST);
+    s = lsqpack_dec_names_add(&names, "x-qux", 5, 256);
+    assert(s == -1 && errno == EINVAL);
+
+    lsqpack_dec_names_init(&full);
+    for (i = 0; i < LSQPACK_MAX_DEC_NAMES + 1; ++i)
+    {
+        snprintf(many[i], sizeof(many[i]), "x-%u", i);
+        s = lsqpack_dec_names_add(&full, many[i], strlen(many[i]), i & 0xFF);
+        assert(i < LSQPACK_MAX_DEC_NAMES ? s == 0
+                                        : s == -1 && errno == ENOSPC);
+    }
+    lsqpack_dec_names_cleanup(&full);
+
+    for (split = 0; split < 2; ++split)
+    {
+        lsqpack_dec_names_cleanup(&names);
+        s = lsqpack_dec_names_add(&names, "content-type", 12, 7);
+        assert(s == 0);
+        s = lsqpack_dec_names_add(&names, "x-foo", 5, 9);
+        assert(s == 0);
+        s = lsqpack_dec_names_add(&names, "x-bar", 5, 11);
+        assert(s == 0);
+        lsqpack_dec_init(&dec, NULL, 0x1000, 0, &capture_hset_if, opts);
+        lsqpack_dec_set_names(&dec, &names);
+        s = lsqpack_dec_enc_in(&dec, ins, sizeof(ins) - 1);
+        assert(s == 0);
+        memset(&hlist, 0, sizeof(hlist));
+
+        for (round = 0; round < 3; ++round)
+        {
+            if (round == 1)
+                lsqpack_dec_set_names(&dec, NULL);
+            else if (round == 2)
+            {
+                s = lsqpack_dec_names_add(&names, "x-other", 7, 13);
+                assert(s == 0);
+                lsqpack_dec_set_names(&dec, &names);
+            }
+            memset(&hblock, 0, sizeof(hblock));
+            buf = block;
+            rhs = lsqpack_dec_header_in_hlist(&dec, &hblock, round * 4,
+                        sizeof(block) - 1, &buf,
+                        split ? 1 : sizeof(block) - 1, NULL, NULL, &hlist);
+            while (rhs == LQRHS_NEED)
+                rhs = lsqpack_dec_header_read(&dec, &hblock, &buf, 1,
+                                                                NULL, NULL);
+            assert(rhs == LQRHS_DONE);
+            assert(hlist.dhl_n_xhdrs == 9);
+            for (i = 0; i < 9; ++i)
+            {
+                xhdr = &hlist.dhl_xhdrs[i];
+                if (tokens[round][i] >= 0)
+                {
+                    assert(xhdr->flags & LSXPACK_APP_IDX);
+                    assert(xhdr->app_index == tokens[round][i]);
+                }
+                else
+                    assert(!(xhdr->flags & LSXPACK_APP_IDX));
+            }
+        }
+
+        lsqpack_dec_hlist_cleanup(&hlist);
+        lsqpack_dec_cleanup(&dec);
+    }
+
+    lsqpack_dec_names_cleanup(&names);
+}
+
+
+/* Write Insert Count Increment or Stream Cancellation instruction, both of
+ * which use 6-bit prefix.  Return its size.
+ */
+static size_t
+risked_write_instr (unsigned char *buf, unsigned char type, uint64_t value)
+{
+    size_t n;
+
+    if (value < 0x3F)
+    {
+        buf[0] = type | (unsigned char) value;
+        return 1;
+    }
+    n = 0;
+    buf[n++] = type | 0x3F;
+    value -= 0x3F;
+    while (value >= 0x80)
+    {
+        buf[n++] = 0x80 | (unsigned char) (value & 0x7F);
+        value >>= 7;
+    }
+    buf[n++] = (unsigned char) value;
+    return n;
+}
+
+
+struct risked_block
+{
+    unsigned    stream;
+    unsigned    max_id;
+    int         alive;
+};
+
+
+static unsigned
+risked_count_streams (const struct risked_block *blocks, unsigned n_blocks,
+                                                        unsigned max_acked)
+{
+    unsigned char at_risk[16];
+    unsigned n, count;
+
+    memset(at_risk, 0, sizeof(at_risk));
+    for (n = 0; n < n_blocks; ++n)
+        if (blocks[n].alive && blocks[n].max_id > max_acked)
+            at_risk[ blocks[n].stream ] = 1;
+    count = 0;
+    for (n = 0; n < sizeof(at_risk); ++n)
+        count += at_risk[n];
+    return count;
+}
+
+
+/* Header blocks on the risked list are not in the order in which they
+ * were encoded: a header block may reference only older entries.  Several
+ * header blocks on the same stream can be at risk at once.  Acknowledge
+ * and cancel them in random order and check that the number of streams at
+ * risk matches what it should be.  Halfway through, the encoder state is
+ * saved and restored into another encoder, which must then behave the same.
+ */
+static void
+test_enc_risked_order (void)
+{
+    struct lsqpack_enc encs[2];
+    struct risked_block *blocks;
+    struct lsxpack_header xhdrs[3];
+    enum lsqpack_enc_header_flags hflags[2];
+    unsigned char enc_buf[2][0x400], hea_buf[2][0x400], dec_buf[0x10];
+    unsigned char tsu[0x10], *state;
+    char names[3][0x10], values[3][0x10];
+    size_t enc_sz[2], hea_sz[2], dec_sz, tsu_sz, state_sz;
+    unsigned seqnos[16], n, i, j, n_blocks, n_encs, stream, max_acked;
+    unsigned max_id, ins_count, total_at_risk;
+    ssize_t nw;
+    int s;
+    /* Decoder capacity 0x1000: 128 entries */
+    const unsigned full_range = 2 * (0x1000 / 32);
+
+    blocks = calloc(2000, sizeof(blocks[0]));
+    assert(blocks);
+    tsu_sz = sizeof(tsu);
+    s = lsqpack_enc_init(&encs[0], NULL, 0x1000, 0x1000, 4,
+                                LSQPACK_ENC_OPT_IX_AGGR, tsu, &tsu_sz);
+    assert(s == 0);
+    memset(seqnos, 0, sizeof(seqnos));
+    srand(30);
+    n_blocks = 0;
+    n_encs = 1;
+    max_acked = 0;
+    total_at_risk = 0;
+
+    for (n = 0; n < 2000; ++n)
+    {
+        if (n == 1000)
+        {
+            state_sz = lsqpack_enc_state_size(&encs[0]);
+            state = malloc(state_sz);
+            assert(state);
+            nw = lsqpack_enc_save_state(&encs[0], state, state_sz);
+            assert(nw == (ssize_t) state_sz);
+            tsu_sz = sizeof(tsu);
+            s = lsqpack_enc_init(&encs[1], NULL, 0x1000, 0x1000, 4,
+                                LSQPACK_ENC_OPT_IX_AGGR, tsu, &tsu_sz);
+            assert(s == 0);
+            s = lsqpack_enc_restore_state(&encs[1], state, state_sz);
+            assert(s == 0);
+            free(state);
+            n_encs = 2;
+        }
+
+        dec_sz = 0;
+        switch (rand() % 9)
+        {
+        default:
+            stream = rand() % 6;
+            for (j = 0; j < 3; ++j)
+            {
+                snprintf(names[j], sizeof(names[j]), "x-%u", rand() % 8);
+                snprintf(values[j], sizeof(values[j]), "v-%u", rand() % 40);
+                lsxpack_header_set_ptr(&xhdrs[j], names[j], strlen(names[j]),
+                                            values[j], strlen(values[j]));
+            }
+            for (i = 0; i < n_encs; ++i)
+            {
+                enc_sz[i] = sizeof(enc_buf[i]);
+                hea_sz[i] = sizeof(hea_buf[i]);
+                s = lsqpack_enc_encode_list(&encs[i], stream * 4,
+                        seqnos[stream], enc_buf[i], &enc_sz[i], hea_buf[i],
+                        &hea_sz[i], xhdrs, 3, 0, &hflags[i]);
+                assert(s == 0);
+            }
+            if (n_encs == 2)
+            {
+                assert(enc_sz[0] == enc_sz[1]);
+                assert(0 == memcmp(enc_buf[0], enc_buf[1], enc_sz[0]));
+                assert(hea_sz[0] == hea_sz[1]);
+                assert(0 == memcmp(hea_buf[0], hea_buf[1], hea_sz[0]));
+                assert(hflags[0] == hflags[1]);
+            }
+            ++seqnos[stream];
+            if (hea_buf[0][0] == 0)
+                break;  /* Dynamic table is not referenced */
+            /* Required Insert Count is encoded modulo the full range */
+            max_id = hea_buf[0][0];
+            if (max_id == 0xFF)
+            {
+                assert(hea_buf[0][1] < 0x80);
+                max_id += hea_buf[0][1];
+            }
+            ins_count = encs[0].qpe_ins_count;
+            max_id = ins_count - (ins_count - (max_id - 1)) % full_range;
+            assert(max_id > 0);
+            assert(!(hflags[0] & LSQECH_REF_AT_RISK) == (max_id <= max_acked));
+            if (max_id > max_acked)
+                ++total_at_risk;
+            blocks[n_blocks].stream = stream;
+            blocks[n_blocks].max_id = max_id;
+            blocks[n_blocks].alive = 1;
+            ++n_blocks;
+            break;
+        case 0:
+            /* Header Ack for the oldest unacknowledged block on a stream */
+            if (n_blocks == 0)
+                break;
+            j = rand() % n_blocks;
+            for (i = 0; i < n_blocks && !blocks[j].alive; ++i)
+                j = (j + 1) % n_blocks;
+            if (!blocks[j].alive)
+                break;
+            stream = blocks[j].stream;
+            for (j = 0; !(blocks[j].alive && blocks[j].stream == stream); ++j)
+                ;
+            blocks[j].alive = 0;
+            if (blocks[j].max_id > max_acked)
+                max_acked = blocks[j].max_id;
+            dec_sz = state_write_ack(dec_buf, stream * 4);
+            break;
+        case 1:
+            if (rand() % 2 == 0)
+            {
+                stream = rand() % 6;
+                for (j = 0; j < n_blocks; ++j)
+                    if (blocks[j].stream == stream)
+                        blocks[j].alive = 0;
+                dec_sz = risked_write_instr(dec_buf, 0x40, stream * 4);
+            }
+            else
+            {
+                ins_count = encs[0].qpe_ins_count;
+                if (ins_count <= encs[0].qpe_last_ici
+                                                || ins_count <= max_acked)
+                    break;
+                i = 1 + rand() % (ins_count - encs[0].qpe_last_ici);
+                if (encs[0].qpe_last_ici + i > max_acked)
+                    max_acked = encs[0].qpe_last_ici + i;
+                dec_sz = risked_write_instr(dec_buf, 0x00, i);
+            }
+            break;
+        }
+
+        for (i = 0; i < n_encs && dec_sz > 0; ++i)
+        {
+            s = lsqpack_enc_decoder_in(&encs[i], dec_buf, dec_sz);
+            assert(s == 0);
+        }
+
+        for (i = 0; i < n_encs; ++i)
+        {
+            assert(encs[i].qpe_max_acked_id == max_acked);
+            assert(encs[i].qpe_cur_streams_at_risk
+                    == risked_count_streams(blocks, n_blocks, max_acked));
+        }
+    }
+
+    /* Make sure that the interesting cases have been exercised */
+    assert(total_at_risk > 100);
+    assert(n_blocks > 500);
+
+    lsqpack_enc_cleanup(&encs[0]);
+    lsqpack_enc_cleanup(&encs[1]);
+    free(blocks);
+}
+
+
 int
 main (void)
 {
@@ -1088,6 +4520,47 @@ main (void)
     test_dec_header_too_short(0);
     test_dec_header_too_short(1);
     test_enc_risked_streams();
+    test_enc_many_outstanding_hblocks();
+    test_enc_ring_arena();
+    test_enc_encode_list();
+    test_dec_many_blocked_streams();
+    test_dec_ring_arena();
+    test_dec_alloc_if();
+    test_dec_zero_copy(0);
+    test_dec_zero_copy(1);
+    test_dec_zero_copy_release_early();
+    test_dec_zero_copy_reused_xhdr();
+    test_stats();
+    test_dec_huff_longer();
+    test_enc_dict();
+    test_enc_names();
+    test_static_lookup();
+    test_dec_lazy_values();
+    test_dec_lazy_reencode();
+    test_dec_reuse_read_ctx();
+    test_enc_cost_model();
+    test_enc_queue();
+    test_enc_hblock_cache();
+    test_enc_stateless();
+    test_cookie_crumbs();
+    test_cookie_chain_hlist();
+    test_cookie_chain_limit();
+    test_dec_mem_limit(0);
+    test_dec_mem_limit(LSQPACK_DEC_OPT_RING_ARENA);
+    test_dec_hlist(0);
+    test_dec_hlist(LSQPACK_DEC_OPT_HTTP1X);
+    test_dec_hlist(LSQPACK_DEC_OPT_ZERO_COPY|LSQPACK_DEC_OPT_HASH_NAMEVAL);
+    test_dec_whole_block(0);
+    test_dec_whole_block(LSQPACK_DEC_OPT_HTTP1X|LSQPACK_DEC_OPT_HASH_NAMEVAL);
+    test_dec_whole_block(LSQPACK_DEC_OPT_LAZY_VALUES);
+    test_enc_state(0);
+    test_enc_state(LSQPACK_ENC_OPT_RING_ARENA|LSQPACK_ENC_OPT_COST_MODEL);
+    test_enc_state(LSQPACK_ENC_OPT_IX_AGGR|LSQPACK_ENC_OPT_ENC_QUEUE);
+    test_dec_state(0);
+    test_dec_state(LSQPACK_DEC_OPT_RING_ARENA|LSQPACK_DEC_OPT_HASH_NAMEVAL);
+    test_enc_risked_order();
+    test_dec_names(0);
+    test_dec_names(LSQPACK_DEC_OPT_HASH_NAME|LSQPACK_DEC_OPT_ZERO_COPY);
 
     return 0;
 }
@@ -16,7 +16,9 @@ struct lsqpack_dec_table_entry
     unsigned    dte_name_len;
     unsigned    dte_val_len;
     unsigned    dte_refcnt;
-    unsigned    dte_pad[4];     /* name hash, nameval hash, name idx, flags */
+    unsigned    dte_pad[6];     /* hashes, name idx, alloc size, app token,
+                                 * flags
+                                 */
     char        dte_buf[0];     /* Contains both name and value */
 };
 
@@ -218,7 +220,8 @@ verify_dyn_table (const struct lsqpack_dec *dec,
 
 
 static void
-run_test (const struct test_read_encoder_stream *test)
+run_test (const struct test_read_encoder_stream *test,
+                                                enum lsqpack_dec_opts opts)
 {
     struct lsqpack_dec dec;
     size_t chunk_sz, off;
@@ -227,7 +230,7 @@ run_test (const struct test_read_encoder_stream *test)
     for (chunk_sz = 1; chunk_sz <= test->input_sz; ++chunk_sz)
     {
         lsqpack_dec_init(&dec, NULL, 0x1000, 100, (void *) 1 /* hset */,
-                                                    LSQPACK_DEC_OPT_HTTP1X);
+                                                LSQPACK_DEC_OPT_HTTP1X|opts);
 
         off = 0;
         do
@@ -252,7 +255,10 @@ main (void)
     const struct test_read_encoder_stream *test;
 
     for (test = tests; test < tests + sizeof(tests) / sizeof(tests[0]); ++test)
-        run_test(test);
+    {
+        run_test(test, 0);
+        run_test(test, LSQPACK_DEC_OPT_RING_ARENA);
+    }
 
     return 0;
 }
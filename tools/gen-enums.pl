@@ -1,5 +1,11 @@
 #!/usr/bin/perl
 # Generate static table enums
+#
+# Usage: gen-enums.pl [xxh32|crc32c]
+#
+# Given hash function name, print static table name and name/value hashes
+# for that hash function instead.  Each hash function the library can be
+# built with (see LSQPACK_CRC32C in lsqpack.c) has its own pair of tables.
 
 use strict;
 use warnings;
@@ -107,6 +113,88 @@ my @table = (
 );
 
 
+my $SEED = 39378473;
+
+sub rotl32 {
+    my ($x, $r) = @_;
+    return (($x << $r) | ($x >> (32 - $r))) & 0xFFFFFFFF;
+}
+
+# Split multiplication so that intermediate product fits into 53 bits
+sub mul32 {
+    my ($a, $b) = @_;
+    return ($a * ($b & 0xFFFF)
+                + ((($a * ($b >> 16)) & 0xFFFF) << 16)) & 0xFFFFFFFF;
+}
+
+sub xxh32 {
+    my ($str, $seed) = @_;
+    my ($P1, $P2, $P3, $P4, $P5) = (2654435761, 2246822519, 3266489917,
+                                    668265263, 374761393);
+    my $len = length $str;
+    my ($off, $h) = (0);
+    if ($len >= 16) {
+        my @v = (($seed + $P1 + $P2) & 0xFFFFFFFF, ($seed + $P2) & 0xFFFFFFFF,
+                 $seed, ($seed - $P1) & 0xFFFFFFFF);
+        for ( ; $off + 16 <= $len; $off += 16) {
+            my @in = unpack("V4", substr($str, $off, 16));
+            $v[$_] = mul32(rotl32(($v[$_] + mul32($in[$_], $P2))
+                                            & 0xFFFFFFFF, 13), $P1) for 0 .. 3;
+        }
+        $h = (rotl32($v[0], 1) + rotl32($v[1], 7) + rotl32($v[2], 12)
+                                        + rotl32($v[3], 18)) & 0xFFFFFFFF;
+    }
+    else {
+        $h = ($seed + $P5) & 0xFFFFFFFF;
+    }
+    $h = ($h + $len) & 0xFFFFFFFF;
+    for ( ; $off + 4 <= $len; $off += 4) {
+        my $in = unpack("V", substr($str, $off, 4));
+        $h = mul32(rotl32(($h + mul32($in, $P3)) & 0xFFFFFFFF, 17), $P4);
+    }
+    for ( ; $off < $len; ++$off) {
+        my $in = ord(substr($str, $off, 1));
+        $h = mul32(rotl32(($h + mul32($in, $P5)) & 0xFFFFFFFF, 11), $P1);
+    }
+    $h = mul32($h ^ ($h >> 15), $P2);
+    $h = mul32($h ^ ($h >> 13), $P3);
+    return $h ^ ($h >> 16);
+}
+
+# No pre- or post-conditioning: seed is used as is, same as lsqpack.c
+sub crc32c {
+    my ($str, $crc) = @_;
+    for my $byte (unpack("C*", $str)) {
+        $crc ^= $byte;
+        $crc = ($crc >> 1) ^ ($crc & 1 ? 0x82F63B78 : 0) for 1 .. 8;
+    }
+    return $crc;
+}
+
+sub print_hashes {
+    my ($var, @hashes) = @_;
+    print "static const uint32_t ${var}[] =\n{\n";
+    while (my @line = splice(@hashes, 0, 5)) {
+        print "    ", join(", ", map sprintf("0x%08Xu", $_), @line), ",\n";
+    }
+    print "};\n";
+}
+
+if (@ARGV) {
+    my %funcs = (xxh32 => \&xxh32, crc32c => \&crc32c);
+    my $func = $funcs{$ARGV[0]} or die "unknown hash function `$ARGV[0]'";
+    my (@name_hashes, @nameval_hashes);
+    for (my $i = 0; $i < @table; $i += 2) {
+        push @name_hashes, $func->($table[$i], $SEED);
+        push @nameval_hashes, $func->($table[$i + 1], $name_hashes[-1]);
+    }
+    print "/* Generated by tools/gen-enums.pl $ARGV[0] */\n";
+    print_hashes("name_hashes", @name_hashes);
+    print "\n\n";
+    print_hashes("nameval_hashes", @nameval_hashes);
+    exit;
+}
+
 my $idx = 0;
 print "enum lsqpack_tnam {\n";
 while (my ($name, $value) = splice(@table, 0, 2)) {
@@ -0,0 +1,234 @@
+#!/usr/bin/perl
+# Generate perfect hash tables for the QPACK static table
+#
+# Names are hashed on their length and three of their bytes: the first,
+# the last, and one in between.  The name slot also holds a displacement
+# used to place the values of that name into the name/value table, where
+# values are hashed the same way.  The output replaces the tables in
+# lsqpack.c.
+
+use strict;
+use warnings;
+
+my @table = (
+    ":authority", "",
+    ":path", "/",
+    "age", "0",
+    "content-disposition", "",
+    "content-length", "0",
+    "cookie", "",
+    "date", "",
+    "etag", "",
+    "if-modified-since", "",
+    "if-none-match", "",
+    "last-modified", "",
+    "link", "",
+    "location", "",
+    "referer", "",
+    "set-cookie", "",
+    ":method", "CONNECT",
+    ":method", "DELETE",
+    ":method", "GET",
+    ":method", "HEAD",
+    ":method", "OPTIONS",
+    ":method", "POST",
+    ":method", "PUT",
+    ":scheme", "http",
+    ":scheme", "https",
+    ":status", "103",
+    ":status", "200",
+    ":status", "304",
+    ":status", "404",
+    ":status", "503",
+    "accept", "*/*",
+    "accept", "application/dns-message",
+    "accept-encoding", "gzip, deflate, br",
+    "accept-ranges", "bytes",
+    "access-control-allow-headers", "cache-control",
+    "access-control-allow-headers", "content-type",
+    "access-control-allow-origin", "*",
+    "cache-control", "max-age=0",
+    "cache-control", "max-age=2592000",
+    "cache-control", "max-age=604800",
+    "cache-control", "no-cache",
+    "cache-control", "no-store",
+    "cache-control", "public, max-age=31536000",
+    "content-encoding", "br",
+    "content-encoding", "gzip",
+    "content-type", "application/dns-message",
+    "content-type", "application/javascript",
+    "content-type", "application/json",
+    "content-type", "application/x-www-form-urlencoded",
+    "content-type", "image/gif",
+    "content-type", "image/jpeg",
+    "content-type", "image/png",
+    "content-type", "text/css",
+    "content-type", "text/html; charset=utf-8",
+    "content-type", "text/plain",
+    "content-type", "text/plain;charset=utf-8",
+    "range", "bytes=0-",
+    "strict-transport-security", "max-age=31536000",
+    "strict-transport-security", "max-age=31536000; includesubdomains",
+    "strict-transport-security", "max-age=31536000; includesubdomains; preload",
+    "vary", "accept-encoding",
+    "vary", "origin",
+    "x-content-type-options", "nosniff",
+    "x-xss-protection", "1; mode=block",
+    ":status", "100",
+    ":status", "204",
+    ":status", "206",
+    ":status", "302",
+    ":status", "400",
+    ":status", "403",
+    ":status", "421",
+    ":status", "425",
+    ":status", "500",
+    "accept-language", "",
+    "access-control-allow-credentials", "FALSE",
+    "access-control-allow-credentials", "TRUE",
+    "access-control-allow-headers", "*",
+    "access-control-allow-methods", "get",
+    "access-control-allow-methods", "get, post, options",
+    "access-control-allow-methods", "options",
+    "access-control-expose-headers", "content-length",
+    "access-control-request-headers", "content-type",
+    "access-control-request-method", "get",
+    "access-control-request-method", "post",
+    "alt-svc", "clear",
+    "authorization", "",
+    "content-security-policy", "script-src 'none'; object-src 'none'; base-uri 'none'",
+    "early-data", "1",
+    "expect-ct", "",
+    "forwarded", "",
+    "if-range", "",
+    "origin", "",
+    "purpose", "prefetch",
+    "server", "",
+    "timing-allow-origin", "*",
+    "upgrade-insecure-requests", "1",
+    "user-agent", "",
+    "x-forwarded-for", "",
+    "x-frame-options", "deny",
+    "x-frame-options", "sameorigin",
+);
+
+
+my $NAME_BITS = 7;
+my $NAMEVAL_BITS = 7;
+
+my (@names, %name2ids);
+for (my $i = 0; $i < @table; $i += 2) {
+    my $name = $table[$i];
+    push @names, $name unless exists $name2ids{$name};
+    push @{ $name2ids{$name} }, $i / 2;
+}
+
+sub feature_hash {
+    my ($str, $pos, @mult) = @_;
+    my $len = length $str;
+    return 0 unless $len;
+    return $len * $mult[0]
+         + ord(substr($str, 0, 1)) * $mult[1]
+         + ord(substr($str, $len - 1, 1)) * $mult[2]
+         + ord(substr($str, ($len * $pos) >> 3, 1)) * $mult[3];
+}
+
+# Find parameters that place all strings into distinct slots.  @$sets is
+# a list of string sets; strings only need to be distinct within a set.
+sub find_params {
+    my ($sets, $bits) = @_;
+    my $mask = (1 << $bits) - 1;
+    for my $pos (0 .. 7) {
+        for my $m0 (1 .. 15) {
+            for my $m1 (1 .. 15) {
+                for my $m2 (1 .. 15) {
+                    MULT: for my $m3 (1 .. 15) {
+                        for my $set (@$sets) {
+                            my %seen;
+                            for my $str (@$set) {
+                                my $slot = feature_hash($str, $pos, $m0, $m1,
+                                                        $m2, $m3) & $mask;
+                                next MULT if $seen{$slot}++;
+                            }
+                        }
+                        return ($pos, $m0, $m1, $m2, $m3);
+                    }
+                }
+            }
+        }
+    }
+    die "cannot find perfect hash parameters";
+}
+
+my @name_params = find_params([ \@names ], $NAME_BITS);
+my @val_params = find_params([ map { [ map $table[$_ * 2 + 1],
+                            @{ $name2ids{$_} } ] } @names ], $NAMEVAL_BITS);
+
+# Place values of names with most values first
+my (@name_slots, @nameval_slots);
+for my $name (sort { @{ $name2ids{$b} } <=> @{ $name2ids{$a} }
+                                                or $a cmp $b } @names) {
+    my @ids = @{ $name2ids{$name} };
+    my $disp;
+    DISP: for my $d (0 .. (1 << $NAMEVAL_BITS) - 1) {
+        for my $id (@ids) {
+            my $slot = (feature_hash($table[$id * 2 + 1], @val_params) + $d)
+                                            & ((1 << $NAMEVAL_BITS) - 1);
+            next DISP if defined $nameval_slots[$slot];
+        }
+        $disp = $d;
+        last;
+    }
+    die "cannot place values of $name" unless defined $disp;
+    for my $id (@ids) {
+        my $slot = (feature_hash($table[$id * 2 + 1], @val_params) + $disp)
+                                            & ((1 << $NAMEVAL_BITS) - 1);
+        $nameval_slots[$slot] = $id + 1;
+    }
+    my $slot = feature_hash($name, @name_params) & ((1 << $NAME_BITS) - 1);
+    $name_slots[$slot] = [ $ids[0] + 1, $disp ];
+}
+
+sub print_macro {
+    my ($macro, @params) = @_;
+    my ($pos, @mult) = @params;
+    print <<"EOC";
+#define $macro(str_, len_) ((len_) ? \\
+    ((unsigned) (len_) * $mult[0] \\
+        + (unsigned char) (str_)[0] * $mult[1] \\
+        + (unsigned char) (str_)[(len_) - 1] * $mult[2] \\
+        + (unsigned char) (str_)[((len_) * $pos) >> 3] * $mult[3]) : 0)
+EOC
+}
+
+print "/* Generated by tools/gen-static-phash.pl */\n";
+print "#define STATIC_NAME_BITS $NAME_BITS\n";
+print "#define STATIC_NAMEVAL_BITS $NAMEVAL_BITS\n";
+print_macro("STATIC_NAME_HASH", @name_params);
+print_macro("STATIC_VAL_HASH", @val_params);
+print "\n";
+
+print "static const struct static_name_slot\n{\n",
+      "    unsigned char   id_plus_one;\n",
+      "    unsigned char   disp;\n",
+      "} static_name_slots[ 1 << STATIC_NAME_BITS ] =\n{\n";
+my @out;
+for my $slot (0 .. $#name_slots) {
+    next unless defined $name_slots[$slot];
+    push @out, sprintf("[%u] = { %u, %u, }", $slot, @{ $name_slots[$slot] });
+}
+while (my @line = splice(@out, 0, 3)) {
+    print "    ", join(", ", @line), ",\n";
+}
+print "};\n\n";
+
+print "static const unsigned char ",
+      "static_nameval_slots[ 1 << STATIC_NAMEVAL_BITS ] =\n{\n";
+for my $slot (0 .. $#nameval_slots) {
+    next unless defined $nameval_slots[$slot];
+    push @out, sprintf("[%u] = %u", $slot, $nameval_slots[$slot]);
+}
+while (my @line = splice(@out, 0, 6)) {
+    print "    ", join(", ", @line), ",\n";
+}
+print "};\n";